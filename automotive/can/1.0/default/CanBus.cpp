@@ -69,15 +69,19 @@ Return<void> CanBus::listen(const hidl_vec<CanMessageFilter>& filter,
 
     sp<CloseHandle> closeHandle = new CloseHandle([this, listenerCb]() {
         std::lock_guard<std::mutex> lck(mMsgListenersGuard);
-        std::erase_if(mMsgListeners, [&](const auto& e) { return e.callback == listenerCb; });
+        std::erase_if(mMsgListeners, [&](const auto& e) { return e->callback == listenerCb; });
+        updateListenerSnapshotLocked();
     });
-    mMsgListeners.emplace_back(CanMessageListener{listenerCb, filter, closeHandle});
-    auto& listener = mMsgListeners.back();
+    auto listener = std::make_shared<CanMessageListener>(
+            CanMessageListener{listenerCb, filter, closeHandle});
 
     // fix message IDs to have all zeros on bits not covered by mask
-    std::for_each(listener.filter.begin(), listener.filter.end(),
+    std::for_each(listener->filter.begin(), listener->filter.end(),
                   [](auto& rule) { rule.id &= rule.mask; });
 
+    mMsgListeners.push_back(std::move(listener));
+    updateListenerSnapshotLocked();
+
     _hidl_cb(Result::OK, closeHandle);
     return {};
 }
@@ -134,13 +138,18 @@ ICanController::Result CanBus::up() {
     mDownAfterUse = !*isUp;
 
     using namespace std::placeholders;
-    CanSocket::ReadCallback rdcb = std::bind(&CanBus::onRead, this, _1, _2);
+    CanSocket::ReadCallback rdcb = std::bind(&CanBus::onRead, this, _1, _2, _3);
     CanSocket::ErrorCallback errcb = std::bind(&CanBus::onError, this, _1);
-    mSocket = CanSocket::open(mIfname, rdcb, errcb);
-    if (!mSocket) {
+    auto socket = CanSocket::open(mIfname, rdcb, errcb);
+    if (!socket) {
         if (mDownAfterUse) netdevice::down(mIfname);
         return ICanController::Result::UNKNOWN_ERROR;
     }
+    {
+        std::lock_guard<std::mutex> lckListeners(mMsgListenersGuard);
+        mSocket = std::move(socket);
+        updateListenerSnapshotLocked();
+    }
 
     mIsUp = true;
     return ICanController::Result::OK;
@@ -152,7 +161,7 @@ void CanBus::clearMsgListeners() {
         std::lock_guard<std::mutex> lck(mMsgListenersGuard);
         std::transform(mMsgListeners.begin(), mMsgListeners.end(),
                        std::back_inserter(listenersToClose),
-                       [](const auto& e) { return e.closeHandle; });
+                       [](const auto& e) { return e->closeHandle; });
     }
 
     for (auto& weakListener : listenersToClose) {
@@ -203,7 +212,15 @@ bool CanBus::down() {
 
     clearMsgListeners();
     clearErrListeners();
-    mSocket.reset();
+
+    /* The socket is released outside of the listeners guard, since the reader thread may be
+     * waiting for it. */
+    std::unique_ptr<CanSocket> socket;
+    {
+        std::lock_guard<std::mutex> lckListeners(mMsgListenersGuard);
+        socket = std::move(mSocket);
+    }
+    socket.reset();
 
     bool success = true;
 
@@ -218,50 +235,20 @@ bool CanBus::down() {
     return success;
 }
 
-/**
- * Helper function to determine if a flag meets the requirements of a
- * FilterFlag. See definition of FilterFlag in types.hal
- *
- * \param filterFlag FilterFlag object to match flag against
- * \param flag bool object from CanMessage object
- */
-static bool satisfiesFilterFlag(FilterFlag filterFlag, bool flag) {
-    if (filterFlag == FilterFlag::DONT_CARE) return true;
-    if (filterFlag == FilterFlag::SET) return flag;
-    if (filterFlag == FilterFlag::NOT_SET) return !flag;
-    return false;
-}
+void CanBus::updateListenerSnapshotLocked() {
+    std::vector<hidl_vec<CanMessageFilter>> filters;
+    filters.reserve(mMsgListeners.size());
+    for (const auto& listener : mMsgListeners) filters.push_back(listener->filter);
 
-/**
- * Match the filter set against message id.
- *
- * For details on the filters syntax, please see CanMessageFilter at
- * the HAL definition (types.hal).
- *
- * \param filter Filter to match against
- * \param id Message id to filter
- * \return true if the message id matches the filter, false otherwise
- */
-static bool match(const hidl_vec<CanMessageFilter>& filter, CanMessageId id, bool isRtr,
-                  bool isExtendedId) {
-    if (filter.size() == 0) return true;
-
-    bool anyNonExcludeRulePresent = false;
-    bool anyNonExcludeRuleSatisfied = false;
-    for (auto& rule : filter) {
-        const bool satisfied = ((id & rule.mask) == rule.id) &&
-                               satisfiesFilterFlag(rule.rtr, isRtr) &&
-                               satisfiesFilterFlag(rule.extendedFormat, isExtendedId);
-
-        if (rule.exclude) {
-            // Any excluded (blacklist) rule not being satisfied invalidates the whole filter set.
-            if (satisfied) return false;
-        } else {
-            anyNonExcludeRulePresent = true;
-            if (satisfied) anyNonExcludeRuleSatisfied = true;
-        }
+    mListenerSnapshot = std::make_shared<const ListenerSnapshot>(
+            ListenerSnapshot{mMsgListeners, CanFilterIndex(filters)});
+
+    // Frames no listener accepts are dropped by the kernel, so they don't wake up the reader.
+    if (!mSocket) return;
+    if (!mSocket->setFilters(mListenerSnapshot->index.kernelFilters())) {
+        LOG(WARNING) << "Can't filter messages in kernel, receiving all of them";
+        mSocket->setFilters({{0, 0}});
     }
-    return !anyNonExcludeRulePresent || anyNonExcludeRuleSatisfied;
 }
 
 void CanBus::notifyErrorListeners(ErrorEvent err, bool isFatal) {
@@ -297,33 +284,59 @@ static ErrorEvent parseErrorFrame(const struct canfd_frame& frame) {
     return ErrorEvent::UNKNOWN_ERROR;
 }
 
-void CanBus::onRead(const struct canfd_frame& frame, std::chrono::nanoseconds timestamp) {
-    if ((frame.can_id & CAN_ERR_FLAG) != 0) {
-        // error bit is set
-        LOG(WARNING) << "CAN Error frame received";
-        notifyErrorListeners(parseErrorFrame(frame), false);
-        return;
+void CanBus::onRead(const struct canfd_frame* frames, size_t count,
+                    std::chrono::nanoseconds timestamp) {
+    /* Callbacks are called without holding the guard, so a listener being closed may still receive
+     * messages of the batch that is being dispatched. */
+    std::shared_ptr<const ListenerSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lck(mMsgListenersGuard);
+        snapshot = mListenerSnapshot;
     }
 
+    for (size_t i = 0; i < count; i++) {
+        const struct canfd_frame& frame = frames[i];
+        if ((frame.can_id & CAN_ERR_FLAG) != 0) {
+            // error bit is set
+            LOG(WARNING) << "CAN Error frame received";
+            notifyErrorListeners(parseErrorFrame(frame), false);
+            continue;
+        }
+
+        onMessage(*snapshot, frame, timestamp);
+    }
+}
+
+void CanBus::onMessage(const ListenerSnapshot& snapshot, const struct canfd_frame& frame,
+                       std::chrono::nanoseconds timestamp) {
+    const bool isExtendedId = (frame.can_id & CAN_EFF_FLAG) != 0;
+    // mask out eff/rtr/err flags, standard frames carry 11 bit IDs only
+    const CanMessageId id = frame.can_id & (isExtendedId ? CAN_EFF_MASK : CAN_SFF_MASK);
+    const bool isRtr = (frame.can_id & CAN_RTR_FLAG) != 0;
+
+    snapshot.index.match(id, isRtr, isExtendedId, &mMatchingListeners);
+    const bool anyMatch = std::any_of(mMatchingListeners.begin(), mMatchingListeners.end(),
+                                      [](uint64_t word) { return word != 0; });
+    if (!anyMatch && !kSuperVerbose) return;
+
     CanMessage message = {};
-    message.id = frame.can_id & CAN_EFF_MASK;  // mask out eff/rtr/err flags
+    message.id = id;
     message.payload = hidl_vec<uint8_t>(frame.data, frame.data + frame.len);
     message.timestamp = timestamp.count();
-    message.isExtendedId = (frame.can_id & CAN_EFF_FLAG) != 0;
-    message.remoteTransmissionRequest = (frame.can_id & CAN_RTR_FLAG) != 0;
+    message.isExtendedId = isExtendedId;
+    message.remoteTransmissionRequest = isRtr;
 
     if (UNLIKELY(kSuperVerbose)) {
         LOG(VERBOSE) << "Got message " << toString(message);
     }
 
-    std::lock_guard<std::mutex> lck(mMsgListenersGuard);
-    for (auto& listener : mMsgListeners) {
-        if (!match(listener.filter, message.id, message.remoteTransmissionRequest,
-                   message.isExtendedId))
-            continue;
-        if (!listener.callback->onReceive(message).isOk() && !listener.failedOnce) {
-            listener.failedOnce = true;
-            LOG(WARNING) << "Failed to notify listener about message";
+    for (size_t word = 0; word < mMatchingListeners.size(); word++) {
+        for (uint64_t bits = mMatchingListeners[word]; bits != 0; bits &= bits - 1) {
+            auto& listener = *snapshot.listeners[word * 64 + __builtin_ctzll(bits)];
+            if (!listener.callback->onReceive(message).isOk() && !listener.failedOnce) {
+                listener.failedOnce = true;
+                LOG(WARNING) << "Failed to notify listener about message";
+            }
         }
     }
 }
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include "CanFilterIndex.h"
 #include "CanSocket.h"
 
 #include <android-base/unique_fd.h>
@@ -79,22 +80,48 @@ struct CanBus : public ICanBus {
         sp<ICanMessageListener> callback;
         hidl_vec<CanMessageFilter> filter;
         wp<ICloseHandle> closeHandle;
+        /** Only accessed by the reader thread. */
         bool failedOnce = false;
     };
+
+    /**
+     * Immutable copy of the listener list along with their compiled filters, so that messages can
+     * be dispatched without holding mMsgListenersGuard.
+     */
+    struct ListenerSnapshot {
+        std::vector<std::shared_ptr<CanMessageListener>> listeners;
+        CanFilterIndex index;
+    };
+
+    /**
+     * Publishes a new snapshot after mMsgListeners changed, and updates kernel filters of mSocket
+     * to match it. mMsgListenersGuard must be held.
+     */
+    void updateListenerSnapshotLocked();
+
     void clearMsgListeners();
     void clearErrListeners();
 
     void notifyErrorListeners(ErrorEvent err, bool isFatal);
 
-    void onRead(const struct canfd_frame& frame, std::chrono::nanoseconds timestamp);
+    void onRead(const struct canfd_frame* frames, size_t count,
+                std::chrono::nanoseconds timestamp);
+    void onMessage(const ListenerSnapshot& snapshot, const struct canfd_frame& frame,
+                   std::chrono::nanoseconds timestamp);
     void onError(int errnoVal);
 
     std::mutex mMsgListenersGuard;
-    std::vector<CanMessageListener> mMsgListeners GUARDED_BY(mMsgListenersGuard);
+    std::vector<std::shared_ptr<CanMessageListener>> mMsgListeners GUARDED_BY(mMsgListenersGuard);
+    std::shared_ptr<const ListenerSnapshot> mListenerSnapshot GUARDED_BY(mMsgListenersGuard) =
+            std::make_shared<const ListenerSnapshot>();
+
+    /** Listeners matching the message being dispatched, only accessed by the reader thread. */
+    CanFilterIndex::ListenerSet mMatchingListeners;
 
     std::mutex mErrListenersGuard;
     std::vector<sp<ICanErrorListener>> mErrListeners GUARDED_BY(mErrListenersGuard);
 
+    /** Written with both mIsUpGuard and mMsgListenersGuard held, so that either can be used. */
     std::unique_ptr<CanSocket> mSocket;
     bool mDownAfterUse;
 
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CanFilterIndex.h"
+
+#include <linux/can/raw.h>
+
+#include <algorithm>
+#include <tuple>
+
+namespace android::hardware::automotive::can::V1_0::implementation {
+
+/**
+ * Helper function to determine if a flag meets the requirements of a
+ * FilterFlag. See definition of FilterFlag in types.hal
+ *
+ * \param filterFlag FilterFlag object to match flag against
+ * \param flag bool object from CanMessage object
+ */
+static bool satisfiesFilterFlag(FilterFlag filterFlag, bool flag) {
+    if (filterFlag == FilterFlag::DONT_CARE) return true;
+    if (filterFlag == FilterFlag::SET) return flag;
+    if (filterFlag == FilterFlag::NOT_SET) return !flag;
+    return false;
+}
+
+static void set(CanFilterIndex::ListenerSet* set, size_t listener) {
+    (*set)[listener / 64] |= 1ull << (listener % 64);
+}
+
+static void clear(CanFilterIndex::ListenerSet* set, size_t listener) {
+    (*set)[listener / 64] &= ~(1ull << (listener % 64));
+}
+
+uint64_t CanFilterIndex::exactKey(CanMessageId id, bool isRtr, bool isExtendedId) {
+    /* The whole ID is part of the key: a rule ID with bits set above the ID format never matches
+     * a message, so it mustn't collide with a rule without them. */
+    return (static_cast<uint64_t>(id) << 2) | (isExtendedId << 1) | isRtr;
+}
+
+/**
+ * Requires a kernel filter to pass only frames with given flag set or only without it, according
+ * to a FilterFlag.
+ */
+static void setKernelFilterFlag(struct can_filter* filter, canid_t flag, FilterFlag filterFlag) {
+    if (filterFlag == FilterFlag::DONT_CARE) return;
+    filter->can_mask |= flag;
+    if (filterFlag == FilterFlag::SET) filter->can_id |= flag;
+}
+
+struct can_filter CanFilterIndex::toKernelFilter(const CanMessageFilter& rule) {
+    struct can_filter filter = {};
+    filter.can_mask = rule.mask & CAN_EFF_MASK;
+    filter.can_id = rule.id & filter.can_mask;
+    setKernelFilterFlag(&filter, CAN_RTR_FLAG, rule.rtr);
+    setKernelFilterFlag(&filter, CAN_EFF_FLAG, rule.extendedFormat);
+    return filter;
+}
+
+CanFilterIndex::CanFilterIndex(const std::vector<hidl_vec<CanMessageFilter>>& filters)
+    : mWords((filters.size() + 63) / 64), mAcceptAll(mWords) {
+    bool acceptAll = false;
+    for (size_t listener = 0; listener < filters.size(); listener++) {
+        bool anyNonExcludeRulePresent = false;
+        for (const auto& rule : filters[listener]) {
+            anyNonExcludeRulePresent |= !rule.exclude;
+            if (!rule.exclude) mKernelFilters.push_back(toKernelFilter(rule));
+            const CanMessageId ruleId = rule.id & rule.mask;
+
+            /* A rule compares all bits of the ID if its mask covers every bit a message ID of
+             * given format can have. Such rule is indexed for every combination of flags it
+             * accepts. */
+            bool exact = true;
+            for (bool isExtendedId : {false, true}) {
+                if (!satisfiesFilterFlag(rule.extendedFormat, isExtendedId)) continue;
+                const uint32_t idMask = isExtendedId ? CAN_EFF_MASK : CAN_SFF_MASK;
+                exact &= (rule.mask & idMask) == idMask;
+            }
+            if (!exact) {
+                auto& rules = rule.exclude ? mMaskExcludes : mMaskIncludes;
+                rules.push_back({ruleId, rule.mask, rule.rtr, rule.extendedFormat, listener});
+                continue;
+            }
+
+            for (bool isExtendedId : {false, true}) {
+                if (!satisfiesFilterFlag(rule.extendedFormat, isExtendedId)) continue;
+                for (bool isRtr : {false, true}) {
+                    if (!satisfiesFilterFlag(rule.rtr, isRtr)) continue;
+                    auto& exactRules = mExactRules[exactKey(ruleId, isRtr, isExtendedId)];
+                    auto& listeners = rule.exclude ? exactRules.exclude : exactRules.include;
+                    listeners.resize(mWords);
+                    set(&listeners, listener);
+                }
+            }
+        }
+        if (!anyNonExcludeRulePresent) {
+            set(&mAcceptAll, listener);
+            acceptAll = true;
+        }
+    }
+
+    std::sort(mKernelFilters.begin(), mKernelFilters.end(), [](const auto& a, const auto& b) {
+        return std::tie(a.can_id, a.can_mask) < std::tie(b.can_id, b.can_mask);
+    });
+    mKernelFilters.erase(std::unique(mKernelFilters.begin(), mKernelFilters.end(),
+                                     [](const auto& a, const auto& b) {
+                                         return a.can_id == b.can_id && a.can_mask == b.can_mask;
+                                     }),
+                         mKernelFilters.end());
+    if (acceptAll || mKernelFilters.size() > CAN_RAW_FILTER_MAX) {
+        mKernelFilters = {{0, 0}};
+    }
+}
+
+void CanFilterIndex::match(CanMessageId id, bool isRtr, bool isExtendedId,
+                           ListenerSet* matches) const {
+    matches->assign(mAcceptAll.begin(), mAcceptAll.end());
+
+    const auto exact = mExactRules.find(exactKey(id, isRtr, isExtendedId));
+    if (exact != mExactRules.end()) {
+        const auto& include = exact->second.include;
+        for (size_t i = 0; i < include.size(); i++) (*matches)[i] |= include[i];
+    }
+
+    auto satisfies = [&](const MaskRule& rule) {
+        return (id & rule.mask) == rule.id && satisfiesFilterFlag(rule.rtr, isRtr) &&
+               satisfiesFilterFlag(rule.extendedFormat, isExtendedId);
+    };
+    for (const auto& rule : mMaskIncludes) {
+        if (satisfies(rule)) set(matches, rule.listener);
+    }
+
+    // Any satisfied exclude rule invalidates the whole filter set of its listener.
+    if (exact != mExactRules.end()) {
+        const auto& exclude = exact->second.exclude;
+        for (size_t i = 0; i < exclude.size(); i++) (*matches)[i] &= ~exclude[i];
+    }
+    for (const auto& rule : mMaskExcludes) {
+        if (satisfies(rule)) clear(matches, rule.listener);
+    }
+}
+
+}  // namespace android::hardware::automotive::can::V1_0::implementation
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/automotive/can/1.0/types.h>
+#include <linux/can.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace android::hardware::automotive::can::V1_0::implementation {
+
+/**
+ * Filter sets of all message listeners of a bus, compiled to match a message against all of them
+ * at once.
+ *
+ * Rules comparing all bits of a message ID are looked up by the ID in a hash table, while the
+ * remaining rules are checked one by one. Exclude rules are kept apart from the others, so that
+ * a match is the union of the listeners accepting the message, minus the listeners excluding it.
+ */
+struct CanFilterIndex {
+    /** Bitmap of listeners, bit n stands for the n-th filter set passed to the constructor. */
+    using ListenerSet = std::vector<uint64_t>;
+
+    /**
+     * Compile filter sets.
+     *
+     * \param filters Filter set of each listener, see CanMessageFilter in types.hal
+     */
+    explicit CanFilterIndex(const std::vector<hidl_vec<CanMessageFilter>>& filters = {});
+
+    /**
+     * Find listeners whose filter sets match a message.
+     *
+     * \param id Message ID
+     * \param isRtr Whether the message is a Remote Transmission Request
+     * \param isExtendedId Whether the message has a 29 bit ID
+     * \param matches Set to the matching listeners, reusing its storage
+     */
+    void match(CanMessageId id, bool isRtr, bool isExtendedId, ListenerSet* matches) const;
+
+    /**
+     * Kernel filters (see CAN_RAW_FILTER) passing every message accepted by any listener.
+     *
+     * Exclude rules are not represented, so the filters may pass messages that no listener
+     * accepts. The result of match() is still needed for every message.
+     */
+    const std::vector<struct can_filter>& kernelFilters() const { return mKernelFilters; }
+
+  private:
+    struct MaskRule {
+        CanMessageId id;
+        uint32_t mask;
+        FilterFlag rtr;
+        FilterFlag extendedFormat;
+        size_t listener;
+    };
+
+    struct ExactRules {
+        ListenerSet include;
+        ListenerSet exclude;
+    };
+
+    static uint64_t exactKey(CanMessageId id, bool isRtr, bool isExtendedId);
+    static struct can_filter toKernelFilter(const CanMessageFilter& rule);
+
+    size_t mWords;
+    /** Listeners without any non-exclude rule. */
+    ListenerSet mAcceptAll;
+    std::unordered_map<uint64_t, ExactRules> mExactRules;
+    std::vector<MaskRule> mMaskIncludes;
+    std::vector<MaskRule> mMaskExcludes;
+    std::vector<struct can_filter> mKernelFilters;
+};
+
+}  // namespace android::hardware::automotive::can::V1_0::implementation
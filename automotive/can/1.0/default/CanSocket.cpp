@@ -20,19 +20,21 @@
 #include <libnetdevice/can.h>
 #include <libnetdevice/libnetdevice.h>
 #include <linux/can.h>
+#include <linux/can/raw.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <utils/SystemClock.h>
 
 #include <chrono>
 
 namespace android::hardware::automotive::can::V1_0::implementation {
 
-using namespace std::chrono_literals;
-
-/* How frequently the read thread checks whether the interface was asked to be down.
+/* Maximum number of frames read with a single system call.
  *
- * Note: This does *not* affect read timing or bandwidth, just CPU load vs time to
- *       down the interface. */
-static constexpr auto kReadPooling = 100ms;
+ * A busy bus delivers a few frames per millisecond, so this is enough to drain the socket buffer
+ * whenever the reader thread is woken up late. */
+static constexpr size_t kReadBatchSize = 64;
 
 std::unique_ptr<CanSocket> CanSocket::open(const std::string& ifname, ReadCallback rdcb,
                                            ErrorCallback errcb) {
@@ -42,18 +44,41 @@ std::unique_ptr<CanSocket> CanSocket::open(const std::string& ifname, ReadCallba
         return nullptr;
     }
 
+    base::unique_fd epoll(epoll_create1(EPOLL_CLOEXEC));
+    base::unique_fd stopEvent(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (!epoll.ok() || !stopEvent.ok()) {
+        PLOG(ERROR) << "Can't create CAN socket reader events";
+        return nullptr;
+    }
+    for (const auto& fd : {sock.get(), stopEvent.get()}) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &event) != 0) {
+            PLOG(ERROR) << "Can't wait for CAN socket reader events";
+            return nullptr;
+        }
+    }
+
     // Can't use std::make_unique due to private CanSocket constructor.
-    return std::unique_ptr<CanSocket>(new CanSocket(std::move(sock), rdcb, errcb));
+    return std::unique_ptr<CanSocket>(new CanSocket(std::move(sock), std::move(epoll),
+                                                    std::move(stopEvent), rdcb, errcb));
 }
 
-CanSocket::CanSocket(base::unique_fd socket, ReadCallback rdcb, ErrorCallback errcb)
+CanSocket::CanSocket(base::unique_fd socket, base::unique_fd epoll, base::unique_fd stopEvent,
+                     ReadCallback rdcb, ErrorCallback errcb)
     : mReadCallback(rdcb),
       mErrorCallback(errcb),
       mSocket(std::move(socket)),
+      mEpoll(std::move(epoll)),
+      mStopEvent(std::move(stopEvent)),
       mReaderThread(&CanSocket::readerThread, this) {}
 
 CanSocket::~CanSocket() {
     mStopReaderThread = true;
+    if (eventfd_write(mStopEvent.get(), 1) != 0) {
+        PLOG(ERROR) << "Failed to stop CAN socket reader thread";
+    }
 
     /* CanSocket can be brought down as a result of read failure, from the same thread,
      * so let's just detach and let it finish on its own. */
@@ -77,37 +102,53 @@ bool CanSocket::send(const struct canfd_frame& frame) {
     return true;
 }
 
-static struct timeval toTimeval(std::chrono::microseconds t) {
-    struct timeval tv;
-    tv.tv_sec = t / 1s;
-    tv.tv_usec = (t % 1s) / 1us;
-    return tv;
-}
-
-static int selectRead(const base::unique_fd& fd, std::chrono::microseconds timeout) {
-    auto timeouttv = toTimeval(timeout);
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(fd.get(), &readfds);
-    return select(fd.get() + 1, &readfds, nullptr, nullptr, &timeouttv);
+bool CanSocket::setFilters(const std::vector<struct can_filter>& filters) {
+    const socklen_t size = filters.size() * sizeof(struct can_filter);
+    if (setsockopt(mSocket.get(), SOL_CAN_RAW, CAN_RAW_FILTER, filters.data(), size) < 0) {
+        PLOG(ERROR) << "Can't set CAN socket filters";
+        return false;
+    }
+    return true;
 }
 
 void CanSocket::readerThread() {
     LOG(VERBOSE) << "Reader thread started";
     int errnoCopy = 0;
 
+    struct canfd_frame frames[kReadBatchSize];
+    struct iovec iovs[kReadBatchSize];
+    struct mmsghdr msgs[kReadBatchSize] = {};
+    for (size_t i = 0; i < kReadBatchSize; i++) {
+        iovs[i] = {&frames[i], CAN_MTU};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    bool drained = true;
     while (!mStopReaderThread) {
         /* The ideal would be to have a blocking read(3) call and interrupt it with shutdown(3).
-         * This is unfortunately not supported for SocketCAN, so we need to rely on select(3). */
-        const auto sel = selectRead(mSocket, kReadPooling);
-        if (sel == 0) continue;  // timeout
-        if (sel == -1) {
-            PLOG(ERROR) << "Select failed";
-            break;
+         * This is unfortunately not supported for SocketCAN, so we wait for either the socket or
+         * mStopEvent with epoll(7) instead.
+         *
+         * A batch shorter than kReadBatchSize means the socket was drained, so we only wait if the
+         * previous batch was short. */
+        if (drained) {
+            struct epoll_event events[2];
+            const auto nevents = epoll_wait(mEpoll.get(), events, 2, -1);
+            if (nevents < 0) {
+                if (errno == EINTR) continue;
+                errnoCopy = errno;
+                PLOG(ERROR) << "Waiting for CAN socket failed";
+                break;
+            }
+            bool readable = false;
+            for (int i = 0; i < nevents; i++) {
+                readable |= events[i].data.fd == mSocket.get();
+            }
+            if (!readable) continue;  // woken up by mStopEvent
         }
 
-        struct canfd_frame frame;
-        const auto nbytes = read(mSocket.get(), &frame, CAN_MTU);
+        const auto nframes = recvmmsg(mSocket.get(), msgs, kReadBatchSize, MSG_DONTWAIT, nullptr);
 
         /* We could use SIOCGSTAMP to get a precise UNIX timestamp for a given packet, but what
          * we really need is a time since boot. There is no direct way to convert between these
@@ -119,22 +160,32 @@ void CanSocket::readerThread() {
          * Apart from the added complexity, it's possible the added calculations and system calls
          * would add so much time to the processing pipeline so the precision of the reported time
          * was buried under the subsystem latency. Let's just use a local time since boot here and
-         * leave precise hardware timestamps for custom proprietary implementations (if needed). */
+         * leave precise hardware timestamps for custom proprietary implementations (if needed).
+         *
+         * All frames of a batch get the same timestamp, they were all read at once. */
         const std::chrono::nanoseconds ts(elapsedRealtimeNano());
 
-        if (nbytes != CAN_MTU) {
-            if (nbytes >= 0) {
-                LOG(ERROR) << "Failed to read CAN packet, got " << nbytes << " bytes";
-                break;
-            }
-            if (errno == EAGAIN) continue;
+        if (nframes < 0) {
+            drained = true;
+            if (errno == EAGAIN || errno == EINTR) continue;
 
             errnoCopy = errno;
-            PLOG(ERROR) << "Failed to read CAN packet";
+            PLOG(ERROR) << "Failed to read CAN packets";
             break;
         }
 
-        mReadCallback(frame, ts);
+        bool truncated = false;
+        for (int i = 0; i < nframes; i++) {
+            if (msgs[i].msg_len != CAN_MTU) {
+                LOG(ERROR) << "Failed to read CAN packet, got " << msgs[i].msg_len << " bytes";
+                truncated = true;
+                break;
+            }
+        }
+        if (truncated) break;
+
+        drained = static_cast<size_t>(nframes) < kReadBatchSize;
+        if (nframes > 0) mReadCallback(frames, nframes, ts);
     }
 
     bool failed = !mStopReaderThread;
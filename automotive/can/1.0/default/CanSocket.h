@@ -22,13 +22,19 @@
 
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <thread>
+#include <vector>
 
 namespace android::hardware::automotive::can::V1_0::implementation {
 
 /** Wrapper around SocketCAN socket. */
 struct CanSocket {
-    using ReadCallback = std::function<void(const struct canfd_frame&, std::chrono::nanoseconds)>;
+    /**
+     * Called with every batch of frames read from the socket at once, and the time they were read.
+     */
+    using ReadCallback = std::function<void(const struct canfd_frame* frames, size_t count,
+                                            std::chrono::nanoseconds)>;
     using ErrorCallback = std::function<void(int errnoVal)>;
 
     /**
@@ -51,17 +57,33 @@ struct CanSocket {
      */
     bool send(const struct canfd_frame& frame);
 
+    /**
+     * Replace kernel filters of received frames (see CAN_RAW_FILTER).
+     *
+     * Error frames are not affected. An empty filter list blocks all other frames.
+     *
+     * \param filters Filters passing a frame if any of them matches it
+     * \return true in case of success, false otherwise
+     */
+    bool setFilters(const std::vector<struct can_filter>& filters);
+
   private:
-    CanSocket(base::unique_fd socket, ReadCallback rdcb, ErrorCallback errcb);
+    CanSocket(base::unique_fd socket, base::unique_fd epoll, base::unique_fd stopEvent,
+              ReadCallback rdcb, ErrorCallback errcb);
     void readerThread();
 
     ReadCallback mReadCallback;
     ErrorCallback mErrorCallback;
 
     const base::unique_fd mSocket;
-    std::thread mReaderThread;
+    /** Waits for mSocket and mStopEvent. */
+    const base::unique_fd mEpoll;
+    /** Signalled to stop the reader thread. */
+    const base::unique_fd mStopEvent;
     std::atomic<bool> mStopReaderThread = false;
     std::atomic<bool> mReaderThreadFinished = false;
+    /** Started last, as it uses all fields above. */
+    std::thread mReaderThread;
 
     DISALLOW_COPY_AND_ASSIGN(CanSocket);
 };
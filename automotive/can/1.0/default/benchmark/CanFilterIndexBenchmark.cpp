@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../CanFilterIndex.h"
+
+#include <benchmark/benchmark.h>
+#include <linux/can.h>
+
+namespace android::hardware::automotive::can::V1_0::implementation {
+
+/** Rules of every listener, all but one of them comparing the whole ID. */
+static constexpr size_t kRulesPerListener = 32;
+
+/* Listener n accepts standard IDs n * kRulesPerListener and the following ones, plus every ID
+ * of its mask rule, except for one excluded ID. */
+static std::vector<hidl_vec<CanMessageFilter>> makeFilters(size_t listeners) {
+    std::vector<hidl_vec<CanMessageFilter>> filters(listeners);
+    for (size_t listener = 0; listener < listeners; listener++) {
+        std::vector<CanMessageFilter> rules;
+        for (size_t i = 0; i + 2 < kRulesPerListener; i++) {
+            const CanMessageId id = (listener * kRulesPerListener + i) & CAN_SFF_MASK;
+            rules.push_back({id, CAN_SFF_MASK, FilterFlag::DONT_CARE, FilterFlag::NOT_SET, false});
+        }
+        rules.push_back({0x700 | (listener & 0xF) << 4, 0x7F0, FilterFlag::DONT_CARE,
+                         FilterFlag::NOT_SET, false});
+        rules.push_back({0x700 | (listener & 0xF) << 4, CAN_SFF_MASK, FilterFlag::DONT_CARE,
+                         FilterFlag::NOT_SET, true});
+        filters[listener] = rules;
+    }
+    return filters;
+}
+
+/* Matches every standard ID against state.range(0) listeners, reporting matched messages per
+ * second. */
+static void BM_Match(benchmark::State& state) {
+    const CanFilterIndex index(makeFilters(state.range(0)));
+    CanFilterIndex::ListenerSet matches;
+    CanMessageId id = 0;
+    for (auto _ : state) {
+        index.match(id, false, false, &matches);
+        benchmark::DoNotOptimize(matches.data());
+        id = (id + 1) & CAN_SFF_MASK;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Match)->Arg(1)->Arg(20)->Arg(64);
+
+}  // namespace android::hardware::automotive::can::V1_0::implementation
+
+BENCHMARK_MAIN();
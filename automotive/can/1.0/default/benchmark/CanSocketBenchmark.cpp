@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../CanSocket.h"
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <libnetdevice/can.h>
+#include <libnetdevice/libnetdevice.h>
+
+#include <condition_variable>
+#include <mutex>
+
+namespace android::hardware::automotive::can::V1_0::implementation {
+
+using namespace std::chrono_literals;
+
+/* Interface to send frames over, created as a vcan interface if it doesn't exist. It can be set
+ * with CAN_BENCHMARK_IFNAME to measure a real bus with loopback. */
+static constexpr char kDefaultIfname[] = "vcanbench0";
+
+/** How long to wait for frames to arrive before counting them as dropped. */
+static constexpr auto kReceiveTimeout = 100ms;
+
+struct BenchmarkInterface {
+    BenchmarkInterface() {
+        const char* ifname = getenv("CAN_BENCHMARK_IFNAME");
+        name = ifname != nullptr ? ifname : kDefaultIfname;
+        if (!netdevice::exists(name)) {
+            created = netdevice::add(name, "vcan");
+            if (!created) {
+                LOG(ERROR) << "Can't create vcan interface " << name;
+                return;
+            }
+        }
+        ok = netdevice::up(name);
+    }
+
+    ~BenchmarkInterface() {
+        if (created) netdevice::del(name);
+    }
+
+    std::string name;
+    bool created = false;
+    bool ok = false;
+};
+
+static std::chrono::nanoseconds cpuTime(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+/* Sends bursts of state.range(0) frames and waits for the reader thread to deliver them.
+ *
+ * Reports received frames per second, frames dropped by the receiving socket, and the CPU time of
+ * the reader thread relative to the wall time. */
+static void BM_ReadThroughput(benchmark::State& state) {
+    static BenchmarkInterface iface;
+    if (!iface.ok) {
+        state.SkipWithError("CAN interface is not available");
+        return;
+    }
+
+    std::mutex lock;
+    std::condition_variable received;
+    uint64_t receivedFrames = 0;
+    uint64_t batches = 0;
+    auto reader = CanSocket::open(
+            iface.name,
+            [&](const struct canfd_frame* /* frames */, size_t count, std::chrono::nanoseconds) {
+                std::lock_guard<std::mutex> lck(lock);
+                receivedFrames += count;
+                batches++;
+                received.notify_one();
+            },
+            [](int /* errnoVal */) {});
+    auto sender = netdevice::can::socket(iface.name);
+    if (!reader || !sender.ok()) {
+        state.SkipWithError("Can't open CAN sockets");
+        return;
+    }
+
+    struct canfd_frame frame = {};
+    frame.can_id = 0x123;
+    frame.len = 8;
+
+    const auto burst = state.range(0);
+    uint64_t sentFrames = 0;
+    const auto processCpuStart = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+    const auto senderCpuStart = cpuTime(CLOCK_THREAD_CPUTIME_ID);
+    const auto wallStart = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        for (int64_t i = 0; i < burst; i++) {
+            if (write(sender.get(), &frame, CAN_MTU) == CAN_MTU) sentFrames++;
+        }
+
+        std::unique_lock<std::mutex> lck(lock);
+        received.wait_for(lck, kReceiveTimeout, [&] { return receivedFrames >= sentFrames; });
+    }
+    const std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+    const std::chrono::duration<double> readerCpuTime =
+            (cpuTime(CLOCK_PROCESS_CPUTIME_ID) - processCpuStart) -
+            (cpuTime(CLOCK_THREAD_CPUTIME_ID) - senderCpuStart);
+    reader.reset();
+
+    state.counters["frames"] = benchmark::Counter(receivedFrames, benchmark::Counter::kIsRate);
+    state.counters["dropped"] = sentFrames - receivedFrames;
+    state.counters["frames_per_read"] =
+            batches > 0 ? static_cast<double>(receivedFrames) / batches : 0;
+    state.counters["reader_cpu"] = readerCpuTime / wallTime;
+}
+BENCHMARK(BM_ReadThroughput)->Arg(1)->Arg(16)->Arg(256)->UseRealTime();
+
+}  // namespace android::hardware::automotive::can::V1_0::implementation
+
+BENCHMARK_MAIN();
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../CanFilterIndex.h"
+
+#include <gtest/gtest.h>
+
+namespace android::hardware::automotive::can::V1_0::implementation {
+
+namespace {
+
+/** Indices of the listeners matching a message. */
+std::vector<size_t> match(const CanFilterIndex& index, CanMessageId id, bool isRtr = false,
+                          bool isExtendedId = false) {
+    CanFilterIndex::ListenerSet matches;
+    index.match(id, isRtr, isExtendedId, &matches);
+
+    std::vector<size_t> listeners;
+    for (size_t i = 0; i < matches.size() * 64; i++) {
+        if ((matches[i / 64] >> (i % 64)) & 1) listeners.push_back(i);
+    }
+    return listeners;
+}
+
+CanMessageFilter rule(CanMessageId id, uint32_t mask, bool exclude = false,
+                      FilterFlag extendedFormat = FilterFlag::DONT_CARE) {
+    return {id, mask, FilterFlag::DONT_CARE, extendedFormat, exclude};
+}
+
+using Listeners = std::vector<size_t>;
+
+TEST(CanFilterIndexTest, emptyFilterAcceptsAll) {
+    const CanFilterIndex index({{}, {rule(0x123, 0x7FF)}});
+
+    ASSERT_EQ(Listeners({0, 1}), match(index, 0x123));
+    ASSERT_EQ(Listeners({0}), match(index, 0x124));
+    ASSERT_EQ(Listeners({0}), match(index, 0x124, false, true));
+}
+
+TEST(CanFilterIndexTest, exactRules) {
+    const CanFilterIndex index({
+            {rule(0x100, 0x7FF, false, FilterFlag::NOT_SET), rule(0x200, 0x7FF)},
+            {rule(0x100, 0x1FFFFFFF, false, FilterFlag::SET)},
+    });
+
+    ASSERT_EQ(Listeners({0}), match(index, 0x100));
+    ASSERT_EQ(Listeners({1}), match(index, 0x100, false, true));
+    ASSERT_EQ(Listeners({0}), match(index, 0x200));
+    // 0x7FF doesn't cover extended IDs, so the second rule of listener 0 is a mask rule for them
+    ASSERT_EQ(Listeners({0}), match(index, 0x200, false, true));
+    ASSERT_EQ(Listeners({}), match(index, 0x300, false, true));
+    ASSERT_EQ(Listeners({}), match(index, 0x300));
+}
+
+TEST(CanFilterIndexTest, maskRules) {
+    const CanFilterIndex index({{rule(0x120, 0x7F0)}, {rule(0x12F, 0x00F)}});
+
+    ASSERT_EQ(Listeners({0}), match(index, 0x120));
+    ASSERT_EQ(Listeners({0, 1}), match(index, 0x12F));
+    ASSERT_EQ(Listeners({1}), match(index, 0x7FF));
+    ASSERT_EQ(Listeners({}), match(index, 0x130));
+}
+
+TEST(CanFilterIndexTest, excludeRules) {
+    const CanFilterIndex index({
+            {rule(0x100, 0x700), rule(0x123, 0x7FF, true)},
+            {rule(0x120, 0x7F0, true)},
+    });
+
+    ASSERT_EQ(Listeners({0, 1}), match(index, 0x100));
+    ASSERT_EQ(Listeners({0}), match(index, 0x121));
+    ASSERT_EQ(Listeners({}), match(index, 0x123));
+    ASSERT_EQ(Listeners({1}), match(index, 0x200));
+}
+
+/* Rule IDs with bits above the 29 bit ID must not match, even though their mask covers the whole
+ * ID of a message. */
+TEST(CanFilterIndexTest, ruleIdAboveMessageId) {
+    const CanFilterIndex index({
+            {rule(0x40000123, 0xFFFFFFFF)},
+            {rule(0x40000123, 0xFFFFFFFF, true)},
+            {rule(0x123, 0xFFFFFFFF)},
+    });
+
+    ASSERT_EQ(Listeners({1, 2}), match(index, 0x123));
+    ASSERT_EQ(Listeners({1, 2}), match(index, 0x123, false, true));
+}
+
+TEST(CanFilterIndexTest, manyListeners) {
+    std::vector<hidl_vec<CanMessageFilter>> filters;
+    for (CanMessageId id = 0; id < 100; id++) filters.push_back({rule(id, 0x7FF)});
+    const CanFilterIndex index(filters);
+
+    ASSERT_EQ(Listeners({70}), match(index, 70));
+    ASSERT_EQ(Listeners({}), match(index, 100));
+}
+
+}  // namespace
+
+}  // namespace android::hardware::automotive::can::V1_0::implementation
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "vhal_v2_0/SubscriptionManager.h"
+#include "vhal_v2_0/VehicleUtils.h"
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace vehicle {
+namespace V2_0 {
+
+namespace {
+
+constexpr int kClientCount = 50;
+constexpr int32_t kPropertyCount = 300;
+
+class NullVehicleCallback : public IVehicleCallback {
+public:
+    Return<void> onPropertyEvent(const hidl_vec<VehiclePropValue>& /* values */) override {
+        return Return<void>();
+    }
+    Return<void> onPropertySet(const VehiclePropValue& /* value */) override {
+        return Return<void>();
+    }
+    Return<void> onPropertySetError(StatusCode /* errorCode */, int32_t /* propId */,
+                                    int32_t /* areaId */) override {
+        return Return<void>();
+    }
+};
+
+int32_t getPropId(int32_t index) {
+    return toInt(VehiclePropertyGroup::VENDOR) | toInt(VehicleArea::GLOBAL) |
+           toInt(VehiclePropertyType::INT32) | (0x100 + index);
+}
+
+// Subscribes kClientCount clients so that every property has the given number
+// of subscribers
+void subscribeClients(SubscriptionManager* manager, int subscribersPerProperty) {
+    for (int client = 0; client < kClientCount; client++) {
+        std::vector<SubscribeOptions> options;
+        for (int32_t i = 0; i < kPropertyCount; i++) {
+            if ((i + client) % kClientCount < subscribersPerProperty) {
+                options.push_back(SubscribeOptions{.propId = getPropId(i),
+                                                   .flags = SubscribeFlags::EVENTS_FROM_CAR});
+            }
+        }
+        std::list<SubscribeOptions> updatedOptions;
+        manager->addOrUpdateSubscription(client + 1, new NullVehicleCallback(), options,
+                                         &updatedOptions);
+    }
+}
+
+// One batch holding an event of every property, dispatched like
+// VehicleHalManager::onBatchHalEvent does
+void BM_DistributeValuesToClients(benchmark::State& state) {
+    SubscriptionManager manager([](int32_t) {});
+    subscribeClients(&manager, state.range(0));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (int32_t i = 0; i < kPropertyCount; i++) {
+        values.push_back(pool.obtainInt32(i));
+        values.back()->prop = getPropId(i);
+    }
+
+    std::vector<HalClientValues> clientValues;
+    for (auto _ : state) {
+        manager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_CAR, &clientValues);
+        benchmark::DoNotOptimize(clientValues.data());
+    }
+    state.SetItemsProcessed(state.iterations() * kPropertyCount);
+}
+
+void BM_GetSubscribedClients(benchmark::State& state) {
+    SubscriptionManager manager([](int32_t) {});
+    subscribeClients(&manager, state.range(0));
+
+    int32_t index = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+                manager.getSubscribedClients(getPropId(index), SubscribeFlags::EVENTS_FROM_CAR));
+        index = (index + 1) % kPropertyCount;
+    }
+}
+
+BENCHMARK(BM_DistributeValuesToClients)->Arg(1)->Arg(10)->Arg(kClientCount);
+BENCHMARK(BM_GetSubscribedClients)->Arg(1)->Arg(10)->Arg(kClientCount);
+
+}  // namespace anonymous
+
+}  // namespace V2_0
+}  // namespace vehicle
+}  // namespace automotive
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "vhal_v2_0/VehiclePropertyStore.h"
+#include "vhal_v2_0/VehicleUtils.h"
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace vehicle {
+namespace V2_0 {
+
+namespace {
+
+constexpr int32_t kPropertyCount = 256;
+constexpr int32_t kAreaCount = 4;
+
+int32_t getPropId(int32_t index) {
+    return toInt(VehiclePropertyGroup::VENDOR) | toInt(VehicleArea::SEAT) |
+           toInt(VehiclePropertyType::INT32) | (0x100 + index);
+}
+
+// One store shared by all threads of a benchmark, holding a value for every
+// area of every property
+VehiclePropertyStore& getStore() {
+    static VehiclePropertyStore* store = [] {
+        auto newStore = new VehiclePropertyStore();
+        for (int32_t i = 0; i < kPropertyCount; i++) {
+            VehiclePropConfig config = {.prop = getPropId(i)};
+            newStore->registerProperty(config);
+            for (int32_t area = 0; area < kAreaCount; area++) {
+                VehiclePropValue value;
+                value.prop = getPropId(i);
+                value.areaId = 1 << area;
+                value.value.int32Values = {0};
+                newStore->writeValue(value, true);
+            }
+        }
+        return newStore;
+    }();
+    return *store;
+}
+
+// Each thread walks the properties from its own starting point, reading
+// readPercent of the time and writing otherwise
+void runStore(benchmark::State& state, int readPercent) {
+    VehiclePropertyStore& store = getStore();
+    int32_t index = state.thread_index * (kPropertyCount / 8);
+    int64_t timestamp = 0;
+    VehiclePropValue value;
+    value.value.int32Values = {0};
+
+    int64_t reads = 0;
+    int64_t writes = 0;
+    for (auto _ : state) {
+        int32_t prop = getPropId(index % kPropertyCount);
+        int32_t area = 1 << (index % kAreaCount);
+        if (index % 100 < readPercent) {
+            benchmark::DoNotOptimize(store.readValueOrNull(prop, area));
+            reads++;
+        } else {
+            value.prop = prop;
+            value.areaId = area;
+            value.timestamp = ++timestamp;
+            value.value.int32Values[0] = index;
+            // timestamps of other threads may be newer, which drops the value
+            benchmark::DoNotOptimize(store.writeValue(value, true));
+            writes++;
+        }
+        index++;
+    }
+
+    state.counters["reads"] = benchmark::Counter(reads, benchmark::Counter::kIsRate);
+    state.counters["writes"] = benchmark::Counter(writes, benchmark::Counter::kIsRate);
+}
+
+void BM_ReadValue(benchmark::State& state) {
+    runStore(state, 100);
+}
+
+void BM_WriteValue(benchmark::State& state) {
+    runStore(state, 0);
+}
+
+// Mostly clients reading, with a stream of updates from the vehicle
+void BM_ReadMostly(benchmark::State& state) {
+    runStore(state, 90);
+}
+
+// A client dumping every value while the other threads update them
+void BM_ReadAllValuesDuringWrites(benchmark::State& state) {
+    if (state.thread_index == 0) {
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(getStore().readAllValues());
+        }
+    } else {
+        runStore(state, 0);
+    }
+}
+
+BENCHMARK(BM_ReadValue)->Threads(1)->Threads(4)->Threads(8)->UseRealTime();
+BENCHMARK(BM_WriteValue)->Threads(1)->Threads(4)->Threads(8)->UseRealTime();
+BENCHMARK(BM_ReadMostly)->Threads(1)->Threads(4)->Threads(8)->UseRealTime();
+BENCHMARK(BM_ReadAllValuesDuringWrites)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+}  // namespace anonymous
+
+}  // namespace V2_0
+}  // namespace vehicle
+}  // namespace automotive
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -17,10 +17,13 @@
 #ifndef android_hardware_automotive_vehicle_V2_0_SubscriptionManager_H_
 #define android_hardware_automotive_vehicle_V2_0_SubscriptionManager_H_
 
+#include <array>
 #include <memory>
 #include <map>
 #include <set>
 #include <list>
+#include <unordered_map>
+#include <vector>
 
 #include <android/log.h>
 #include <hidl/HidlSupport.h>
@@ -75,7 +78,7 @@ public:
 
 struct HalClientValues {
     sp<HalClient> client;
-    std::list<VehiclePropValue *> values;
+    std::vector<VehiclePropValue *> values;
 };
 
 using ClientId = uint64_t;
@@ -107,12 +110,18 @@ public:
                                        std::list<SubscribeOptions>* outUpdatedOptions);
 
     /**
-     * Returns a list of IVehicleCallback -> list of VehiclePropValue ready for
+     * Groups given values by the clients subscribed to them, ready for
      * dispatching to its clients.
+     *
+     * outClientValues has an entry for every client, entries of clients that
+     * get no values have an empty list of values and no client. Callers are
+     * expected to pass the same vector for every batch, so that the lists of
+     * values keep their capacity.
      */
-    std::list<HalClientValues> distributeValuesToClients(
+    void distributeValuesToClients(
             const std::vector<recyclable_ptr<VehiclePropValue>>& propValues,
-            SubscribeFlags flags) const;
+            SubscribeFlags flags,
+            std::vector<HalClientValues>* outClientValues) const;
 
     std::list<sp<HalClient>> getSubscribedClients(int32_t propId, SubscribeFlags flags) const;
     /**
@@ -135,6 +144,34 @@ private:
 
     void onCallbackDead(uint64_t cookie);
 
+    /**
+     * Rebuilds mClientSlots and mPropSubscribers, must be called after every
+     * change of mClients or mPropToClients.
+     */
+    void rebuildIndexLocked();
+
+    /** Calls f with the slot of every client subscribed to propId with any of the flags. */
+    template <typename F>
+    void forEachSubscribedSlotLocked(int32_t propId, SubscribeFlags flags, F f) const {
+        auto it = mPropSubscribers.find(propId);
+        if (it == mPropSubscribers.end()) {
+            return;
+        }
+        const PropSubscribers& subscribers = it->second;
+        for (size_t word = 0; word < subscribers[0].size(); word++) {
+            uint64_t bits = 0;
+            for (size_t i = 0; i < kSubscribeFlagCount; i++) {
+                if (flags & (1 << i)) {
+                    bits |= subscribers[i][word];
+                }
+            }
+            while (bits != 0) {
+                f(word * 64 + __builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
 private:
     using OnClientDead = std::function<void(uint64_t)>;
 
@@ -164,6 +201,14 @@ private:
     std::map<int32_t, sp<HalClientVector>> mPropToClients;
     std::map<int32_t, SubscribeOptions> mHalEventSubscribeOptions;
 
+    // Index of the subscriptions above, for dispatching events. Every client
+    // has a slot in mClientSlots, and for every SubscribeFlags bit a property
+    // has a bitmap of the slots of its subscribers.
+    static constexpr size_t kSubscribeFlagCount = 2;
+    using PropSubscribers = std::array<std::vector<uint64_t>, kSubscribeFlagCount>;
+    std::vector<sp<HalClient>> mClientSlots;
+    std::unordered_map<int32_t, PropSubscribers> mPropSubscribers;
+
     OnPropertyUnsubscribed mOnPropertyUnsubscribed;
     sp<DeathRecipient> mCallbackDeathRecipient;
 };
@@ -126,6 +126,8 @@ private:
     SubscriptionManager mSubscriptionManager;
 
     hidl_vec<VehiclePropValue> mHidlVecOfVehiclePropValuePool;
+    // Only used by onBatchHalEvent, reused across batches.
+    std::vector<HalClientValues> mClientValues;
 
     ConcurrentQueue<VehiclePropValuePtr> mEventQueue;
     BatchingConsumer<VehiclePropValuePtr> mBatchingConsumer;
@@ -18,10 +18,11 @@
 #ifndef android_hardware_automotive_vehicle_V2_0_VehicleObjectPool_H_
 #define android_hardware_automotive_vehicle_V2_0_VehicleObjectPool_H_
 
-#include <deque>
-#include <map>
-#include <mutex>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <android/hardware/automotive/vehicle/2.0/types.h>
 
@@ -31,17 +32,11 @@ namespace automotive {
 namespace vehicle {
 namespace V2_0 {
 
-// Handy metric mostly for unit tests and debug.
-#define INC_METRIC_IF_DEBUG(val) PoolStats::instance()->val++;
+// Counts of an object pool, mostly for unit tests and debug.
 struct PoolStats {
-    std::atomic<uint32_t> Obtained {0};
-    std::atomic<uint32_t> Created {0};
-    std::atomic<uint32_t> Recycled {0};
-
-    static PoolStats* instance() {
-        static PoolStats inst;
-        return &inst;
-    }
+    uint64_t Obtained = 0;
+    uint64_t Created = 0;
+    uint64_t Recycled = 0;
 };
 
 template<typename T>
@@ -75,25 +70,91 @@ using recyclable_ptr = typename std::unique_ptr<T, Deleter<T>>;
  * multiple threads is OK, also client can obtain an object in one thread and
  * then move ownership to another thread.
  *
+ * Each thread caches idle objects in two magazines of kMagazineSize objects,
+ * so most calls to #obtain(...) and #recycle(...) do not touch any state shared
+ * with other threads. Once both magazines of a thread are empty (or full), one
+ * is exchanged for a full (or empty) magazine from a lock-free depot of
+ * kDepotSize magazines. Objects recycled while the depot holds no empty
+ * magazine are deleted. When a thread exits, its magazines go back to the
+ * depot.
  */
 template<typename T>
 class ObjectPool {
 public:
-    ObjectPool() = default;
-    virtual ~ObjectPool() = default;
+    static constexpr uint32_t kMagazineSize = 16;
+    static constexpr uint32_t kDepotSize = 32;
+
+    ObjectPool()
+        : mRegistry(std::make_shared<Registry>(this)),
+          mMagazines(new Magazine[kDepotSize]),
+          mDeleter([this] (T* o) { recycle(o); }) {
+        SlotAllocator& slots = getSlotAllocator();
+        {
+            std::lock_guard<std::mutex> g(slots.lock);
+            mId = slots.nextId++;
+            if (slots.freeSlots.empty()) {
+                mSlot = slots.nextSlot++;
+            } else {
+                mSlot = slots.freeSlots.back();
+                slots.freeSlots.pop_back();
+            }
+        }
+        for (uint32_t i = 0; i < kDepotSize; i++) {
+            pushMagazine(&mEmpty, &mMagazines[i]);
+        }
+    }
+
+    virtual ~ObjectPool() {
+        {
+            std::lock_guard<std::mutex> g(mRegistry->lock);
+            for (auto& cache : mRegistry->caches) {
+                cache->loaded = nullptr;
+                cache->previous = nullptr;
+            }
+            mRegistry->pool = nullptr;
+        }
+        // Magazines of thread caches are in the depot too.
+        for (uint32_t i = 0; i < kDepotSize; i++) {
+            const Magazine& magazine = mMagazines[i];
+            for (uint32_t j = 0; j < magazine.count; j++) {
+                delete magazine.objects[j];
+            }
+        }
+
+        SlotAllocator& slots = getSlotAllocator();
+        std::lock_guard<std::mutex> g(slots.lock);
+        slots.freeSlots.push_back(mSlot);
+    }
 
     virtual recyclable_ptr<T> obtain() {
-        std::lock_guard<std::mutex> g(mLock);
-        INC_METRIC_IF_DEBUG(Obtained)
-        if (mObjects.empty()) {
-            INC_METRIC_IF_DEBUG(Created)
-            return wrap(createObject());
+        T* o = nullptr;
+        ThreadCache* cache = getThreadCache();
+        if (cache != nullptr) {
+            increment(&cache->counters.obtained);
+            o = popObject(cache);
+            if (o == nullptr) {
+                increment(&cache->counters.created);
+            }
+        } else {
+            std::lock_guard<std::mutex> g(mRegistry->lock);
+            increment(&mRegistry->retired.obtained);
+            increment(&mRegistry->retired.created);
         }
 
-        auto o = wrap(mObjects.front().release());
-        mObjects.pop_front();
+        if (o == nullptr) {
+            o = createObject();
+        }
+        return recyclable_ptr<T> { o, mDeleter };
+    }
 
-        return o;
+    PoolStats getStats() const {
+        std::lock_guard<std::mutex> g(mRegistry->lock);
+        PoolStats stats;
+        addCounters(&stats, mRegistry->retired);
+        for (const auto& cache : mRegistry->caches) {
+            addCounters(&stats, cache->counters);
+        }
+        return stats;
     }
 
     ObjectPool& operator =(const ObjectPool &) = delete;
@@ -103,29 +164,262 @@ protected:
     virtual T* createObject() = 0;
 
     virtual void recycle(T* o) {
-        INC_METRIC_IF_DEBUG(Recycled)
-        std::lock_guard<std::mutex> g(mLock);
-        mObjects.push_back(std::unique_ptr<T> { o } );
+        ThreadCache* cache = getThreadCache();
+        if (cache != nullptr) {
+            increment(&cache->counters.recycled);
+            if (pushObject(cache, o)) {
+                return;
+            }
+        } else {
+            std::lock_guard<std::mutex> g(mRegistry->lock);
+            increment(&mRegistry->retired.recycled);
+        }
+        delete o;
     }
 
 private:
-    const Deleter<T>& getDeleter() {
-        if (!mDeleter.get()) {
-            Deleter<T> *d = new Deleter<T>(std::bind(
-                &ObjectPool::recycle, this, std::placeholders::_1));
-            mDeleter.reset(d);
+    struct Magazine {
+        // Index of the next magazine on the same depot stack.
+        std::atomic<uint32_t> next {kNoMagazine};
+        uint32_t count = 0;
+        T* objects[kMagazineSize];
+    };
+
+    // Each counter is written by one thread at a time, but read by #getStats().
+    struct Counters {
+        std::atomic<uint64_t> obtained {0};
+        std::atomic<uint64_t> created {0};
+        std::atomic<uint64_t> recycled {0};
+    };
+
+    struct ThreadCache {
+        Magazine* loaded = nullptr;
+        Magazine* previous = nullptr;
+        Counters counters;
+    };
+
+    // Shared between the pool and the threads that cache its objects, as a
+    // thread may exit after the pool is destroyed.
+    struct Registry {
+        explicit Registry(ObjectPool* p) : pool(p) {}
+
+        std::mutex lock;
+        ObjectPool* pool;  // nullptr once the pool is destroyed
+        std::vector<std::unique_ptr<ThreadCache>> caches;
+        // Counts of exited threads, and of calls made without a thread cache.
+        Counters retired;
+    };
+
+    struct CacheRef {
+        uint64_t poolId = 0;
+        std::shared_ptr<Registry> registry;
+        ThreadCache* cache = nullptr;
+    };
+
+    // Thread caches of all pools of T, indexed by pool slot.
+    struct ThreadCacheTable {
+        ~ThreadCacheTable() {
+            threadCachesDestroyed() = true;
+            for (auto& ref : refs) {
+                releaseCache(&ref);
+            }
+        }
+
+        std::vector<CacheRef> refs;
+    };
+
+    // Pools reuse the slots of destroyed pools, so that the per-thread tables
+    // stay small, but never their ids.
+    struct SlotAllocator {
+        std::mutex lock;
+        std::vector<uint32_t> freeSlots;
+        uint32_t nextSlot = 0;
+        uint64_t nextId = 1;
+    };
+
+    static constexpr uint32_t kNoMagazine = UINT32_MAX;
+
+    static SlotAllocator& getSlotAllocator() {
+        // Never deleted, pools may be destroyed after static destructors run.
+        static SlotAllocator* slots = new SlotAllocator();
+        return *slots;
+    }
+
+    static bool& threadCachesDestroyed() {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    static ThreadCacheTable* getThreadCacheTable() {
+        // Objects may still be recycled by other thread_local destructors.
+        if (threadCachesDestroyed()) {
+            return nullptr;
+        }
+        static thread_local ThreadCacheTable table;
+        return &table;
+    }
+
+    static void releaseCache(CacheRef* ref) {
+        if (ref->cache == nullptr) {
+            return;
+        }
+        {
+            Registry* registry = ref->registry.get();
+            std::lock_guard<std::mutex> g(registry->lock);
+            if (registry->pool != nullptr) {
+                registry->pool->flush(ref->cache);
+            }
+            Counters& from = ref->cache->counters;
+            add(&registry->retired.obtained, from.obtained);
+            add(&registry->retired.created, from.created);
+            add(&registry->retired.recycled, from.recycled);
+
+            auto& caches = registry->caches;
+            for (auto it = caches.begin(); it != caches.end(); it++) {
+                if (it->get() == ref->cache) {
+                    caches.erase(it);
+                    break;
+                }
+            }
         }
-        return *mDeleter.get();
+        ref->cache = nullptr;
+        ref->registry.reset();
     }
 
-    recyclable_ptr<T> wrap(T* raw) {
-        return recyclable_ptr<T> { raw, getDeleter() };
+    // Only ever called by the thread owning the counter, or under the
+    // registry lock.
+    static void increment(std::atomic<uint64_t>* counter) {
+        counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static void add(std::atomic<uint64_t>* counter, const std::atomic<uint64_t>& value) {
+        counter->store(counter->load(std::memory_order_relaxed) +
+                       value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    static void addCounters(PoolStats* stats, const Counters& counters) {
+        stats->Obtained += counters.obtained.load(std::memory_order_relaxed);
+        stats->Created += counters.created.load(std::memory_order_relaxed);
+        stats->Recycled += counters.recycled.load(std::memory_order_relaxed);
+    }
+
+    ThreadCache* getThreadCache() {
+        ThreadCacheTable* table = getThreadCacheTable();
+        if (table == nullptr) {
+            return nullptr;
+        }
+        if (mSlot < table->refs.size() && table->refs[mSlot].poolId == mId) {
+            return table->refs[mSlot].cache;
+        }
+
+        if (table->refs.size() <= mSlot) {
+            table->refs.resize(mSlot + 1);
+        }
+        CacheRef& ref = table->refs[mSlot];
+        // Left behind by a destroyed pool that had the same slot.
+        releaseCache(&ref);
+
+        std::unique_ptr<ThreadCache> cache(new ThreadCache());
+        ref.poolId = mId;
+        ref.registry = mRegistry;
+        ref.cache = cache.get();
+        std::lock_guard<std::mutex> g(mRegistry->lock);
+        mRegistry->caches.push_back(std::move(cache));
+        return ref.cache;
+    }
+
+    T* popObject(ThreadCache* cache) {
+        if (cache->loaded == nullptr || cache->loaded->count == 0) {
+            if (cache->previous != nullptr && cache->previous->count > 0) {
+                std::swap(cache->loaded, cache->previous);
+            } else {
+                Magazine* full = popMagazine(&mFull);
+                if (full == nullptr) {
+                    return nullptr;
+                }
+                if (cache->previous != nullptr) {
+                    pushMagazine(&mEmpty, cache->previous);
+                }
+                cache->previous = cache->loaded;
+                cache->loaded = full;
+            }
+        }
+        return cache->loaded->objects[--cache->loaded->count];
+    }
+
+    bool pushObject(ThreadCache* cache, T* o) {
+        if (cache->loaded == nullptr || cache->loaded->count == kMagazineSize) {
+            if (cache->previous != nullptr && cache->previous->count < kMagazineSize) {
+                std::swap(cache->loaded, cache->previous);
+            } else {
+                Magazine* empty = popMagazine(&mEmpty);
+                if (empty == nullptr) {
+                    return false;
+                }
+                if (cache->previous != nullptr) {
+                    pushMagazine(&mFull, cache->previous);
+                }
+                cache->previous = cache->loaded;
+                cache->loaded = empty;
+            }
+        }
+        cache->loaded->objects[cache->loaded->count++] = o;
+        return true;
+    }
+
+    // Called under the registry lock. Partially filled magazines go to the
+    // full stack, popObject(...) takes whatever they hold.
+    void flush(ThreadCache* cache) {
+        for (Magazine* magazine : {cache->loaded, cache->previous}) {
+            if (magazine != nullptr) {
+                pushMagazine(magazine->count > 0 ? &mFull : &mEmpty, magazine);
+            }
+        }
+        cache->loaded = nullptr;
+        cache->previous = nullptr;
+    }
+
+    // A depot stack head holds the index of its top magazine in the low half,
+    // and in the high half a tag that changes with every update, so that a
+    // thread holding a stale head cannot pop a magazine that was meanwhile
+    // popped and pushed back.
+    static uint64_t makeHead(uint64_t oldHead, uint32_t index) {
+        return (((oldHead >> 32) + 1) << 32) | index;
+    }
+
+    Magazine* popMagazine(std::atomic<uint64_t>* stack) {
+        uint64_t head = stack->load(std::memory_order_acquire);
+        while (static_cast<uint32_t>(head) != kNoMagazine) {
+            Magazine* magazine = &mMagazines[static_cast<uint32_t>(head)];
+            uint64_t next = makeHead(head, magazine->next.load(std::memory_order_relaxed));
+            if (stack->compare_exchange_weak(head, next, std::memory_order_acquire,
+                                             std::memory_order_acquire)) {
+                return magazine;
+            }
+        }
+        return nullptr;
+    }
+
+    void pushMagazine(std::atomic<uint64_t>* stack, Magazine* magazine) {
+        uint32_t index = static_cast<uint32_t>(magazine - mMagazines.get());
+        uint64_t head = stack->load(std::memory_order_relaxed);
+        do {
+            magazine->next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        } while (!stack->compare_exchange_weak(head, makeHead(head, index),
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
     }
 
 private:
-    mutable std::mutex mLock;
-    std::deque<std::unique_ptr<T>> mObjects;
-    std::unique_ptr<Deleter<T>> mDeleter;
+    const std::shared_ptr<Registry> mRegistry;
+    uint32_t mSlot;
+    uint64_t mId;
+
+    const std::unique_ptr<Magazine[]> mMagazines;
+    std::atomic<uint64_t> mFull {kNoMagazine};
+    std::atomic<uint64_t> mEmpty {kNoMagazine};
+
+    const Deleter<T> mDeleter;
 };
 
 /**
@@ -145,6 +439,10 @@ private:
  * synchornization penalty for these objects since we do not store them in the
  * pool.
  *
+ * Recyclable objects are kept in a separate ObjectPool for every value type
+ * and vector size, so an object obtained from the pool already has vectors of
+ * the requested size.
+ *
  * This class is thread-safe. Users can obtain an object in one thread and pass
  * it to another.
  *
@@ -174,8 +472,8 @@ public:
      * returning back to the object pool.
      *
      */
-    VehiclePropValuePool(size_t maxRecyclableVectorSize = 4) :
-        mMaxRecyclableVectorSize(maxRecyclableVectorSize) {};
+    VehiclePropValuePool(size_t maxRecyclableVectorSize = 4);
+    ~VehiclePropValuePool();
 
     RecyclableType obtain(VehiclePropertyType type);
 
@@ -188,14 +486,20 @@ public:
     RecyclableType obtainString(const char* cstr);
     RecyclableType obtainComplex();
 
+    // Returns the counts of all recyclable value types together.
+    PoolStats getStats() const;
+
     VehiclePropValuePool(VehiclePropValuePool& ) = delete;
     VehiclePropValuePool& operator=(VehiclePropValuePool&) = delete;
 private:
     bool isDisposable(VehiclePropertyType type, size_t vecSize) const {
-        return vecSize > mMaxRecyclableVectorSize || VehiclePropertyType::STRING == type ||
-               VehiclePropertyType::MIXED == type;
+        return vecSize > mMaxRecyclableVectorSize || getRecyclableTypeIndex(type) < 0;
     }
 
+    // Returns the index of a recyclable value type, or -1 for strings and
+    // mixed values.
+    static int getRecyclableTypeIndex(VehiclePropertyType type);
+
     RecyclableType obtainDisposable(VehiclePropertyType valueType,
                                     size_t vectorSize) const;
     RecyclableType obtainRecylable(VehiclePropertyType type,
@@ -232,9 +536,11 @@ private:
     };
 
 private:
-    mutable std::mutex mLock;
+    static constexpr int kRecyclableTypeCount = 8;
+
     const size_t mMaxRecyclableVectorSize;
-    std::map<int32_t, std::unique_ptr<InternalPool>> mValueTypePools;
+    // Indexed by recyclable type index and vector size, created on first use.
+    std::unique_ptr<std::atomic<InternalPool*>[]> mValueTypePools;
 };
 
 }  // namespace V2_0
@@ -17,10 +17,12 @@
 #ifndef android_hardware_automotive_vehicle_V2_0_impl_PropertyDb_H_
 #define android_hardware_automotive_vehicle_V2_0_impl_PropertyDb_H_
 
+#include <array>
 #include <cstdint>
 #include <unordered_map>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 
 #include <android/hardware/automotive/vehicle/2.0/IVehicle.h>
 
@@ -34,10 +36,13 @@ namespace V2_0 {
  * Encapsulates work related to storing and accessing configuration, storing and modifying
  * vehicle property values.
  *
- * VehiclePropertyValues stored in a sorted map thus it makes easier to get range of values, e.g.
- * to get value for all areas for particular property.
+ * Properties are spread over shards by property id. Each shard has its own reader/writer lock
+ * and hashes the values of a property by area and token, so that reads never block each other
+ * and writes only block accesses to properties of the same shard.
  *
- * This class is thread-safe, however it uses blocking synchronization across all methods.
+ * Values that are read in bulk are returned sorted by property, area and token.
+ *
+ * This class is thread-safe.
  */
 class VehiclePropertyStore {
 public:
@@ -59,8 +64,19 @@ private:
         bool operator<(const RecordId& other) const;
     };
 
-    using PropertyMap = std::map<RecordId, VehiclePropValue>;
-    using PropertyMapRange = std::pair<PropertyMap::const_iterator, PropertyMap::const_iterator>;
+    struct RecordIdHash {
+        size_t operator()(const RecordId& recId) const;
+    };
+
+    struct PropertyRecord {
+        RecordConfig config;
+        std::unordered_map<RecordId, VehiclePropValue, RecordIdHash> values;
+    };
+
+    struct Shard {
+        mutable std::shared_mutex lock;
+        std::unordered_map<int32_t /* VehicleProperty */, PropertyRecord> properties;
+    };
 
 public:
     void registerProperty(const VehiclePropConfig& config, TokenFunction tokenFunc = nullptr);
@@ -83,16 +99,23 @@ public:
     const VehiclePropConfig* getConfigOrDie(int32_t propId) const;
 
 private:
-    RecordId getRecordIdLocked(const VehiclePropValue& valuePrototype) const;
-    const VehiclePropValue* getValueOrNullLocked(const RecordId& recId) const;
-    PropertyMapRange findRangeLocked(int32_t propId) const;
+    using ReadGuard = std::shared_lock<std::shared_mutex>;
+    using WriteGuard = std::unique_lock<std::shared_mutex>;
 
-private:
-    using MuxGuard = std::lock_guard<std::mutex>;
-    mutable std::mutex mLock;
-    std::unordered_map<int32_t /* VehicleProperty */, RecordConfig> mConfigs;
+    static constexpr size_t kShardBits = 4;
+    static constexpr size_t kShardCount = 1 << kShardBits;
 
-    PropertyMap mPropertyValues;  // Sorted map of RecordId : VehiclePropValue.
+    Shard& getShard(int32_t propId);
+    const Shard& getShard(int32_t propId) const;
+    static RecordId getRecordId(const PropertyRecord& record,
+                                const VehiclePropValue& valuePrototype);
+    static void collectValues(const PropertyRecord& record,
+                              std::vector<std::pair<RecordId, VehiclePropValue>>* values);
+    static std::vector<VehiclePropValue> sortValues(
+            std::vector<std::pair<RecordId, VehiclePropValue>>* values);
+
+private:
+    std::array<Shard, kShardCount> mShards;
 };
 
 }  // namespace V2_0
@@ -113,35 +113,32 @@ StatusCode SubscriptionManager::addOrUpdateSubscription(
             }
         }
     }
+    rebuildIndexLocked();
 
     return StatusCode::OK;
 }
 
-std::list<HalClientValues> SubscriptionManager::distributeValuesToClients(
+void SubscriptionManager::distributeValuesToClients(
         const std::vector<recyclable_ptr<VehiclePropValue>>& propValues,
-        SubscribeFlags flags) const {
-    std::map<sp<HalClient>, std::list<VehiclePropValue*>> clientValuesMap;
-
-    {
-        MuxGuard g(mLock);
-        for (const auto& propValue: propValues) {
-            VehiclePropValue* v = propValue.get();
-            auto clients = getSubscribedClientsLocked(v->prop, flags);
-            for (const auto& client : clients) {
-                clientValuesMap[client].push_back(v);
-            }
-        }
+        SubscribeFlags flags,
+        std::vector<HalClientValues>* outClientValues) const {
+    MuxGuard g(mLock);
+    outClientValues->resize(mClientSlots.size());
+    for (HalClientValues& clientValues : *outClientValues) {
+        clientValues.client.clear();
+        clientValues.values.clear();
     }
 
-    std::list<HalClientValues> clientValues;
-    for (const auto& entry : clientValuesMap) {
-        clientValues.push_back(HalClientValues {
-            .client = entry.first,
-            .values = entry.second
+    for (const auto& propValue: propValues) {
+        VehiclePropValue* v = propValue.get();
+        forEachSubscribedSlotLocked(v->prop, flags, [&](size_t slot) {
+            HalClientValues& clientValues = (*outClientValues)[slot];
+            if (clientValues.values.empty()) {
+                clientValues.client = mClientSlots[slot];
+            }
+            clientValues.values.push_back(v);
         });
     }
-
-    return clientValues;
 }
 
 std::list<sp<HalClient>> SubscriptionManager::getSubscribedClients(int32_t propId,
@@ -153,18 +150,43 @@ std::list<sp<HalClient>> SubscriptionManager::getSubscribedClients(int32_t propI
 std::list<sp<HalClient>> SubscriptionManager::getSubscribedClientsLocked(
     int32_t propId, SubscribeFlags flags) const {
     std::list<sp<HalClient>> subscribedClients;
+    forEachSubscribedSlotLocked(propId, flags, [&](size_t slot) {
+        subscribedClients.push_back(mClientSlots[slot]);
+    });
+    return subscribedClients;
+}
+
+void SubscriptionManager::rebuildIndexLocked() {
+    std::map<HalClient*, size_t> slots;
+    mClientSlots.clear();
+    for (const auto& entry : mClients) {
+        slots.emplace(entry.second.get(), mClientSlots.size());
+        mClientSlots.push_back(entry.second);
+    }
+
+    size_t words = (mClientSlots.size() + 63) / 64;
+    mPropSubscribers.clear();
+    for (const auto& entry : mPropToClients) {
+        int32_t propId = entry.first;
+        const sp<HalClientVector>& propClients = entry.second;
 
-    sp<HalClientVector> propClients = getClientsForPropertyLocked(propId);
-    if (propClients.get() != nullptr) {
+        PropSubscribers& subscribers = mPropSubscribers[propId];
+        for (auto& bitmap : subscribers) {
+            bitmap.assign(words, 0);
+        }
         for (size_t i = 0; i < propClients->size(); i++) {
             const auto& client = propClients->itemAt(i);
-            if (client->isSubscribed(propId, flags)) {
-                subscribedClients.push_back(client);
+            auto slot = slots.find(client.get());
+            if (slot == slots.end()) {
+                continue;
+            }
+            for (size_t flag = 0; flag < kSubscribeFlagCount; flag++) {
+                if (client->isSubscribed(propId, static_cast<SubscribeFlags>(1 << flag))) {
+                    subscribers[flag][slot->second / 64] |= 1ull << (slot->second % 64);
+                }
             }
         }
     }
-
-    return subscribedClients;
 }
 
 bool SubscriptionManager::updateHalEventSubscriptionLocked(
@@ -263,6 +285,7 @@ void SubscriptionManager::unsubscribe(ClientId clientId,
             }
             mClients.erase(clientIter);
         }
+        rebuildIndexLocked();
     }
 
     if (propertyClients == nullptr || propertyClients->isEmpty()) {
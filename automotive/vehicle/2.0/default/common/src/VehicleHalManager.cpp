@@ -480,17 +480,21 @@ void VehicleHalManager::onHalPropertySetError(StatusCode errorCode,
 }
 
 void VehicleHalManager::onBatchHalEvent(const std::vector<VehiclePropValuePtr>& values) {
-    const auto& clientValues =
-        mSubscriptionManager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_CAR);
+    mSubscriptionManager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_CAR,
+                                                   &mClientValues);
 
-    for (const HalClientValues& cv : clientValues) {
+    for (const HalClientValues& cv : mClientValues) {
         auto vecSize = cv.values.size();
-        hidl_vec<VehiclePropValue> vec;
-        if (vecSize < kMaxHidlVecOfVehiclPropValuePoolSize) {
-            vec.setToExternal(&mHidlVecOfVehiclePropValuePool[0], vecSize);
-        } else {
-            vec.resize(vecSize);
+        if (vecSize == 0) {
+            continue;
         }
+        if (vecSize > mHidlVecOfVehiclePropValuePool.size()) {
+            // Values in the pool only point to the data of earlier events, so
+            // it can be replaced without copying them.
+            mHidlVecOfVehiclePropValuePool = hidl_vec<VehiclePropValue>(vecSize);
+        }
+        hidl_vec<VehiclePropValue> vec;
+        vec.setToExternal(&mHidlVecOfVehiclePropValuePool[0], vecSize);
 
         int i = 0;
         for (VehiclePropValue* pValue : cv.values) {
@@ -28,6 +28,58 @@ namespace automotive {
 namespace vehicle {
 namespace V2_0 {
 
+VehiclePropValuePool::VehiclePropValuePool(size_t maxRecyclableVectorSize)
+    : mMaxRecyclableVectorSize(maxRecyclableVectorSize),
+      mValueTypePools(new std::atomic<InternalPool*>[kRecyclableTypeCount *
+                                                     (maxRecyclableVectorSize + 1)]) {
+    for (size_t i = 0; i < kRecyclableTypeCount * (mMaxRecyclableVectorSize + 1); i++) {
+        mValueTypePools[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+VehiclePropValuePool::~VehiclePropValuePool() {
+    for (size_t i = 0; i < kRecyclableTypeCount * (mMaxRecyclableVectorSize + 1); i++) {
+        delete mValueTypePools[i].load(std::memory_order_relaxed);
+    }
+}
+
+PoolStats VehiclePropValuePool::getStats() const {
+    PoolStats stats;
+    for (size_t i = 0; i < kRecyclableTypeCount * (mMaxRecyclableVectorSize + 1); i++) {
+        InternalPool* pool = mValueTypePools[i].load(std::memory_order_acquire);
+        if (pool != nullptr) {
+            PoolStats poolStats = pool->getStats();
+            stats.Obtained += poolStats.Obtained;
+            stats.Created += poolStats.Created;
+            stats.Recycled += poolStats.Recycled;
+        }
+    }
+    return stats;
+}
+
+int VehiclePropValuePool::getRecyclableTypeIndex(VehiclePropertyType type) {
+    switch (type) {
+        case VehiclePropertyType::BOOLEAN:
+            return 0;
+        case VehiclePropertyType::INT32:
+            return 1;
+        case VehiclePropertyType::INT32_VEC:
+            return 2;
+        case VehiclePropertyType::INT64:
+            return 3;
+        case VehiclePropertyType::INT64_VEC:
+            return 4;
+        case VehiclePropertyType::FLOAT:
+            return 5;
+        case VehiclePropertyType::FLOAT_VEC:
+            return 6;
+        case VehiclePropertyType::BYTES:
+            return 7;
+        default:
+            return -1;
+    }
+}
+
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtain(
         VehiclePropertyType type, size_t vecSize) {
     return isDisposable(type, vecSize)
@@ -88,18 +140,19 @@ VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainComplex() {
 
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainRecylable(
         VehiclePropertyType type, size_t vecSize) {
-    // VehiclePropertyType is not overlapping with vectorSize.
-    int32_t key = static_cast<int32_t>(type)
-                  | static_cast<int32_t>(vecSize);
-
-    std::lock_guard<std::mutex> g(mLock);
-    auto it = mValueTypePools.find(key);
+    std::atomic<InternalPool*>& slot = mValueTypePools[
+            getRecyclableTypeIndex(type) * (mMaxRecyclableVectorSize + 1) + vecSize];
 
-    if (it == mValueTypePools.end()) {
+    InternalPool* pool = slot.load(std::memory_order_acquire);
+    if (pool == nullptr) {
         auto newPool(std::make_unique<InternalPool>(type, vecSize));
-        it = mValueTypePools.emplace(key, std::move(newPool)).first;
+        if (slot.compare_exchange_strong(pool, newPool.get(), std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+            pool = newPool.release();
+        }
+        // Otherwise another thread created the pool first and pool points to it.
     }
-    return it->second->obtain();
+    return pool->obtain();
 }
 
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainBoolean(
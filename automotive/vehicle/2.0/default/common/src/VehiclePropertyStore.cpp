@@ -16,6 +16,8 @@
 #define LOG_TAG "VehiclePropertyStore"
 #include <log/log.h>
 
+#include <algorithm>
+
 #include <common/include/vhal_v2_0/VehicleUtils.h>
 #include "VehiclePropertyStore.h"
 
@@ -35,24 +37,37 @@ bool VehiclePropertyStore::RecordId::operator<(const VehiclePropertyStore::Recor
            || (prop == other.prop && area == other.area && token < other.token);
 }
 
+size_t VehiclePropertyStore::RecordIdHash::operator()(
+        const VehiclePropertyStore::RecordId& recId) const {
+    uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(recId.prop)) << 32)
+                   | static_cast<uint32_t>(recId.area);
+    return std::hash<uint64_t>()(key) ^ (std::hash<int64_t>()(recId.token) * 31);
+}
+
 void VehiclePropertyStore::registerProperty(const VehiclePropConfig& config,
                                             VehiclePropertyStore::TokenFunction tokenFunc) {
-    MuxGuard g(mLock);
-    mConfigs.insert({ config.prop, RecordConfig { config, tokenFunc } });
+    Shard& shard = getShard(config.prop);
+    WriteGuard g(shard.lock);
+    shard.properties.insert(
+            { config.prop, PropertyRecord { RecordConfig { config, tokenFunc }, {} } });
 }
 
 bool VehiclePropertyStore::writeValue(const VehiclePropValue& propValue,
                                         bool updateStatus) {
-    MuxGuard g(mLock);
-    if (!mConfigs.count(propValue.prop)) return false;
-
-    RecordId recId = getRecordIdLocked(propValue);
-    VehiclePropValue* valueToUpdate = const_cast<VehiclePropValue*>(getValueOrNullLocked(recId));
-    if (valueToUpdate == nullptr) {
-        mPropertyValues.insert({ recId, propValue });
+    Shard& shard = getShard(propValue.prop);
+    WriteGuard g(shard.lock);
+    auto recordIt = shard.properties.find(propValue.prop);
+    if (recordIt == shard.properties.end()) return false;
+
+    PropertyRecord& record = recordIt->second;
+    RecordId recId = getRecordId(record, propValue);
+    auto valueIt = record.values.find(recId);
+    if (valueIt == record.values.end()) {
+        record.values.insert({ recId, propValue });
         return true;
     }
 
+    VehiclePropValue* valueToUpdate = &valueIt->second;
     // propValue is outdated and drops it.
     if (valueToUpdate->timestamp > propValue.timestamp) {
         return false;
@@ -69,72 +84,93 @@ bool VehiclePropertyStore::writeValue(const VehiclePropValue& propValue,
 }
 
 void VehiclePropertyStore::removeValue(const VehiclePropValue& propValue) {
-    MuxGuard g(mLock);
-    RecordId recId = getRecordIdLocked(propValue);
-    auto it = mPropertyValues.find(recId);
-    if (it != mPropertyValues.end()) {
-        mPropertyValues.erase(it);
+    Shard& shard = getShard(propValue.prop);
+    WriteGuard g(shard.lock);
+    auto recordIt = shard.properties.find(propValue.prop);
+    if (recordIt != shard.properties.end()) {
+        recordIt->second.values.erase(getRecordId(recordIt->second, propValue));
     }
 }
 
 void VehiclePropertyStore::removeValuesForProperty(int32_t propId) {
-    MuxGuard g(mLock);
-    auto range = findRangeLocked(propId);
-    mPropertyValues.erase(range.first, range.second);
+    Shard& shard = getShard(propId);
+    WriteGuard g(shard.lock);
+    auto recordIt = shard.properties.find(propId);
+    if (recordIt != shard.properties.end()) {
+        recordIt->second.values.clear();
+    }
 }
 
 std::vector<VehiclePropValue> VehiclePropertyStore::readAllValues() const {
-    MuxGuard g(mLock);
-    std::vector<VehiclePropValue> allValues;
-    allValues.reserve(mPropertyValues.size());
-    for (auto&& it : mPropertyValues) {
-        allValues.push_back(it.second);
+    // Each shard is copied under its own lock, so concurrent writes to other shards may or may
+    // not be seen, as if they were made before or after the call.
+    std::vector<std::pair<RecordId, VehiclePropValue>> values;
+    for (const Shard& shard : mShards) {
+        ReadGuard g(shard.lock);
+        for (auto&& it : shard.properties) {
+            collectValues(it.second, &values);
+        }
     }
-    return allValues;
+    return sortValues(&values);
 }
 
 std::vector<VehiclePropValue> VehiclePropertyStore::readValuesForProperty(int32_t propId) const {
-    std::vector<VehiclePropValue> values;
-    MuxGuard g(mLock);
-    auto range = findRangeLocked(propId);
-    for (auto it = range.first; it != range.second; ++it) {
-        values.push_back(it->second);
+    std::vector<std::pair<RecordId, VehiclePropValue>> values;
+    const Shard& shard = getShard(propId);
+    {
+        ReadGuard g(shard.lock);
+        auto recordIt = shard.properties.find(propId);
+        if (recordIt != shard.properties.end()) {
+            collectValues(recordIt->second, &values);
+        }
     }
-
-    return values;
+    return sortValues(&values);
 }
 
 std::unique_ptr<VehiclePropValue> VehiclePropertyStore::readValueOrNull(
         const VehiclePropValue& request) const {
-    MuxGuard g(mLock);
-    RecordId recId = getRecordIdLocked(request);
-    const VehiclePropValue* internalValue = getValueOrNullLocked(recId);
-    return internalValue ? std::make_unique<VehiclePropValue>(*internalValue) : nullptr;
+    const Shard& shard = getShard(request.prop);
+    ReadGuard g(shard.lock);
+    auto recordIt = shard.properties.find(request.prop);
+    if (recordIt == shard.properties.end()) return nullptr;
+
+    const auto& values = recordIt->second.values;
+    auto valueIt = values.find(getRecordId(recordIt->second, request));
+    return valueIt != values.end() ? std::make_unique<VehiclePropValue>(valueIt->second) : nullptr;
 }
 
 std::unique_ptr<VehiclePropValue> VehiclePropertyStore::readValueOrNull(
         int32_t prop, int32_t area, int64_t token) const {
     RecordId recId = {prop, isGlobalProp(prop) ? 0 : area, token };
-    MuxGuard g(mLock);
-    const VehiclePropValue* internalValue = getValueOrNullLocked(recId);
-    return internalValue ? std::make_unique<VehiclePropValue>(*internalValue) : nullptr;
+    const Shard& shard = getShard(prop);
+    ReadGuard g(shard.lock);
+    auto recordIt = shard.properties.find(prop);
+    if (recordIt == shard.properties.end()) return nullptr;
+
+    const auto& values = recordIt->second.values;
+    auto valueIt = values.find(recId);
+    return valueIt != values.end() ? std::make_unique<VehiclePropValue>(valueIt->second) : nullptr;
 }
 
 
 std::vector<VehiclePropConfig> VehiclePropertyStore::getAllConfigs() const {
-    MuxGuard g(mLock);
     std::vector<VehiclePropConfig> configs;
-    configs.reserve(mConfigs.size());
-    for (auto&& recordConfigIt: mConfigs) {
-        configs.push_back(recordConfigIt.second.propConfig);
+    for (const Shard& shard : mShards) {
+        ReadGuard g(shard.lock);
+        for (auto&& recordIt : shard.properties) {
+            configs.push_back(recordIt.second.config.propConfig);
+        }
     }
     return configs;
 }
 
 const VehiclePropConfig* VehiclePropertyStore::getConfigOrNull(int32_t propId) const {
-    MuxGuard g(mLock);
-    auto recordConfigIt = mConfigs.find(propId);
-    return recordConfigIt != mConfigs.end() ? &recordConfigIt->second.propConfig : nullptr;
+    // Properties are never unregistered, and rehashing keeps elements in place, so the config
+    // stays valid after the lock is released.
+    const Shard& shard = getShard(propId);
+    ReadGuard g(shard.lock);
+    auto recordIt = shard.properties.find(propId);
+    return recordIt != shard.properties.end() ? &recordIt->second.config.propConfig : nullptr;
 }
 
 const VehiclePropConfig* VehiclePropertyStore::getConfigOrDie(int32_t propId) const {
@@ -146,35 +182,50 @@ const VehiclePropConfig* VehiclePropertyStore::getConfigOrDie(int32_t propId) co
     return cfg;
 }
 
-VehiclePropertyStore::RecordId VehiclePropertyStore::getRecordIdLocked(
-        const VehiclePropValue& valuePrototype) const {
+VehiclePropertyStore::Shard& VehiclePropertyStore::getShard(int32_t propId) {
+    return const_cast<Shard&>(static_cast<const VehiclePropertyStore*>(this)->getShard(propId));
+}
+
+const VehiclePropertyStore::Shard& VehiclePropertyStore::getShard(int32_t propId) const {
+    // Property ids of a group differ in their low bits, so mix them into the top bits.
+    uint32_t hash = static_cast<uint32_t>(propId) * 0x9e3779b1u;
+    return mShards[hash >> (32 - kShardBits)];
+}
+
+VehiclePropertyStore::RecordId VehiclePropertyStore::getRecordId(
+        const PropertyRecord& record, const VehiclePropValue& valuePrototype) {
     RecordId recId = {
         .prop = valuePrototype.prop,
         .area = isGlobalProp(valuePrototype.prop) ? 0 : valuePrototype.areaId,
         .token = 0
     };
 
-    auto it = mConfigs.find(recId.prop);
-    if (it == mConfigs.end()) return {};
-
-    if (it->second.tokenFunction != nullptr) {
-        recId.token = it->second.tokenFunction(valuePrototype);
+    if (record.config.tokenFunction != nullptr) {
+        recId.token = record.config.tokenFunction(valuePrototype);
     }
     return recId;
 }
 
-const VehiclePropValue* VehiclePropertyStore::getValueOrNullLocked(
-        const VehiclePropertyStore::RecordId& recId) const  {
-    auto it = mPropertyValues.find(recId);
-    return it == mPropertyValues.end() ? nullptr : &it->second;
+void VehiclePropertyStore::collectValues(
+        const PropertyRecord& record,
+        std::vector<std::pair<RecordId, VehiclePropValue>>* values) {
+    values->reserve(values->size() + record.values.size());
+    for (auto&& it : record.values) {
+        values->push_back(it);
+    }
 }
 
-VehiclePropertyStore::PropertyMapRange VehiclePropertyStore::findRangeLocked(int32_t propId) const {
-    // Based on the fact that mPropertyValues is a sorted map by RecordId.
-    auto beginIt = mPropertyValues.lower_bound( RecordId { propId, INT32_MIN, 0 });
-    auto endIt = mPropertyValues.lower_bound( RecordId { propId + 1, INT32_MIN, 0 });
+std::vector<VehiclePropValue> VehiclePropertyStore::sortValues(
+        std::vector<std::pair<RecordId, VehiclePropValue>>* values) {
+    std::sort(values->begin(), values->end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
 
-    return  PropertyMapRange { beginIt, endIt };
+    std::vector<VehiclePropValue> sortedValues;
+    sortedValues.reserve(values->size());
+    for (auto&& it : *values) {
+        sortedValues.push_back(std::move(it.second));
+    }
+    return sortedValues;
 }
 
 }  // namespace V2_0
@@ -188,6 +188,64 @@ TEST_F(SubscriptionManagerTest, unsubscribe) {
     assertLastUnsubscribedProperty(PROP1);
 }
 
+TEST_F(SubscriptionManagerTest, distributeValuesToClients) {
+    std::list<SubscribeOptions> updatedOptions;
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrToProp1, &updatedOptions));
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(2, cb2, subscrToProp2, &updatedOptions));
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(3, cb3, subscrToProp1and2, &updatedOptions));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (int32_t prop : {PROP1, PROP2, PROP1}) {
+        values.push_back(pool.obtainInt32(0));
+        values.back()->prop = prop;
+    }
+
+    std::vector<HalClientValues> clientValues;
+    manager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_CAR, &clientValues);
+    ASSERT_EQ(3u, clientValues.size());
+    for (const auto& cv : clientValues) {
+        std::vector<int32_t> props;
+        for (const VehiclePropValue* v : cv.values) {
+            props.push_back(v->prop);
+        }
+        if (cv.client->getCallback() == cb1) {
+            ASSERT_EQ(std::vector<int32_t>({PROP1, PROP1}), props);
+        } else if (cv.client->getCallback() == cb2) {
+            ASSERT_EQ(std::vector<int32_t>({PROP2}), props);
+        } else {
+            ASSERT_EQ(cb3, cv.client->getCallback());
+            ASSERT_EQ(std::vector<int32_t>({PROP1, PROP2, PROP1}), props);
+        }
+    }
+
+    // Clients without values keep their entry, but have nothing to dispatch.
+    manager.unsubscribe(3, PROP1);
+    manager.unsubscribe(3, PROP2);
+    values.pop_back();
+    values.erase(values.begin());
+    manager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_CAR, &clientValues);
+    size_t dispatched = 0;
+    for (const auto& cv : clientValues) {
+        if (!cv.values.empty()) {
+            ASSERT_EQ(cb2, cv.client->getCallback());
+            dispatched++;
+        } else {
+            ASSERT_EQ(nullptr, cv.client.get());
+        }
+    }
+    ASSERT_EQ(1u, dispatched);
+
+    // Wrong flag
+    manager.distributeValuesToClients(values, SubscribeFlags::EVENTS_FROM_ANDROID, &clientValues);
+    for (const auto& cv : clientValues) {
+        ASSERT_TRUE(cv.values.empty());
+    }
+}
+
 }  // namespace anonymous
 
 }  // namespace V2_0
@@ -33,38 +33,44 @@ namespace {
 class VehicleObjectPoolTest : public ::testing::Test {
 protected:
     void SetUp() override {
-        stats = PoolStats::instance();
-        resetStats();
         valuePool.reset(new VehiclePropValuePool);
     }
 
     void TearDown() override {
         // At the end, all created objects should be either recycled or deleted.
         // Some objects could be recycled multiple times, that's why it's <=
-        ASSERT_EQ(stats->Obtained, stats->Recycled);
-        ASSERT_LE(stats->Created, stats->Recycled);
-    }
-private:
-    void resetStats() {
-        stats->Obtained = 0;
-        stats->Created = 0;
-        stats->Recycled = 0;
+        PoolStats stats = valuePool->getStats();
+        ASSERT_EQ(stats.Obtained, stats.Recycled);
+        ASSERT_LE(stats.Created, stats.Recycled);
     }
 
 public:
-    PoolStats* stats;
     std::unique_ptr<VehiclePropValuePool> valuePool;
 };
 
 TEST_F(VehicleObjectPoolTest, valuePoolBasicCorrectness) {
-    auto value = valuePool->obtain(VehiclePropertyType::INT32);
+    void* raw = valuePool->obtain(VehiclePropertyType::INT32).get();
     // At this point, v1 should be recycled and the only object in the pool.
-    ASSERT_EQ(value.get(), valuePool->obtain(VehiclePropertyType::INT32).get());
+    ASSERT_EQ(raw, valuePool->obtain(VehiclePropertyType::INT32).get());
     // Obtaining value of another type - should return a new object
-    ASSERT_NE(value.get(), valuePool->obtain(VehiclePropertyType::FLOAT).get());
+    ASSERT_NE(raw, valuePool->obtain(VehiclePropertyType::FLOAT).get());
+
+    ASSERT_EQ(3u, valuePool->getStats().Obtained);
+    ASSERT_EQ(2u, valuePool->getStats().Created);
+}
 
-    ASSERT_EQ(3u, stats->Obtained);
-    ASSERT_EQ(2u, stats->Created);
+TEST_F(VehicleObjectPoolTest, valuePoolVectorSizes) {
+    auto value = valuePool->obtain(VehiclePropertyType::INT32_VEC, 3);
+    void* raw = value.get();
+    value.reset();
+
+    value = valuePool->obtain(VehiclePropertyType::INT32_VEC, 3);
+    ASSERT_EQ(raw, value.get());
+    ASSERT_EQ(3u, value->value.int32Values.size());
+    // Values with another vector size come from another pool
+    auto other = valuePool->obtain(VehiclePropertyType::INT32_VEC, 2);
+    ASSERT_NE(raw, other.get());
+    ASSERT_EQ(2u, other->value.int32Values.size());
 }
 
 TEST_F(VehicleObjectPoolTest, valuePoolStrings) {
@@ -78,7 +84,25 @@ TEST_F(VehicleObjectPoolTest, valuePoolStrings) {
     ASSERT_EQ(0u, vs2->value.stringValue.size());
     ASSERT_NE(raw, valuePool->obtain(VehiclePropertyType::STRING).get());
 
-    ASSERT_EQ(0u, stats->Obtained);
+    ASSERT_EQ(0u, valuePool->getStats().Obtained);
+}
+
+TEST_F(VehicleObjectPoolTest, valuePoolRecycleInExitedThread) {
+    const size_t kCount = 3 * ObjectPool<VehiclePropValue>::kMagazineSize;
+
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    std::thread([this, &values] {
+        for (size_t i = 0; i < kCount; i++) {
+            values.push_back(valuePool->obtain(VehiclePropertyType::INT64));
+        }
+        values.clear();
+    }).join();
+
+    // The exited thread returned its cached objects.
+    for (size_t i = 0; i < kCount; i++) {
+        values.push_back(valuePool->obtain(VehiclePropertyType::INT64));
+    }
+    ASSERT_EQ(kCount, valuePool->getStats().Created);
 }
 
 TEST_F(VehicleObjectPoolTest, valuePoolMultithreadedBenchmark) {
@@ -112,10 +136,13 @@ TEST_F(VehicleObjectPoolTest, valuePoolMultithreadedBenchmark) {
     }
     auto finish = elapsedRealtimeNano();
 
-    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats->Obtained);
-    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats->Recycled);
-    // Created less than obtained.
-    ASSERT_GE(static_cast<uint32_t>(T * O), stats->Created);
+    PoolStats stats = valuePool->getStats();
+    ASSERT_EQ(static_cast<uint64_t>(T * C * O), stats.Obtained);
+    ASSERT_EQ(static_cast<uint64_t>(T * C * O), stats.Recycled);
+    // Created less than obtained. Besides the objects in use, other threads
+    // may hold up to two magazines of each value type.
+    ASSERT_GE(static_cast<uint64_t>(T * O + T * 2 * 2 * ObjectPool<VehiclePropValue>::kMagazineSize),
+              stats.Created);
 
     auto elapsedMs = (finish - start) / 1000000;
     ASSERT_GE(1000, elapsedMs);  // Less a second to access 100K objects.
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "vhal_v2_0/VehiclePropertyStore.h"
+
+#include "VehicleHalTestUtils.h"
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace vehicle {
+namespace V2_0 {
+
+namespace {
+
+const int32_t kFanSpeed = toInt(VehicleProperty::HVAC_FAN_SPEED);
+const int32_t kMake = toInt(VehicleProperty::INFO_MAKE);
+const int32_t kFreezeFrame = toInt(VehicleProperty::OBD2_FREEZE_FRAME);
+const int32_t kLeft = toInt(VehicleAreaSeat::ROW_1_LEFT);
+const int32_t kRight = toInt(VehicleAreaSeat::ROW_1_RIGHT);
+
+VehiclePropValue makeValue(int32_t prop, int32_t areaId, int64_t timestamp, int32_t value) {
+    VehiclePropValue propValue;
+    propValue.prop = prop;
+    propValue.areaId = areaId;
+    propValue.timestamp = timestamp;
+    propValue.value.int32Values = {value};
+    return propValue;
+}
+
+class VehiclePropertyStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        for (const auto& config : kVehicleProperties) {
+            store.registerProperty(config);
+        }
+        VehiclePropConfig freezeFrameConfig = {.prop = kFreezeFrame};
+        store.registerProperty(freezeFrameConfig, [](const VehiclePropValue& value) {
+            return static_cast<int64_t>(value.value.int32Values[0]);
+        });
+    }
+
+public:
+    VehiclePropertyStore store;
+};
+
+TEST_F(VehiclePropertyStoreTest, writeAndRead) {
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kLeft, 1, 3), true));
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kRight, 1, 5), true));
+
+    auto left = store.readValueOrNull(kFanSpeed, kLeft);
+    ASSERT_NE(nullptr, left);
+    ASSERT_EQ(3, left->value.int32Values[0]);
+    auto right = store.readValueOrNull(makeValue(kFanSpeed, kRight, 0, 0));
+    ASSERT_NE(nullptr, right);
+    ASSERT_EQ(5, right->value.int32Values[0]);
+
+    ASSERT_EQ(nullptr, store.readValueOrNull(kFanSpeed, kLeft | kRight));
+}
+
+TEST_F(VehiclePropertyStoreTest, writeUnregistered) {
+    ASSERT_FALSE(store.writeValue(makeValue(toInt(VehicleProperty::INVALID), 0, 1, 0), true));
+    ASSERT_EQ(nullptr, store.getConfigOrNull(toInt(VehicleProperty::INVALID)));
+}
+
+TEST_F(VehiclePropertyStoreTest, globalPropertyIgnoresArea) {
+    ASSERT_TRUE(store.writeValue(makeValue(kMake, 7, 1, 1), true));
+    ASSERT_NE(nullptr, store.readValueOrNull(kMake, 0));
+    ASSERT_NE(nullptr, store.readValueOrNull(kMake, 3));
+}
+
+TEST_F(VehiclePropertyStoreTest, outdatedValueDropped) {
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kLeft, 10, 1), true));
+    ASSERT_FALSE(store.writeValue(makeValue(kFanSpeed, kLeft, 9, 2), true));
+    ASSERT_EQ(1, store.readValueOrNull(kFanSpeed, kLeft)->value.int32Values[0]);
+}
+
+TEST_F(VehiclePropertyStoreTest, valuesSorted) {
+    for (int32_t token : {5, 1, 3}) {
+        ASSERT_TRUE(store.writeValue(makeValue(kFreezeFrame, 0, 1, token), true));
+    }
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kRight, 1, 0), true));
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kLeft, 1, 0), true));
+
+    auto frames = store.readValuesForProperty(kFreezeFrame);
+    ASSERT_EQ(3u, frames.size());
+    ASSERT_EQ(1, frames[0].value.int32Values[0]);
+    ASSERT_EQ(3, frames[1].value.int32Values[0]);
+    ASSERT_EQ(5, frames[2].value.int32Values[0]);
+
+    auto all = store.readAllValues();
+    ASSERT_EQ(5u, all.size());
+    for (size_t i = 1; i < all.size(); i++) {
+        ASSERT_TRUE(all[i - 1].prop < all[i].prop ||
+                    (all[i - 1].prop == all[i].prop && all[i - 1].areaId <= all[i].areaId));
+    }
+}
+
+TEST_F(VehiclePropertyStoreTest, removeValues) {
+    for (int32_t token : {1, 2}) {
+        ASSERT_TRUE(store.writeValue(makeValue(kFreezeFrame, 0, 1, token), true));
+    }
+    ASSERT_TRUE(store.writeValue(makeValue(kFanSpeed, kLeft, 1, 0), true));
+
+    store.removeValue(makeValue(kFreezeFrame, 0, 0, 1));
+    ASSERT_EQ(1u, store.readValuesForProperty(kFreezeFrame).size());
+    store.removeValuesForProperty(kFreezeFrame);
+    ASSERT_TRUE(store.readValuesForProperty(kFreezeFrame).empty());
+    ASSERT_NE(nullptr, store.readValueOrNull(kFanSpeed, kLeft));
+}
+
+TEST_F(VehiclePropertyStoreTest, concurrentWritesAndReads) {
+    const int kIterations = 1000;
+    std::vector<std::thread> threads;
+    for (int32_t area : {kLeft, kRight}) {
+        threads.emplace_back([this, area] {
+            for (int i = 0; i < kIterations; i++) {
+                store.writeValue(makeValue(kFanSpeed, area, i, i), true);
+                store.writeValue(makeValue(kMake, 0, i, i), true);
+            }
+        });
+        threads.emplace_back([this, area] {
+            for (int i = 0; i < kIterations; i++) {
+                store.readValueOrNull(kFanSpeed, area);
+                store.readAllValues();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_EQ(kIterations - 1, store.readValueOrNull(kFanSpeed, kLeft)->value.int32Values[0]);
+    ASSERT_EQ(kIterations - 1, store.readValueOrNull(kFanSpeed, kRight)->value.int32Values[0]);
+}
+
+}  // namespace anonymous
+
+}  // namespace V2_0
+}  // namespace vehicle
+}  // namespace automotive
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "ExtCamConvert@3.4"
+//#define LOG_NDEBUG 0
+#include <log/log.h>
+
+#include <string.h>
+#include "ExternalCameraConvert.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#elif defined(__SSE2__)
+#define HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+namespace {
+
+// Row kernels. Widths are in pixels for yuyvToNv12Row and in chroma samples
+// for splitUvRow.
+struct ConvertKernels {
+    const char* name;
+    // Two YUYV rows to two Y rows and one averaged, interleaved UV row
+    void (*yuyvToNv12Row)(const uint8_t* src0, const uint8_t* src1,
+                          uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width);
+    // One interleaved UV row to separate U and V rows
+    void (*splitUvRow)(const uint8_t* srcUV, uint8_t* dstU, uint8_t* dstV, int width);
+};
+
+void yuyvToNv12RowC(const uint8_t* src0, const uint8_t* src1,
+                    uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width) {
+    for (int x = 0; x < width; x++) {
+        dstY0[x] = src0[2 * x];
+        dstY1[x] = src1[2 * x];
+        dstUV[x] = (src0[2 * x + 1] + src1[2 * x + 1] + 1) >> 1;
+    }
+}
+
+void splitUvRowC(const uint8_t* srcUV, uint8_t* dstU, uint8_t* dstV, int width) {
+    for (int x = 0; x < width; x++) {
+        dstU[x] = srcUV[2 * x];
+        dstV[x] = srcUV[2 * x + 1];
+    }
+}
+
+const ConvertKernels kKernelsC = {"c", yuyvToNv12RowC, splitUvRowC};
+
+#if defined(HAVE_NEON_KERNELS)
+void yuyvToNv12RowNeon(const uint8_t* src0, const uint8_t* src1,
+                       uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        // val[0] is luma, val[1] is already in NV12 UV order
+        uint8x16x2_t row0 = vld2q_u8(src0 + 2 * x);
+        uint8x16x2_t row1 = vld2q_u8(src1 + 2 * x);
+        vst1q_u8(dstY0 + x, row0.val[0]);
+        vst1q_u8(dstY1 + x, row1.val[0]);
+        vst1q_u8(dstUV + x, vrhaddq_u8(row0.val[1], row1.val[1]));
+    }
+    if (x < width) {
+        yuyvToNv12RowC(src0 + 2 * x, src1 + 2 * x, dstY0 + x, dstY1 + x, dstUV + x, width - x);
+    }
+}
+
+void splitUvRowNeon(const uint8_t* srcUV, uint8_t* dstU, uint8_t* dstV, int width) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t uv = vld2q_u8(srcUV + 2 * x);
+        vst1q_u8(dstU + x, uv.val[0]);
+        vst1q_u8(dstV + x, uv.val[1]);
+    }
+    if (x < width) {
+        splitUvRowC(srcUV + 2 * x, dstU + x, dstV + x, width - x);
+    }
+}
+
+const ConvertKernels kKernelsNeon = {"neon", yuyvToNv12RowNeon, splitUvRowNeon};
+#endif
+
+#if defined(HAVE_SSE2_KERNELS)
+void yuyvToNv12RowSse2(const uint8_t* src0, const uint8_t* src1,
+                       uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width) {
+    const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* s0 = reinterpret_cast<const __m128i*>(src0 + 2 * x);
+        const __m128i* s1 = reinterpret_cast<const __m128i*>(src1 + 2 * x);
+        __m128i a0 = _mm_loadu_si128(s0);
+        __m128i b0 = _mm_loadu_si128(s0 + 1);
+        __m128i a1 = _mm_loadu_si128(s1);
+        __m128i b1 = _mm_loadu_si128(s1 + 1);
+        __m128i y0 = _mm_packus_epi16(_mm_and_si128(a0, lowBytes), _mm_and_si128(b0, lowBytes));
+        __m128i y1 = _mm_packus_epi16(_mm_and_si128(a1, lowBytes), _mm_and_si128(b1, lowBytes));
+        // Odd bytes of YUYV are already in NV12 UV order
+        __m128i uv0 = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8));
+        __m128i uv1 = _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dstY0 + x), y0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dstY1 + x), y1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dstUV + x), _mm_avg_epu8(uv0, uv1));
+    }
+    if (x < width) {
+        yuyvToNv12RowC(src0 + 2 * x, src1 + 2 * x, dstY0 + x, dstY1 + x, dstUV + x, width - x);
+    }
+}
+
+void splitUvRowSse2(const uint8_t* srcUV, uint8_t* dstU, uint8_t* dstV, int width) {
+    const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* s = reinterpret_cast<const __m128i*>(srcUV + 2 * x);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i u = _mm_packus_epi16(_mm_and_si128(a, lowBytes), _mm_and_si128(b, lowBytes));
+        __m128i v = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dstU + x), u);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dstV + x), v);
+    }
+    if (x < width) {
+        splitUvRowC(srcUV + 2 * x, dstU + x, dstV + x, width - x);
+    }
+}
+
+const ConvertKernels kKernelsSse2 = {"sse2", yuyvToNv12RowSse2, splitUvRowSse2};
+#endif
+
+const ConvertKernels* selectKernels() {
+#if defined(HAVE_NEON_KERNELS)
+#if defined(__arm__)
+    // NEON is optional on ARMv7
+    if ((getauxval(AT_HWCAP) & HWCAP_NEON) == 0) {
+        return &kKernelsC;
+    }
+#endif
+    return &kKernelsNeon;
+#elif defined(HAVE_SSE2_KERNELS)
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2")) {
+        return &kKernelsC;
+    }
+    return &kKernelsSse2;
+#else
+    return &kKernelsC;
+#endif
+}
+
+const ConvertKernels& getKernels() {
+    static const ConvertKernels* sKernels = [] {
+        const ConvertKernels* kernels = selectKernels();
+        ALOGI("Using %s YUV conversion kernels", kernels->name);
+        return kernels;
+    }();
+    return *sKernels;
+}
+
+bool checkSize(const char* func, int width, int height) {
+    if (width <= 0 || height <= 0 || (width % 2) || (height % 2)) {
+        ALOGE("%s: bad size %dx%d", func, width, height);
+        return false;
+    }
+    return true;
+}
+
+void copyPlane(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+               int width, int height) {
+    if (srcStride == width && dstStride == width) {
+        memcpy(dst, src, static_cast<size_t>(width) * height);
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        memcpy(dst, src, width);
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+void splitUvPlane(const ConvertKernels& k, const uint8_t* srcUV, int srcUVStride,
+                  uint8_t* dstU, int dstUStride, uint8_t* dstV, int dstVStride,
+                  int chromaWidth, int chromaHeight) {
+    for (int y = 0; y < chromaHeight; y++) {
+        k.splitUvRow(srcUV, dstU, dstV, chromaWidth);
+        srcUV += srcUVStride;
+        dstU += dstUStride;
+        dstV += dstVStride;
+    }
+}
+
+} // anonymous namespace
+
+int convertYuyvToNv12(const uint8_t* src, int srcStride,
+                      uint8_t* dstY, int dstYStride,
+                      uint8_t* dstUV, int dstUVStride,
+                      int width, int height) {
+    if (src == nullptr || dstY == nullptr || dstUV == nullptr ||
+            !checkSize(__FUNCTION__, width, height)) {
+        return -1;
+    }
+
+    const ConvertKernels& k = getKernels();
+    for (int y = 0; y < height; y += 2) {
+        k.yuyvToNv12Row(src, src + srcStride, dstY, dstY + dstYStride, dstUV, width);
+        src += 2 * srcStride;
+        dstY += 2 * dstYStride;
+        dstUV += dstUVStride;
+    }
+    return 0;
+}
+
+int convertNv12ToI420(const uint8_t* srcY, int srcYStride,
+                      const uint8_t* srcUV, int srcUVStride,
+                      uint8_t* dstY, int dstYStride,
+                      uint8_t* dstU, int dstUStride,
+                      uint8_t* dstV, int dstVStride,
+                      int width, int height) {
+    if (srcY == nullptr || srcUV == nullptr || dstY == nullptr ||
+            dstU == nullptr || dstV == nullptr ||
+            !checkSize(__FUNCTION__, width, height)) {
+        return -1;
+    }
+
+    copyPlane(srcY, srcYStride, dstY, dstYStride, width, height);
+    splitUvPlane(getKernels(), srcUV, srcUVStride, dstU, dstUStride, dstV, dstVStride,
+            width / 2, height / 2);
+    return 0;
+}
+
+int convertNv12ToYv12Cropped(const uint8_t* srcY, int srcYStride,
+                             const uint8_t* srcUV, int srcUVStride,
+                             int cropLeft, int cropTop, int cropWidth, int cropHeight,
+                             uint8_t* dstY, int dstYStride,
+                             uint8_t* dstV, int dstVStride,
+                             uint8_t* dstU, int dstUStride) {
+    if (srcY == nullptr || srcUV == nullptr || dstY == nullptr ||
+            dstU == nullptr || dstV == nullptr ||
+            cropLeft < 0 || cropTop < 0 || (cropLeft % 2) || (cropTop % 2) ||
+            !checkSize(__FUNCTION__, cropWidth, cropHeight)) {
+        ALOGE("%s: bad crop left %d top %d", __FUNCTION__, cropLeft, cropTop);
+        return -1;
+    }
+
+    copyPlane(srcY + cropTop * srcYStride + cropLeft, srcYStride,
+            dstY, dstYStride, cropWidth, cropHeight);
+    splitUvPlane(getKernels(), srcUV + (cropTop / 2) * srcUVStride + cropLeft, srcUVStride,
+            dstU, dstUStride, dstV, dstVStride, cropWidth / 2, cropHeight / 2);
+    return 0;
+}
+
+const char* getConvertKernelName() {
+    return getKernels().name;
+}
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -23,15 +23,18 @@
 #include "ExternalCameraDeviceSession_3.4.h"
 
 #include "android-base/macros.h"
+#include <cutils/properties.h>
 #include <utils/Timers.h>
 #include <utils/Trace.h>
 #include <linux/videodev2.h>
 #include <sync/sync.h>
+#include <poll.h>
 
 #define HAVE_JPEG // required for libyuv.h to export MJPEG decode APIs
 #include <libyuv.h>
 
 #include <jpeglib.h>
+#include "ExternalCameraConvert.h"
 #include "RgaCropScale.h"
 #ifndef RK_GRALLOC_4
 #include "ExternalCameraGralloc.h"
@@ -63,10 +66,16 @@ constexpr int MAX_RETRY = 15; // Allow retry some ioctl failures a few times to
                              // webcam showing temporarily ioctl failures.
 constexpr int IOCTL_RETRY_SLEEP_US = 33000; // 33ms * MAX_RETRY = 0.5 seconds
 
+// Streams at or above this fps use ExternalCameraConfig::numVideoBuffers
+constexpr double kDefaultFps = 30.0;
+
 // Constants for tryLock during dumpstate
 static constexpr int kDumpLockRetries = 50;
 static constexpr int kDumpLockSleep = 60000;
 
+// While set, every dumpstate clears the latency histograms after printing them
+constexpr char kLatencyResetProperty[] = "vendor.camera.external.latency_reset";
+
 bool tryLock(Mutex& mutex)
 {
     bool locked = false;
@@ -93,6 +102,117 @@ bool tryLock(std::mutex& mutex)
     return locked;
 }
 
+// Timeout waiting for an output buffer acquire fence
+constexpr int kSyncWaitTimeoutMs = 500;
+
+// A request can bypass the intermediate YU12 frame when it has a single output
+// buffer of the V4L2 frame size in an NV12 compatible format. The 16 pixel
+// alignment matches the stride the hardware decoder writes; the buffer layout
+// itself is checked with hasDecoderLayout() or by the YUYV converter.
+bool isDirectOutputCandidate(const HalRequest& req) {
+    if (req.buffers.size() != 1) {
+        return false;
+    }
+    const HalStreamBuffer& halBuf = req.buffers[0];
+    if (halBuf.format != PixelFormat::YCBCR_420_888 &&
+            halBuf.format != PixelFormat::IMPLEMENTATION_DEFINED) {
+        return false;
+    }
+    if (halBuf.bufPtr == nullptr || *(halBuf.bufPtr) == nullptr) {
+        return false;
+    }
+    return halBuf.width == req.frameIn->mWidth && halBuf.height == req.frameIn->mHeight &&
+            (halBuf.width & 0x0f) == 0 && (halBuf.height & 0x0f) == 0;
+}
+
+// The hardware decoder writes NV12 with a 16 aligned stride and the chroma
+// plane right after the aligned luma rows. gralloc may allocate
+// IMPLEMENTATION_DEFINED buffers as NV21 or with a wider stride, so check the
+// actual layout before decoding into a buffer, like the YUYV direct path does.
+bool hasDecoderLayout(HandleImporter& importer, HalStreamBuffer& halBuf) {
+    IMapper::Rect outRect {0, 0,
+            static_cast<int32_t>(halBuf.width),
+            static_cast<int32_t>(halBuf.height)};
+    YCbCrLayout layout = importer.lockYCbCr(*(halBuf.bufPtr), halBuf.usage, outRect);
+    uint32_t alignedWidth = (halBuf.width + 15) & (~15);
+    uint32_t alignedHeight = (halBuf.height + 15) & (~15);
+    uint8_t* y = static_cast<uint8_t*>(layout.y);
+    bool match = y != nullptr &&
+            getFourCcFromLayout(layout) == V4L2_PIX_FMT_NV12 &&
+            layout.yStride == alignedWidth && layout.cStride == alignedWidth &&
+            static_cast<uint8_t*>(layout.cb) == y + alignedWidth * alignedHeight;
+    int relFence = importer.unlock(*(halBuf.bufPtr));
+    if (relFence >= 0) {
+        ::close(relFence);
+    }
+    if (!match) {
+        ALOGV("%s: y_str %d c_str %d c_step %d cb offset %td, not a decoder layout",
+                __FUNCTION__, layout.yStride, layout.cStride, layout.chromaStep,
+                static_cast<uint8_t*>(layout.cb) - y);
+    }
+    return match;
+}
+
+int getBufferShareFd(buffer_handle_t buf) {
+    int handle_fd = -1;
+#ifndef RK_GRALLOC_4
+    gralloc_module_t const* mGrallocModule;
+    const hw_module_t *allocMod = NULL;
+    if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &allocMod) != 0) {
+        return -1;
+    }
+    mGrallocModule = reinterpret_cast<gralloc_module_t const *>(allocMod);
+    mGrallocModule->perform(
+            mGrallocModule,
+            GRALLOC_MODULE_PERFORM_GET_HADNLE_PRIME_FD,
+            buf,
+            &handle_fd);
+#else
+    ExCamGralloc4::get_share_fd(buf, &handle_fd);
+#endif
+    return handle_fd;
+}
+
+// Insert an APP1 segment into a JPEG stream that was encoded reserve bytes
+// into buf. The segment goes right after SOI and the JFIF APP0 segment, which
+// is where libjpeg would have written it, and the result starts at buf.
+int spliceApp1(uint8_t* buf, size_t reserve, size_t codeSize,
+        const std::vector<uint8_t>& app1, /*out*/size_t* outSize) {
+    uint8_t* jpeg = buf + reserve;
+    size_t segSize = app1.size() + 4;
+    if (codeSize < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        ALOGE("%s: encoded image does not start with SOI", __FUNCTION__);
+        return -1;
+    }
+    if (app1.size() + 2 > 0xFFFF || segSize > reserve) {
+        ALOGE("%s: APP1 segment too big: %zu", __FUNCTION__, app1.size());
+        return -1;
+    }
+
+    size_t headerSize = 2;
+    if (jpeg[2] == 0xFF && jpeg[3] == 0xE0 && codeSize >= 6) {
+        headerSize += 2 + ((jpeg[4] << 8) | jpeg[5]);
+        if (headerSize > codeSize) {
+            ALOGE("%s: malformed APP0 segment", __FUNCTION__);
+            return -1;
+        }
+    }
+
+    // Every copy moves data towards the start of buf and the APP1 segment
+    // never overlaps the bytes still to be moved since segSize <= reserve
+    memmove(buf, jpeg, headerSize);
+    memmove(buf + headerSize + segSize, jpeg + headerSize, codeSize - headerSize);
+    uint8_t* seg = buf + headerSize;
+    seg[0] = 0xFF;
+    seg[1] = 0xE1;
+    seg[2] = ((app1.size() + 2) >> 8) & 0xFF;
+    seg[3] = (app1.size() + 2) & 0xFF;
+    memcpy(seg + 4, app1.data(), app1.size());
+
+    *outSize = codeSize + segSize;
+    return 0;
+}
+
 int g_spsAndPpsLen = 0;
 static int getNextNALUnit(const uint8_t **_data, size_t *_size, const uint8_t **nalStart, size_t *nalSize)
 {
@@ -231,6 +351,9 @@ static bool checkH264FrameType(const uint8_t *pInBuffer, size_t inputLen,size_t
 // Static instances
 const int ExternalCameraDeviceSession::kMaxProcessedStream;
 const int ExternalCameraDeviceSession::kMaxStallStream;
+const uint32_t ExternalCameraDeviceSession::FormatConvertThread::kMaxPipelineDepth;
+const size_t ExternalCameraDeviceSession::JpegEncodeThread::kApp1Reserve;
+const int ExternalCameraDeviceSession::JpegEncodeThread::kFlushWaitTimeoutSec;
 HandleImporter ExternalCameraDeviceSession::sHandleImporter;
 
 ExternalCameraDeviceSession::ExternalCameraDeviceSession(
@@ -256,7 +379,9 @@ void ExternalCameraDeviceSession::createPreviewBuffer() {
     int tempWidth, tempHeight;
 
     memset(&mGrallocBuf,0,sizeof(struct bufferinfo_s));
-    mGrallocBuf.mNumBffers = mCfg.numVideoBuffers;
+    // Preview buffers are indexed by V4L2 buffer index
+    mGrallocBuf.mNumBffers = mV4L2BufferCount;
+    mPreviewBufferCount = mV4L2BufferCount;
     tempWidth = (mV4l2StreamingFmt.width + 15) & (~15);
     tempHeight = (mV4l2StreamingFmt.height + 15) & (~15);
     LOGD("alloc buffer W:H=%dx%d", tempWidth, tempHeight);
@@ -348,7 +473,8 @@ bool ExternalCameraDeviceSession::isInitFailed() {
 
 void ExternalCameraDeviceSession::initOutputThread() {
     mOutputThread = new OutputThread(this, mCroppingType, mCameraCharacteristics);
-    mFormatConvertThread = new FormatConvertThread(mOutputThread);
+    mOutputThread->setScaleWorkers(mCfg.scaleWorkerCount);
+    mFormatConvertThread = new FormatConvertThread(mOutputThread, mCfg.decodePipelineDepth);
 }
 
 void ExternalCameraDeviceSession::closeOutputThread() {
@@ -361,6 +487,7 @@ void ExternalCameraDeviceSession::closeOutputThreadImpl() {
         mOutputThread->requestExit();
         mOutputThread->join();
         mOutputThread.clear();
+        flushPendingResults();
     }
 }
 
@@ -453,6 +580,19 @@ void ExternalCameraDeviceSession::dumpState(const native_handle_t* handle) {
         }
         dprintf(fd, "V4L2 buffer queue size %zu, dequeued %zu\n",
                 v4L2BufferCount, numDequeuedV4l2Buffers);
+
+        nsecs_t holdTime;
+        {
+            std::lock_guard<std::mutex> lk(mV4l2BufferLock);
+            holdTime = mV4l2HoldTime;
+        }
+        uint64_t staleFrames;
+        {
+            std::lock_guard<std::mutex> lk(mCaptureLock);
+            staleFrames = mStaleFrames;
+        }
+        dprintf(fd, "V4L2 buffer average hold time %" PRId64 "us, stale frames dropped %" PRIu64
+                "\n", ns2us(holdTime), staleFrames);
     }
 
     dprintf(fd, "In-flight frames (not sorted):");
@@ -460,7 +600,22 @@ void ExternalCameraDeviceSession::dumpState(const native_handle_t* handle) {
         dprintf(fd, "%d, ", frameNumber);
     }
     dprintf(fd, "\n");
+    mFormatConvertThread->dump(fd);
+    if (mFormatConvertThread->mCamMemManager != nullptr) {
+        mFormatConvertThread->mCamMemManager->dump(fd);
+    }
     mOutputThread->dump(fd);
+    {
+        std::lock_guard<std::mutex> lk(mResultBatchLock);
+        dprintf(fd, "Result batching: %" PRIu64 " results in %" PRIu64 " callbacks, "
+                "%zu results pending\n", mSentResults, mResultCallbacks, mPendingResults.size());
+    }
+    mLatencyRecorder.dump(fd);
+    // Lets repeated dumps measure one interval each without reconfiguring
+    if (property_get_bool(kLatencyResetProperty, /*default*/false)) {
+        mLatencyRecorder.clear();
+        dprintf(fd, "Latency histograms cleared (%s is set)\n", kLatencyResetProperty);
+    }
     dprintf(fd, "\n");
 
     if (intfLocked) {
@@ -636,7 +791,14 @@ Return<Status> ExternalCameraDeviceSession::flush() {
     if (status != Status::OK) {
         return status;
     }
+    // Drain the decode pipeline first so every decoded request is already queued
+    // in the OutputThread, then error out what was never dispatched for decode
+    std::list<std::shared_ptr<HalRequest>> pendingReqs = mFormatConvertThread->flush();
     mOutputThread->flush();
+    for (const auto& req : pendingReqs) {
+        processCaptureRequestError(req);
+    }
+    flushPendingResults();
     return Status::OK;
 }
 
@@ -859,6 +1021,7 @@ Status ExternalCameraDeviceSession::processOneCaptureRequest(const CaptureReques
         }
 
         if (requestFpsMax != mV4l2StreamingFps) {
+            stopCaptureThreadLocked();
             {
                 std::unique_lock<std::mutex> lk(mV4l2BufferLock);
                 while (mNumDequeuedV4l2Buffers != 0) {
@@ -879,13 +1042,17 @@ Status ExternalCameraDeviceSession::processOneCaptureRequest(const CaptureReques
         return status;
     }
 
+    StageLatencies latency;
 REDEQUE:
     nsecs_t shutterTs = 0;
-    sp<V4L2Frame> frameIn = dequeueV4l2FrameLocked(&shutterTs);
+    nsecs_t dequeueStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    sp<V4L2Frame> frameIn = (mCaptureThread != nullptr) ?
+            acquireCapturedFrameLocked(&shutterTs) : dequeueV4l2FrameLocked(&shutterTs);
     if ( frameIn == nullptr) {
         ALOGE("%s: V4L2 deque frame failed!", __FUNCTION__);
         return Status::INTERNAL_ERROR;
     }
+    latency.add(STAGE_DEQUEUE, systemTime(SYSTEM_TIME_MONOTONIC) - dequeueStart);
 
     if (mV4l2StreamingFmt.fourcc == V4L2_PIX_FMT_H264) {
         //if (isNeedCheckIFrame) {
@@ -938,7 +1105,9 @@ REDEQUE:
 			    PREVIEWBUFFER, frameIn->mBufferIndex, buffer_sharre_fd);
 			mVirAddr = mFormatConvertThread->mCamMemManager->getBufferAddr(
 			    PREVIEWBUFFER, frameIn->mBufferIndex, buffer_addr_vir);
+            nsecs_t decodeStart = systemTime(SYSTEM_TIME_MONOTONIC);
             int ret = mFormatConvertThread->h264Decoder(mShareFd, inData, inDataSize);
+            latency.add(STAGE_DECODE, systemTime(SYSTEM_TIME_MONOTONIC) - decodeStart);
             if (ret == VPU_EAGAIN) {
                 enqueueV4l2Frame(frameIn);
                 goto REDEQUE;
@@ -956,6 +1125,7 @@ REDEQUE:
     halReq->setting = mLatestReqSetting;
     halReq->frameIn = frameIn;
     halReq->shutterTs = shutterTs;
+    halReq->latency = latency;
     halReq->buffers.resize(numOutputBufs);
     for (size_t i = 0; i < numOutputBufs; i++) {
         HalStreamBuffer& halBuf = halReq->buffers[i];
@@ -981,22 +1151,39 @@ REDEQUE:
     return Status::OK;
 }
 
-void ExternalCameraDeviceSession::notifyShutter(uint32_t frameNumber, nsecs_t shutterTs) {
+namespace {
+
+NotifyMsg makeShutterMsg(uint32_t frameNumber, nsecs_t shutterTs) {
     NotifyMsg msg;
     msg.type = MsgType::SHUTTER;
     msg.msg.shutter.frameNumber = frameNumber;
     msg.msg.shutter.timestamp = shutterTs;
-    mCallback->notify({msg});
+    return msg;
 }
 
-void ExternalCameraDeviceSession::notifyError(
-        uint32_t frameNumber, int32_t streamId, ErrorCode ec) {
+NotifyMsg makeErrorMsg(uint32_t frameNumber, int32_t streamId, ErrorCode ec) {
     NotifyMsg msg;
     msg.type = MsgType::ERROR;
     msg.msg.error.frameNumber = frameNumber;
     msg.msg.error.errorStreamId = streamId;
     msg.msg.error.errorCode = ec;
-    mCallback->notify({msg});
+    return msg;
+}
+
+} // anonymous namespace
+
+void ExternalCameraDeviceSession::notifyShutter(uint32_t frameNumber, nsecs_t shutterTs) {
+    std::vector<NotifyMsg> msgs {makeShutterMsg(frameNumber, shutterTs)};
+    hidl_vec<CaptureResult> results;
+    queueResults(msgs, results, /*flushNow*/true);
+}
+
+void ExternalCameraDeviceSession::notifyError(
+        uint32_t frameNumber, int32_t streamId, ErrorCode ec) {
+    // Goes out behind any results still pending
+    std::vector<NotifyMsg> msgs {makeErrorMsg(frameNumber, streamId, ec)};
+    hidl_vec<CaptureResult> results;
+    queueResults(msgs, results, /*flushNow*/true);
 }
 
 //TODO: refactor with processCaptureResult
@@ -1010,22 +1197,12 @@ Status ExternalCameraDeviceSession::processCaptureRequestError(
             static_cast<V3_4::implementation::V4L2Frame*>(req->frameIn.get());
     enqueueV4l2Frame(v4l2Frame);
 
-    if (outMsgs == nullptr) {
-        notifyShutter(req->frameNumber, req->shutterTs);
-        notifyError(/*frameNum*/req->frameNumber, /*stream*/-1, ErrorCode::ERROR_REQUEST);
-    } else {
-        NotifyMsg shutter;
-        shutter.type = MsgType::SHUTTER;
-        shutter.msg.shutter.frameNumber = req->frameNumber;
-        shutter.msg.shutter.timestamp = req->shutterTs;
-
-        NotifyMsg error;
-        error.type = MsgType::ERROR;
-        error.msg.error.frameNumber = req->frameNumber;
-        error.msg.error.errorStreamId = -1;
-        error.msg.error.errorCode = ErrorCode::ERROR_REQUEST;
-        outMsgs->push_back(shutter);
-        outMsgs->push_back(error);
+    std::vector<NotifyMsg> msgs;
+    msgs.push_back(makeShutterMsg(req->frameNumber, req->shutterTs));
+    msgs.push_back(makeErrorMsg(req->frameNumber, /*stream*/-1, ErrorCode::ERROR_REQUEST));
+    if (outMsgs != nullptr) {
+        outMsgs->insert(outMsgs->end(), msgs.begin(), msgs.end());
+        msgs.clear();
     }
 
     // Fill output buffers
@@ -1053,12 +1230,13 @@ Status ExternalCameraDeviceSession::processCaptureRequestError(
         mInflightFrames.erase(req->frameNumber);
     }
 
-    if (outResults == nullptr) {
-        // Callback into framework
-        invokeProcessCaptureResultCallback(results, /* tryWriteFmq */true);
-        freeReleaseFences(results);
-    } else {
+    if (outResults != nullptr) {
         outResults->push_back(result);
+        results.resize(0);
+    }
+    if (!msgs.empty() || results.size() > 0) {
+        // Callback into framework
+        queueResults(msgs, results, /*flushNow*/true);
     }
     return Status::OK;
 }
@@ -1071,7 +1249,8 @@ Status ExternalCameraDeviceSession::processCaptureResult(std::shared_ptr<HalRequ
     enqueueV4l2Frame(v4l2Frame);
 
     // NotifyShutter
-    notifyShutter(req->frameNumber, req->shutterTs);
+    std::vector<NotifyMsg> msgs;
+    msgs.push_back(makeShutterMsg(req->frameNumber, req->shutterTs));
 
     // Fill output buffers
     hidl_vec<CaptureResult> results;
@@ -1091,7 +1270,8 @@ Status ExternalCameraDeviceSession::processCaptureResult(std::shared_ptr<HalRequ
                 handle->data[0] = req->buffers[i].acquireFence;
                 result.outputBuffers[i].releaseFence.setTo(handle, /*shouldOwn*/false);
             }
-            notifyError(req->frameNumber, req->buffers[i].streamId, ErrorCode::ERROR_BUFFER);
+            msgs.push_back(makeErrorMsg(
+                    req->frameNumber, req->buffers[i].streamId, ErrorCode::ERROR_BUFFER));
         } else {
             result.outputBuffers[i].status = BufferStatus::OK;
             // TODO: refactor
@@ -1109,15 +1289,66 @@ Status ExternalCameraDeviceSession::processCaptureResult(std::shared_ptr<HalRequ
     V3_2::implementation::convertToHidl(rawResult, &result.result);
     req->setting.unlock(rawResult);
 
+    // update inflight records. A request with a deferred buffer stays inflight
+    // until processCaptureBufferResult
+    if (!req->deferredBuffer) {
+        std::lock_guard<std::mutex> lk(mInflightFramesLock);
+        mInflightFrames.erase(req->frameNumber);
+    }
+
+    std::vector<PendingLatency> latencies;
+    for (const auto& halBuf : req->buffers) {
+        if (halBuf.fenceTimeout) {
+            continue;
+        }
+        PendingLatency pending = {halBuf.streamId, req->latency};
+        pending.latency.merge(halBuf.latency);
+        latencies.push_back(pending);
+    }
+
+    // Callback into framework, possibly batched with the next few results
+    queueResults(msgs, results, /*flushNow*/false, &latencies);
+    return Status::OK;
+}
+
+Status ExternalCameraDeviceSession::processCaptureBufferResult(
+        uint32_t frameNumber, HalStreamBuffer& halBuf, bool success) {
+    ATRACE_CALL();
+    std::vector<NotifyMsg> msgs;
+    if (!success) {
+        msgs.push_back(makeErrorMsg(frameNumber, halBuf.streamId, ErrorCode::ERROR_BUFFER));
+    }
+
+    // Buffer only result, metadata was sent with the rest of the request
+    hidl_vec<CaptureResult> results;
+    results.resize(1);
+    CaptureResult& result = results[0];
+    result.frameNumber = frameNumber;
+    result.partialResult = 0;
+    result.inputBuffer.streamId = -1;
+    result.outputBuffers.resize(1);
+    result.outputBuffers[0].streamId = halBuf.streamId;
+    result.outputBuffers[0].bufferId = halBuf.bufferId;
+    result.outputBuffers[0].status = success ? BufferStatus::OK : BufferStatus::ERROR;
+    if (halBuf.acquireFence >= 0) {
+        native_handle_t* handle = native_handle_create(/*numFds*/1, /*numInts*/0);
+        handle->data[0] = halBuf.acquireFence;
+        result.outputBuffers[0].releaseFence.setTo(handle, /*shouldOwn*/false);
+    }
+
     // update inflight records
     {
         std::lock_guard<std::mutex> lk(mInflightFramesLock);
-        mInflightFrames.erase(req->frameNumber);
+        mInflightFrames.erase(frameNumber);
     }
 
-    // Callback into framework
-    invokeProcessCaptureResultCallback(results, /* tryWriteFmq */true);
-    freeReleaseFences(results);
+    std::vector<PendingLatency> latencies;
+    if (success) {
+        latencies.push_back({halBuf.streamId, halBuf.latency});
+    }
+
+    // Callback into framework. Nothing else may be queued behind this one
+    queueResults(msgs, results, /*flushNow*/true, &latencies);
     return Status::OK;
 }
 
@@ -1132,7 +1363,27 @@ void ExternalCameraDeviceSession::invokeProcessCaptureResultCallback(
             return;
         }
     }
-    if (tryWriteFmq && mResultMetadataQueue->availableToWrite() > 0) {
+    size_t totalMetadataSize = 0;
+    for (const CaptureResult &result : results) {
+        totalMetadataSize += result.result.size();
+    }
+    ResultMetadataQueue::MemTransaction tx;
+    if (tryWriteFmq && totalMetadataSize > 0 &&
+            mResultMetadataQueue->beginWrite(totalMetadataSize, &tx)) {
+        // All result metadata of the batch in one FMQ write. The framework reads
+        // fmqResultSize bytes for each result, in order
+        size_t offset = 0;
+        for (CaptureResult &result : results) {
+            size_t size = result.result.size();
+            if (size > 0) {
+                tx.copyTo(result.result.data(), offset, size);
+                offset += size;
+                result.result.resize(0);
+            }
+            result.fmqResultSize = size;
+        }
+        mResultMetadataQueue->commitWrite(totalMetadataSize);
+    } else if (tryWriteFmq && mResultMetadataQueue->availableToWrite() > 0) {
         for (CaptureResult &result : results) {
             if (result.result.size() > 0) {
                 if (mResultMetadataQueue->write(result.result.data(), result.result.size())) {
@@ -1156,6 +1407,64 @@ void ExternalCameraDeviceSession::invokeProcessCaptureResultCallback(
     mProcessCaptureResultLock.unlock();
 }
 
+void ExternalCameraDeviceSession::queueResults(
+        std::vector<NotifyMsg>& msgs, hidl_vec<CaptureResult>& results, bool flushNow,
+        std::vector<PendingLatency>* latencies) {
+    std::lock_guard<std::mutex> lk(mResultBatchLock);
+    mPendingMsgs.insert(mPendingMsgs.end(), msgs.begin(), msgs.end());
+    for (auto& result : results) {
+        mPendingResults.push_back(std::move(result));
+    }
+    if (latencies != nullptr) {
+        mPendingLatencies.insert(mPendingLatencies.end(), latencies->begin(), latencies->end());
+    }
+
+    // Only hold results back while the output thread has more requests queued,
+    // so a result is never waiting on a request that has not been captured yet
+    if (flushNow || mPendingResults.size() >= mCfg.resultBatchCount ||
+            mOutputThread == nullptr || !mOutputThread->hasPendingRequests()) {
+        flushPendingResultsLocked();
+    }
+}
+
+void ExternalCameraDeviceSession::flushPendingResults() {
+    std::lock_guard<std::mutex> lk(mResultBatchLock);
+    flushPendingResultsLocked();
+}
+
+void ExternalCameraDeviceSession::flushPendingResultsLocked() {
+    ATRACE_CALL();
+    if (!mPendingMsgs.empty()) {
+        auto status = mCallback->notify(mPendingMsgs);
+        if (!status.isOk()) {
+            ALOGE("%s: notify ERROR : %s", __FUNCTION__, status.description().c_str());
+        }
+        mPendingMsgs.clear();
+    }
+    if (!mPendingResults.empty()) {
+        // Move, not copy: copying a hidl_handle would clone the fence fds
+        hidl_vec<CaptureResult> results;
+        results.resize(mPendingResults.size());
+        for (size_t i = 0; i < mPendingResults.size(); i++) {
+            results[i] = std::move(mPendingResults[i]);
+        }
+        mPendingResults.clear();
+        nsecs_t callbackStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        invokeProcessCaptureResultCallback(results, /* tryWriteFmq */true);
+        nsecs_t callbackDuration = systemTime(SYSTEM_TIME_MONOTONIC) - callbackStart;
+        freeReleaseFences(results);
+        mSentResults += results.size();
+        mResultCallbacks++;
+
+        // Every result of the batch waited for the whole callback
+        for (auto& pending : mPendingLatencies) {
+            pending.latency.add(STAGE_CALLBACK, callbackDuration);
+            mLatencyRecorder.record(pending.streamId, pending.latency);
+        }
+    }
+    mPendingLatencies.clear();
+}
+
 extern "C" void debugShowFPS() {
     static int mFrameCount = 0;
     static int mLastFrameCount = 0;
@@ -1172,29 +1481,111 @@ extern "C" void debugShowFPS() {
     }
 }
 ExternalCameraDeviceSession::FormatConvertThread::FormatConvertThread(
-        sp<OutputThread>& mOutputThread) {
+        sp<OutputThread>& mOutputThread, uint32_t pipelineDepth) :
+        mPipelineDepth(std::max(1u, std::min(pipelineDepth, kMaxPipelineDepth))) {
     //memset(&mHWJpegDecoder, 0, sizeof(MpiJpegDecoder));
     //memset(&mHWDecoderFrameOut, 0, sizeof(MpiJpegDecoder::OutputFrame_t));
     mFmtOutputThread  = mOutputThread;
+    mSlotRequests.resize(mPipelineDepth);
+    mSlotDecoded.resize(mPipelineDepth, false);
+    for (uint32_t i = 0; i < mPipelineDepth; i++) {
+        sp<DecodeSlot> slot = new DecodeSlot(this, i);
+        std::string name = "ExtFmtCvt" + std::to_string(i);
+        slot->run(name.c_str(), PRIORITY_DISPLAY);
+        mDecodeSlots.push_back(slot);
+    }
+    ALOGI("%s: decode pipeline depth %u", __FUNCTION__, mPipelineDepth);
+}
+
+ExternalCameraDeviceSession::FormatConvertThread::~FormatConvertThread() {
+    // Slots keep a raw pointer back to us, make sure they are gone first
+    for (auto& slot : mDecodeSlots) {
+        slot->requestExitAndWait();
+    }
+    mDecodeSlots.clear();
 }
 
-ExternalCameraDeviceSession::FormatConvertThread::~FormatConvertThread() {}
+void ExternalCameraDeviceSession::FormatConvertThread::requestExit() {
+    Thread::requestExit();
+    for (auto& slot : mDecodeSlots) {
+        slot->requestExit();
+    }
+    mRequestCond.notify_all();
+    mSlotFreeCond.notify_all();
+}
 
 void ExternalCameraDeviceSession::FormatConvertThread::createJpegDecoder() {
+    for (auto& slot : mDecodeSlots) {
+        slot->createJpegDecoder();
+    }
+}
+
+void ExternalCameraDeviceSession::FormatConvertThread::destroyJpegDecoder() {
+    for (auto& slot : mDecodeSlots) {
+        slot->destroyJpegDecoder();
+    }
+}
+
+ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::DecodeSlot(
+        FormatConvertThread* parent, uint32_t index) :
+        mParent(parent), mIndex(index) {}
+
+ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::~DecodeSlot() {}
+
+void ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::createJpegDecoder() {
     int ret = mHWJpegDecoder.prepareDecoder();
     if (!ret) {
-        ALOGE("failed to prepare JPEG decoder");
+        ALOGE("failed to prepare JPEG decoder for slot %u", mIndex);
         mHWJpegDecoder.flushBuffer();
     }
     memset(&mHWDecoderFrameOut, 0, sizeof(MpiJpegDecoder::OutputFrame_t));
 }
 
-void ExternalCameraDeviceSession::FormatConvertThread::destroyJpegDecoder() {
+void ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::destroyJpegDecoder() {
     //mHWJpegDecoder.deinitOutputFrame(&mHWDecoderFrameOut);
     mHWJpegDecoder.flushBuffer();
 }
 
-int ExternalCameraDeviceSession::FormatConvertThread::jpegDecoder(
+void ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::start(
+        const std::shared_ptr<HalRequest>& req) {
+    std::unique_lock<std::mutex> lk(mSlotLock);
+    mRequest = req;
+    lk.unlock();
+    mSlotCond.notify_one();
+}
+
+void ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::requestExit() {
+    Thread::requestExit();
+    mSlotCond.notify_one();
+}
+
+bool ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::threadLoop() {
+    std::unique_lock<std::mutex> lk(mSlotLock);
+    while (mRequest == nullptr) {
+        if (exitPending()) {
+            return false;
+        }
+        mSlotCond.wait(lk);
+    }
+    // Only this thread clears mRequest, and the parent does not start a new
+    // request on this slot before onDecodeDone, so it is safe to decode unlocked
+    std::shared_ptr<HalRequest> req = mRequest;
+    lk.unlock();
+
+    nsecs_t decodeStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    decodeLocked(req);
+    if (req->frameIn->mFourcc == V4L2_PIX_FMT_MJPEG) {
+        req->latency.add(STAGE_DECODE, systemTime(SYSTEM_TIME_MONOTONIC) - decodeStart);
+    }
+
+    lk.lock();
+    mRequest.reset();
+    lk.unlock();
+    mParent->onDecodeDone(mIndex);
+    return true;
+}
+
+int ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::jpegDecoder(
         unsigned int mShareFd, uint8_t* inData, size_t inDataSize) {
     int ret = 0;
     unsigned int output_len = 0;
@@ -1225,60 +1616,17 @@ int ExternalCameraDeviceSession::FormatConvertThread::jpegDecoder(
 void ExternalCameraDeviceSession::FormatConvertThread:: yuyvToNv12(
             int v4l2_fmt_dst, char *srcbuf, char *dstbuf,
             int src_w, int src_h,int dst_w, int dst_h) {
-    int *dstint_y, *dstint_uv, *srcint, y_size, i;
-
-    y_size = src_w * src_h;
-    if (v4l2_fmt_dst == V4L2_PIX_FMT_NV12) {
-        if ((src_w == dst_w) && (src_h == dst_h)) {
-            dstint_y = (int*)dstbuf;
-            srcint = (int*)srcbuf;
-            dstint_uv =  (int*)(dstbuf + y_size);
-#if defined(__arm64__) || defined(__aarch64__)
-            for (i = 0; i < src_h; i++) {
-                for (int j = 0; j < (src_w >> 2); j++) {
-                    if (i % 2 == 0) {
-                        *dstint_uv++ = (*(srcint+1) & 0xff000000) |
-                                    ((*(srcint+1) & 0x0000ff00) << 8) |
-                                    ((*srcint & 0xff000000) >> 16) |
-                                    ((*srcint & 0x0000ff00) >> 8);
-                    }
-                    *dstint_y++ = ((*(srcint+1) & 0x00ff0000) << 8) |
-                                    ((*(srcint+1) & 0x000000ff) << 16) |
-                                    ((*srcint & 0x00ff0000) >> 8) |
-                                    (*srcint & 0x000000ff);
-                    srcint += 2;
-                }
-            }
-#else
-            for (i = 0; i < src_h; i++) {
-                int n = src_w;
-                char tmp = i % 2; // get uv only when in even row
-                asm volatile (
-                    "   pld [%[src], %[src_stride], lsl #2]                 \n\t"
-                    "   cmp %[n], #16                                       \n\t"
-                    "   blt 5f                                              \n\t"
-                    "0: @ 16 pixel swap                                     \n\t"
-                    "   vld2.8  {q0,q1} , [%[src]]!  @ q0 = y q1 = uv       \n\t"
-                    "   vst1.16 {q0},[%[dst_y]]!     @ now q0  -> dst       \n\t"
-                    "   cmp %[tmp], #1                                      \n\t"
-                    "   bge 1f                                              \n\t"
-                    "   vst1.16 {q1},[%[dst_uv]]!    @ now q1  -> dst       \n\t"
-                    "1: @ don't need get uv in odd row                      \n\t"
-                    "   sub %[n], %[n], #16                                 \n\t"
-                    "   cmp %[n], #16                                       \n\t"
-                    "   bge 0b                                              \n\t"
-                    "5: @ end                                               \n\t"
-                    : [dst_y] "+r" (dstint_y), [dst_uv] "+r" (dstint_uv),
-                      [src] "+r" (srcint), [n] "+r" (n),[tmp] "+r" (tmp)
-                    : [src_stride] "r" (src_w)
-                    : "cc", "memory", "q0", "q1", "q2"
-                );
-            }
-#endif
-        }
-    } else {
+    if (v4l2_fmt_dst != V4L2_PIX_FMT_NV12) {
         LOGE("don't support this format !");
+        return;
+    }
+    if ((src_w != dst_w) || (src_h != dst_h)) {
+        LOGE("don't support scaling %dx%d to %dx%d", src_w, src_h, dst_w, dst_h);
+        return;
     }
+    uint8_t* dst = reinterpret_cast<uint8_t*>(dstbuf);
+    convertYuyvToNv12(reinterpret_cast<uint8_t*>(srcbuf), src_w * 2,
+            dst, dst_w, dst + dst_w * dst_h, dst_w, dst_w, dst_h);
 }
 
 void ExternalCameraDeviceSession::FormatConvertThread::createH264Decoder(int w, int h) {
@@ -1341,54 +1689,60 @@ int ExternalCameraDeviceSession::FormatConvertThread::h264Decoder(unsigned long
     return ret;
 }
 
-bool ExternalCameraDeviceSession::FormatConvertThread::threadLoop() {
-    std::shared_ptr<HalRequest> req;
+void ExternalCameraDeviceSession::FormatConvertThread::DecodeSlot::decodeLocked(
+        const std::shared_ptr<HalRequest>& req) {
+    ATRACE_CALL();
     uint8_t* inData;
     size_t inDataSize;
     unsigned long mVirAddr;
     unsigned long mShareFd;
 
-    waitForNextRequest(&req);
-    if (req == nullptr) {
-        // No new request, wait again
-        return true;
-    }
-    if (req->frameIn->mFourcc != V4L2_PIX_FMT_MJPEG &&
-            req->frameIn->mFourcc != V4L2_PIX_FMT_Z16 &&
-            req->frameIn->mFourcc != V4L2_PIX_FMT_YUYV &&
-            req->frameIn->mFourcc != V4L2_PIX_FMT_NV12 &&
-            req->frameIn->mFourcc != V4L2_PIX_FMT_H264) {
-
-         LOGD("do not support V4L2 format %c%c%c%c",
-                req->frameIn->mFourcc & 0xFF,
-                (req->frameIn->mFourcc >> 8) & 0xFF,
-                (req->frameIn->mFourcc >> 16) & 0xFF,
-                (req->frameIn->mFourcc >> 24) & 0xFF);
-         return true;
-    }
-    debugShowFPS();
     if (req->frameIn->getData(&inData, &inDataSize) != 0) {
          LOGE("%s(%d)getData failed!\n", __FUNCTION__, __LINE__);
     }
 
-    mShareFd = mCamMemManager->getBufferAddr(
+    mShareFd = mParent->mCamMemManager->getBufferAddr(
             PREVIEWBUFFER, req->frameIn->mBufferIndex, buffer_sharre_fd);
-    mVirAddr = mCamMemManager->getBufferAddr(
+    mVirAddr = mParent->mCamMemManager->getBufferAddr(
             PREVIEWBUFFER, req->frameIn->mBufferIndex, buffer_addr_vir);
 
-    ALOGV("%s(%d)mShareFd(%d) mVirAddr(%p)!\n", __FUNCTION__, __LINE__, mShareFd, mVirAddr);
+    ALOGV("%s(%d)slot(%u) mShareFd(%d) mVirAddr(%p)!\n", __FUNCTION__, __LINE__,
+            mIndex, mShareFd, mVirAddr);
 
     int tmpW = (req->frameIn->mWidth + 15) & (~15);
     int tmpH = (req->frameIn->mHeight + 15) & (~15);
 
     if (req->frameIn->mFourcc == V4L2_PIX_FMT_MJPEG) {
 #ifdef RK_HW_JPEG_DECODER
-        int ret = jpegDecoder(mShareFd, inData, inDataSize);
+        // Decode straight into the output buffer if nothing needs to be cropped,
+        // scaled or converted
+        unsigned long dstFd = mShareFd;
+        bool direct = false;
+        if (isDirectOutputCandidate(*req)) {
+            HalStreamBuffer& halBuf = req->buffers[0];
+            if (halBuf.acquireFence >= 0) {
+                if (sync_wait(halBuf.acquireFence, kSyncWaitTimeoutMs) == 0) {
+                    ::close(halBuf.acquireFence);
+                    halBuf.acquireFence = -1;
+                } else {
+                    halBuf.fenceTimeout = true;
+                }
+            }
+            int handle_fd = -1;
+            if (!halBuf.fenceTimeout && hasDecoderLayout(sHandleImporter, halBuf)) {
+                handle_fd = getBufferShareFd(*(halBuf.bufPtr));
+            }
+            if (handle_fd >= 0) {
+                dstFd = handle_fd;
+                direct = true;
+            }
+        }
+        int ret = jpegDecoder(dstFd, inData, inDataSize);
         if(!ret) {
             LOGE("mjpeg decode failed");
-            mFmtOutputThread->submitRequest(req);
-            return true;
+            return;
         }
+        req->directOutput = direct;
 #ifdef DUMP_YUV
         {
             int frameCount = req->frameNumber;
@@ -1432,11 +1786,75 @@ bool ExternalCameraDeviceSession::FormatConvertThread::threadLoop() {
 
     req->inData = inData;
     req->inDataSize = inDataSize;
-    mFmtOutputThread->submitRequest(req);
+}
+
+bool ExternalCameraDeviceSession::FormatConvertThread::threadLoop() {
+    std::shared_ptr<HalRequest> req;
+
+    waitForNextRequest(&req);
+    if (req == nullptr) {
+        // No new request, wait again
+        return true;
+    }
+    if (req->frameIn->mFourcc != V4L2_PIX_FMT_MJPEG &&
+            req->frameIn->mFourcc != V4L2_PIX_FMT_Z16 &&
+            req->frameIn->mFourcc != V4L2_PIX_FMT_YUYV &&
+            req->frameIn->mFourcc != V4L2_PIX_FMT_NV12 &&
+            req->frameIn->mFourcc != V4L2_PIX_FMT_H264) {
+
+         LOGD("do not support V4L2 format %c%c%c%c",
+                req->frameIn->mFourcc & 0xFF,
+                (req->frameIn->mFourcc >> 8) & 0xFF,
+                (req->frameIn->mFourcc >> 16) & 0xFF,
+                (req->frameIn->mFourcc >> 24) & 0xFF);
+         return true;
+    }
+    debugShowFPS();
+
+    // Wait for the slot this request maps to. It is freed once the request that
+    // used it depth frames ago has been released to the OutputThread.
+    std::unique_lock<std::mutex> lk(mSlotLock);
+    uint32_t slot = mSubmitSeq % mPipelineDepth;
+    while (mSlotRequests[slot] != nullptr) {
+        if (exitPending()) {
+            // Hand the request to the OutputThread so it is errored out by its flush
+            lk.unlock();
+            mFmtOutputThread->submitRequest(req);
+            return false;
+        }
+        mSlotFreeCond.wait(lk);
+    }
+    mSlotRequests[slot] = req;
+    mSlotDecoded[slot] = false;
+    mSubmitSeq++;
+    lk.unlock();
 
+    mDecodeSlots[slot]->start(req);
     return true;
 }
 
+void ExternalCameraDeviceSession::FormatConvertThread::onDecodeDone(uint32_t slotIndex) {
+    std::unique_lock<std::mutex> lk(mSlotLock);
+    mSlotDecoded[slotIndex] = true;
+    // Release every request that is decoded and has no undecoded predecessor
+    bool released = false;
+    while (mEmitSeq < mSubmitSeq) {
+        uint32_t slot = mEmitSeq % mPipelineDepth;
+        if (!mSlotDecoded[slot]) {
+            break;
+        }
+        mFmtOutputThread->submitRequest(mSlotRequests[slot]);
+        mSlotRequests[slot].reset();
+        mSlotDecoded[slot] = false;
+        mEmitSeq++;
+        released = true;
+    }
+    lk.unlock();
+    if (released) {
+        mSlotFreeCond.notify_all();
+    }
+}
+
 Status ExternalCameraDeviceSession::FormatConvertThread::submitRequest(
         const std::shared_ptr<HalRequest>& req) {
     std::unique_lock<std::mutex> lk(mRequestListLock);
@@ -1446,6 +1864,45 @@ Status ExternalCameraDeviceSession::FormatConvertThread::submitRequest(
     return Status::OK;
 }
 
+std::list<std::shared_ptr<HalRequest>>
+ExternalCameraDeviceSession::FormatConvertThread::flush() {
+    ATRACE_CALL();
+    std::unique_lock<std::mutex> lk(mRequestListLock);
+    std::list<std::shared_ptr<HalRequest>> reqs = std::move(mRequestList);
+    mRequestList.clear();
+    lk.unlock();
+
+    std::unique_lock<std::mutex> slotLk(mSlotLock);
+    std::chrono::seconds timeout = std::chrono::seconds(kFlushWaitTimeoutSec);
+    bool drained = mSlotFreeCond.wait_for(slotLk, timeout,
+            [this] { return mEmitSeq == mSubmitSeq; });
+    if (!drained) {
+        ALOGE("%s: wait for %" PRIu64 " inflight decodes timeout!",
+                __FUNCTION__, mSubmitSeq - mEmitSeq);
+    }
+    return reqs;
+}
+
+void ExternalCameraDeviceSession::FormatConvertThread::dump(int fd) {
+    {
+        std::lock_guard<std::mutex> lk(mSlotLock);
+        dprintf(fd, "FormatConvertThread pipeline depth %u, decoding frame: ", mPipelineDepth);
+        for (uint64_t seq = mEmitSeq; seq < mSubmitSeq; seq++) {
+            const auto& req = mSlotRequests[seq % mPipelineDepth];
+            if (req != nullptr) {
+                dprintf(fd, "%d, ", req->frameNumber);
+            }
+        }
+        dprintf(fd, "\n");
+    }
+    std::lock_guard<std::mutex> lk(mRequestListLock);
+    dprintf(fd, "FormatConvertThread request list contains frame: ");
+    for (const auto& req : mRequestList) {
+        dprintf(fd, "%d, ", req->frameNumber);
+    }
+    dprintf(fd, "\n");
+}
+
 void ExternalCameraDeviceSession::FormatConvertThread::waitForNextRequest(
         std::shared_ptr<HalRequest>* out) {
     ATRACE_CALL();
@@ -1472,12 +1929,19 @@ void ExternalCameraDeviceSession::FormatConvertThread::waitForNextRequest(
     *out = mRequestList.front();
     mRequestList.pop_front();
 }
+
 ExternalCameraDeviceSession::OutputThread::OutputThread(
         wp<OutputThreadInterface> parent, CroppingType ct,
         const common::V1_0::helper::CameraMetadata& chars) :
-        mParent(parent), mCroppingType(ct), mCameraCharacteristics(chars) {}
+        mParent(parent), mCroppingType(ct), mCameraCharacteristics(chars) {
+    mJpegThread = new JpegEncodeThread(parent, chars);
+    mJpegThread->run("ExtCamJpeg", PRIORITY_DISPLAY);
+}
 
-ExternalCameraDeviceSession::OutputThread::~OutputThread() {}
+ExternalCameraDeviceSession::OutputThread::~OutputThread() {
+    mJpegThread->requestExit();
+    mJpegThread->join();
+}
 
 void ExternalCameraDeviceSession::OutputThread::setExifMakeModel(
         const std::string& make, const std::string& model) {
@@ -1485,6 +1949,13 @@ void ExternalCameraDeviceSession::OutputThread::setExifMakeModel(
     mExifModel = model;
 }
 
+void ExternalCameraDeviceSession::OutputThread::setScaleWorkers(uint32_t numWorkers) {
+    std::lock_guard<std::mutex> lk(mBufferLock);
+    if (mScaler->getNumWorkers() != numWorkers) {
+        mScaler = std::make_unique<TiledScaler>(numWorkers);
+    }
+}
+
 int ExternalCameraDeviceSession::OutputThread::cropAndScaleLocked(
         sp<AllocatedFrame>& in, const Size& outSz, YCbCrLayout* out) {
     Size inSz = {in->mWidth, in->mHeight};
@@ -1523,19 +1994,25 @@ int ExternalCameraDeviceSession::OutputThread::cropAndScaleLocked(
         return 0;
     }
 
+    // mScaledYu12Frames holds the frames already scaled from the current
+    // mYu12Frame, so streams sharing a size are only scaled once per request
     auto it = mScaledYu12Frames.find(outSz);
-    sp<AllocatedFrame> scaledYu12Buf;
     if (it != mScaledYu12Frames.end()) {
-        scaledYu12Buf = it->second;
-    } else {
-        it = mIntermediateBuffers.find(outSz);
-        if (it == mIntermediateBuffers.end()) {
-            ALOGE("%s: failed to find intermediate buffer size %dx%d",
-                    __FUNCTION__, outSz.width, outSz.height);
-            return -1;
+        ret = it->second->getLayout(out);
+        if (ret != 0) {
+            ALOGE("%s: failed to get scaled buffer layout", __FUNCTION__);
         }
-        scaledYu12Buf = it->second;
+        return ret;
     }
+
+    it = mIntermediateBuffers.find(outSz);
+    if (it == mIntermediateBuffers.end()) {
+        ALOGE("%s: failed to find intermediate buffer size %dx%d",
+                __FUNCTION__, outSz.width, outSz.height);
+        return -1;
+    }
+    sp<AllocatedFrame> scaledYu12Buf = it->second;
+
     // Scale
     YCbCrLayout outLayout;
     ret = scaledYu12Buf->getLayout(&outLayout);
@@ -1544,25 +2021,8 @@ int ExternalCameraDeviceSession::OutputThread::cropAndScaleLocked(
         return ret;
     }
 
-    ret = libyuv::I420Scale(
-            static_cast<uint8_t*>(croppedLayout.y),
-            croppedLayout.yStride,
-            static_cast<uint8_t*>(croppedLayout.cb),
-            croppedLayout.cStride,
-            static_cast<uint8_t*>(croppedLayout.cr),
-            croppedLayout.cStride,
-            inputCrop.width,
-            inputCrop.height,
-            static_cast<uint8_t*>(outLayout.y),
-            outLayout.yStride,
-            static_cast<uint8_t*>(outLayout.cb),
-            outLayout.cStride,
-            static_cast<uint8_t*>(outLayout.cr),
-            outLayout.cStride,
-            outSz.width,
-            outSz.height,
-            // TODO: b/72261744 see if we can use better filter without losing too much perf
-            libyuv::FilterMode::kFilterNone);
+    ret = mScaler->scale(croppedLayout, inputCrop.width, inputCrop.height,
+            outLayout, outSz.width, outSz.height);
 
     if (ret != 0) {
         ALOGE("%s: failed to scale buffer from %dx%d to %dx%d. Ret %d",
@@ -1692,24 +2152,8 @@ int ExternalCameraDeviceSession::OutputThread::cropAndScaleThumbLocked(
     }
 
 
-    ret = libyuv::I420Scale(
-            static_cast<uint8_t*>(inputLayout.y),
-            inputLayout.yStride,
-            static_cast<uint8_t*>(inputLayout.cb),
-            inputLayout.cStride,
-            static_cast<uint8_t*>(inputLayout.cr),
-            inputLayout.cStride,
-            inputCrop.width,
-            inputCrop.height,
-            static_cast<uint8_t*>(outFullLayout.y),
-            outFullLayout.yStride,
-            static_cast<uint8_t*>(outFullLayout.cb),
-            outFullLayout.cStride,
-            static_cast<uint8_t*>(outFullLayout.cr),
-            outFullLayout.cStride,
-            outSz.width,
-            outSz.height,
-            libyuv::FilterMode::kFilterNone);
+    ret = mScaler->scale(inputLayout, inputCrop.width, inputCrop.height,
+            outFullLayout, outSz.width, outSz.height);
 
     if (ret != 0) {
         ALOGE("%s: failed to scale buffer from %dx%d to %dx%d. Ret %d",
@@ -1787,11 +2231,13 @@ ssize_t ExternalCameraDeviceSession::getJpegBufferSize(
     return jpegBufferSize;
 }
 
-int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
-        HalStreamBuffer &halBuf,
-        const common::V1_0::helper::CameraMetadata& setting)
+int ExternalCameraDeviceSession::OutputThread::prepareJpegJobLocked(
+        uint32_t frameNumber, HalStreamBuffer &halBuf,
+        const common::V1_0::helper::CameraMetadata& setting,
+        /*out*/std::shared_ptr<JpegEncodeThread::JpegJob>* outJob)
 {
     ATRACE_CALL();
+    nsecs_t startTs = systemTime(SYSTEM_TIME_MONOTONIC);
     int ret;
     auto lfail = [&](auto... args) {
         ALOGE(args...);
@@ -1814,14 +2260,19 @@ int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
           __FUNCTION__,
           mYu12Frame->mWidth, mYu12Frame->mHeight);
 
-    int jpegQuality, thumbQuality;
-    Size thumbSize;
+    auto job = std::make_shared<JpegEncodeThread::JpegJob>();
+    job->frameNumber = frameNumber;
+    job->halBuf = halBuf;
+    job->setting = setting;
+    job->exifMake = mExifMake;
+    job->exifModel = mExifModel;
+
     bool outputThumbnail = true;
 
     if (setting.exists(ANDROID_JPEG_QUALITY)) {
         camera_metadata_ro_entry entry =
             setting.find(ANDROID_JPEG_QUALITY);
-        jpegQuality = entry.data.u8[0];
+        job->jpegQuality = entry.data.u8[0];
     } else {
         return lfail("%s: ANDROID_JPEG_QUALITY not set",__FUNCTION__);
     }
@@ -1829,7 +2280,7 @@ int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
     if (setting.exists(ANDROID_JPEG_THUMBNAIL_QUALITY)) {
         camera_metadata_ro_entry entry =
             setting.find(ANDROID_JPEG_THUMBNAIL_QUALITY);
-        thumbQuality = entry.data.u8[0];
+        job->thumbQuality = entry.data.u8[0];
     } else {
         return lfail(
             "%s: ANDROID_JPEG_THUMBNAIL_QUALITY not set",
@@ -1839,10 +2290,10 @@ int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
     if (setting.exists(ANDROID_JPEG_THUMBNAIL_SIZE)) {
         camera_metadata_ro_entry entry =
             setting.find(ANDROID_JPEG_THUMBNAIL_SIZE);
-        thumbSize = Size { static_cast<uint32_t>(entry.data.i32[0]),
-                           static_cast<uint32_t>(entry.data.i32[1])
+        job->thumbSize = Size { static_cast<uint32_t>(entry.data.i32[0]),
+                                static_cast<uint32_t>(entry.data.i32[1])
         };
-        if (thumbSize.width == 0 && thumbSize.height == 0) {
+        if (job->thumbSize.width == 0 && job->thumbSize.height == 0) {
             outputThumbnail = false;
         }
     } else {
@@ -1850,95 +2301,207 @@ int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
             "%s: ANDROID_JPEG_THUMBNAIL_SIZE not set", __FUNCTION__);
     }
 
-    /* Cropped and scaled YU12 buffer for main and thumbnail */
-    YCbCrLayout yu12Main;
-    Size jpegSize { halBuf.width, halBuf.height };
-
-    /* Compute temporary buffer sizes accounting for the following:
-     * thumbnail can't exceed APP1 size of 64K
-     * main image needs to hold APP1, headers, and at most a poorly
-     * compressed image */
-    const ssize_t maxThumbCodeSize = 64 * 1024;
-    const ssize_t maxJpegCodeSize = mBlobBufferSize == 0 ?
-            parent->getJpegBufferSize(jpegSize.width, jpegSize.height) :
+    job->jpegSize = Size { halBuf.width, halBuf.height };
+    job->maxJpegCodeSize = mBlobBufferSize == 0 ?
+            parent->getJpegBufferSize(job->jpegSize.width, job->jpegSize.height) :
             mBlobBufferSize;
 
     /* Check that getJpegBufferSize did not return an error */
-    if (maxJpegCodeSize < 0) {
+    if (job->maxJpegCodeSize < 0) {
         return lfail(
-            "%s: getJpegBufferSize returned %zd",__FUNCTION__,maxJpegCodeSize);
+            "%s: getJpegBufferSize returned %zd",__FUNCTION__, job->maxJpegCodeSize);
     }
 
+    /* The intermediate buffers are reused by the next request, so the encoder
+     * gets its own copy of the cropped and scaled images */
+    auto copyFrame = [](const YCbCrLayout& in, const Size& sz, sp<AllocatedFrame>* out) {
+        sp<AllocatedFrame> frame = new AllocatedFrame(sz.width, sz.height);
+        YCbCrLayout outLayout;
+        int ret = frame->allocate(&outLayout);
+        if (ret != 0) {
+            return ret;
+        }
+        ret = libyuv::I420Copy(
+                static_cast<uint8_t*>(in.y), in.yStride,
+                static_cast<uint8_t*>(in.cb), in.cStride,
+                static_cast<uint8_t*>(in.cr), in.cStride,
+                static_cast<uint8_t*>(outLayout.y), outLayout.yStride,
+                static_cast<uint8_t*>(outLayout.cb), outLayout.cStride,
+                static_cast<uint8_t*>(outLayout.cr), outLayout.cStride,
+                sz.width, sz.height);
+        if (ret == 0) {
+            *out = frame;
+        }
+        return ret;
+    };
 
-    /* Hold actual thumbnail and main image code sizes */
-    size_t thumbCodeSize = 0, jpegCodeSize = 0;
-    /* Temporary thumbnail code buffer */
-    std::vector<uint8_t> thumbCode(outputThumbnail ? maxThumbCodeSize : 0);
-
-    YCbCrLayout yu12Thumb;
     if (outputThumbnail) {
-        ret = cropAndScaleThumbLocked(mYu12Frame, thumbSize, &yu12Thumb);
+        YCbCrLayout yu12Thumb;
+        ret = cropAndScaleThumbLocked(mYu12Frame, job->thumbSize, &yu12Thumb);
 
         if (ret != 0) {
             return lfail(
                 "%s: crop and scale thumbnail failed!", __FUNCTION__);
         }
+
+        ret = copyFrame(yu12Thumb, job->thumbSize, &job->thumbFrame);
+        if (ret != 0) {
+            return lfail("%s: copy thumbnail failed with %d", __FUNCTION__, ret);
+        }
     }
 
     /* Scale and crop main jpeg */
-    ret = cropAndScaleLocked(mYu12Frame, jpegSize, &yu12Main);
+    YCbCrLayout yu12Main;
+    ret = cropAndScaleLocked(mYu12Frame, job->jpegSize, &yu12Main);
 
     if (ret != 0) {
         return lfail("%s: crop and scale main failed!", __FUNCTION__);
     }
 
-    /* Encode the thumbnail image */
-    if (outputThumbnail) {
-        ret = encodeJpegYU12(thumbSize, yu12Thumb,
-                thumbQuality, 0, 0,
-                &thumbCode[0], maxThumbCodeSize, thumbCodeSize);
+    ret = copyFrame(yu12Main, job->jpegSize, &job->mainFrame);
+    if (ret != 0) {
+        return lfail("%s: copy main image failed with %d", __FUNCTION__, ret);
+    }
 
-        if (ret != 0) {
-            return lfail("%s: thumbnail encodeJpegYU12 failed with %d",__FUNCTION__, ret);
+    job->submitTs = systemTime(SYSTEM_TIME_MONOTONIC);
+    job->prepareDuration = job->submitTs - startTs;
+    *outJob = job;
+    return 0;
+}
+
+ExternalCameraDeviceSession::JpegEncodeThread::JpegEncodeThread(
+        wp<OutputThreadInterface> parent,
+        const common::V1_0::helper::CameraMetadata& chars) : mParent(parent) {
+    mThumbThread = new ThumbnailThread(chars);
+    mThumbThread->run("ExtCamJpegThumb", PRIORITY_DISPLAY);
+}
+
+ExternalCameraDeviceSession::JpegEncodeThread::~JpegEncodeThread() {
+    mThumbThread->requestExit();
+    mThumbThread->join();
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::submitJob(
+        const std::shared_ptr<JpegJob>& job) {
+    std::lock_guard<std::mutex> lk(mJobLock);
+    mJobs.push_back(job);
+    mJobCond.notify_one();
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::requestExit() {
+    Thread::requestExit();
+    std::lock_guard<std::mutex> lk(mJobLock);
+    mJobCond.notify_one();
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::flush() {
+    ATRACE_CALL();
+    std::unique_lock<std::mutex> lk(mJobLock);
+    std::list<std::shared_ptr<JpegJob>> jobs = std::move(mJobs);
+    mJobs.clear();
+    if (mEncoding) {
+        std::chrono::seconds timeout = std::chrono::seconds(kFlushWaitTimeoutSec);
+        bool done = mJobDoneCond.wait_for(lk, timeout, [this] { return !mEncoding; });
+        if (!done) {
+            ALOGE("%s: wait for inflight jpeg encode timeout!", __FUNCTION__);
         }
     }
+    lk.unlock();
 
-    /* Combine camera characteristics with request settings to form EXIF
-     * metadata */
-    common::V1_0::helper::CameraMetadata meta(mCameraCharacteristics);
-    meta.append(setting);
+    auto parent = mParent.promote();
+    if (parent == nullptr) {
+       ALOGE("%s: session has been disconnected!", __FUNCTION__);
+       return;
+    }
+    for (const auto& job : jobs) {
+        parent->processCaptureBufferResult(job->frameNumber, job->halBuf, /*success*/false);
+    }
+}
 
-    /* Generate EXIF object */
-    std::unique_ptr<ExifUtils> utils(ExifUtils::create());
-    /* Make sure it's initialized */
-    utils->initialize();
+bool ExternalCameraDeviceSession::JpegEncodeThread::threadLoop() {
+    std::shared_ptr<JpegJob> job;
+    {
+        std::unique_lock<std::mutex> lk(mJobLock);
+        mJobCond.wait(lk, [this] { return exitPending() || !mJobs.empty(); });
+        if (mJobs.empty()) {
+            return false;
+        }
+        job = mJobs.front();
+        mJobs.pop_front();
+        mEncoding = true;
+    }
 
-    utils->setFromMetadata(meta, jpegSize.width, jpegSize.height);
-    utils->setMake(mExifMake);
-    utils->setModel(mExifModel);
+    int ret = encodeJob(job);
+    nsecs_t encodeDuration = systemTime(SYSTEM_TIME_MONOTONIC) - job->submitTs;
+    nsecs_t total = encodeDuration + job->prepareDuration;
+    job->halBuf.latency.add(STAGE_ENCODE, encodeDuration);
+
+    auto parent = mParent.promote();
+    if (parent != nullptr) {
+        parent->processCaptureBufferResult(job->frameNumber, job->halBuf, ret == 0);
+    } else {
+        ALOGE("%s: session has been disconnected!", __FUNCTION__);
+    }
 
-    ret = utils->generateApp1(outputThumbnail ? &thumbCode[0] : 0, thumbCodeSize);
+    {
+        std::lock_guard<std::mutex> lk(mStatsLock);
+        mPrepareStats.add(job->prepareDuration);
+        mTotalStats.add(total);
+    }
+    {
+        std::lock_guard<std::mutex> lk(mJobLock);
+        mEncoding = false;
+        mJobDoneCond.notify_all();
+    }
+    return true;
+}
 
-    if (!ret) {
-        return lfail("%s: generating APP1 failed", __FUNCTION__);
+int ExternalCameraDeviceSession::JpegEncodeThread::encodeJob(
+        const std::shared_ptr<JpegJob>& job) {
+    ATRACE_CALL();
+    HalStreamBuffer& halBuf = job->halBuf;
+    const ssize_t maxJpegCodeSize = job->maxJpegCodeSize;
+    if (maxJpegCodeSize <= static_cast<ssize_t>(kApp1Reserve + sizeof(CameraBlob))) {
+        ALOGE("%s: jpeg buffer size %zd too small", __FUNCTION__, maxJpegCodeSize);
+        return 1;
     }
 
-    /* Get internal buffer */
-    size_t exifDataSize = utils->getApp1Length();
-    const uint8_t* exifData = utils->getApp1Buffer();
+    // Thumbnail and EXIF are generated concurrently with the main image
+    mThumbThread->start(job);
 
     /* Lock the HAL jpeg code buffer */
-    void *bufPtr = sHandleImporter.lock(
-            *(halBuf.bufPtr), halBuf.usage, maxJpegCodeSize);
+    uint8_t *bufPtr = static_cast<uint8_t*>(sHandleImporter.lock(
+            *(halBuf.bufPtr), halBuf.usage, maxJpegCodeSize));
 
+    std::vector<uint8_t> app1;
+    nsecs_t thumbDuration = 0;
     if (!bufPtr) {
-        return lfail("%s: could not lock %zu bytes", __FUNCTION__, maxJpegCodeSize);
+        ALOGE("%s: could not lock %zu bytes", __FUNCTION__, maxJpegCodeSize);
+        mThumbThread->waitForApp1(&app1, &thumbDuration);
+        return 1;
+    }
+
+    /* Encode the main jpeg image after the room reserved for APP1 */
+    nsecs_t mainStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    YCbCrLayout yu12Main;
+    size_t jpegCodeSize = 0;
+    int ret = job->mainFrame->getLayout(&yu12Main);
+    if (ret == 0) {
+        ret = encodeJpegYU12(job->jpegSize, yu12Main,
+                job->jpegQuality, nullptr, 0,
+                bufPtr + kApp1Reserve, maxJpegCodeSize - kApp1Reserve - sizeof(CameraBlob),
+                jpegCodeSize);
     }
+    nsecs_t mainDuration = systemTime(SYSTEM_TIME_MONOTONIC) - mainStart;
 
-    /* Encode the main jpeg image */
-    ret = encodeJpegYU12(jpegSize, yu12Main,
-            jpegQuality, exifData, exifDataSize,
-            bufPtr, maxJpegCodeSize, jpegCodeSize);
+    int thumbRet = mThumbThread->waitForApp1(&app1, &thumbDuration);
+
+    nsecs_t spliceStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (ret == 0 && thumbRet == 0) {
+        ret = spliceApp1(bufPtr, kApp1Reserve, jpegCodeSize, app1, &jpegCodeSize);
+    } else if (thumbRet != 0) {
+        ret = thumbRet;
+    }
 
     /* TODO: Not sure this belongs here, maybe better to pass jpegCodeSize out
      * and do this when returning buffer to parent */
@@ -1954,16 +2517,149 @@ int ExternalCameraDeviceSession::OutputThread::createJpegLocked(
     if (relFence >= 0) {
         halBuf.acquireFence = relFence;
     }
+    nsecs_t spliceDuration = systemTime(SYSTEM_TIME_MONOTONIC) - spliceStart;
+
+    {
+        std::lock_guard<std::mutex> lk(mStatsLock);
+        mMainStats.add(mainDuration);
+        mThumbStats.add(thumbDuration);
+        mSpliceStats.add(spliceDuration);
+    }
 
     /* Check if our JPEG actually succeeded */
     if (ret != 0) {
-        return lfail(
-            "%s: encodeJpegYU12 failed with %d",__FUNCTION__, ret);
+        ALOGE("%s: encode frame %u failed with %d", __FUNCTION__, job->frameNumber, ret);
+        return ret;
+    }
+
+    ALOGV("%s: encoded JPEG (ret:%d) with Q:%d size: %zu max size: %zu",
+          __FUNCTION__, ret, job->jpegQuality, jpegCodeSize, maxJpegCodeSize);
+    return 0;
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::StageStats::add(nsecs_t duration) {
+    count++;
+    total += duration;
+    max = std::max(max, duration);
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::StageStats::dump(
+        int fd, const char* name) const {
+    dprintf(fd, "  %-10s count %" PRIu64 " avg %" PRId64 "us max %" PRId64 "us\n", name,
+            count, count == 0 ? 0 : ns2us(total / static_cast<nsecs_t>(count)), ns2us(max));
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::dump(int fd) {
+    {
+        std::lock_guard<std::mutex> lk(mJobLock);
+        dprintf(fd, "JpegEncodeThread %s, %zu jobs queued\n",
+                mEncoding ? "encoding" : "idle", mJobs.size());
+    }
+    std::lock_guard<std::mutex> lk(mStatsLock);
+    mPrepareStats.dump(fd, "prepare");
+    mThumbStats.dump(fd, "thumb+exif");
+    mMainStats.dump(fd, "main");
+    mSpliceStats.dump(fd, "splice");
+    mTotalStats.dump(fd, "total");
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::ThumbnailThread::start(
+        const std::shared_ptr<JpegJob>& job) {
+    std::lock_guard<std::mutex> lk(mLock);
+    mJob = job;
+    mDone = false;
+    mCond.notify_all();
+}
+
+int ExternalCameraDeviceSession::JpegEncodeThread::ThumbnailThread::waitForApp1(
+        std::vector<uint8_t>* out, nsecs_t* duration) {
+    std::unique_lock<std::mutex> lk(mLock);
+    mCond.wait(lk, [this] { return mDone || exitPending(); });
+    if (!mDone) {
+        return 1;
+    }
+    out->swap(mApp1);
+    *duration = mDuration;
+    return mResult;
+}
+
+void ExternalCameraDeviceSession::JpegEncodeThread::ThumbnailThread::requestExit() {
+    Thread::requestExit();
+    std::lock_guard<std::mutex> lk(mLock);
+    mCond.notify_all();
+}
+
+bool ExternalCameraDeviceSession::JpegEncodeThread::ThumbnailThread::threadLoop() {
+    std::shared_ptr<JpegJob> job;
+    {
+        std::unique_lock<std::mutex> lk(mLock);
+        mCond.wait(lk, [this] { return exitPending() || mJob != nullptr; });
+        if (mJob == nullptr) {
+            return false;
+        }
+        job = mJob;
+        mJob.reset();
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::vector<uint8_t> app1;
+    int ret = generateApp1(*job, &app1);
+    nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    std::lock_guard<std::mutex> lk(mLock);
+    mApp1.swap(app1);
+    mResult = ret;
+    mDuration = duration;
+    mDone = true;
+    mCond.notify_all();
+    return true;
+}
+
+int ExternalCameraDeviceSession::JpegEncodeThread::ThumbnailThread::generateApp1(
+        const JpegJob& job, std::vector<uint8_t>* out) {
+    ATRACE_CALL();
+    /* Thumbnail can't exceed APP1 size of 64K */
+    const ssize_t maxThumbCodeSize = 64 * 1024;
+    size_t thumbCodeSize = 0;
+    std::vector<uint8_t> thumbCode;
+
+    /* Encode the thumbnail image */
+    if (job.thumbFrame != nullptr) {
+        thumbCode.resize(maxThumbCodeSize);
+        YCbCrLayout yu12Thumb;
+        int ret = job.thumbFrame->getLayout(&yu12Thumb);
+        if (ret == 0) {
+            ret = encodeJpegYU12(job.thumbSize, yu12Thumb,
+                    job.thumbQuality, 0, 0,
+                    &thumbCode[0], maxThumbCodeSize, thumbCodeSize);
+        }
+        if (ret != 0) {
+            ALOGE("%s: thumbnail encodeJpegYU12 failed with %d", __FUNCTION__, ret);
+            return ret;
+        }
     }
 
-    ALOGV("%s: encoded JPEG (ret:%d) with Q:%d max size: %zu",
-          __FUNCTION__, ret, jpegQuality, maxJpegCodeSize);
+    /* Combine camera characteristics with request settings to form EXIF
+     * metadata */
+    common::V1_0::helper::CameraMetadata meta(mCameraCharacteristics);
+    meta.append(job.setting);
+
+    /* Generate EXIF object */
+    std::unique_ptr<ExifUtils> utils(ExifUtils::create());
+    /* Make sure it's initialized */
+    utils->initialize();
+
+    utils->setFromMetadata(meta, job.jpegSize.width, job.jpegSize.height);
+    utils->setMake(job.exifMake);
+    utils->setModel(job.exifModel);
+
+    if (!utils->generateApp1(thumbCodeSize > 0 ? &thumbCode[0] : 0, thumbCodeSize)) {
+        ALOGE("%s: generating APP1 failed", __FUNCTION__);
+        return 1;
+    }
 
+    const uint8_t* exifData = utils->getApp1Buffer();
+    out->assign(exifData, exifData + utils->getApp1Length());
     return 0;
 }
 
@@ -1975,9 +2671,6 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
        return false;
     }
 
-    // TODO: maybe we need to setup a sensor thread to dq/enq v4l frames
-    //       regularly to prevent v4l buffer queue filled with stale buffers
-    //       when app doesn't program a preveiw request
     waitForNextRequest(&req);
     if (req == nullptr) {
         // No new request, wait again
@@ -2041,6 +2734,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         }
     }
 
+    nsecs_t convertStart = systemTime(SYSTEM_TIME_MONOTONIC);
     if (isBlobOrYv12 && req->frameIn->mFourcc == V4L2_PIX_FMT_MJPEG) {
         /*LOGD("format is BLOB or YV12,use software jpeg decoder, framenumber(%d)", req->frameNumber);
         ATRACE_BEGIN("MJPGtoI420");
@@ -2057,7 +2751,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         input.cStride = tempFrameWidth; //mYu12Frame->mWidth;
         LOGD("format is BLOB or YV12, use software NV12ToI420");
 
-        int ret = libyuv::NV12ToI420(
+        int ret = convertNv12ToI420(
                 static_cast<uint8_t*>(input.y),
                 input.yStride,
                 static_cast<uint8_t*>(input.cb),
@@ -2094,7 +2788,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         input.cb = (uint8_t*)(req->inData) + mYu12Frame->mWidth * mYu12Frame->mHeight;
         input.cStride = mYu12Frame->mWidth;
 
-        int res = libyuv::NV12ToI420(
+        int res = convertNv12ToI420(
                 static_cast<uint8_t*>(input.y),
                 input.yStride,
                 static_cast<uint8_t*>(input.cb),
@@ -2131,7 +2825,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         input.cb = (uint8_t*)(req->inData) + mYu12Frame->mWidth * mYu12Frame->mHeight;
         input.cStride = mYu12Frame->mWidth;
 
-        int res = libyuv::NV12ToI420(
+        int res = convertNv12ToI420(
                 static_cast<uint8_t*>(input.y),
                 input.yStride,
                 static_cast<uint8_t*>(input.cb),
@@ -2169,7 +2863,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         input.cb = (uint8_t*)(req->mVirAddr) + mYu12Frame->mWidth * mYu12Frame->mHeight;
         input.cStride = mYu12Frame->mWidth;
 
-        int res = libyuv::NV12ToI420(
+        int res = convertNv12ToI420(
                 static_cast<uint8_t*>(input.y),
                 input.yStride,
                 static_cast<uint8_t*>(input.cb),
@@ -2225,6 +2919,10 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
         }
     }
 
+    if (isBlobOrYv12) {
+        req->latency.add(STAGE_CONVERT, systemTime(SYSTEM_TIME_MONOTONIC) - convertStart);
+    }
+
     ATRACE_BEGIN("Wait for BufferRequest done");
     res = waitForBufferRequestDone(&req->buffers);
     ATRACE_END();
@@ -2236,7 +2934,7 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
     }
     
     ALOGV("%s processing new request", __FUNCTION__);
-    const int kSyncWaitTimeoutMs = 500;
+    std::vector<std::shared_ptr<JpegEncodeThread::JpegJob>> jpegJobs;
     for (auto& halBuf : req->buffers) {
         if (*(halBuf.bufPtr) == nullptr) {
             ALOGW("%s: buffer for stream %d missing", __FUNCTION__, halBuf.streamId);
@@ -2255,16 +2953,23 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
             continue;
         }
 
+        nsecs_t bufStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t scaleNs = 0;
         // Gralloc lockYCbCr the buffer
         switch (halBuf.format) {
             case PixelFormat::BLOB: {
-                int ret = createJpegLocked(halBuf, req->setting);
+                std::shared_ptr<JpegEncodeThread::JpegJob> job;
+                int ret = prepareJpegJobLocked(req->frameNumber, halBuf, req->setting, &job);
 
                 if(ret != 0) {
                     lk.unlock();
-                    return onDeviceError("%s: createJpegLocked failed with %d",
+                    return onDeviceError("%s: prepareJpegJobLocked failed with %d",
                           __FUNCTION__, ret);
                 }
+                // Returned on its own by mJpegThread, so carries the request stages too
+                job->halBuf.latency = req->latency;
+                job->halBuf.latency.add(STAGE_SCALE, job->prepareDuration);
+                jpegJobs.push_back(job);
             } break;
             case PixelFormat::Y16: {
                 void* outLayout = sHandleImporter.lock(*(halBuf.bufPtr), halBuf.usage, req->inDataSize);
@@ -2294,25 +2999,29 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                         (outputFourcc >> 16) & 0xFF,
                         (outputFourcc >> 24) & 0xFF);
 
-                YCbCrLayout cropAndScaled;
-                ATRACE_BEGIN("cropAndScaleLocked");
-                int ret = cropAndScaleLocked(
-                        mYu12Frame,
-                        Size { halBuf.width, halBuf.height },
-                        &cropAndScaled);
-                ATRACE_END();
-                if (ret != 0) {
-                    lk.unlock();
-                    return onDeviceError("%s: crop and scale failed!", __FUNCTION__);
-                }
-
                 Size sz {halBuf.width, halBuf.height};
-                ATRACE_BEGIN("formatConvert");
-                ret = formatConvert(cropAndScaled, outLayout, sz, outputFourcc);
+                ATRACE_BEGIN("NV12toYV12Cropped");
+                int ret = convertNv12CroppedLocked(req, sz, outLayout);
                 ATRACE_END();
                 if (ret != 0) {
-                    lk.unlock();
-                    return onDeviceError("%s: format coversion failed!", __FUNCTION__);
+                    YCbCrLayout cropAndScaled;
+                    nsecs_t scaleStart = systemTime(SYSTEM_TIME_MONOTONIC);
+                    ATRACE_BEGIN("cropAndScaleLocked");
+                    ret = cropAndScaleLocked(mYu12Frame, sz, &cropAndScaled);
+                    ATRACE_END();
+                    scaleNs += systemTime(SYSTEM_TIME_MONOTONIC) - scaleStart;
+                    if (ret != 0) {
+                        lk.unlock();
+                        return onDeviceError("%s: crop and scale failed!", __FUNCTION__);
+                    }
+
+                    ATRACE_BEGIN("formatConvert");
+                    ret = formatConvert(cropAndScaled, outLayout, sz, outputFourcc);
+                    ATRACE_END();
+                    if (ret != 0) {
+                        lk.unlock();
+                        return onDeviceError("%s: format coversion failed!", __FUNCTION__);
+                    }
                 }
                 int relFence = sHandleImporter.unlock(*(halBuf.bufPtr));
                 if (relFence >= 0) {
@@ -2322,6 +3031,35 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
             case PixelFormat::YCBCR_420_888:
             case PixelFormat::IMPLEMENTATION_DEFINED:
             case PixelFormat::YCRCB_420_SP: {
+                if (req->directOutput) {
+                    // Already decoded into this buffer by the FormatConvertThread
+                    mDirectOutputFrames++;
+                    break;
+                }
+                if (req->frameIn->mFourcc == V4L2_PIX_FMT_YUYV &&
+                        isDirectOutputCandidate(*req)) {
+                    IMapper::Rect outRect {0, 0,
+                            static_cast<int32_t>(halBuf.width),
+                            static_cast<int32_t>(halBuf.height)};
+                    YCbCrLayout outLayout = sHandleImporter.lockYCbCr(
+                            *(halBuf.bufPtr), halBuf.usage, outRect);
+                    ATRACE_BEGIN("YUYVDirect");
+                    int ret = convertYuyvDirectLocked(req, outLayout);
+                    ATRACE_END();
+                    if (ret == 0) {
+                        int relFence = sHandleImporter.unlock(*(halBuf.bufPtr));
+                        if (relFence >= 0) {
+                            halBuf.acquireFence = relFence;
+                        }
+                        mDirectOutputFrames++;
+                        break;
+                    }
+                    // Unsupported output layout, go through mYu12Frame below
+                    int relFence = sHandleImporter.unlock(*(halBuf.bufPtr));
+                    if (relFence >= 0) {
+                        ::close(relFence);
+                    }
+                }
                 if (req->frameIn->mFourcc == V4L2_PIX_FMT_YUYV){
                     ALOGV("%s libyuvToI420", __FUNCTION__);
                     ATRACE_BEGIN("YUYVtoI420");
@@ -2349,12 +3087,14 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                             (outputFourcc >> 24) & 0xFF);
 
                     YCbCrLayout cropAndScaled;
+                    nsecs_t scaleStart = systemTime(SYSTEM_TIME_MONOTONIC);
                     ATRACE_BEGIN("cropAndScaleLocked");
                     ret = cropAndScaleLocked(
                             mYu12Frame,
                             Size { halBuf.width, halBuf.height },
                             &cropAndScaled);
                     ATRACE_END();
+                    scaleNs += systemTime(SYSTEM_TIME_MONOTONIC) - scaleStart;
                     if (ret != 0) {
                         lk.unlock();
                         return onDeviceError("%s: crop and scale failed!", __FUNCTION__);
@@ -2397,11 +3137,13 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                     ALOGV("%s(%d) halbuf_wxh(%dx%d) frameNumber(%d)", __FUNCTION__, __LINE__,
                         halBuf.width, halBuf.height, req->frameNumber);
                     unsigned long vir_addr =  reinterpret_cast<unsigned long>(req->inData);
+                    nsecs_t scaleStart = systemTime(SYSTEM_TIME_MONOTONIC);
                     camera2::RgaCropScale::rga_nv12_scale_crop(
                         tempFrameWidth, tempFrameHeight, vir_addr, handle_fd,
                         halBuf.width, halBuf.height, 100, false, true,
                         (halBuf.format == PixelFormat::YCRCB_420_SP), is16Align,
                         true);
+                    scaleNs += systemTime(SYSTEM_TIME_MONOTONIC) - scaleStart;
                 } else if (req->frameIn->mFourcc == V4L2_PIX_FMT_H264){
 
                     int handle_fd = -1, ret;
@@ -2428,11 +3170,13 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                     ALOGV("%s(%d) halbuf_wxh(%dx%d) frameNumber(%d)", __FUNCTION__, __LINE__,
                         halBuf.width, halBuf.height, req->frameNumber);
                     unsigned long vir_addr =  reinterpret_cast<unsigned long>(req->mVirAddr);
+                    nsecs_t scaleStart = systemTime(SYSTEM_TIME_MONOTONIC);
                     camera2::RgaCropScale::rga_nv12_scale_crop(
                         tempFrameWidth, tempFrameHeight, vir_addr, handle_fd,
                         halBuf.width, halBuf.height, 100, false, true,
                         (halBuf.format == PixelFormat::YCRCB_420_SP), is16Align,
                         true);
+                    scaleNs += systemTime(SYSTEM_TIME_MONOTONIC) - scaleStart;
                 } else {
 
                     if (req->mShareFd <= 0) {
@@ -2517,11 +3261,13 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                     ALOGV("%s(%d) halbuf_wxh(%dx%d) frameNumber(%d)", __FUNCTION__, __LINE__,
                         halBuf.width, halBuf.height, req->frameNumber);
 
+                    nsecs_t scaleStart = systemTime(SYSTEM_TIME_MONOTONIC);
                     camera2::RgaCropScale::rga_nv12_scale_crop(
                         tempFrameWidth, tempFrameHeight, req->mShareFd, handle_fd,
                         halBuf.width, halBuf.height, 100, false, true,
                         (halBuf.format == PixelFormat::YCRCB_420_SP), is16Align,
                         req->frameIn->mFourcc == V4L2_PIX_FMT_YUYV);
+                    scaleNs += systemTime(SYSTEM_TIME_MONOTONIC) - scaleStart;
 #ifdef DUMP_YUV
                     {
                         void* mVirAddr = NULL;
@@ -2572,8 +3318,26 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
                 lk.unlock();
                 return onDeviceError("%s: unknown output format %x", __FUNCTION__, halBuf.format);
         }
+
+        if (halBuf.format != PixelFormat::BLOB && !req->directOutput) {
+            nsecs_t bufDuration = systemTime(SYSTEM_TIME_MONOTONIC) - bufStart;
+            if (scaleNs > 0) {
+                halBuf.latency.add(STAGE_SCALE, scaleNs);
+            }
+            halBuf.latency.add(STAGE_CONVERT, bufDuration - scaleNs);
+        }
     } // for each buffer
     mScaledYu12Frames.clear();
+    mProcessedFrames++;
+
+    // BLOB buffers are returned by mJpegThread once encoded
+    if (!jpegJobs.empty()) {
+        req->buffers.erase(std::remove_if(req->buffers.begin(), req->buffers.end(),
+                [](const HalStreamBuffer& halBuf) {
+                    return halBuf.format == PixelFormat::BLOB && !halBuf.fenceTimeout;
+                }), req->buffers.end());
+        req->deferredBuffer = true;
+    }
 
     // Don't hold the lock while calling back to parent
     lk.unlock();
@@ -2581,10 +3345,94 @@ bool ExternalCameraDeviceSession::OutputThread::threadLoop() {
     if (st != Status::OK) {
         return onDeviceError("%s: failed to process capture result!", __FUNCTION__);
     }
+    // Shutter and result metadata are sent, the BLOB buffers can follow at any time
+    for (const auto& job : jpegJobs) {
+        mJpegThread->submitJob(job);
+    }
     signalRequestDone();
     return true;
 }
 
+int ExternalCameraDeviceSession::OutputThread::convertYuyvDirectLocked(
+        const std::shared_ptr<HalRequest>& req, const YCbCrLayout& outLayout) {
+    int width = req->frameIn->mWidth;
+    int height = req->frameIn->mHeight;
+    int srcStride = width * 2;
+    uint32_t outputFourcc = getFourCcFromLayout(outLayout);
+    switch (outputFourcc) {
+        case V4L2_PIX_FMT_NV12:
+            return convertYuyvToNv12(
+                    req->inData, srcStride,
+                    static_cast<uint8_t*>(outLayout.y), outLayout.yStride,
+                    static_cast<uint8_t*>(outLayout.cb), outLayout.cStride,
+                    width, height);
+        case V4L2_PIX_FMT_YUV420: // YU12
+        case V4L2_PIX_FMT_YVU420: // YV12
+            return libyuv::YUY2ToI420(
+                    req->inData, srcStride,
+                    static_cast<uint8_t*>(outLayout.y), outLayout.yStride,
+                    static_cast<uint8_t*>(outLayout.cb), outLayout.cStride,
+                    static_cast<uint8_t*>(outLayout.cr), outLayout.cStride,
+                    width, height);
+        default:
+            ALOGV("%s: no direct YUYV conversion to %c%c%c%c", __FUNCTION__,
+                    outputFourcc & 0xFF,
+                    (outputFourcc >> 8) & 0xFF,
+                    (outputFourcc >> 16) & 0xFF,
+                    (outputFourcc >> 24) & 0xFF);
+            return -1;
+    }
+}
+
+int ExternalCameraDeviceSession::OutputThread::convertNv12CroppedLocked(
+        const std::shared_ptr<HalRequest>& req, const Size& outSize,
+        const YCbCrLayout& outLayout) {
+    if (req->directOutput || getFourCcFromLayout(outLayout) != V4L2_PIX_FMT_YVU420) {
+        return -1;
+    }
+
+    uint32_t width = req->frameIn->mWidth;
+    uint32_t height = req->frameIn->mHeight;
+    uint32_t stride = width;
+    uint32_t alignedHeight = height;
+    const uint8_t* src = nullptr;
+    switch (req->frameIn->mFourcc) {
+        case V4L2_PIX_FMT_MJPEG:
+            // Decoded by the FormatConvertThread into 16 aligned NV12
+            stride = (width + 15) & (~15);
+            alignedHeight = (height + 15) & (~15);
+            src = reinterpret_cast<const uint8_t*>(req->mVirAddr);
+            break;
+        case V4L2_PIX_FMT_H264:
+            src = reinterpret_cast<const uint8_t*>(req->mVirAddr);
+            break;
+        case V4L2_PIX_FMT_NV12:
+            src = req->inData;
+            break;
+        default:
+            return -1;
+    }
+    if (src == nullptr) {
+        return -1;
+    }
+
+    IMapper::Rect inputCrop;
+    int ret = getCropRect(mCroppingType, Size {width, height}, outSize, &inputCrop);
+    if (ret != 0 ||
+            inputCrop.width != static_cast<int32_t>(outSize.width) ||
+            inputCrop.height != static_cast<int32_t>(outSize.height)) {
+        // Needs scaling, go through mYu12Frame
+        return -1;
+    }
+
+    return convertNv12ToYv12Cropped(
+            src, stride, src + stride * alignedHeight, stride,
+            inputCrop.left, inputCrop.top, inputCrop.width, inputCrop.height,
+            static_cast<uint8_t*>(outLayout.y), outLayout.yStride,
+            static_cast<uint8_t*>(outLayout.cr), outLayout.cStride,
+            static_cast<uint8_t*>(outLayout.cb), outLayout.cStride);
+}
+
 Status ExternalCameraDeviceSession::OutputThread::allocateIntermediateBuffers(
         const Size& v4lSize, const Size& thumbSize,
         const hidl_vec<Stream>& streams,
@@ -2679,6 +3527,11 @@ Status ExternalCameraDeviceSession::OutputThread::submitRequest(
     return Status::OK;
 }
 
+bool ExternalCameraDeviceSession::OutputThread::hasPendingRequests() const {
+    std::lock_guard<std::mutex> lk(mRequestListLock);
+    return !mRequestList.empty();
+}
+
 void ExternalCameraDeviceSession::OutputThread::flush() {
     ATRACE_CALL();
     auto parent = mParent.promote();
@@ -2703,6 +3556,7 @@ void ExternalCameraDeviceSession::OutputThread::flush() {
     for (const auto& req : reqs) {
         parent->processCaptureRequestError(req);
     }
+    mJpegThread->flush();
 }
 
 std::list<std::shared_ptr<HalRequest>>
@@ -2781,6 +3635,11 @@ void ExternalCameraDeviceSession::OutputThread::dump(int fd) {
         dprintf(fd, "%d, ", req->frameNumber);
     }
     dprintf(fd, "\n");
+    dprintf(fd, "OutputThread direct output frames %" PRIu64 " / %" PRIu64 " processed\n",
+            mDirectOutputFrames.load(), mProcessedFrames.load());
+    dprintf(fd, "OutputThread scale workers %u\n", mScaler->getNumWorkers());
+    dprintf(fd, "OutputThread conversion kernels %s\n", getConvertKernelName());
+    mJpegThread->dump(fd);
 }
 
 void ExternalCameraDeviceSession::cleanupBuffersLocked(int id) {
@@ -2876,6 +3735,8 @@ int ExternalCameraDeviceSession::v4l2StreamOffLocked() {
         return OK;
     }
 
+    stopCaptureThreadLocked();
+
     {
         std::lock_guard<std::mutex> lk(mV4l2BufferLock);
         if (mNumDequeuedV4l2Buffers != 0)  {
@@ -3034,7 +3895,6 @@ int ExternalCameraDeviceSession::configureV4l2StreamLocked(
     }
     mMaxV4L2BufferSize = bufferSize;
 
-    const double kDefaultFps = 30.0;
     double fps = 1000.0;
     if (requestFps != 0.0) {
         fps = requestFps;
@@ -3062,8 +3922,7 @@ int ExternalCameraDeviceSession::configureV4l2StreamLocked(
 //    }
     mV4l2StreamingFps = fps;
 
-    uint32_t v4lBufferCount = (fps >= kDefaultFps) ?
-            mCfg.numVideoBuffers : mCfg.numStillBuffers;
+    uint32_t v4lBufferCount = getV4l2BufferCountLocked(fps);
     // VIDIOC_REQBUFS: create buffers
     v4l2_requestbuffers req_buffers{};
     if (mCapability.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
@@ -3084,9 +3943,19 @@ int ExternalCameraDeviceSession::configureV4l2StreamLocked(
         return NO_MEMORY;
     }
 
+    if (mPreviewBufferCount != 0 && req_buffers.count > mPreviewBufferCount) {
+        ALOGE("%s: driver returned %d buffers, only %zu preview buffers allocated",
+                __FUNCTION__, req_buffers.count, mPreviewBufferCount);
+        return NO_MEMORY;
+    }
+
     // VIDIOC_QUERYBUF:  get buffer offset in the V4L2 fd
     // VIDIOC_QBUF: send buffer to driver
     mV4L2BufferCount = req_buffers.count;
+    {
+        std::lock_guard<std::mutex> lk(mV4l2BufferLock);
+        mV4l2DequeueTs.assign(mV4L2BufferCount, 0);
+    }
     for (uint32_t i = 0; i < req_buffers.count; i++) {
         v4l2_buffer buffer;
         buffer.index = i;
@@ -3168,6 +4037,9 @@ int ExternalCameraDeviceSession::configureV4l2StreamLocked(
                 __FUNCTION__, v4l2Fmt.width, v4l2Fmt.height, fps);
     mV4l2StreamingFmt = v4l2Fmt;
     mV4l2Streaming = true;
+    if (v4l2Fmt.fourcc != V4L2_PIX_FMT_H264) {
+        startCaptureThreadLocked();
+    }
     return OK;
 }
 
@@ -3190,6 +4062,12 @@ sp<V4L2Frame> ExternalCameraDeviceSession::dequeueV4l2FrameLocked(/*out*/nsecs_t
         }
     }
 
+    return dequeueV4l2FrameImpl(shutterTs);
+}
+
+sp<V4L2Frame> ExternalCameraDeviceSession::dequeueV4l2FrameImpl(/*out*/nsecs_t* shutterTs) {
+    sp<V4L2Frame> ret = nullptr;
+
     ATRACE_BEGIN("VIDIOC_DQBUF");
     v4l2_buffer buffer{};
     if (mCapability.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
@@ -3236,6 +4114,9 @@ sp<V4L2Frame> ExternalCameraDeviceSession::dequeueV4l2FrameLocked(/*out*/nsecs_t
     {
         std::lock_guard<std::mutex> lk(mV4l2BufferLock);
         mNumDequeuedV4l2Buffers++;
+        if (buffer.index < mV4l2DequeueTs.size()) {
+            mV4l2DequeueTs[buffer.index] = systemTime(SYSTEM_TIME_MONOTONIC);
+        }
     }
     if (mCapability.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
         ALOGD("%s(%d) buffer.index(%d), length(%d), mem_offset(%d)",__FUNCTION__, __LINE__,
@@ -3279,8 +4160,142 @@ void ExternalCameraDeviceSession::enqueueV4l2Frame(const sp<V4L2Frame>& frame) {
     {
         std::lock_guard<std::mutex> lk(mV4l2BufferLock);
         mNumDequeuedV4l2Buffers--;
+        size_t index = static_cast<size_t>(frame->mBufferIndex);
+        if (index < mV4l2DequeueTs.size() && mV4l2DequeueTs[index] != 0) {
+            // Moving average over roughly the last 16 buffers
+            nsecs_t holdTime = systemTime(SYSTEM_TIME_MONOTONIC) - mV4l2DequeueTs[index];
+            mV4l2HoldTime = (mV4l2HoldTime == 0) ? holdTime :
+                    mV4l2HoldTime + (holdTime - mV4l2HoldTime) / 16;
+            mV4l2DequeueTs[index] = 0;
+        }
+    }
+    // The capture thread and a request may both be waiting
+    mV4L2BufferReturned.notify_all();
+}
+
+uint32_t ExternalCameraDeviceSession::getV4l2BufferCountLocked(double fps) {
+    uint32_t count = (fps >= kDefaultFps) ? mCfg.numVideoBuffers : mCfg.numStillBuffers;
+
+    // Enough buffers to cover the frames held by the pipeline during one hold
+    // time, plus the one being filled and the one waiting for the next request
+    nsecs_t holdTime;
+    {
+        std::lock_guard<std::mutex> lk(mV4l2BufferLock);
+        holdTime = mV4l2HoldTime;
+    }
+    if (holdTime > 0 && fps > 0.0) {
+        uint32_t needed = static_cast<uint32_t>(std::ceil(holdTime * fps / s2ns(1))) + 2;
+        if (needed > count) {
+            ALOGI("%s: buffer hold time %" PRId64 "us at %ffps, using %u V4L2 buffers",
+                    __FUNCTION__, ns2us(holdTime), fps, needed);
+            count = needed;
+        }
+    }
+    count = std::min(count, kMaxV4l2BufferCount);
+    if (mPreviewBufferCount != 0) {
+        // Preview buffers are not reallocated on this stream on
+        count = std::min(count, static_cast<uint32_t>(mPreviewBufferCount));
+    }
+    return count;
+}
+
+void ExternalCameraDeviceSession::startCaptureThreadLocked() {
+    if (mCaptureThread != nullptr) {
+        return;
+    }
+    mCaptureThread = new CaptureThread(this);
+    status_t res = mCaptureThread->run("ExtCamCapture", PRIORITY_DISPLAY);
+    if (res != OK) {
+        ALOGE("%s: failed to start capture thread: %d", __FUNCTION__, res);
+        mCaptureThread.clear();
+    }
+}
+
+void ExternalCameraDeviceSession::stopCaptureThreadLocked() {
+    if (mCaptureThread == nullptr) {
+        return;
+    }
+    mCaptureThread->requestExit();
+    {
+        // Wake up a DQBUF waiting for a free buffer
+        std::lock_guard<std::mutex> lk(mV4l2BufferLock);
+        mV4L2BufferReturned.notify_all();
     }
-    mV4L2BufferReturned.notify_one();
+    mCaptureThread->join();
+    mCaptureThread.clear();
+
+    sp<V4L2Frame> frame;
+    {
+        std::lock_guard<std::mutex> lk(mCaptureLock);
+        frame = mCapturedFrame;
+        mCapturedFrame.clear();
+    }
+    if (frame != nullptr) {
+        enqueueV4l2Frame(frame);
+    }
+}
+
+sp<V4L2Frame> ExternalCameraDeviceSession::acquireCapturedFrameLocked(
+        /*out*/nsecs_t* shutterTs) {
+    ATRACE_CALL();
+    std::unique_lock<std::mutex> lk(mCaptureLock);
+    std::chrono::seconds timeout = std::chrono::seconds(kBufferWaitTimeoutSec);
+    if (!mCaptureCond.wait_for(lk, timeout, [this] { return mCapturedFrame != nullptr; })) {
+        ALOGE("%s: wait for captured frame timeout!", __FUNCTION__);
+        return nullptr;
+    }
+    sp<V4L2Frame> frame = mCapturedFrame;
+    mCapturedFrame.clear();
+    *shutterTs = mCapturedShutterTs;
+    return frame;
+}
+
+bool ExternalCameraDeviceSession::CaptureThread::threadLoop() {
+    // Keep one buffer in the driver so capture never stalls on the held frame
+    {
+        std::unique_lock<std::mutex> lk(mParent->mV4l2BufferLock);
+        mParent->mV4L2BufferReturned.wait(lk, [this] {
+            return exitPending() ||
+                    mParent->mNumDequeuedV4l2Buffers < mParent->mV4L2BufferCount;
+        });
+    }
+    if (exitPending()) {
+        return false;
+    }
+
+    struct pollfd pfd = { mParent->mV4l2Fd.get(), POLLIN, 0 };
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, kPollTimeoutMs));
+    if (ret <= 0 || exitPending()) {
+        if (ret < 0) {
+            ALOGE("%s: poll failed: %s", __FUNCTION__, strerror(errno));
+        }
+        return !exitPending();
+    }
+
+    nsecs_t shutterTs = 0;
+    sp<V4L2Frame> frame = mParent->dequeueV4l2FrameImpl(&shutterTs);
+    if (frame == nullptr) {
+        // Already logged; don't spin on a broken device
+        usleep(IOCTL_RETRY_SLEEP_US);
+        return true;
+    }
+
+    sp<V4L2Frame> stale;
+    {
+        std::lock_guard<std::mutex> lk(mParent->mCaptureLock);
+        stale = mParent->mCapturedFrame;
+        mParent->mCapturedFrame = frame;
+        mParent->mCapturedShutterTs = shutterTs;
+        if (stale != nullptr) {
+            mParent->mStaleFrames++;
+        }
+    }
+    mParent->mCaptureCond.notify_one();
+
+    if (stale != nullptr) {
+        mParent->enqueueV4l2Frame(stale);
+    }
+    return true;
 }
 
 Status ExternalCameraDeviceSession::isStreamCombinationSupported(
@@ -3442,6 +4457,8 @@ Status ExternalCameraDeviceSession::configureStreams(
         return Status::ILLEGAL_ARGUMENT;
     }
 
+    // Preview buffers are reallocated below to match the new V4L2 buffer count
+    mPreviewBufferCount = 0;
     if (configureV4l2StreamLocked(v4l2Fmt) != 0) {
         ALOGE("V4L configuration failed!, format:%c%c%c%c, w %d, h %d",
             v4l2Fmt.fourcc & 0xFF,
@@ -3524,6 +4541,12 @@ Status ExternalCameraDeviceSession::configureStreams(
         }
     }
 
+    std::vector<int32_t> streamIds;
+    for (const auto& stream : config.streams) {
+        streamIds.push_back(stream.id);
+    }
+    mLatencyRecorder.reset(streamIds);
+
     mFirstRequest = true;
     return Status::OK;
 }
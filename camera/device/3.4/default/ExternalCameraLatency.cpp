@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "ExtCamLatency@3.4"
+//#define LOG_NDEBUG 0
+#include <log/log.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <limits>
+#include "ExternalCameraLatency.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+namespace {
+
+const char* kStageNames[STAGE_COUNT] = {
+    "dequeue", "decode", "convert", "scale", "encode", "callback"
+};
+
+} // anonymous namespace
+
+const uint32_t LatencyRecorder::kMaxStreams;
+
+uint32_t LatencyHistogram::getBucket(uint32_t us) {
+    if (us < kLinearBuckets) {
+        return us;
+    }
+    uint32_t msb = 31 - __builtin_clz(us);
+    uint32_t shift = msb - kSubBucketBits;
+    uint32_t sub = (us >> shift) & ((1u << kSubBucketBits) - 1);
+    return kLinearBuckets + ((msb - kSubBucketBits - 1) << kSubBucketBits) + sub;
+}
+
+uint32_t LatencyHistogram::getBucketUpperBoundUs(uint32_t bucket) {
+    if (bucket < kLinearBuckets) {
+        return bucket;
+    }
+    uint32_t group = (bucket - kLinearBuckets) >> kSubBucketBits;
+    uint32_t sub = (bucket - kLinearBuckets) & ((1u << kSubBucketBits) - 1);
+    uint32_t shift = group + 1;
+    uint64_t lower = static_cast<uint64_t>((1u << kSubBucketBits) + sub) << shift;
+    return static_cast<uint32_t>(lower + (1ull << shift) - 1);
+}
+
+void LatencyHistogram::record(nsecs_t duration) {
+    nsecs_t us = std::max<nsecs_t>(ns2us(duration), 0);
+    uint32_t clamped = static_cast<uint32_t>(
+            std::min<nsecs_t>(us, std::numeric_limits<uint32_t>::max()));
+
+    mBuckets[getBucket(clamped)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = mMaxUs.load(std::memory_order_relaxed);
+    while (clamped > max &&
+            !mMaxUs.compare_exchange_weak(max, clamped, std::memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : mBuckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    mCount.store(0, std::memory_order_relaxed);
+    mMaxUs.store(0, std::memory_order_relaxed);
+}
+
+uint32_t LatencyHistogram::getPercentileUs(uint32_t percentile) const {
+    // Snapshot the buckets first; they may move while we walk them
+    uint32_t counts[kNumBuckets];
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < kNumBuckets; i++) {
+        counts[i] = mBuckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = std::max<uint64_t>((total * percentile + 99) / 100, 1);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < kNumBuckets; i++) {
+        seen += counts[i];
+        if (seen >= target) {
+            return std::min(getBucketUpperBoundUs(i), getMaxUs());
+        }
+    }
+    return getMaxUs();
+}
+
+void LatencyRecorder::reset(const std::vector<int32_t>& streamIds) {
+    if (streamIds.size() > kMaxStreams) {
+        ALOGW("%s: %zu streams configured, only the first %u are tracked",
+                __FUNCTION__, streamIds.size(), kMaxStreams);
+    }
+    for (uint32_t i = 0; i < kMaxStreams; i++) {
+        Slot& slot = mSlots[i];
+        // Unbind before clearing so nothing lands in a half reset slot
+        slot.streamId.store(-1, std::memory_order_release);
+        for (auto& stage : slot.stages) {
+            stage.reset();
+        }
+        if (i < streamIds.size()) {
+            slot.streamId.store(streamIds[i], std::memory_order_release);
+        }
+    }
+}
+
+void LatencyRecorder::clear() {
+    for (auto& slot : mSlots) {
+        for (auto& stage : slot.stages) {
+            stage.reset();
+        }
+    }
+}
+
+void LatencyRecorder::record(int32_t streamId, const StageLatencies& latencies) {
+    for (auto& slot : mSlots) {
+        if (slot.streamId.load(std::memory_order_acquire) != streamId) {
+            continue;
+        }
+        for (uint32_t i = 0; i < STAGE_COUNT; i++) {
+            if (latencies.mask & (1u << i)) {
+                slot.stages[i].record(latencies.ns[i]);
+            }
+        }
+        return;
+    }
+}
+
+void LatencyRecorder::dump(int fd) const {
+    dprintf(fd, "Per stage latency (p50/p99/max in us):\n");
+    for (const auto& slot : mSlots) {
+        int32_t streamId = slot.streamId.load(std::memory_order_acquire);
+        if (streamId < 0) {
+            continue;
+        }
+        dprintf(fd, "  stream %d:\n", streamId);
+        for (uint32_t i = 0; i < STAGE_COUNT; i++) {
+            const LatencyHistogram& hist = slot.stages[i];
+            uint32_t count = hist.getCount();
+            if (count == 0) {
+                continue;
+            }
+            dprintf(fd, "    %-8s %8u samples %8u / %8u / %8u\n", kStageNames[i], count,
+                    hist.getPercentileUs(50), hist.getPercentileUs(99), hist.getMaxUs());
+        }
+    }
+}
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
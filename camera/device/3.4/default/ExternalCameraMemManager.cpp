@@ -17,12 +17,129 @@
 #define LOG_TAG "CamBufMgr"
 #define LOG_NDEBUG 0
 
+#include <inttypes.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <log/log.h>
 #include "ExternalCameraMemManager.h"
 
 namespace android {
+BufferPool::BufferPool()
+    :mNumBuffers(0),
+    mHead(kEmpty),
+    mInUse(0),
+    mHighWaterMark(0),
+    mAcquireCount(0),
+    mAcquireFailCount(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+}
+
+int BufferPool::init(unsigned int numBuffers)
+{
+    mNext.reset(new std::atomic<uint32_t>[numBuffers]);
+    mRefCount.reset(new std::atomic<int32_t>[numBuffers]);
+    mNumBuffers = numBuffers;
+    mHead.store(kEmpty);
+    mInUse.store(0);
+    mHighWaterMark.store(0);
+    mAcquireCount.store(0);
+    mAcquireFailCount.store(0);
+    // Push in reverse so index 0 is handed out first
+    for (int i = numBuffers - 1; i >= 0; i--) {
+        mRefCount[i].store(0);
+        push(i);
+    }
+    return 0;
+}
+
+void BufferPool::reset()
+{
+    mNumBuffers = 0;
+    mHead.store(kEmpty);
+    mNext.reset();
+    mRefCount.reset();
+    mInUse.store(0);
+}
+
+void BufferPool::push(unsigned int idx)
+{
+    uint64_t head = mHead.load(std::memory_order_relaxed);
+    uint64_t newHead;
+    do {
+        mNext[idx].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        newHead = (((head >> 32) + 1) << 32) | (idx + 1);
+    } while (!mHead.compare_exchange_weak(head, newHead,
+                std::memory_order_release, std::memory_order_relaxed));
+}
+
+int BufferPool::acquire()
+{
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    uint64_t newHead;
+    uint32_t node;
+    do {
+        node = static_cast<uint32_t>(head);
+        if (node == kEmpty) {
+            mAcquireFailCount.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+        // The tag makes a stale read of mNext harmless: the CAS fails if the
+        // head was popped and pushed back in between
+        uint32_t next = mNext[node - 1].load(std::memory_order_relaxed);
+        newHead = (((head >> 32) + 1) << 32) | next;
+    } while (!mHead.compare_exchange_weak(head, newHead,
+                std::memory_order_acquire, std::memory_order_acquire));
+
+    unsigned int idx = node - 1;
+    mRefCount[idx].store(1, std::memory_order_relaxed);
+    mAcquireCount.fetch_add(1, std::memory_order_relaxed);
+    unsigned int inUse = mInUse.fetch_add(1, std::memory_order_relaxed) + 1;
+    unsigned int hwm = mHighWaterMark.load(std::memory_order_relaxed);
+    while (inUse > hwm &&
+            !mHighWaterMark.compare_exchange_weak(hwm, inUse, std::memory_order_relaxed)) {
+    }
+    return idx;
+}
+
+int BufferPool::retain(unsigned int idx)
+{
+    if (idx >= mNumBuffers) {
+        LOGE("Buffer index(0x%x) is invalidate, Total buffer is 0x%x", idx, mNumBuffers);
+        return -1;
+    }
+    int32_t prev = mRefCount[idx].fetch_add(1, std::memory_order_relaxed);
+    if (prev <= 0) {
+        LOGE("retain buffer %u which is not acquired (refcount %d)", idx, prev);
+        mRefCount[idx].fetch_sub(1, std::memory_order_relaxed);
+        return -1;
+    }
+    return 0;
+}
+
+int BufferPool::release(unsigned int idx)
+{
+    if (idx >= mNumBuffers) {
+        LOGE("Buffer index(0x%x) is invalidate, Total buffer is 0x%x", idx, mNumBuffers);
+        return -1;
+    }
+    int32_t prev = mRefCount[idx].fetch_sub(1, std::memory_order_acq_rel);
+    if (prev <= 0) {
+        LOGE("release buffer %u which is not acquired (refcount %d)", idx, prev);
+        mRefCount[idx].fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+    if (prev == 1) {
+        mInUse.fetch_sub(1, std::memory_order_relaxed);
+        push(idx);
+    }
+    return 0;
+}
+
 MemManagerBase::MemManagerBase()
 {
     mPreviewBufferInfo = NULL;
@@ -32,30 +149,16 @@ MemManagerBase::~MemManagerBase()
     mPreviewBufferInfo = NULL;
 }
 
-void MemManagerBase::setBufferStatus(enum buffer_type_enum buf_type,
-                                unsigned int buf_idx, int status) {
-    struct bufferinfo_s *buf_info;
-
+BufferPool* MemManagerBase::getPool(enum buffer_type_enum buf_type)
+{
     switch(buf_type)
     {
         case PREVIEWBUFFER:
-            buf_info = mPreviewBufferInfo;
-        break;
+            return &mPreviewPool;
         default:
             LOGE("Buffer type(0x%x) is invaildate",buf_type);
-            goto getVirAddr_end;
+            return NULL;
     }
-
-    if (buf_idx >= buf_info->mNumBffers) {
-        LOGE("Buffer index(0x%x) is invalidate, Total buffer is 0x%x",
-            buf_idx,buf_info->mNumBffers);
-        goto getVirAddr_end;
-    }
-
-    (buf_info+buf_idx)->mStatus = status;
-
-getVirAddr_end:
-    return;
 }
 
 unsigned long MemManagerBase::getBufferAddr(enum buffer_type_enum buf_type,
@@ -74,7 +177,7 @@ unsigned long MemManagerBase::getBufferAddr(enum buffer_type_enum buf_type,
             goto getVirAddr_end;
     }
 
-    if (buf_idx > buf_info->mNumBffers) {
+    if (buf_idx >= buf_info->mNumBffers) {
         LOGE("Buffer index(0x%x) is invalidate, Total buffer is 0x%x",
             buf_idx,buf_info->mNumBffers);
         goto getVirAddr_end;
@@ -92,40 +195,39 @@ getVirAddr_end:
     return addr;
 }
 
-int MemManagerBase::getIdleBufferIndex(enum buffer_type_enum buf_type) {
-    unsigned long addr = 0x00;
-    struct bufferinfo_s *buf_info;
-    int index = -1;
-
-    switch(buf_type)
-    {
-        case PREVIEWBUFFER:
-            buf_info = mPreviewBufferInfo;
-        break;
-        default:
-            LOGE("Buffer type(0x%x) is invaildate",buf_type);
-            goto getVirAddr_end;
-    }
-
-    for (int i = 0; i < buf_info->mNumBffers; i++)
-        if ((buf_info+i)->mStatus == 0) {
-            index = i;
-            break;
-        }
-
-    if (index >= buf_info->mNumBffers) {
-        LOGE("Buffer index(0x%x) is invalidate, Total buffer is 0x%x",
-            index,buf_info->mNumBffers);
+int MemManagerBase::acquireBuffer(enum buffer_type_enum buf_type)
+{
+    BufferPool* pool = getPool(buf_type);
+    if (!pool)
         return -1;
-    }
-    
-getVirAddr_end:
+    int index = pool->acquire();
+    if (index < 0)
+        LOGE("no idle buffer, %u buffers in use", pool->inUse());
     return index;
+}
+
+int MemManagerBase::retainBuffer(enum buffer_type_enum buf_type, unsigned int buf_idx)
+{
+    BufferPool* pool = getPool(buf_type);
+    if (!pool)
+        return -1;
+    return pool->retain(buf_idx);
+}
 
+int MemManagerBase::releaseBuffer(enum buffer_type_enum buf_type, unsigned int buf_idx)
+{
+    BufferPool* pool = getPool(buf_type);
+    if (!pool)
+        return -1;
+    return pool->release(buf_idx);
 }
 
-int MemManagerBase::dump()
+int MemManagerBase::dump(int fd)
 {
+    dprintf(fd, "Preview buffer pool: %u buffers, %u in use, high water mark %u,"
+            " %" PRIu64 " acquires, %" PRIu64 " failed\n",
+            mPreviewPool.size(), mPreviewPool.inUse(), mPreviewPool.highWaterMark(),
+            mPreviewPool.acquireCount(), mPreviewPool.acquireFailCount());
     return 0;
 }
 
@@ -216,6 +318,9 @@ int GrallocDrmMemManager::createGrallocDrmBuffer(struct bufferinfo_s* grallocbuf
         tmp_buf++;
         tmpalloc++;
     }
+    if(ret == 0 && grallocbuf->mBufType == PREVIEWBUFFER) {
+        mPreviewPool.init(numBufs);
+    }
     if(ret < 0) {
         LOGE(" failed !");
         while(--i >= 0) {
@@ -265,6 +370,7 @@ void GrallocDrmMemManager::destroyGrallocDrmBuffer(buffer_type_enum buftype)
     switch(buftype)
     {
         case PREVIEWBUFFER:
+            mPreviewPool.reset();
             free(mPreviewData);
             mPreviewData = NULL;
             free(mPreviewBufferInfo);
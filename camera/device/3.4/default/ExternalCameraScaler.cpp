@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "ExtCamScaler@3.4"
+//#define LOG_NDEBUG 0
+#include <log/log.h>
+
+#include <algorithm>
+#include "ExternalCameraScaler.h"
+
+#define HAVE_JPEG // required for libyuv.h to export MJPEG decode APIs
+#include <libyuv.h>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+namespace {
+
+uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+uint8_t* offsetPlane(void* plane, uint32_t stride, uint32_t rows) {
+    return static_cast<uint8_t*>(plane) + stride * rows;
+}
+
+} // anonymous namespace
+
+TiledScaler::TiledScaler(uint32_t numWorkers) {
+    numWorkers = std::min(numWorkers, kMaxWorkers);
+    for (uint32_t i = 0; i < numWorkers; i++) {
+        sp<Worker> worker = new Worker(this);
+        status_t res = worker->run("ExtCamScale", PRIORITY_DISPLAY);
+        if (res != OK) {
+            ALOGE("%s: failed to start scale worker %u: %d", __FUNCTION__, i, res);
+            break;
+        }
+        mWorkers.push_back(worker);
+    }
+}
+
+TiledScaler::~TiledScaler() {
+    {
+        std::lock_guard<std::mutex> lk(mLock);
+        mExiting = true;
+    }
+    mWorkCond.notify_all();
+    for (auto& worker : mWorkers) {
+        worker->requestExitAndWait();
+    }
+    mWorkers.clear();
+}
+
+int TiledScaler::scaleStrip(const Strip& strip) {
+    return libyuv::I420Scale(
+            static_cast<uint8_t*>(strip.in.y),
+            strip.in.yStride,
+            static_cast<uint8_t*>(strip.in.cb),
+            strip.in.cStride,
+            static_cast<uint8_t*>(strip.in.cr),
+            strip.in.cStride,
+            strip.inWidth,
+            strip.inHeight,
+            static_cast<uint8_t*>(strip.out.y),
+            strip.out.yStride,
+            static_cast<uint8_t*>(strip.out.cb),
+            strip.out.cStride,
+            static_cast<uint8_t*>(strip.out.cr),
+            strip.out.cStride,
+            strip.outWidth,
+            strip.outHeight,
+            // TODO: b/72261744 see if we can use better filter without losing too much perf
+            libyuv::FilterMode::kFilterNone);
+}
+
+bool TiledScaler::runOneStripLocked(std::unique_lock<std::mutex>& lk) {
+    if (mStrips.empty()) {
+        return false;
+    }
+    Strip strip = mStrips.front();
+    mStrips.pop_front();
+
+    lk.unlock();
+    int ret = scaleStrip(strip);
+    lk.lock();
+
+    if (ret != 0 && mError == 0) {
+        mError = ret;
+    }
+    if (--mPendingStrips == 0) {
+        mDoneCond.notify_one();
+    }
+    return true;
+}
+
+int TiledScaler::scale(
+        const YCbCrLayout& in, uint32_t inWidth, uint32_t inHeight,
+        const YCbCrLayout& out, uint32_t outWidth, uint32_t outHeight) {
+    Strip whole {in, inWidth, inHeight, out, outWidth, outHeight};
+    if (mWorkers.empty() || inHeight == 0 || outHeight == 0) {
+        return scaleStrip(whole);
+    }
+
+    // Smallest group of rows where input and output line up exactly. Keep it
+    // even so chroma rows line up too.
+    uint32_t g = gcd(inHeight, outHeight);
+    uint32_t inUnit = inHeight / g;
+    uint32_t outUnit = outHeight / g;
+    if ((inUnit & 1) || (outUnit & 1)) {
+        inUnit *= 2;
+        outUnit *= 2;
+    }
+    uint32_t numUnits = inHeight / inUnit;
+
+    uint32_t numStrips = mWorkers.size() + 1;
+    numStrips = std::min(numStrips, (outWidth * outHeight) / kMinPixelsPerStrip);
+    numStrips = std::min(numStrips, numUnits);
+    if (numStrips <= 1) {
+        return scaleStrip(whole);
+    }
+
+    uint32_t unitsPerStrip = numUnits / numStrips;
+    std::unique_lock<std::mutex> lk(mLock);
+    for (uint32_t i = 0; i < numStrips; i++) {
+        uint32_t inRow = i * unitsPerStrip * inUnit;
+        uint32_t outRow = i * unitsPerStrip * outUnit;
+        bool last = (i == numStrips - 1);
+        Strip strip;
+        strip.in.y = offsetPlane(in.y, in.yStride, inRow);
+        strip.in.cb = offsetPlane(in.cb, in.cStride, inRow / 2);
+        strip.in.cr = offsetPlane(in.cr, in.cStride, inRow / 2);
+        strip.in.yStride = in.yStride;
+        strip.in.cStride = in.cStride;
+        strip.in.chromaStep = in.chromaStep;
+        strip.inWidth = inWidth;
+        strip.inHeight = last ? inHeight - inRow : unitsPerStrip * inUnit;
+        strip.out.y = offsetPlane(out.y, out.yStride, outRow);
+        strip.out.cb = offsetPlane(out.cb, out.cStride, outRow / 2);
+        strip.out.cr = offsetPlane(out.cr, out.cStride, outRow / 2);
+        strip.out.yStride = out.yStride;
+        strip.out.cStride = out.cStride;
+        strip.out.chromaStep = out.chromaStep;
+        strip.outWidth = outWidth;
+        strip.outHeight = last ? outHeight - outRow : unitsPerStrip * outUnit;
+        mStrips.push_back(strip);
+    }
+    mPendingStrips = numStrips;
+    mError = 0;
+    mWorkCond.notify_all();
+
+    // Help out instead of idling until the workers are done
+    while (runOneStripLocked(lk)) {}
+    mDoneCond.wait(lk, [this] { return mPendingStrips == 0; });
+
+    if (mError != 0) {
+        ALOGE("%s: failed to scale %ux%u to %ux%u in %u strips: %d", __FUNCTION__,
+                inWidth, inHeight, outWidth, outHeight, numStrips, mError);
+    }
+    return mError;
+}
+
+bool TiledScaler::Worker::threadLoop() {
+    std::unique_lock<std::mutex> lk(mParent->mLock);
+    mParent->mWorkCond.wait(lk, [this] {
+        return mParent->mExiting || !mParent->mStrips.empty();
+    });
+    if (mParent->mExiting) {
+        return false;
+    }
+    mParent->runOneStripLocked(lk);
+    return true;
+}
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
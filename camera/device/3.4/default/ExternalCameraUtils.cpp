@@ -725,6 +725,9 @@ namespace {
     const int kDefaultNumStillBuffer = 2;
     const int kDefaultOrientation = 0; // suitable for natural landscape displays like tablet/TV
                                        // For phone devices 270 is better
+    const int kDefaultDecodePipelineDepth = 2;
+    const int kDefaultScaleWorkerCount = 2;
+    const int kDefaultResultBatchCount = 4;
 } // anonymous namespace
 
 const char* ExternalCameraConfig::kDefaultCfgPath = "/vendor/etc/external_camera_config.xml";
@@ -850,10 +853,36 @@ ExternalCameraConfig ExternalCameraConfig::loadFromCfg(const char* cfgPath) {
         ret.orientation = orientation->IntAttribute("degree", /*Default*/kDefaultOrientation);
     }
 
+    XMLElement *decodeDepth = deviceCfg->FirstChildElement("DecodePipelineDepth");
+    if (decodeDepth == nullptr) {
+        ALOGI("%s: no decode pipeline depth specified", __FUNCTION__);
+    } else {
+        ret.decodePipelineDepth =
+                decodeDepth->UnsignedAttribute("count", /*Default*/kDefaultDecodePipelineDepth);
+    }
+
+    XMLElement *scaleWorkers = deviceCfg->FirstChildElement("ScaleWorkers");
+    if (scaleWorkers == nullptr) {
+        ALOGI("%s: no scale worker count specified", __FUNCTION__);
+    } else {
+        ret.scaleWorkerCount =
+                scaleWorkers->UnsignedAttribute("count", /*Default*/kDefaultScaleWorkerCount);
+    }
+
+    XMLElement *resultBatch = deviceCfg->FirstChildElement("ResultBatch");
+    if (resultBatch == nullptr) {
+        ALOGI("%s: no result batch count specified", __FUNCTION__);
+    } else {
+        ret.resultBatchCount =
+                resultBatch->UnsignedAttribute("count", /*Default*/kDefaultResultBatchCount);
+    }
+
     ALOGI("%s: external camera cfg loaded: maxJpgBufSize %d,"
-            " num video buffers %d, num still buffers %d, orientation %d",
+            " num video buffers %d, num still buffers %d, orientation %d,"
+            " decode pipeline depth %d, scale workers %d, result batch %d",
             __FUNCTION__, ret.maxJpegBufSize,
-            ret.numVideoBuffers, ret.numStillBuffers, ret.orientation);
+            ret.numVideoBuffers, ret.numStillBuffers, ret.orientation,
+            ret.decodePipelineDepth, ret.scaleWorkerCount, ret.resultBatchCount);
     for (const auto& limit : ret.fpsLimits) {
         ALOGI("%s: fpsLimitList: %dx%d@%f", __FUNCTION__,
                 limit.size.width, limit.size.height, limit.fpsUpperBound);
@@ -901,7 +930,10 @@ ExternalCameraConfig::ExternalCameraConfig() :
         numVideoBuffers(kDefaultNumVideoBuffer),
         numStillBuffers(kDefaultNumStillBuffer),
         depthEnabled(false),
-        orientation(kDefaultOrientation) {
+        orientation(kDefaultOrientation),
+        decodePipelineDepth(kDefaultDecodePipelineDepth),
+        scaleWorkerCount(kDefaultScaleWorkerCount),
+        resultBatchCount(kDefaultResultBatchCount) {
     fpsLimits.push_back({/*Size*/{ 640,  480}, /*FPS upper bound*/30.0});
     fpsLimits.push_back({/*Size*/{1280,  720}, /*FPS upper bound*/7.5});
     fpsLimits.push_back({/*Size*/{1920, 1080}, /*FPS upper bound*/5.0});
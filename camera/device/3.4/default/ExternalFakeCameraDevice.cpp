@@ -989,7 +989,11 @@ void ExternalFakeCameraDevice::updateFpsBounds(
 }
 
 void ExternalFakeCameraDevice::initSupportedFormatsLocked(int fd) {
-    const SupportedV4L2Format::FrameRate fps[] = {{1,30},
+    // Frames are paced by FakeFrameSource, so the rates above 30 are only
+    // bounded by how fast the pipeline keeps up
+    const SupportedV4L2Format::FrameRate fps[] = {{1,120},
+        {1,60},
+        {1,30},
         {1,25},
         {1,20},
         {1,15},
@@ -998,21 +1002,21 @@ void ExternalFakeCameraDevice::initSupportedFormatsLocked(int fd) {
     SupportedV4L2Format format_1080p {
                             .width = 1920,
                             .height = 1080,
-                            .fourcc = kDefaultFourCc
+                            .fourcc = FakeFrameSource::findReplayFourcc(1920, 1080, kDefaultFourCc)
                         };
     for (SupportedV4L2Format::FrameRate fps : fps)
         format_1080p.frameRates.push_back(fps);
     SupportedV4L2Format format_720p {
                             .width = 1280,
                             .height = 720,
-                            .fourcc = kDefaultFourCc
+                            .fourcc = FakeFrameSource::findReplayFourcc(1280, 720, kDefaultFourCc)
                         };
     for (SupportedV4L2Format::FrameRate fps : fps)
         format_720p.frameRates.push_back(fps);
     SupportedV4L2Format format_480p {
                             .width = 640,
                             .height = 480,
-                            .fourcc = kDefaultFourCc
+                            .fourcc = FakeFrameSource::findReplayFourcc(640, 480, kDefaultFourCc)
                         };
     for (SupportedV4L2Format::FrameRate fps : fps)
         format_480p.frameRates.push_back(fps);
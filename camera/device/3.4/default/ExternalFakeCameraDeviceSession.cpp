@@ -32,6 +32,7 @@
 #include <libyuv.h>
 
 #include <jpeglib.h>
+#include "ExternalCameraConvert.h"
 #include "RgaCropScale.h"
 #ifndef RK_GRALLOC_4
 #include "ExternalCameraGralloc.h"
@@ -321,6 +322,12 @@ void ExternalFakeCameraDeviceSession::dumpState(const native_handle_t* handle) {
         }
         dprintf(fd, "V4L2 buffer queue size %zu, dequeued %zu\n",
                 v4L2BufferCount, numDequeuedV4l2Buffers);
+
+        bool sessionLocked = tryLock(mLock);
+        if (sessionLocked) {
+            mFrameSource.dump(fd);
+            mLock.unlock();
+        }
     }
 
     dprintf(fd, "In-flight frames (not sorted):");
@@ -328,6 +335,9 @@ void ExternalFakeCameraDeviceSession::dumpState(const native_handle_t* handle) {
         dprintf(fd, "%d, ", frameNumber);
     }
     dprintf(fd, "\n");
+    if (mFormatConvertThread->mCamMemManager != nullptr) {
+        mFormatConvertThread->mCamMemManager->dump(fd);
+    }
     mOutputThread->dump(fd);
     dprintf(fd, "\n");
 
@@ -924,6 +934,42 @@ Status ExternalFakeCameraDeviceSession::processCaptureResult(std::shared_ptr<Hal
     return Status::OK;
 }
 
+Status ExternalFakeCameraDeviceSession::processCaptureBufferResult(
+        uint32_t frameNumber, HalStreamBuffer& halBuf, bool success) {
+    ATRACE_CALL();
+    if (!success) {
+        notifyError(frameNumber, halBuf.streamId, ErrorCode::ERROR_BUFFER);
+    }
+
+    // Buffer only result, metadata was sent with the rest of the request
+    hidl_vec<CaptureResult> results;
+    results.resize(1);
+    CaptureResult& result = results[0];
+    result.frameNumber = frameNumber;
+    result.partialResult = 0;
+    result.inputBuffer.streamId = -1;
+    result.outputBuffers.resize(1);
+    result.outputBuffers[0].streamId = halBuf.streamId;
+    result.outputBuffers[0].bufferId = halBuf.bufferId;
+    result.outputBuffers[0].status = success ? BufferStatus::OK : BufferStatus::ERROR;
+    if (halBuf.acquireFence >= 0) {
+        native_handle_t* handle = native_handle_create(/*numFds*/1, /*numInts*/0);
+        handle->data[0] = halBuf.acquireFence;
+        result.outputBuffers[0].releaseFence.setTo(handle, /*shouldOwn*/false);
+    }
+
+    // update inflight records
+    {
+        std::lock_guard<std::mutex> lk(mInflightFramesLock);
+        mInflightFrames.erase(frameNumber);
+    }
+
+    // Callback into framework
+    invokeProcessCaptureResultCallback(results, /* tryWriteFmq */false);
+    freeReleaseFences(results);
+    return Status::OK;
+}
+
 void ExternalFakeCameraDeviceSession::invokeProcessCaptureResultCallback(
         hidl_vec<CaptureResult> &results, bool tryWriteFmq) {
     if (mProcessCaptureResultLock.tryLock() != OK) {
@@ -1028,60 +1074,17 @@ int ExternalFakeCameraDeviceSession::FormatConvertThread::jpegDecoder(
 void ExternalFakeCameraDeviceSession::FormatConvertThread:: yuyvToNv12(
             int v4l2_fmt_dst, char *srcbuf, char *dstbuf,
             int src_w, int src_h,int dst_w, int dst_h) {
-    int *dstint_y, *dstint_uv, *srcint, y_size, i;
-
-    y_size = src_w * src_h;
-    if (v4l2_fmt_dst == V4L2_PIX_FMT_NV12) {
-        if ((src_w == dst_w) && (src_h == dst_h)) {
-            dstint_y = (int*)dstbuf;
-            srcint = (int*)srcbuf;
-            dstint_uv =  (int*)(dstbuf + y_size);
-#if defined(__arm64__) || defined(__aarch64__)
-            for (i = 0; i < src_h; i++) {
-                for (int j = 0; j < (src_w >> 2); j++) {
-                    if (i % 2 == 0) {
-                        *dstint_uv++ = (*(srcint+1) & 0xff000000) |
-                                    ((*(srcint+1) & 0x0000ff00) << 8) |
-                                    ((*srcint & 0xff000000) >> 16) |
-                                    ((*srcint & 0x0000ff00) >> 8);
-                    }
-                    *dstint_y++ = ((*(srcint+1) & 0x00ff0000) << 8) |
-                                    ((*(srcint+1) & 0x000000ff) << 16) |
-                                    ((*srcint & 0x00ff0000) >> 8) |
-                                    (*srcint & 0x000000ff);
-                    srcint += 2;
-                }
-            }
-#else
-            for (i = 0; i < src_h; i++) {
-                int n = src_w;
-                char tmp = i % 2; // get uv only when in even row
-                asm volatile (
-                    "   pld [%[src], %[src_stride], lsl #2]                 \n\t"
-                    "   cmp %[n], #16                                       \n\t"
-                    "   blt 5f                                              \n\t"
-                    "0: @ 16 pixel swap                                     \n\t"
-                    "   vld2.8  {q0,q1} , [%[src]]!  @ q0 = y q1 = uv       \n\t"
-                    "   vst1.16 {q0},[%[dst_y]]!     @ now q0  -> dst       \n\t"
-                    "   cmp %[tmp], #1                                      \n\t"
-                    "   bge 1f                                              \n\t"
-                    "   vst1.16 {q1},[%[dst_uv]]!    @ now q1  -> dst       \n\t"
-                    "1: @ don't need get uv in odd row                      \n\t"
-                    "   sub %[n], %[n], #16                                 \n\t"
-                    "   cmp %[n], #16                                       \n\t"
-                    "   bge 0b                                              \n\t"
-                    "5: @ end                                               \n\t"
-                    : [dst_y] "+r" (dstint_y), [dst_uv] "+r" (dstint_uv),
-                      [src] "+r" (srcint), [n] "+r" (n),[tmp] "+r" (tmp)
-                    : [src_stride] "r" (src_w)
-                    : "cc", "memory", "q0", "q1", "q2"
-                );
-            }
-#endif
-        }
-    } else {
+    if (v4l2_fmt_dst != V4L2_PIX_FMT_NV12) {
         LOGE("don't support this format !");
+        return;
     }
+    if ((src_w != dst_w) || (src_h != dst_h)) {
+        LOGE("don't support scaling %dx%d to %dx%d", src_w, src_h, dst_w, dst_h);
+        return;
+    }
+    uint8_t* dst = reinterpret_cast<uint8_t*>(dstbuf);
+    convertYuyvToNv12(reinterpret_cast<uint8_t*>(srcbuf), src_w * 2,
+            dst, dst_w, dst + dst_w * dst_h, dst_w, dst_w, dst_h);
 }
 
 bool ExternalFakeCameraDeviceSession::FormatConvertThread::threadLoop() {
@@ -2090,11 +2093,13 @@ bool ExternalFakeCameraDeviceSession::OutputThread::threadLoop() {
                     ALOGV("%s(%d): halBuf handle_fd(%d)", __FUNCTION__, __LINE__, handle_fd);
                     ALOGV("%s(%d) halbuf_wxh(%dx%d) frameNumber(%d)", __FUNCTION__, __LINE__,
                         halBuf.width, halBuf.height, req->frameNumber);
+                    // inData points into the replay file mapping, which only
+                    // holds frames of the real size, never the 16-aligned one
                     unsigned long vir_addr =  reinterpret_cast<unsigned long>(req->inData);
                     camera2::RgaCropScale::rga_nv12_scale_crop(
-                        tempFrameWidth, tempFrameHeight, vir_addr, handle_fd,
+                        req->yuvframeIn->mWidth, req->yuvframeIn->mHeight, vir_addr, handle_fd,
                         halBuf.width, halBuf.height, 100, false, true,
-                        (halBuf.format == PixelFormat::YCRCB_420_SP), is16Align,
+                        (halBuf.format == PixelFormat::YCRCB_420_SP), true,
                         true);
                 }else {
 
@@ -2573,6 +2578,7 @@ int ExternalFakeCameraDeviceSession::v4l2StreamOffLocked() {
         return -errno;
     }*/
 
+    mFrameSource.close();
     mV4l2Streaming = false;
     return OK;
 }
@@ -2617,6 +2623,7 @@ int ExternalFakeCameraDeviceSession::setV4l2FpsLocked(double fps) {
         ALOGE("%s: expect fps %f, got %f instead", __FUNCTION__, fps, retFps);
         return -1;
     }*/
+    mFrameSource.setFrameRate(fps);
     mV4l2StreamingFps = fps;
     return 0;
 }
@@ -2639,6 +2646,14 @@ int ExternalFakeCameraDeviceSession::configureV4l2StreamLocked(
 
     mMaxV4L2BufferSize = v4l2Fmt.width * v4l2Fmt.height * 1.5;
 
+    std::string replayPath = FakeFrameSource::getReplayPath(
+            v4l2Fmt.fourcc, v4l2Fmt.width, v4l2Fmt.height);
+    ret = mFrameSource.open(replayPath, v4l2Fmt.fourcc, v4l2Fmt.width, v4l2Fmt.height);
+    if (ret != 0) {
+        ALOGE("%s: cannot replay frames from %s: ret %d", __FUNCTION__, replayPath.c_str(), ret);
+        return ret;
+    }
+
     const double kDefaultFps = 30.0;
     double fps = 1000.0;
     if (requestFps != 0.0) {
@@ -2700,7 +2715,7 @@ sp<YuvFrame> ExternalFakeCameraDeviceSession::dequeueV4l2FrameLocked(/*out*/nsec
     }
 
     ATRACE_BEGIN("VIDIOC_DQBUF");
-    int index = mFormatConvertThread->mCamMemManager->getIdleBufferIndex(PREVIEWBUFFER);
+    int index = mFormatConvertThread->mCamMemManager->acquireBuffer(PREVIEWBUFFER);
     ATRACE_END();
 
     if (index < 0) {
@@ -2708,44 +2723,18 @@ sp<YuvFrame> ExternalFakeCameraDeviceSession::dequeueV4l2FrameLocked(/*out*/nsec
         return ret;
     }
 
-    unsigned long viraddr = mFormatConvertThread->mCamMemManager->getBufferAddr(
-            PREVIEWBUFFER, index, buffer_addr_vir);
-
+    // The preview buffer only receives decoded MJPEG frames, YUYV and NV12
+    // frames are read straight out of the replay file mapping
+    const uint8_t* data = nullptr;
     size_t size = 0;
-    if (mV4l2StreamingFmt.fourcc == V4L2_PIX_FMT_MJPEG) {
-        FILE* fp =NULL;
-        char filename[128];
-        filename[0] = 0x00;
-        sprintf(filename, "/data/camera/camera_%dx%d.jpg",
-            mV4l2StreamingFmt.width, mV4l2StreamingFmt.height);
-        fp = fopen(filename, "r+");
-        if (fp != NULL) {
-            size = fread((char*)viraddr,1,mV4l2StreamingFmt.width*mV4l2StreamingFmt.height*1.5,fp);
-            fclose(fp);
-            ALOGD("read success jpeg data to %s size:%d",filename, size);
-        } else {
-            ALOGE("Create %s failed(%d, %s)",filename,fp, strerror(errno));
-        }
-    } else if (mV4l2StreamingFmt.fourcc == V4L2_PIX_FMT_NV12) {
-        FILE* fp =NULL;
-        char filename[128];
-        filename[0] = 0x00;
-        sprintf(filename, "/data/camera/camera_%dx%d.yuv",
-            mV4l2StreamingFmt.width, mV4l2StreamingFmt.height);
-        fp = fopen(filename, "r+");
-        if (fp != NULL) {
-            size = fread((char*)viraddr,1,mV4l2StreamingFmt.width*mV4l2StreamingFmt.height*1.5,fp);
-            fclose(fp);
-            ALOGV("read success NV12 data to %s size:%d",filename, size);
-        } else {
-            ALOGE("Create %s failed(%d, %s)",filename,fp, strerror(errno));
-        }
+    ATRACE_BEGIN("FakeFrameSource::nextFrame");
+    int srcRet = mFrameSource.nextFrame(&data, &size, shutterTs);
+    ATRACE_END();
+    if (srcRet != 0) {
+        ALOGE("%s: no frame from fake frame source: %d", __FUNCTION__, srcRet);
+        mFormatConvertThread->mCamMemManager->releaseBuffer(PREVIEWBUFFER, index);
+        return ret;
     }
-    
-    mFormatConvertThread->mCamMemManager->setBufferStatus(
-            PREVIEWBUFFER, index, 1);
-
-    *shutterTs = systemTime(SYSTEM_TIME_MONOTONIC);
 
     {
         std::lock_guard<std::mutex> lk(mV4l2BufferLock);
@@ -2754,14 +2743,14 @@ sp<YuvFrame> ExternalFakeCameraDeviceSession::dequeueV4l2FrameLocked(/*out*/nsec
 
     return new YuvFrame(
             mV4l2StreamingFmt.width, mV4l2StreamingFmt.height, mV4l2StreamingFmt.fourcc,
-            index, (uint8_t*) viraddr, size);
+            index, const_cast<uint8_t*>(data), size);
 
 }
 
 void ExternalFakeCameraDeviceSession::enqueueV4l2Frame(const sp<YuvFrame>& frame) {
     ATRACE_CALL();
-    mFormatConvertThread->mCamMemManager->setBufferStatus(
-            PREVIEWBUFFER, frame->mBufferIndex, 0);
+    mFormatConvertThread->mCamMemManager->releaseBuffer(
+            PREVIEWBUFFER, frame->mBufferIndex);
 
     ATRACE_END();
 
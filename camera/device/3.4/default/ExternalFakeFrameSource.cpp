@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "ExtFakeFrameSrc@3.4"
+//#define LOG_NDEBUG 0
+#include <log/log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include "android-base/unique_fd.h"
+#include "ExternalFakeFrameSource.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+namespace {
+
+const char* kReplayDir = "/data/camera";
+
+bool isSoi(const uint8_t* p, const uint8_t* end) {
+    return end - p >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF;
+}
+
+} // anonymous namespace
+
+FakeFrameSource::~FakeFrameSource() {
+    close();
+}
+
+std::string FakeFrameSource::getReplayPath(uint32_t fourcc, uint32_t width, uint32_t height) {
+    const char* ext = nullptr;
+    switch (fourcc) {
+        case V4L2_PIX_FMT_MJPEG: ext = "jpg"; break;
+        case V4L2_PIX_FMT_YUYV: ext = "yuyv"; break;
+        case V4L2_PIX_FMT_NV12: ext = "yuv"; break;
+        default: return "";
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "%s/camera_%ux%u.%s", kReplayDir, width, height, ext);
+    return path;
+}
+
+uint32_t FakeFrameSource::findReplayFourcc(
+        uint32_t width, uint32_t height, uint32_t defaultFourcc) {
+    for (uint32_t fourcc : {V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV}) {
+        if (access(getReplayPath(fourcc, width, height).c_str(), R_OK) == 0) {
+            return fourcc;
+        }
+    }
+    return defaultFourcc;
+}
+
+int FakeFrameSource::open(
+        const std::string& path, uint32_t fourcc, uint32_t width, uint32_t height) {
+    close();
+
+    base::unique_fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0) {
+        ALOGE("%s: open %s failed: %s", __FUNCTION__, path.c_str(), strerror(errno));
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0 || st.st_size <= 0) {
+        ALOGE("%s: %s is empty or cannot be read", __FUNCTION__, path.c_str());
+        return -EINVAL;
+    }
+
+    // RGA reads NV12 frames with the height aligned to 16, so reserve zeroed
+    // pages behind the file for the rows it reads past the last frame
+    size_t padding = 0;
+    if (fourcc == V4L2_PIX_FMT_NV12) {
+        size_t alignedHeight = (height + 15) & ~15u;
+        padding = static_cast<size_t>(width) * (alignedHeight - height) * 3 / 2;
+    }
+    size_t mapSize = st.st_size + padding;
+    void* data = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        ALOGE("%s: reserving %zu bytes for %s failed: %s", __FUNCTION__, mapSize,
+                path.c_str(), strerror(errno));
+        return -errno;
+    }
+    // Populate up front so the first laps are not paced by page faults
+    if (mmap(data, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE,
+            fd.get(), 0) == MAP_FAILED) {
+        int err = errno;
+        ALOGE("%s: mmap %s failed: %s", __FUNCTION__, path.c_str(), strerror(err));
+        munmap(data, mapSize);
+        return -err;
+    }
+    mData = static_cast<uint8_t*>(data);
+    mDataSize = st.st_size;
+    mMapSize = mapSize;
+    mPath = path;
+    mFourcc = fourcc;
+
+    int ret = -EINVAL;
+    switch (fourcc) {
+        case V4L2_PIX_FMT_MJPEG:
+            ret = indexJpegFrames();
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            ret = indexRawFrames(static_cast<size_t>(width) * height * 2);
+            break;
+        case V4L2_PIX_FMT_NV12:
+            ret = indexRawFrames(static_cast<size_t>(width) * height * 3 / 2);
+            break;
+        default:
+            ALOGE("%s: unsupported format %c%c%c%c", __FUNCTION__,
+                    fourcc & 0xFF, (fourcc >> 8) & 0xFF,
+                    (fourcc >> 16) & 0xFF, (fourcc >> 24) & 0xFF);
+            break;
+    }
+    if (ret != 0) {
+        close();
+        return ret;
+    }
+
+    ALOGI("%s: replaying %zu frames from %s", __FUNCTION__, mFrames.size(), path.c_str());
+    return 0;
+}
+
+void FakeFrameSource::close() {
+    if (mData != nullptr) {
+        munmap(mData, mMapSize);
+        mData = nullptr;
+    }
+    mDataSize = 0;
+    mMapSize = 0;
+    mFrames.clear();
+    mNextFrame = 0;
+    mNextFrameTime = 0;
+}
+
+int FakeFrameSource::indexJpegFrames() {
+    const uint8_t* begin = mData;
+    const uint8_t* end = mData + mDataSize;
+    const uint8_t* frameStart = begin;
+    if (!isSoi(frameStart, end)) {
+        ALOGE("%s: %s does not start with a JPEG SOI marker", __FUNCTION__, mPath.c_str());
+        return -EINVAL;
+    }
+
+    // A frame ends at the EOI that is followed by the next SOI or by the end of
+    // the file. EOIs of embedded EXIF thumbnails are followed by more segments
+    for (const uint8_t* p = frameStart + 2; p + 1 < end; p++) {
+        if (p[0] != 0xFF || p[1] != 0xD9) {
+            continue;
+        }
+        const uint8_t* next = p + 2;
+        if (next == end || isSoi(next, end)) {
+            mFrames.push_back({static_cast<size_t>(frameStart - begin),
+                               static_cast<size_t>(next - frameStart)});
+            frameStart = next;
+            p = next + 1;
+        }
+    }
+    if (frameStart != end) {
+        ALOGW("%s: ignoring %zu trailing bytes of %s", __FUNCTION__,
+                static_cast<size_t>(end - frameStart), mPath.c_str());
+    }
+    if (mFrames.empty()) {
+        ALOGE("%s: no complete JPEG frame in %s", __FUNCTION__, mPath.c_str());
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int FakeFrameSource::indexRawFrames(size_t frameSize) {
+    size_t numFrames = mDataSize / frameSize;
+    if (numFrames == 0) {
+        ALOGE("%s: %s is smaller than one %zu byte frame",
+                __FUNCTION__, mPath.c_str(), frameSize);
+        return -EINVAL;
+    }
+    if (mDataSize % frameSize) {
+        ALOGW("%s: ignoring %zu trailing bytes of %s", __FUNCTION__,
+                mDataSize % frameSize, mPath.c_str());
+    }
+    for (size_t i = 0; i < numFrames; i++) {
+        mFrames.push_back({i * frameSize, frameSize});
+    }
+    return 0;
+}
+
+void FakeFrameSource::setFrameRate(double fps) {
+    mFrameInterval = (fps > 0.0) ? static_cast<nsecs_t>(1e9 / fps) : 0;
+    mNextFrameTime = 0;
+}
+
+int FakeFrameSource::nextFrame(const uint8_t** data, size_t* size, nsecs_t* timestamp) {
+    if (data == nullptr || size == nullptr || timestamp == nullptr) {
+        ALOGE("%s: output arguments must not be null", __FUNCTION__);
+        return -EINVAL;
+    }
+    if (mData == nullptr) {
+        ALOGE("%s: no replay file open", __FUNCTION__);
+        return -ENODEV;
+    }
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (mFrameInterval > 0) {
+        if (mNextFrameTime == 0 || now - mNextFrameTime >= mFrameInterval) {
+            // Like a sensor, frames nobody asked for in time are dropped rather
+            // than delivered in a burst
+            if (mNextFrameTime != 0) {
+                mLateFrames++;
+            }
+            mNextFrameTime = now;
+        }
+        struct timespec ts = {
+            .tv_sec = static_cast<time_t>(mNextFrameTime / 1000000000LL),
+            .tv_nsec = static_cast<long>(mNextFrameTime % 1000000000LL),
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+        *timestamp = mNextFrameTime;
+        mNextFrameTime += mFrameInterval;
+    } else {
+        *timestamp = now;
+    }
+
+    const FrameSpan& frame = mFrames[mNextFrame];
+    mNextFrame = (mNextFrame + 1) % mFrames.size();
+    *data = mData + frame.offset;
+    *size = frame.size;
+    mFramesDelivered++;
+    return 0;
+}
+
+void FakeFrameSource::dump(int fd) const {
+    if (mData == nullptr) {
+        dprintf(fd, "Fake frame source: no replay file open\n");
+        return;
+    }
+    dprintf(fd, "Fake frame source: %s, %zu frames, %.2f fps, "
+            "%" PRIu64 " frames delivered, %" PRIu64 " late\n",
+            mPath.c_str(), mFrames.size(),
+            (mFrameInterval > 0) ? 1e9 / mFrameInterval : 0.0,
+            mFramesDelivered, mLateFrames);
+}
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
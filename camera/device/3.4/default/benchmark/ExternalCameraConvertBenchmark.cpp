@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ExtCamConvertBenchmark"
+
+#include <stdint.h>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <libyuv.h>
+
+#include "ExternalCameraConvert.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+namespace {
+
+// A 16:9 frame for each of 720p/1080p/4K
+void FrameSizes(benchmark::internal::Benchmark* b) {
+    b->Args({1280, 720});
+    b->Args({1920, 1080});
+    b->Args({3840, 2160});
+}
+
+std::vector<uint8_t> makeFrame(size_t size) {
+    std::vector<uint8_t> frame(size);
+    for (size_t i = 0; i < size; i++) {
+        frame[i] = static_cast<uint8_t>(i * 7);
+    }
+    return frame;
+}
+
+struct Nv12Frame {
+    Nv12Frame(int w, int h) : width(w), height(h), data(makeFrame(w * h * 3 / 2)) {}
+    const uint8_t* y() const { return data.data(); }
+    const uint8_t* uv() const { return data.data() + width * height; }
+    int width;
+    int height;
+    std::vector<uint8_t> data;
+};
+
+struct I420Frame {
+    I420Frame(int w, int h) : width(w), height(h), data(w * h * 3 / 2) {}
+    uint8_t* y() { return data.data(); }
+    uint8_t* u() { return data.data() + width * height; }
+    uint8_t* v() { return u() + width * height / 4; }
+    int width;
+    int height;
+    std::vector<uint8_t> data;
+};
+
+void setBytes(benchmark::State& state, int width, int height) {
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * width * height * 3 / 2);
+}
+
+void BM_YuyvToNv12_libyuv(benchmark::State& state) {
+    int w = state.range(0), h = state.range(1);
+    std::vector<uint8_t> src = makeFrame(w * h * 2);
+    std::vector<uint8_t> dst(w * h * 3 / 2);
+    for (auto _ : state) {
+        libyuv::YUY2ToNV12(src.data(), w * 2, dst.data(), w, dst.data() + w * h, w, w, h);
+        benchmark::DoNotOptimize(dst.data());
+    }
+    setBytes(state, w, h);
+}
+BENCHMARK(BM_YuyvToNv12_libyuv)->Apply(FrameSizes);
+
+void BM_YuyvToNv12(benchmark::State& state) {
+    int w = state.range(0), h = state.range(1);
+    std::vector<uint8_t> src = makeFrame(w * h * 2);
+    std::vector<uint8_t> dst(w * h * 3 / 2);
+    for (auto _ : state) {
+        convertYuyvToNv12(src.data(), w * 2, dst.data(), w, dst.data() + w * h, w, w, h);
+        benchmark::DoNotOptimize(dst.data());
+    }
+    setBytes(state, w, h);
+    state.SetLabel(getConvertKernelName());
+}
+BENCHMARK(BM_YuyvToNv12)->Apply(FrameSizes);
+
+void BM_Nv12ToI420_libyuv(benchmark::State& state) {
+    Nv12Frame src(state.range(0), state.range(1));
+    I420Frame dst(src.width, src.height);
+    for (auto _ : state) {
+        libyuv::NV12ToI420(src.y(), src.width, src.uv(), src.width,
+                dst.y(), dst.width, dst.u(), dst.width / 2, dst.v(), dst.width / 2,
+                dst.width, dst.height);
+        benchmark::DoNotOptimize(dst.data.data());
+    }
+    setBytes(state, src.width, src.height);
+}
+BENCHMARK(BM_Nv12ToI420_libyuv)->Apply(FrameSizes);
+
+void BM_Nv12ToI420(benchmark::State& state) {
+    Nv12Frame src(state.range(0), state.range(1));
+    I420Frame dst(src.width, src.height);
+    for (auto _ : state) {
+        convertNv12ToI420(src.y(), src.width, src.uv(), src.width,
+                dst.y(), dst.width, dst.u(), dst.width / 2, dst.v(), dst.width / 2,
+                dst.width, dst.height);
+        benchmark::DoNotOptimize(dst.data.data());
+    }
+    setBytes(state, src.width, src.height);
+    state.SetLabel(getConvertKernelName());
+}
+BENCHMARK(BM_Nv12ToI420)->Apply(FrameSizes);
+
+// 4:3 YV12 output horizontally cropped out of the 16:9 input. The libyuv path
+// is what OutputThread did before: NV12 to a full size YU12 intermediate, then
+// copy the cropped region into the YV12 buffer.
+void BM_Nv12ToYv12Cropped_libyuv(benchmark::State& state) {
+    Nv12Frame src(state.range(0), state.range(1));
+    I420Frame yu12(src.width, src.height);
+    int cropW = (src.height * 4 / 3) & ~1;
+    int left = ((src.width - cropW) / 2) & ~1;
+    I420Frame dst(cropW, src.height);
+    for (auto _ : state) {
+        libyuv::NV12ToI420(src.y(), src.width, src.uv(), src.width,
+                yu12.y(), yu12.width, yu12.u(), yu12.width / 2, yu12.v(), yu12.width / 2,
+                yu12.width, yu12.height);
+        libyuv::I420Copy(yu12.y() + left, yu12.width,
+                yu12.u() + left / 2, yu12.width / 2,
+                yu12.v() + left / 2, yu12.width / 2,
+                dst.y(), dst.width, dst.v(), dst.width / 2, dst.u(), dst.width / 2,
+                dst.width, dst.height);
+        benchmark::DoNotOptimize(dst.data.data());
+    }
+    setBytes(state, dst.width, dst.height);
+}
+BENCHMARK(BM_Nv12ToYv12Cropped_libyuv)->Apply(FrameSizes);
+
+void BM_Nv12ToYv12Cropped(benchmark::State& state) {
+    Nv12Frame src(state.range(0), state.range(1));
+    int cropW = (src.height * 4 / 3) & ~1;
+    int left = ((src.width - cropW) / 2) & ~1;
+    I420Frame dst(cropW, src.height);
+    for (auto _ : state) {
+        convertNv12ToYv12Cropped(src.y(), src.width, src.uv(), src.width,
+                left, 0, dst.width, dst.height,
+                dst.y(), dst.width, dst.v(), dst.width / 2, dst.u(), dst.width / 2);
+        benchmark::DoNotOptimize(dst.data.data());
+    }
+    setBytes(state, dst.width, dst.height);
+    state.SetLabel(getConvertKernelName());
+}
+BENCHMARK(BM_Nv12ToYv12Cropped)->Apply(FrameSizes);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ExtFakeCamBenchmark"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <log/log.h>
+#include <ui/GraphicBuffer.h>
+
+#include "ExternalFakeCameraDevice_3_4.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+namespace {
+
+using ::android::hardware::camera::device::V3_2::BufferUsageFlags;
+using ::android::hardware::camera::device::V3_2::StreamBuffer;
+
+const uint32_t kStreamWidth = 1280;
+const uint32_t kStreamHeight = 720;
+const int kRunSeconds = 5;
+const int kResultTimeoutSec = 3;
+
+// Records the time from processCaptureRequest to the buffer coming back, and
+// recycles returned buffers for the next requests.
+struct BenchmarkCallback : public V3_2::ICameraDeviceCallback {
+    Return<void> processCaptureResult(const hidl_vec<CaptureResult>& results) override {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        std::lock_guard<std::mutex> lk(mLock);
+        for (const auto& result : results) {
+            for (const auto& buffer : result.outputBuffers) {
+                auto it = mSubmitTimes.find(result.frameNumber);
+                if (it != mSubmitTimes.end()) {
+                    mLatencies.push_back(now - it->second);
+                    mSubmitTimes.erase(it);
+                }
+                if (buffer.status != BufferStatus::OK) {
+                    mErrors++;
+                }
+                mFreeBufferIds.push_back(buffer.bufferId);
+            }
+        }
+        mCond.notify_all();
+        return Void();
+    }
+
+    Return<void> notify(const hidl_vec<NotifyMsg>& msgs) override {
+        std::lock_guard<std::mutex> lk(mLock);
+        for (const auto& msg : msgs) {
+            if (msg.type == MsgType::ERROR) {
+                mErrors++;
+            }
+        }
+        return Void();
+    }
+
+    // Block until a buffer is free, 0 on timeout
+    uint64_t acquireBuffer(uint32_t frameNumber) {
+        std::unique_lock<std::mutex> lk(mLock);
+        bool ready = mCond.wait_for(lk, std::chrono::seconds(kResultTimeoutSec),
+                [this] { return !mFreeBufferIds.empty(); });
+        if (!ready) {
+            return 0;
+        }
+        uint64_t bufferId = mFreeBufferIds.front();
+        mFreeBufferIds.pop_front();
+        mSubmitTimes[frameNumber] = systemTime(SYSTEM_TIME_MONOTONIC);
+        return bufferId;
+    }
+
+    bool waitForAllResults() {
+        std::unique_lock<std::mutex> lk(mLock);
+        return mCond.wait_for(lk, std::chrono::seconds(kResultTimeoutSec),
+                [this] { return mSubmitTimes.empty(); });
+    }
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<uint64_t> mFreeBufferIds;
+    std::unordered_map<uint32_t, nsecs_t> mSubmitTimes;
+    std::vector<nsecs_t> mLatencies;
+    uint32_t mErrors = 0;
+};
+
+double percentileMs(std::vector<nsecs_t>& sorted, double percentile) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t idx = std::min(sorted.size() - 1,
+            static_cast<size_t>(sorted.size() * percentile / 100.0));
+    return sorted[idx] / 1e6;
+}
+
+// Streams one 720p YUV output off the fake camera at the frame rate given as
+// the argument, keeping as many requests in flight as the HAL has buffers.
+void BM_FakeCameraStream(benchmark::State& state) {
+    const int32_t fps = state.range(0);
+    static ExternalCameraConfig cfg = ExternalCameraConfig::loadFromCfg();
+    sp<ExternalFakeCameraDevice> device = new ExternalFakeCameraDevice("/dev/video0", cfg);
+    sp<BenchmarkCallback> callback = new BenchmarkCallback();
+
+    sp<ICameraDeviceSession> session;
+    device->getInterface()->open(callback,
+            [&](Status s, const sp<V3_2::ICameraDeviceSession>& newSession) {
+                if (s == Status::OK) {
+                    session = ICameraDeviceSession::castFrom(newSession);
+                }
+            });
+    if (session == nullptr) {
+        state.SkipWithError("cannot open the fake camera");
+        return;
+    }
+
+    V3_2::CameraMetadata defaultSettings;
+    session->constructDefaultRequestSettings(RequestTemplate::PREVIEW,
+            [&](Status s, const V3_2::CameraMetadata& settings) {
+                if (s == Status::OK) {
+                    defaultSettings = settings;
+                }
+            });
+    camera_metadata_t* rawSettings = clone_camera_metadata(
+            reinterpret_cast<const camera_metadata_t*>(defaultSettings.data()));
+    common::V1_0::helper::CameraMetadata requestSettings(rawSettings);
+    int32_t fpsRange[] = {fps / 2, fps};
+    requestSettings.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, fpsRange, 2);
+
+    V3_4::Stream stream;
+    stream.v3_2 = {/*id*/0, StreamType::OUTPUT, kStreamWidth, kStreamHeight,
+            PixelFormat::YCBCR_420_888,
+            static_cast<BufferUsageFlags>(BufferUsage::CPU_READ_OFTEN), 0, StreamRotation::ROTATION_0};
+    V3_4::StreamConfiguration config;
+    config.streams = {stream};
+    config.operationMode = StreamConfigurationMode::NORMAL_MODE;
+
+    V3_4::HalStream halStream;
+    Status configStatus = Status::INTERNAL_ERROR;
+    session->configureStreams_3_4(config,
+            [&](Status s, const HalStreamConfiguration& halConfig) {
+                configStatus = s;
+                if (s == Status::OK && halConfig.streams.size() == 1) {
+                    halStream = halConfig.streams[0];
+                }
+            });
+    if (configStatus != Status::OK) {
+        session->close();
+        state.SkipWithError("configureStreams failed");
+        return;
+    }
+
+    const V3_2::HalStream& hal = halStream.v3_3.v3_2;
+    std::vector<sp<GraphicBuffer>> buffers;
+    for (uint32_t i = 0; i < hal.maxBuffers; i++) {
+        sp<GraphicBuffer> gb = new GraphicBuffer(kStreamWidth, kStreamHeight,
+                static_cast<int32_t>(hal.overrideFormat), /*layerCount*/1,
+                hal.producerUsage | hal.consumerUsage, "ExtFakeCamBenchmark");
+        if (gb->initCheck() != OK) {
+            session->close();
+            state.SkipWithError("cannot allocate output buffers");
+            return;
+        }
+        buffers.push_back(gb);
+        // Buffer ids must not be 0
+        callback->mFreeBufferIds.push_back(i + 1);
+    }
+
+    std::vector<bool> registered(buffers.size(), false);
+    uint32_t frameNumber = 0;
+    for (auto _ : state) {
+        uint64_t bufferId = callback->acquireBuffer(frameNumber);
+        if (bufferId == 0) {
+            state.SkipWithError("timed out waiting for a result");
+            break;
+        }
+
+        // The first request carries the settings, a buffer handle is only sent
+        // until the HAL has cached it under its id
+        StreamBuffer outputBuffer = {hal.id, bufferId, nullptr, BufferStatus::OK,
+                nullptr, nullptr};
+        if (!registered[bufferId - 1]) {
+            outputBuffer.buffer = buffers[bufferId - 1]->handle;
+            registered[bufferId - 1] = true;
+        }
+        V3_4::CaptureRequest request;
+        request.v3_2.frameNumber = frameNumber;
+        request.v3_2.fmqSettingsSize = 0;
+        request.v3_2.inputBuffer = {-1, 0, nullptr, BufferStatus::ERROR, nullptr, nullptr};
+        request.v3_2.outputBuffers = {outputBuffer};
+        const camera_metadata_t* raw = nullptr;
+        if (frameNumber == 0) {
+            raw = requestSettings.getAndLock();
+            request.v3_2.settings.setToExternal(
+                    const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(raw)),
+                    get_camera_metadata_size(raw));
+        }
+
+        Status status = Status::INTERNAL_ERROR;
+        session->processCaptureRequest_3_4({request}, {},
+                [&status](Status s, uint32_t) { status = s; });
+        if (raw != nullptr) {
+            requestSettings.unlock(raw);
+        }
+        if (status != Status::OK) {
+            state.SkipWithError("processCaptureRequest failed");
+            break;
+        }
+        frameNumber++;
+    }
+
+    bool drained = callback->waitForAllResults();
+    session->close();
+
+    std::lock_guard<std::mutex> lk(callback->mLock);
+    if (!drained) {
+        ALOGE("%s: %zu requests never completed", __FUNCTION__, callback->mSubmitTimes.size());
+    }
+    std::vector<nsecs_t>& latencies = callback->mLatencies;
+    std::sort(latencies.begin(), latencies.end());
+    state.SetItemsProcessed(latencies.size());
+    state.counters["fps"] = benchmark::Counter(latencies.size(), benchmark::Counter::kIsRate);
+    state.counters["p50_ms"] = percentileMs(latencies, 50);
+    state.counters["p99_ms"] = percentileMs(latencies, 99);
+    state.counters["max_ms"] = latencies.empty() ? 0.0 : latencies.back() / 1e6;
+    state.counters["errors"] = callback->mErrors;
+}
+
+// Each run is long enough for kRunSeconds of frames at its target rate; the
+// frame source paces the requests, so the rate reported falls short of the
+// target when the pipeline cannot keep up.
+BENCHMARK(BM_FakeCameraStream)->Arg(30)->Iterations(30 * kRunSeconds)
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FakeCameraStream)->Arg(60)->Iterations(60 * kRunSeconds)
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FakeCameraStream)->Arg(120)->Iterations(120 * kRunSeconds)
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMCONVERT_H
+#define ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMCONVERT_H
+
+#include <stdint.h>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+// Software YUV conversions used when RGA is not in the path. Every call picks
+// the NEON, SSE2 or plain C row kernels once at first use depending on what
+// the CPU supports. All functions return 0 on success and -1 on bad arguments.
+// Frames must have even width and height.
+
+// YUYV (YUY2) to NV12. Chroma of each row pair is averaged, same as
+// libyuv::YUY2ToNV12.
+int convertYuyvToNv12(const uint8_t* src, int srcStride,
+                      uint8_t* dstY, int dstYStride,
+                      uint8_t* dstUV, int dstUVStride,
+                      int width, int height);
+
+// NV12 to I420 (YU12)
+int convertNv12ToI420(const uint8_t* srcY, int srcYStride,
+                      const uint8_t* srcUV, int srcUVStride,
+                      uint8_t* dstY, int dstYStride,
+                      uint8_t* dstU, int dstUStride,
+                      uint8_t* dstV, int dstVStride,
+                      int width, int height);
+
+// Copy the cropWidth x cropHeight rect at (cropLeft, cropTop) out of an NV12
+// frame into a YV12 frame of the same size, in a single pass. Crop offsets
+// must be even.
+int convertNv12ToYv12Cropped(const uint8_t* srcY, int srcYStride,
+                             const uint8_t* srcUV, int srcUVStride,
+                             int cropLeft, int cropTop, int cropWidth, int cropHeight,
+                             uint8_t* dstY, int dstYStride,
+                             uint8_t* dstV, int dstVStride,
+                             uint8_t* dstU, int dstUStride);
+
+// Name of the row kernels in use ("neon", "sse2" or "c"), for dumps
+const char* getConvertKernelName();
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMCONVERT_H
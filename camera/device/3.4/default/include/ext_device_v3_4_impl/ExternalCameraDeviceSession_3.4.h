@@ -23,6 +23,7 @@
 #include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
 #include <include/convert.h>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <list>
@@ -40,6 +41,7 @@
 #include "rkvpu_dec_api.h"
 #include <utils/Singleton.h>
 #include "ExternalCameraMemManager.h"
+#include "ExternalCameraScaler.h"
 #include <linux/videodev2.h>
 
 namespace android {
@@ -117,6 +119,95 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
     static const uint32_t kMaxBytesPerPixel = 2;
 	void createPreviewBuffer();
 
+    // Encodes BLOB buffers off the OutputThread so a still capture does not hold
+    // up the preview. The thumbnail and EXIF are produced on a helper thread while
+    // the main image is encoded, then spliced in after the JFIF header.
+    class JpegEncodeThread : public android::Thread {
+    public:
+        struct JpegJob {
+            uint32_t frameNumber;
+            HalStreamBuffer halBuf;
+            common::V1_0::helper::CameraMetadata setting;
+            Size jpegSize;
+            sp<AllocatedFrame> mainFrame;  // cropped and scaled copy of the main image
+            Size thumbSize;
+            sp<AllocatedFrame> thumbFrame; // nullptr if no thumbnail is requested
+            int jpegQuality;
+            int thumbQuality;
+            ssize_t maxJpegCodeSize;
+            std::string exifMake;
+            std::string exifModel;
+            nsecs_t submitTs;
+            nsecs_t prepareDuration;       // time spent in the OutputThread
+        };
+
+        JpegEncodeThread(wp<OutputThreadInterface> parent,
+                const common::V1_0::helper::CameraMetadata& chars);
+        ~JpegEncodeThread();
+
+        void submitJob(const std::shared_ptr<JpegJob>&);
+        // Return queued jobs with error and wait for the job being encoded
+        void flush();
+        void dump(int fd);
+        virtual bool threadLoop() override;
+        virtual void requestExit() override;
+
+    private:
+        struct StageStats {
+            uint64_t count = 0;
+            nsecs_t total = 0;
+            nsecs_t max = 0;
+            void add(nsecs_t duration);
+            void dump(int fd, const char* name) const;
+        };
+
+        // Encodes the thumbnail and generates the EXIF APP1 segment for one job
+        class ThumbnailThread : public android::Thread {
+        public:
+            explicit ThumbnailThread(const common::V1_0::helper::CameraMetadata& chars) :
+                    mCameraCharacteristics(chars) {}
+            void start(const std::shared_ptr<JpegJob>&);
+            // Returns non-zero on failure. out is the APP1 payload without marker
+            int waitForApp1(std::vector<uint8_t>* out, nsecs_t* duration);
+            virtual bool threadLoop() override;
+            virtual void requestExit() override;
+        private:
+            int generateApp1(const JpegJob&, std::vector<uint8_t>* out);
+
+            const common::V1_0::helper::CameraMetadata mCameraCharacteristics;
+            std::mutex mLock;                 // Protect everything below
+            std::condition_variable mCond;    // signaled on start, done and exit
+            std::shared_ptr<JpegJob> mJob;
+            bool mDone = false;
+            int mResult = 0;
+            nsecs_t mDuration = 0;
+            std::vector<uint8_t> mApp1;
+        };
+
+        int encodeJob(const std::shared_ptr<JpegJob>&);
+
+        // Room left in front of the main image for the APP1 segment: marker,
+        // 16 bit length and up to 65533 bytes of payload
+        static const size_t kApp1Reserve = 65537;
+        static const int kFlushWaitTimeoutSec = 3; // 3 sec
+
+        const wp<OutputThreadInterface> mParent;
+        sp<ThumbnailThread> mThumbThread;
+
+        std::mutex mJobLock;                  // Protect mJobs and mEncoding
+        std::condition_variable mJobCond;     // signaled when a job is submitted or on exit
+        std::condition_variable mJobDoneCond; // signaled when a job is done encoding
+        std::list<std::shared_ptr<JpegJob>> mJobs;
+        bool mEncoding = false;
+
+        mutable std::mutex mStatsLock;        // Protect the stage stats
+        StageStats mPrepareStats;
+        StageStats mThumbStats;
+        StageStats mMainStats;
+        StageStats mSpliceStats;
+        StageStats mTotalStats;
+    };
+
     class OutputThread : public android::Thread {
     public:
         OutputThread(wp<OutputThreadInterface> parent, CroppingType,
@@ -132,8 +223,14 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
         void dump(int fd);
         virtual bool threadLoop() override;
 
+        // True if requests are queued behind the one being processed
+        bool hasPendingRequests() const;
+
         void setExifMakeModel(const std::string& make, const std::string& model);
 
+        // Number of extra threads used to crop/scale intermediate YU12 frames
+        void setScaleWorkers(uint32_t numWorkers);
+
         // The remaining request list is returned for offline processing
         std::list<std::shared_ptr<HalRequest>> switchToOffline();
 
@@ -159,8 +256,22 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
                 sp<AllocatedFrame>& in, const Size& outSize,
                 YCbCrLayout* out);
 
-        int createJpegLocked(HalStreamBuffer &halBuf,
-                const common::V1_0::helper::CameraMetadata& settings);
+        // Crop/scale the main and thumbnail images of a BLOB buffer into a job
+        // for mJpegThread
+        int prepareJpegJobLocked(uint32_t frameNumber, HalStreamBuffer &halBuf,
+                const common::V1_0::helper::CameraMetadata& settings,
+                /*out*/std::shared_ptr<JpegEncodeThread::JpegJob>* outJob);
+
+        // Convert a YUYV frame straight into the locked output buffer. Returns
+        // non-zero if the output layout is not supported, in which case nothing is written
+        int convertYuyvDirectLocked(const std::shared_ptr<HalRequest>& req,
+                const YCbCrLayout& outLayout);
+
+        // Crop an NV12 input frame straight into a locked YV12 output buffer
+        // when no scaling is needed. Returns non-zero if that is not possible,
+        // in which case nothing is written
+        int convertNv12CroppedLocked(const std::shared_ptr<HalRequest>& req,
+                const Size& outSize, const YCbCrLayout& outLayout);
 
         void clearIntermediateBuffers();
 
@@ -187,15 +298,22 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
         std::unordered_map<Size, sp<AllocatedFrame>, SizeHasher> mScaledYu12Frames;
         YCbCrLayout mYu12FrameLayout;
         YCbCrLayout mYu12ThumbFrameLayout;
+        std::unique_ptr<TiledScaler> mScaler = std::make_unique<TiledScaler>(0);
         uint32_t mBlobBufferSize = 0; // 0 -> HAL derive buffer size, else: use given size
 
         std::string mExifMake;
         std::string mExifModel;
+
+        // Frames written to the output buffer without going through mYu12Frame
+        std::atomic<uint64_t> mDirectOutputFrames {0};
+        std::atomic<uint64_t> mProcessedFrames {0};
+
+        sp<JpegEncodeThread> mJpegThread;
     };
 
     class FormatConvertThread : public android::Thread {
     public:
-        FormatConvertThread(sp<OutputThread>& mOutputThread);
+        FormatConvertThread(sp<OutputThread>& mOutputThread, uint32_t pipelineDepth = 1);
         ~FormatConvertThread();
         void createJpegDecoder();
         void destroyJpegDecoder();
@@ -204,18 +322,52 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
 		void destroyH264Decoder();
         Status submitRequest(const std::shared_ptr<HalRequest>&);
         virtual bool threadLoop() override;
+        virtual void requestExit() override;
+
+        // Wait for in-flight decodes to reach the OutputThread. Requests that were not
+        // dispatched to a decode slot yet are returned for the caller to error out.
+        std::list<std::shared_ptr<HalRequest>> flush();
+        void dump(int fd);
 
         sp <MemManagerBase> mCamMemManager;
+
+        static const uint32_t kMaxPipelineDepth = 4;
     private:
-        int jpegDecoder(unsigned int mShareFd, uint8_t* inData, size_t inDataSize);
+        // One in-flight decode. Each slot owns its own hardware JPEG decoder so that
+        // decode of frame N+1 can run while frame N is still being decoded or processed
+        // by the OutputThread. The decode destination is the preview buffer indexed by
+        // the V4L2 buffer index, so slots never share a destination buffer.
+        class DecodeSlot : public android::Thread {
+        public:
+            DecodeSlot(FormatConvertThread* parent, uint32_t index);
+            ~DecodeSlot();
+            void createJpegDecoder();
+            void destroyJpegDecoder();
+            void start(const std::shared_ptr<HalRequest>&);
+            virtual bool threadLoop() override;
+            virtual void requestExit() override;
+        private:
+            void decodeLocked(const std::shared_ptr<HalRequest>&);
+            int jpegDecoder(unsigned int mShareFd, uint8_t* inData, size_t inDataSize);
+
+            FormatConvertThread* const mParent; // owns this slot and joins it on destruction
+            const uint32_t mIndex;
+            MpiJpegDecoder mHWJpegDecoder;
+            MpiJpegDecoder::OutputFrame_t mHWDecoderFrameOut;
+            std::mutex mSlotLock;                 // Protect mRequest
+            std::condition_variable mSlotCond;    // signaled when a request is started
+            std::shared_ptr<HalRequest> mRequest;
+        };
+
         void yuyvToNv12(int v4l2_fmt_dst, char *srcbuf, char *dstbuf,
                 int src_w, int src_h,int dst_w, int dst_h);
         void setOutputThread(sp<OutputThread>& mOutputThread);
         void waitForNextRequest(std::shared_ptr<HalRequest>* out);
         //void signalRequestDone();
 
-        MpiJpegDecoder mHWJpegDecoder;
-        MpiJpegDecoder::OutputFrame_t mHWDecoderFrameOut;
+        // Called by DecodeSlot when its request is decoded. Hands every decoded request
+        // to the OutputThread in submission order.
+        void onDecodeDone(uint32_t slotIndex);
 
 		RKHWDecApi mRkHwDecApi;
         sp<OutputThread> mFmtOutputThread;
@@ -225,6 +377,20 @@ struct ExternalCameraDeviceSession : public virtual RefBase,
         std::list<std::shared_ptr<HalRequest>> mRequestList;
         static const int kReqWaitTimeoutMs = 33;   // 33ms
         static const int kReqWaitTimesMax = 90;    // 33ms * 90 ~= 3 sec
+        static const int kFlushWaitTimeoutSec = 3; // 3 sec
+
+        // Decode ring. Request with sequence number n always lands in slot n % depth, and
+        // requests are released to the OutputThread in sequence order, so at most
+        // mPipelineDepth requests are in flight: [mEmitSeq, mSubmitSeq)
+        const uint32_t mPipelineDepth;
+        std::vector<sp<DecodeSlot>> mDecodeSlots;
+        mutable std::mutex mSlotLock;             // Protect mSlotRequests, mSlotDecoded,
+                                                  // mSubmitSeq and mEmitSeq
+        std::condition_variable mSlotFreeCond;    // signaled when a request leaves the ring
+        std::vector<std::shared_ptr<HalRequest>> mSlotRequests;
+        std::vector<bool> mSlotDecoded;
+        uint64_t mSubmitSeq = 0;
+        uint64_t mEmitSeq = 0;
     };
 
 protected:
@@ -275,6 +441,9 @@ protected:
 
     virtual Status processCaptureResult(std::shared_ptr<HalRequest>&) override;
 
+    virtual Status processCaptureBufferResult(
+            uint32_t frameNumber, HalStreamBuffer& halBuf, bool success) override;
+
     virtual Status processCaptureRequestError(const std::shared_ptr<HalRequest>&,
         /*out*/std::vector<NotifyMsg>* msgs = nullptr,
         /*out*/std::vector<CaptureResult>* results = nullptr) override;
@@ -311,8 +480,31 @@ protected:
 
     // TODO: change to unique_ptr for better tracking
     sp<V4L2Frame> dequeueV4l2FrameLocked(/*out*/nsecs_t* shutterTs); // Called with mLock hold
+    // DQBUF without waiting for a free buffer; does not need mLock
+    sp<V4L2Frame> dequeueV4l2FrameImpl(/*out*/nsecs_t* shutterTs);
     void enqueueV4l2Frame(const sp<V4L2Frame>&);
 
+    // Keeps dequeuing V4L2 frames while streaming so a request always gets the
+    // freshest frame. A frame that no request picked up is requeued as soon as a
+    // newer one arrives. Not used for H264, where the decoder needs every frame.
+    class CaptureThread : public android::Thread {
+    public:
+        explicit CaptureThread(ExternalCameraDeviceSession* parent) : mParent(parent) {}
+        virtual bool threadLoop() override;
+    private:
+        static const int kPollTimeoutMs = 100; // to check for exit while no frame arrives
+
+        ExternalCameraDeviceSession* const mParent; // joins this thread on stream off
+    };
+
+    void startCaptureThreadLocked();
+    // Also requeues the frame held for the next request
+    void stopCaptureThreadLocked();
+    // Wait for a frame captured after the previous call. Called with mLock held
+    sp<V4L2Frame> acquireCapturedFrameLocked(/*out*/nsecs_t* shutterTs);
+    // Buffer count for the next stream on, from the config and measured buffer hold time
+    uint32_t getV4l2BufferCountLocked(double fps);
+
     // Check if input Stream is one of supported stream setting on this device
     static bool isSupported(const Stream& stream,
             const std::vector<SupportedV4L2Format>& supportedFormats,
@@ -347,6 +539,21 @@ protected:
     void invokeProcessCaptureResultCallback(
             hidl_vec<CaptureResult> &results, bool tryWriteFmq);
 
+    // Latency samples of a result, recorded once the result has been delivered
+    struct PendingLatency {
+        int32_t streamId;
+        StageLatencies latency;
+    };
+
+    // Queue notifies and results behind the ones already pending. The whole
+    // batch is sent when flushNow is set, the batch is full or the output
+    // thread has no more requests queued. The latency samples get the time
+    // spent in the callback that delivers the batch as STAGE_CALLBACK.
+    void queueResults(std::vector<NotifyMsg>& msgs, hidl_vec<CaptureResult>& results,
+            bool flushNow, std::vector<PendingLatency>* latencies = nullptr);
+    void flushPendingResults();
+    void flushPendingResultsLocked();
+
     Size getMaxJpegResolution() const;
     Size getMaxThumbResolution() const;
 
@@ -391,6 +598,24 @@ protected:
     std::condition_variable mV4L2BufferReturned;
     size_t mNumDequeuedV4l2Buffers = 0;
     uint32_t mMaxV4L2BufferSize = 0;
+    std::vector<nsecs_t> mV4l2DequeueTs; // per buffer index, protected by mV4l2BufferLock
+    nsecs_t mV4l2HoldTime = 0;           // moving average of DQBUF to QBUF time,
+                                         // protected by mV4l2BufferLock
+    size_t mPreviewBufferCount = 0;      // 0 when preview buffers will be reallocated
+
+    static const uint32_t kMaxV4l2BufferCount = 8;
+
+    sp<CaptureThread> mCaptureThread;
+    std::mutex mCaptureLock;              // protect mCapturedFrame, mCapturedShutterTs and
+                                          // mStaleFrames
+    std::condition_variable mCaptureCond; // signaled when a frame is captured
+    sp<V4L2Frame> mCapturedFrame;         // freshest frame not handed to a request yet
+    nsecs_t mCapturedShutterTs = 0;
+    uint64_t mStaleFrames = 0;            // frames requeued without being used
+
+    // Per stream, per stage latency of completed buffers. Reset when streams
+    // are configured; lock-free, so recorded from any thread
+    LatencyRecorder mLatencyRecorder;
 
     // Not protected by mLock (but might be used when mLock is locked)
     sp<OutputThread> mOutputThread;
@@ -432,6 +657,14 @@ protected:
     std::string mExifModel;
     /* End of members not changed after initialize() */
 
+    // Held while a batch is sent too, so batches reach the framework in order
+    std::mutex mResultBatchLock;            // protect the members below
+    std::vector<NotifyMsg> mPendingMsgs;
+    std::vector<CaptureResult> mPendingResults;
+    std::vector<PendingLatency> mPendingLatencies;
+    uint64_t mSentResults = 0;
+    uint64_t mResultCallbacks = 0;
+
 private:
 
     struct TrampolineSessionInterface_3_4 : public ICameraDeviceSession {
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMLATENCY_H
+#define ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMLATENCY_H
+
+#include <atomic>
+#include <vector>
+#include "utils/Timers.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+enum LatencyStage : uint32_t {
+    STAGE_DEQUEUE = 0,  // waiting for a V4L2 frame
+    STAGE_DECODE,       // MJPEG/H264 decode
+    STAGE_CONVERT,      // pixel format conversion
+    STAGE_SCALE,        // crop and scale, RGA or software
+    STAGE_ENCODE,       // JPEG encode, including time queued for the encoder
+    STAGE_CALLBACK,     // processCaptureResult callback into the framework
+    STAGE_COUNT
+};
+
+// Time spent in each stage by one request or one of its buffers. Stages that
+// were never entered are left out of the histograms.
+struct StageLatencies {
+    nsecs_t ns[STAGE_COUNT] = {};
+    uint32_t mask = 0;
+
+    void add(LatencyStage stage, nsecs_t duration) {
+        ns[stage] += duration;
+        mask |= 1u << stage;
+    }
+
+    void merge(const StageLatencies& other) {
+        for (uint32_t i = 0; i < STAGE_COUNT; i++) {
+            if (other.mask & (1u << i)) {
+                add(static_cast<LatencyStage>(i), other.ns[i]);
+            }
+        }
+    }
+};
+
+// Log-linear histogram of durations with ~12% bucket resolution, from 1us up
+// to a few hours. record() is lock-free and can be called from any thread.
+class LatencyHistogram {
+public:
+    LatencyHistogram() { reset(); }
+
+    void record(nsecs_t duration);
+    void reset();
+
+    uint32_t getCount() const { return mCount.load(std::memory_order_relaxed); }
+    uint32_t getMaxUs() const { return mMaxUs.load(std::memory_order_relaxed); }
+    // Upper bound of the bucket holding the given percentile, capped at the max
+    uint32_t getPercentileUs(uint32_t percentile) const;
+
+private:
+    // Values below kLinearBuckets us get a bucket each, every power of two
+    // above is split into 2^kSubBucketBits buckets
+    static const uint32_t kSubBucketBits = 3;
+    static const uint32_t kLinearBuckets = 2 << kSubBucketBits;
+    static const uint32_t kNumBuckets = kLinearBuckets + ((32 - kSubBucketBits - 1) << kSubBucketBits);
+
+    static uint32_t getBucket(uint32_t us);
+    static uint32_t getBucketUpperBoundUs(uint32_t bucket);
+
+    std::atomic<uint32_t> mBuckets[kNumBuckets];
+    std::atomic<uint32_t> mCount;
+    std::atomic<uint32_t> mMaxUs;
+};
+
+// Per stream, per stage latency histograms. Streams are bound to slots by
+// reset() when streams are configured, so recording never allocates or locks.
+// Samples for streams that have no slot are dropped.
+class LatencyRecorder {
+public:
+    void reset(const std::vector<int32_t>& streamIds);
+    // Starts the histograms over, keeping the streams bound to their slots.
+    // Samples recorded meanwhile may land on either side of the clear.
+    void clear();
+    void record(int32_t streamId, const StageLatencies& latencies);
+    void dump(int fd) const;
+
+    static const uint32_t kMaxStreams = 8;
+
+private:
+    struct Slot {
+        std::atomic<int32_t> streamId {-1};
+        LatencyHistogram stages[STAGE_COUNT];
+    };
+
+    Slot mSlots[kMaxStreams];
+};
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMLATENCY_H
@@ -18,6 +18,8 @@
 #define ANDROID_HARDWARE_CAMERA_MEM_MANAGER
 
 #include <dlfcn.h>
+#include <atomic>
+#include <memory>
 #include "utils/LightRefBase.h"
 #ifndef RK_GRALLOC_4
 #include "ExternalCameraGralloc.h"
@@ -53,6 +55,51 @@ typedef enum buffer_addr_e {
     buffer_sharre_fd
 }buffer_addr_t;
 
+/*
+ * Fixed size pool of buffer indices backed by a lock-free free list (Treiber
+ * stack with an ABA tag in the upper 32 bits of the head). acquire/release are
+ * O(1) and safe to call from any number of threads; each buffer carries a
+ * refcount so several consumers can hold the same buffer.
+ */
+class BufferPool {
+public :
+    BufferPool();
+    ~BufferPool();
+    // Not thread safe, must not race with acquire/release
+    int init(unsigned int numBuffers);
+    void reset();
+
+    // Returns a free index with refcount 1, or -1 if the pool is exhausted
+    int acquire();
+    // Add a reference to an index that is already acquired
+    int retain(unsigned int idx);
+    // Drop a reference, the index returns to the free list when it reaches 0
+    int release(unsigned int idx);
+
+    unsigned int size() const { return mNumBuffers; }
+    unsigned int inUse() const { return mInUse.load(std::memory_order_relaxed); }
+    unsigned int highWaterMark() const {
+        return mHighWaterMark.load(std::memory_order_relaxed);
+    }
+    uint64_t acquireCount() const { return mAcquireCount.load(std::memory_order_relaxed); }
+    uint64_t acquireFailCount() const {
+        return mAcquireFailCount.load(std::memory_order_relaxed);
+    }
+private:
+    void push(unsigned int idx);
+
+    static const uint32_t kEmpty = 0; // node ids are index + 1, 0 terminates the list
+
+    unsigned int mNumBuffers;
+    std::atomic<uint64_t> mHead; // tag << 32 | node id
+    std::unique_ptr<std::atomic<uint32_t>[]> mNext;
+    std::unique_ptr<std::atomic<int32_t>[]> mRefCount;
+    std::atomic<unsigned int> mInUse;
+    std::atomic<unsigned int> mHighWaterMark;
+    std::atomic<uint64_t> mAcquireCount;
+    std::atomic<uint64_t> mAcquireFailCount;
+};
+
 class MemManagerBase : public virtual VirtualLightRefBase {
 public :
     MemManagerBase();
@@ -60,14 +107,18 @@ public :
     virtual int createPreviewBuffer(struct bufferinfo_s* previewbuf) = 0;
     virtual int destroyPreviewBuffer() = 0;
     virtual int flushCacheMem(buffer_type_enum buftype) = 0;
-    void setBufferStatus(enum buffer_type_enum buf_type,
-                                unsigned int buf_idx, int status);
     unsigned long getBufferAddr(enum buffer_type_enum buf_type,
             unsigned int buf_idx, buffer_addr_t addr_type);
-    int getIdleBufferIndex(enum buffer_type_enum buf_type);
-    int dump();
+    // Buffer pool API, returns -1 on failure
+    int acquireBuffer(enum buffer_type_enum buf_type);
+    int retainBuffer(enum buffer_type_enum buf_type, unsigned int buf_idx);
+    int releaseBuffer(enum buffer_type_enum buf_type, unsigned int buf_idx);
+    int dump(int fd);
 protected:
+    BufferPool* getPool(enum buffer_type_enum buf_type);
+
     struct bufferinfo_s* mPreviewBufferInfo;
+    BufferPool mPreviewPool;
     mutable Mutex mLock;
 };
 
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMSCALER_H
+#define ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMSCALER_H
+
+#include <android/hardware/graphics/mapper/2.0/IMapper.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "utils/Thread.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+using ::android::hardware::graphics::mapper::V2_0::YCbCrLayout;
+
+// Nearest neighbour I420 scaler that splits the output into horizontal strips
+// and scales them on a small pool of worker threads. Strip boundaries are
+// placed where input and output rows map exactly onto each other, so every
+// strip is an independent scale with the same ratio as the whole frame.
+// scale() is not reentrant; callers serialize it (OutputThread holds mBufferLock).
+class TiledScaler {
+public:
+    // numWorkers extra threads are spawned; the calling thread also scales a
+    // strip. 0 workers means every scale runs single-threaded.
+    explicit TiledScaler(uint32_t numWorkers);
+    ~TiledScaler();
+
+    // Same contract as libyuv::I420Scale with kFilterNone
+    int scale(const YCbCrLayout& in, uint32_t inWidth, uint32_t inHeight,
+              const YCbCrLayout& out, uint32_t outWidth, uint32_t outHeight);
+
+    uint32_t getNumWorkers() const { return mWorkers.size(); }
+
+    static const uint32_t kMaxWorkers = 4;
+
+private:
+    struct Strip {
+        YCbCrLayout in;
+        uint32_t inWidth;
+        uint32_t inHeight;
+        YCbCrLayout out;
+        uint32_t outWidth;
+        uint32_t outHeight;
+    };
+
+    class Worker : public android::Thread {
+    public:
+        explicit Worker(TiledScaler* parent) : mParent(parent) {}
+        virtual bool threadLoop() override;
+    private:
+        TiledScaler* const mParent;
+    };
+
+    // Outputs smaller than this are scaled in one go; splitting them costs
+    // more in wakeups than it saves
+    static const uint32_t kMinPixelsPerStrip = 320 * 240;
+
+    static int scaleStrip(const Strip& strip);
+    // Pop one queued strip and scale it. Returns false if the queue was empty
+    bool runOneStripLocked(std::unique_lock<std::mutex>& lk);
+
+    std::vector<sp<Worker>> mWorkers;
+
+    std::mutex mLock;                 // Protect mStrips, mPendingStrips, mError and mExiting
+    std::condition_variable mWorkCond; // signaled when strips are queued or on exit
+    std::condition_variable mDoneCond; // signaled when mPendingStrips drops to 0
+    std::deque<Strip> mStrips;
+    uint32_t mPendingStrips = 0;
+    int mError = 0;
+    bool mExiting = false;
+};
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTCAMSCALER_H
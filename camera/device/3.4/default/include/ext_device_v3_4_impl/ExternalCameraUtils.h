@@ -102,6 +102,19 @@ struct ExternalCameraConfig {
     // The value of android.sensor.orientation
     int32_t orientation;
 
+    // Number of V4L2 frames that may be decoded concurrently before being handed
+    // to the output thread
+    uint32_t decodePipelineDepth;
+
+    // Number of worker threads, in addition to the output thread, used to crop
+    // and scale intermediate frames
+    uint32_t scaleWorkerCount;
+
+    // Maximum number of capture results held back to be sent in a single
+    // callback while more requests are queued for the output thread. 1 sends
+    // every result as soon as it is ready
+    uint32_t resultBatchCount;
+
 private:
     ExternalCameraConfig();
     static bool updateFpsList(tinyxml2::XMLElement* fpsList, std::vector<FpsLimitation>& fpsLimits);
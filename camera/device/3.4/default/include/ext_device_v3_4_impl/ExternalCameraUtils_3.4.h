@@ -31,6 +31,7 @@
 #include "utils/Timers.h"
 #include <CameraMetadata.h>
 #include <HandleImporter.h>
+#include "ExternalCameraLatency.h"
 
 
 using ::android::hardware::graphics::mapper::V2_0::IMapper;
@@ -102,6 +103,19 @@ struct ExternalCameraConfig {
     // The value of android.sensor.orientation
     int32_t orientation;
 
+    // Number of V4L2 frames that may be decoded concurrently before being handed
+    // to the output thread
+    uint32_t decodePipelineDepth;
+
+    // Number of worker threads, in addition to the output thread, used to crop
+    // and scale intermediate frames
+    uint32_t scaleWorkerCount;
+
+    // Maximum number of capture results held back to be sent in a single
+    // callback while more requests are queued for the output thread. 1 sends
+    // every result as soon as it is ready
+    uint32_t resultBatchCount;
+
 private:
     ExternalCameraConfig();
     static bool updateFpsList(tinyxml2::XMLElement* fpsList, std::vector<FpsLimitation>& fpsLimits);
@@ -217,6 +231,8 @@ struct HalStreamBuffer {
     buffer_handle_t* bufPtr;
     int acquireFence;
     bool fenceTimeout;
+    // Stages spent on this buffer alone
+    StageLatencies latency;
 };
 
 struct HalRequest {
@@ -230,6 +246,13 @@ struct HalRequest {
     unsigned long mVirAddr;
     uint8_t* inData;
     size_t inDataSize;
+    // Frame was decoded straight into buffers[0], no intermediate conversion needed
+    bool directOutput = false;
+    // A buffer was moved out of buffers to be returned later through
+    // processCaptureBufferResult (JPEG encode in progress)
+    bool deferredBuffer = false;
+    // Stages shared by all buffers of the request
+    StageLatencies latency;
 };
 
 static const uint64_t BUFFER_ID_NO_BUFFER = 0;
@@ -295,6 +318,11 @@ struct OutputThreadInterface : public virtual RefBase {
     virtual ::android::hardware::camera::common::V1_0::Status processCaptureResult(
             std::shared_ptr<HalRequest>&) = 0;
 
+    // Return a buffer that was held back from processCaptureResult. Must be called
+    // after processCaptureResult for the same frame.
+    virtual ::android::hardware::camera::common::V1_0::Status processCaptureBufferResult(
+            uint32_t frameNumber, HalStreamBuffer& halBuf, bool success) = 0;
+
     virtual ssize_t getJpegBufferSize(uint32_t width, uint32_t height) const = 0;
 };
 
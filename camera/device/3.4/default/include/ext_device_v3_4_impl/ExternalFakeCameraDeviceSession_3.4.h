@@ -39,6 +39,7 @@
 #include "MpiJpegDecoder.h"
 #include <utils/Singleton.h>
 #include "ExternalCameraMemManager.h"
+#include "ExternalFakeFrameSource.h"
 #include <linux/videodev2.h>
 
 namespace android {
@@ -269,6 +270,9 @@ protected:
 
     virtual Status processCaptureResult(std::shared_ptr<HalRequest>&) override;
 
+    virtual Status processCaptureBufferResult(
+            uint32_t frameNumber, HalStreamBuffer& halBuf, bool success) override;
+
     virtual Status processCaptureRequestError(const std::shared_ptr<HalRequest>&,
         /*out*/std::vector<NotifyMsg>* msgs = nullptr,
         /*out*/std::vector<CaptureResult>* results = nullptr) override;
@@ -375,6 +379,7 @@ protected:
     SupportedV4L2Format mV4l2StreamingFmt;
     double mV4l2StreamingFps = 0.0;
     size_t mV4L2BufferCount = 0;
+    FakeFrameSource mFrameSource; // replaces the V4L2 device queue
     struct v4l2_plane planes[1];
     struct v4l2_capability mCapability;
 
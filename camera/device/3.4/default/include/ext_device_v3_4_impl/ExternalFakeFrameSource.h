@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTFAKEFRAMESOURCE_H
+#define ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTFAKEFRAMESOURCE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "utils/Timers.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_4 {
+namespace implementation {
+
+// Stands in for the V4L2 device of ExternalFakeCameraDeviceSession. Replays
+// the frames of a memory-mapped file in a loop, paced to the configured frame
+// rate. Frames are handed out as pointers into the mapping, nothing is copied.
+//
+// MJPEG files are concatenated JPEG images; YUYV and NV12 files are raw frames
+// of the configured size back to back.
+//
+// Not thread safe; the session calls it with its mLock held.
+class FakeFrameSource {
+public:
+    FakeFrameSource() = default;
+    ~FakeFrameSource();
+
+    // Default replay file of a format, /data/camera/camera_<w>x<h>.{jpg,yuyv,yuv}
+    static std::string getReplayPath(uint32_t fourcc, uint32_t width, uint32_t height);
+    // First of MJPEG, NV12, YUYV that has a replay file of the given size, or
+    // defaultFourcc if there is none
+    static uint32_t findReplayFourcc(uint32_t width, uint32_t height, uint32_t defaultFourcc);
+
+    // Map and index a replay file. Returns 0 on success
+    int open(const std::string& path, uint32_t fourcc, uint32_t width, uint32_t height);
+    void close();
+    bool isOpen() const { return mData != nullptr; }
+
+    // 0 hands out frames as fast as they are asked for
+    void setFrameRate(double fps);
+
+    // Block until the next frame is due, then return it. The data stays valid
+    // until close(). Returns 0 on success
+    int nextFrame(const uint8_t** data, size_t* size, /*out*/nsecs_t* timestamp);
+
+    size_t getFrameCount() const { return mFrames.size(); }
+    void dump(int fd) const;
+
+private:
+    struct FrameSpan {
+        size_t offset;
+        size_t size;
+    };
+
+    int indexJpegFrames();
+    int indexRawFrames(size_t frameSize);
+
+    std::string mPath;
+    uint32_t mFourcc = 0;
+    uint8_t* mData = nullptr;
+    size_t mDataSize = 0;
+    size_t mMapSize = 0;  // mDataSize plus the zeroed padding behind the file
+    std::vector<FrameSpan> mFrames;
+    size_t mNextFrame = 0;
+
+    nsecs_t mFrameInterval = 0;
+    nsecs_t mNextFrameTime = 0;
+    uint64_t mFramesDelivered = 0;
+    uint64_t mLateFrames = 0;  // asked for after the following frame was already due
+};
+
+}  // namespace implementation
+}  // namespace V3_4
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_CAMERA_DEVICE_V3_4_EXTFAKEFRAMESOURCE_H
@@ -211,6 +211,9 @@ Status ExternalCameraDeviceSession::switchToOffline(const hidl_vec<int32_t>& off
 
     // pause output thread and get all remaining inflight requests
     auto remainingReqs = mOutputThread->switchToOffline();
+    // Results still batched from before the pause must reach the framework
+    // ahead of the errors and offline session handed back below
+    flushPendingResults();
     std::vector<std::shared_ptr<V3_4::implementation::HalRequest>> halReqs;
 
     // Send out buffer/request error for remaining requests and filter requests
@@ -33,6 +33,7 @@
 #include <string.h>
 
 #include <android/hardware/graphics/composer/2.1/IComposer.h>
+#include <composer-command-buffer/2.1/ComposerCommandStream.h>
 #include <fmq/MessageQueue.h>
 #include <log/log.h>
 #include <sync/sync.h>
@@ -52,9 +53,20 @@ using CommandQueueType = MessageQueue<uint32_t, kSynchronizedReadWrite>;
 
 // This class helps build a command queue.  Note that all sizes/lengths are in
 // units of uint32_t's.
+//
+// Once the message queue exists, commands are serialized straight into its
+// free space and writeQueue only commits them.  Only when a batch of commands
+// does not fit in the queue are they staged in mData and copied over (to a
+// bigger queue) by writeQueue.  writeQueue must be followed by reset() before
+// the next batch of commands is written.
+//
+// The queue grows geometrically, and shrinks by half (never below the initial
+// size) only after kQueueShrinkBatches consecutive batches used less than
+// 1/kQueueShrinkRatio of it, so that the peer rarely has to map a new queue.
 class CommandWriterBase {
    public:
-    CommandWriterBase(uint32_t initialMaxSize) : mDataMaxSize(initialMaxSize) {
+    CommandWriterBase(uint32_t initialMaxSize)
+        : mDataMaxSize(initialMaxSize), mInitialMaxSize(initialMaxSize) {
         mData = std::make_unique<uint32_t[]>(mDataMaxSize);
         reset();
     }
@@ -64,9 +76,11 @@ class CommandWriterBase {
     void reset() {
         mDataWritten = 0;
         mCommandEnd = 0;
+        endDirectWrite();
 
         // handles in mDataHandles are owned by the caller
         mDataHandles.clear();
+        mHandleSlots.clear();
 
         // handles in mTemporaryHandles are owned by the writer
         for (auto handle : mTemporaryHandles) {
@@ -77,7 +91,7 @@ class CommandWriterBase {
     }
 
     IComposerClient::Command getCommand(uint32_t offset) {
-        uint32_t val = (offset < mDataWritten) ? mData[offset] : 0;
+        uint32_t val = (offset < mDataWritten) ? *dataSlot(offset) : 0;
         return static_cast<IComposerClient::Command>(
             val & static_cast<uint32_t>(IComposerClient::Command::OPCODE_MASK));
     }
@@ -91,25 +105,39 @@ class CommandWriterBase {
             return true;
         }
 
-        // After data are written to the queue, it may not be read by the
-        // remote reader when
-        //
-        //  - the writer does not send them (because of other errors)
-        //  - the hwbinder transaction fails
-        //  - the reader does not read them (because of other errors)
-        //
-        // Discard the stale data here.
-        size_t staleDataSize = mQueue ? mQueue->availableToRead() : 0;
-        if (staleDataSize > 0) {
-            ALOGW("discarding stale data from message queue");
-            CommandQueueType::MemTransaction tx;
-            if (mQueue->beginRead(staleDataSize, &tx)) {
-                mQueue->commitRead(staleDataSize);
+        if (mRecorder && !(mDirectWrite && mDirectCommitted)) {
+            recordBatch();
+        }
+
+        // commands are already in the queue; stale data was discarded before
+        // they were written
+        if (mDirectWrite) {
+            if (!mDirectCommitted) {
+                if (!mQueue->commitWrite(mDataWritten)) {
+                    ALOGE("failed to commit commands to message queue");
+                    return false;
+                }
+                mDirectCommitted = true;
+                updateQueueUsage();
             }
+
+            *outQueueChanged = false;
+            *outCommandLength = mDataWritten;
+            outCommandHandles->setToExternal(const_cast<hidl_handle*>(mDataHandles.data()),
+                                             mDataHandles.size());
+            return true;
+        }
+
+        discardStaleData();
+
+        // this batch needs the whole queue, so there is nothing to shrink
+        if (mQueue && mQueueShrinkPending && getNewQueueSize() == mQueue->getQuantumCount()) {
+            mQueueShrinkPending = false;
+            mQueueUnderusedBatches = 0;
         }
 
         // write data to queue, optionally resizing it
-        if (mQueue && (mDataMaxSize <= mQueue->getQuantumCount())) {
+        if (mQueue && !mQueueShrinkPending && (mDataWritten <= mQueue->getQuantumCount())) {
             if (!mQueue->write(mData.get(), mDataWritten)) {
                 ALOGE("failed to write commands to message queue");
                 return false;
@@ -117,15 +145,27 @@ class CommandWriterBase {
 
             *outQueueChanged = false;
         } else {
-            auto newQueue = std::make_unique<CommandQueueType>(mDataMaxSize);
+            size_t oldQueueSize = mQueue ? mQueue->getQuantumCount() : 0;
+            size_t newQueueSize = getNewQueueSize();
+            auto newQueue = std::make_unique<CommandQueueType>(newQueueSize);
             if (!newQueue->isValid() || !newQueue->write(mData.get(), mDataWritten)) {
                 ALOGE("failed to prepare a new message queue ");
                 return false;
             }
 
+            if (oldQueueSize > 0) {
+                if (newQueueSize > oldQueueSize) {
+                    mQueueGrowCount++;
+                } else {
+                    mQueueShrinkCount++;
+                }
+            }
             mQueue = std::move(newQueue);
+            mQueueShrinkPending = false;
+            mQueueUnderusedBatches = 0;
             *outQueueChanged = true;
         }
+        updateQueueUsage();
 
         *outCommandLength = mDataWritten;
         outCommandHandles->setToExternal(const_cast<hidl_handle*>(mDataHandles.data()),
@@ -134,10 +174,51 @@ class CommandWriterBase {
         return true;
     }
 
+    uint32_t getDataWritten() const { return mDataWritten; }
+
+    // Pass every batch to recorder before it is written to the queue.  The
+    // recorder must outlive this writer or be unset first.
+    void setRecorder(CommandStreamRecorder* recorder) { mRecorder = recorder; }
+
+    // Append the commands other wrote in [begin, end), along with the handles
+    // they reference.  Temporary handles stay owned by other, which must not
+    // be reset until this writer is.
+    void appendCommands(const CommandWriterBase& other, uint32_t begin, uint32_t end) {
+        if (mCommandEnd || other.mCommandEnd) {
+            LOG_FATAL("cannot append commands in the middle of a command");
+        }
+        if (begin >= end) {
+            return;
+        }
+
+        if (mDataWritten == 0) {
+            beginDirectWrite();
+        }
+        growData(end - begin);
+
+        // handle indices are relative to the writer's mDataHandles
+        auto slot = std::lower_bound(other.mHandleSlots.begin(), other.mHandleSlots.end(), begin);
+        for (uint32_t offset = begin; offset < end; offset++) {
+            uint32_t val = *other.dataSlot(offset);
+            if (slot != other.mHandleSlots.end() && *slot == offset) {
+                mHandleSlots.push_back(mDataWritten);
+                mDataHandles.push_back(other.mDataHandles[val]);
+                val = mDataHandles.size() - 1;
+                slot++;
+            }
+            write(val);
+        }
+    }
+
     const MQDescriptorSync<uint32_t>* getMQDescriptor() const {
         return (mQueue) ? mQueue->getDesc() : nullptr;
     }
 
+    // queue statistics, in units of uint32_t's and reallocations
+    size_t getQueueSize() const { return (mQueue) ? mQueue->getQuantumCount() : 0; }
+    uint32_t getQueueGrowCount() const { return mQueueGrowCount; }
+    uint32_t getQueueShrinkCount() const { return mQueueShrinkCount; }
+
     static constexpr uint16_t kSelectDisplayLength = 2;
     void selectDisplay(Display display) {
         beginCommand(IComposerClient::Command::SELECT_DISPLAY, kSelectDisplayLength);
@@ -439,6 +520,9 @@ class CommandWriterBase {
             LOG_FATAL("endCommand was not called before command 0x%x", command);
         }
 
+        if (mDataWritten == 0) {
+            beginDirectWrite();
+        }
         growData(1 + length);
         write(static_cast<uint32_t>(command) | length);
 
@@ -461,11 +545,24 @@ class CommandWriterBase {
         mCommandEnd = 0;
     }
 
-    void write(uint32_t val) { mData[mDataWritten++] = val; }
+    void write(uint32_t val) { *dataSlot(mDataWritten++) = val; }
 
-    void writeSigned(int32_t val) { memcpy(&mData[mDataWritten++], &val, sizeof(val)); }
+    void writeSigned(int32_t val) { memcpy(dataSlot(mDataWritten++), &val, sizeof(val)); }
 
-    void writeFloat(float val) { memcpy(&mData[mDataWritten++], &val, sizeof(val)); }
+    void writeFloat(float val) { memcpy(dataSlot(mDataWritten++), &val, sizeof(val)); }
+
+    // writes length bytes, zero-padded to a multiple of 4
+    void writeBytes(const void* data, uint32_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while (length > 0) {
+            uint32_t val = 0;
+            uint32_t n = std::min(length, static_cast<uint32_t>(sizeof(val)));
+            memcpy(&val, bytes, n);
+            write(val);
+            bytes += n;
+            length -= n;
+        }
+    }
 
     void write64(uint64_t val) {
         uint32_t lo = static_cast<uint32_t>(val & 0xffffffff);
@@ -507,6 +604,7 @@ class CommandWriterBase {
         }
 
         mDataHandles.push_back(handle);
+        mHandleSlots.push_back(mDataWritten);
         writeSigned(mDataHandles.size() - 1);
     }
 
@@ -539,10 +637,114 @@ class CommandWriterBase {
 
     static constexpr uint16_t kMaxLength = std::numeric_limits<uint16_t>::max();
 
+    // staging buffer, only valid while not writing directly to the queue
     std::unique_ptr<uint32_t[]> mData;
     uint32_t mDataWritten;
 
    private:
+    uint32_t* dataSlot(uint32_t offset) const {
+        if (!mDirectWrite) {
+            return &mData[offset];
+        }
+        // the free space of the queue may wrap around its end
+        return (offset < mDirectFirstCount) ? mDirectFirst + offset
+                                            : mDirectSecond + (offset - mDirectFirstCount);
+    }
+
+    // After data are written to the queue, it may not be read by the
+    // remote reader when
+    //
+    //  - the writer does not send them (because of other errors)
+    //  - the hwbinder transaction fails
+    //  - the reader does not read them (because of other errors)
+    //
+    // Discard the stale data here.
+    void discardStaleData() {
+        size_t staleDataSize = mQueue ? mQueue->availableToRead() : 0;
+        if (staleDataSize > 0) {
+            ALOGW("discarding stale data from message queue");
+            CommandQueueType::MemTransaction tx;
+            if (mQueue->beginRead(staleDataSize, &tx)) {
+                mQueue->commitRead(staleDataSize);
+            }
+        }
+    }
+
+    // Reserve all free space of the queue for the commands to come.  Nothing
+    // is visible to the reader until writeQueue commits it.
+    void beginDirectWrite() {
+        // a queue about to be shrunk is replaced by writeQueue from mData
+        if (!mQueue || mDirectWrite || mQueueShrinkPending) {
+            return;
+        }
+
+        discardStaleData();
+        size_t available = mQueue->availableToWrite();
+        CommandQueueType::MemTransaction tx;
+        if (available == 0 || !mQueue->beginWrite(available, &tx)) {
+            return;
+        }
+
+        mDirectFirst = tx.getFirstRegion().getAddress();
+        mDirectFirstCount = tx.getFirstRegion().getLength();
+        mDirectSecond = tx.getSecondRegion().getAddress();
+        mDirectCapacity = available;
+        mDirectWrite = true;
+    }
+
+    void recordBatch() {
+        CommandStreamBatch batch;
+        batch.commands.resize(mDataWritten);
+        for (uint32_t offset = 0; offset < mDataWritten; offset++) {
+            batch.commands[offset] = *dataSlot(offset);
+        }
+        batch.handleSlots = mHandleSlots;
+        batch.handles.reserve(mDataHandles.size());
+        for (const auto& handle : mDataHandles) {
+            const native_handle_t* nativeHandle = handle.getNativeHandle();
+            batch.handles.push_back({nativeHandle ? nativeHandle->numFds : 0,
+                                     nativeHandle ? nativeHandle->numInts : 0});
+        }
+
+        mRecorder->recordBatch(std::move(batch));
+    }
+
+    void endDirectWrite() {
+        mDirectWrite = false;
+        mDirectCommitted = false;
+        mDirectFirst = nullptr;
+        mDirectSecond = nullptr;
+        mDirectFirstCount = 0;
+        mDirectCapacity = 0;
+    }
+
+    // the size of the queue to replace mQueue with, big enough for the
+    // commands in mData
+    size_t getNewQueueSize() const {
+        size_t size = std::max(mInitialMaxSize, 1u);
+        if (mQueue) {
+            size = mQueue->getQuantumCount();
+            size = mQueueShrinkPending ? std::max(size / 2, size_t(mInitialMaxSize)) : size * 2;
+        }
+        while (size < mDataWritten) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    // called once the commands are in mQueue
+    void updateQueueUsage() {
+        size_t queueSize = mQueue->getQuantumCount();
+        if (queueSize <= mInitialMaxSize || mDataWritten * kQueueShrinkRatio > queueSize) {
+            mQueueUnderusedBatches = 0;
+            return;
+        }
+
+        if (++mQueueUnderusedBatches >= kQueueShrinkBatches) {
+            mQueueShrinkPending = true;
+        }
+    }
+
     void growData(uint32_t grow) {
         uint32_t newWritten = mDataWritten + grow;
         if (newWritten < mDataWritten) {
@@ -550,6 +752,23 @@ class CommandWriterBase {
                              mDataWritten, grow);
         }
 
+        if (mDirectWrite) {
+            if (newWritten <= mDirectCapacity) {
+                return;
+            }
+
+            // out of queue space; move what was written to the staging buffer
+            // and let writeQueue allocate a bigger queue
+            if (mDataMaxSize < mDataWritten) {
+                mDataMaxSize = mDataWritten;
+                mData = std::make_unique<uint32_t[]>(mDataMaxSize);
+            }
+            uint32_t firstCount = std::min(mDataWritten, static_cast<uint32_t>(mDirectFirstCount));
+            std::copy_n(mDirectFirst, firstCount, mData.get());
+            std::copy_n(mDirectSecond, mDataWritten - firstCount, mData.get() + firstCount);
+            endDirectWrite();
+        }
+
         if (newWritten <= mDataMaxSize) {
             return;
         }
@@ -569,10 +788,30 @@ class CommandWriterBase {
     // end offset of the current command
     uint32_t mCommandEnd;
 
+    static constexpr uint32_t kQueueShrinkRatio = 4;
+    static constexpr uint32_t kQueueShrinkBatches = 256;
+
+    const uint32_t mInitialMaxSize;
+    uint32_t mQueueUnderusedBatches = 0;
+    bool mQueueShrinkPending = false;
+    uint32_t mQueueGrowCount = 0;
+    uint32_t mQueueShrinkCount = 0;
+
+    // reserved free space of mQueue that commands are written to directly
+    bool mDirectWrite = false;
+    bool mDirectCommitted = false;
+    uint32_t* mDirectFirst = nullptr;
+    uint32_t* mDirectSecond = nullptr;
+    size_t mDirectFirstCount = 0;
+    size_t mDirectCapacity = 0;
+
     std::vector<hidl_handle> mDataHandles;
+    // offsets of the words holding indices into mDataHandles, ascending
+    std::vector<uint32_t> mHandleSlots;
     std::vector<native_handle_t*> mTemporaryHandles;
 
     std::unique_ptr<CommandQueueType> mQueue;
+    CommandStreamRecorder* mRecorder = nullptr;
 };
 
 // This class helps parse a command queue.  Note that all sizes/lengths are in
@@ -609,6 +848,7 @@ class CommandReaderBase {
 
         mDataSize = commandLength;
         mDataRead = 0;
+        mDataOffset = 0;
         mCommandBegin = 0;
         mCommandEnd = 0;
         mDataHandles.setToExternal(const_cast<hidl_handle*>(commandHandles.data()),
@@ -617,9 +857,36 @@ class CommandReaderBase {
         return true;
     }
 
+    // Read the commands in [begin, end) of what source has read.  Command
+    // locations stay relative to source, and the handles are shared with it.
+    bool readSegment(const CommandReaderBase& source, uint32_t begin, uint32_t end) {
+        if (begin > end || end > source.mDataSize) {
+            ALOGE("invalid command segment [%" PRIu32 ", %" PRIu32 ")", begin, end);
+            return false;
+        }
+
+        uint32_t length = end - begin;
+        if (mDataMaxSize < length) {
+            mDataMaxSize = length;
+            mData = std::make_unique<uint32_t[]>(mDataMaxSize);
+        }
+        std::copy_n(source.mData.get() + begin, length, mData.get());
+
+        mDataSize = length;
+        mDataRead = 0;
+        mDataOffset = begin;
+        mCommandBegin = 0;
+        mCommandEnd = 0;
+        mDataHandles.setToExternal(const_cast<hidl_handle*>(source.mDataHandles.data()),
+                                   source.mDataHandles.size());
+
+        return true;
+    }
+
     void reset() {
         mDataSize = 0;
         mDataRead = 0;
+        mDataOffset = 0;
         mCommandBegin = 0;
         mCommandEnd = 0;
         mDataHandles.setToExternal(nullptr, 0);
@@ -634,6 +901,8 @@ class CommandReaderBase {
 
     bool isEmpty() const { return (mDataRead >= mDataSize); }
 
+    uint32_t getDataSize() const { return mDataSize; }
+
     bool beginCommandBase(IComposerClient::Command* outCommand, uint16_t* outLength) {
         if (mCommandEnd) {
             LOG_FATAL("endCommand was not called for last command");
@@ -675,7 +944,7 @@ class CommandReaderBase {
         mCommandEnd = 0;
     }
 
-    uint32_t getCommandLoc() const { return mCommandBegin; }
+    uint32_t getCommandLoc() const { return mDataOffset + mCommandBegin; }
 
     uint32_t read() { return mData[mDataRead++]; }
 
@@ -765,6 +1034,8 @@ class CommandReaderBase {
     uint32_t mDataMaxSize;
 
     uint32_t mDataSize;
+    // offset of mData in the command stream, for command locations
+    uint32_t mDataOffset;
 
     // begin/end offsets of the current command
     uint32_t mCommandBegin;
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "ComposerCommandStream.h included without LOG_TAG"
+#endif
+
+#include <mutex>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+
+// One batch of commands, as written by CommandWriterBase::writeQueue
+struct CommandStreamBatch {
+    // the shape of a handle; its fds and ints are not recorded
+    struct Handle {
+        int32_t numFds;
+        int32_t numInts;
+    };
+
+    std::vector<uint32_t> commands;
+    // offsets of the words in commands holding indices into handles, ascending
+    std::vector<uint32_t> handleSlots;
+    std::vector<Handle> handles;
+};
+
+// Records the command batches of one or more CommandWriterBase, so that they
+// can be replayed later without a composer HAL.  Batches are kept in memory until
+// saved, so recordings are meant to span a few hundred frames.
+//
+// The file is a header of kMagic and kVersion, followed for every batch by
+// its command length, handle count, the handle shapes, the handle slots and
+// the command words, all as native-endian 32-bit words.
+class CommandStreamRecorder {
+   public:
+    void recordBatch(CommandStreamBatch batch) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBatches.push_back(std::move(batch));
+    }
+
+    std::vector<CommandStreamBatch> getBatches() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mBatches;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBatches.clear();
+    }
+
+    bool save(const char* path) const {
+        FILE* file = fopen(path, "we");
+        if (!file) {
+            ALOGE("failed to open %s for recording", path);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        bool ok = writeWord(file, kMagic) && writeWord(file, kVersion);
+        for (const auto& batch : mBatches) {
+            if (!ok) {
+                break;
+            }
+            ok = writeWord(file, batch.commands.size()) && writeWord(file, batch.handles.size());
+            for (const auto& handle : batch.handles) {
+                ok = ok && writeWord(file, handle.numFds) && writeWord(file, handle.numInts);
+            }
+            ok = ok && writeWords(file, batch.handleSlots) && writeWords(file, batch.commands);
+        }
+
+        if (fclose(file) != 0 || !ok) {
+            ALOGE("failed to write recording to %s", path);
+            return false;
+        }
+        return true;
+    }
+
+    static bool load(const char* path, std::vector<CommandStreamBatch>* outBatches) {
+        FILE* file = fopen(path, "re");
+        if (!file) {
+            ALOGE("failed to open recording %s", path);
+            return false;
+        }
+
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        bool ok = readWord(file, &magic) && readWord(file, &version) && magic == kMagic &&
+                  version == kVersion;
+        if (!ok) {
+            ALOGE("%s is not a command stream recording", path);
+        }
+
+        outBatches->clear();
+        uint32_t commandLength;
+        while (ok && readWord(file, &commandLength)) {
+            CommandStreamBatch batch;
+            uint32_t handleCount = 0;
+            ok = readWord(file, &handleCount);
+            batch.handles.resize(ok ? handleCount : 0);
+            for (auto& handle : batch.handles) {
+                ok = ok && readWord(file, &handle.numFds) && readWord(file, &handle.numInts);
+            }
+            batch.handleSlots.resize(ok ? handleCount : 0);
+            batch.commands.resize(ok ? commandLength : 0);
+            ok = ok && readWords(file, &batch.handleSlots) && readWords(file, &batch.commands);
+            if (!ok) {
+                ALOGE("truncated batch %zu in %s", outBatches->size(), path);
+                break;
+            }
+            outBatches->push_back(std::move(batch));
+        }
+
+        fclose(file);
+        return ok;
+    }
+
+    // "CMDS"
+    static constexpr uint32_t kMagic = 0x53444d43;
+    static constexpr uint32_t kVersion = 1;
+
+   private:
+    template <typename T>
+    static bool writeWord(FILE* file, T val) {
+        uint32_t word = static_cast<uint32_t>(val);
+        return fwrite(&word, sizeof(word), 1, file) == 1;
+    }
+
+    static bool writeWords(FILE* file, const std::vector<uint32_t>& words) {
+        return fwrite(words.data(), sizeof(uint32_t), words.size(), file) == words.size();
+    }
+
+    template <typename T>
+    static bool readWord(FILE* file, T* outVal) {
+        static_assert(sizeof(T) == sizeof(uint32_t), "not a 32-bit word");
+        return fread(outVal, sizeof(T), 1, file) == 1;
+    }
+
+    static bool readWords(FILE* file, std::vector<uint32_t>* outWords) {
+        return fread(outWords->data(), sizeof(uint32_t), outWords->size(), file) ==
+               outWords->size();
+    }
+
+    mutable std::mutex mMutex;
+    std::vector<CommandStreamBatch> mBatches;
+};
+
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
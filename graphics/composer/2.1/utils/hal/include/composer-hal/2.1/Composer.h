@@ -23,8 +23,10 @@
 #include <array>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
 #include <android/hardware/graphics/composer/2.1/IComposer.h>
@@ -82,7 +84,15 @@ class ComposerImpl : public Interface {
     }
 
     Return<void> dumpDebugInfo(IComposer::dumpDebugInfo_cb hidl_cb) override {
-        hidl_cb(mHal->dumpDebugInfo());
+        std::string info = mHal->dumpDebugInfo();
+        {
+            std::lock_guard<std::mutex> lock(mClientMutex);
+            if (mClientDebugInfo) {
+                info += mClientDebugInfo();
+            }
+        }
+
+        hidl_cb(info);
         return Void();
     }
 
@@ -129,6 +139,7 @@ class ComposerImpl : public Interface {
     void onClientDestroyed() {
         std::lock_guard<std::mutex> lock(mClientMutex);
         mClient.clear();
+        mClientDebugInfo = nullptr;
         mClientDestroyedCondition.notify_all();
     }
 
@@ -140,14 +151,23 @@ class ComposerImpl : public Interface {
 
         auto clientDestroyed = [this]() { onClientDestroyed(); };
         client->setOnClientDestroyed(clientDestroyed);
+        setClientDebugInfo(client.get());
 
         return client.release();
     }
 
+    // must be called with mClientMutex held; the client clears it through
+    // onClientDestroyed before it goes away
+    template <typename Client>
+    void setClientDebugInfo(Client* client) {
+        mClientDebugInfo = [client]() { return client->dumpDebugInfo(); };
+    }
+
     const std::unique_ptr<Hal> mHal;
 
     std::mutex mClientMutex;
     wp<IComposerClient> mClient;
+    std::function<std::string()> mClientDebugInfo;
     std::condition_variable mClientDestroyedCondition;
 };
 
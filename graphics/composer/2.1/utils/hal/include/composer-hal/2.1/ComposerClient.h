@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
 #include <android/hardware/graphics/composer/2.1/IComposerClient.h>
@@ -83,6 +84,11 @@ class ComposerClientImpl : public Interface {
         mOnClientDestroyed = onClientDestroyed;
     }
 
+    std::string dumpDebugInfo() {
+        std::lock_guard<std::mutex> lock(mCommandEngineMutex);
+        return "Composer client:\n" + mCommandEngine->dumpDebugInfo() + mResources->dumpDebugInfo();
+    }
+
     // IComposerClient 2.1 interface
 
     class HalEventCallback : public Hal::EventCallback {
@@ -20,10 +20,14 @@
 #warning "ComposerCommandEngine.h included without LOG_TAG"
 #endif
 
+#include <algorithm>
+#include <functional>
+#include <string>
 #include <vector>
 
 #include <composer-command-buffer/2.1/ComposerCommandBuffer.h>
 #include <composer-hal/2.1/ComposerHal.h>
+#include <composer-hal/2.1/ComposerWorkerPool.h>
 #include <composer-resources/2.1/ComposerResources.h>
 // TODO remove hwcomposer_defs.h dependency
 #include <hardware/hwcomposer_defs.h>
@@ -47,6 +51,7 @@ class ComposerCommandEngine : protected CommandReaderBase {
     virtual ~ComposerCommandEngine() = default;
 
     bool setInputMQDescriptor(const MQDescriptorSync<uint32_t>& descriptor) {
+        mInputQueueChanges++;
         return setMQDescriptor(descriptor);
     }
 
@@ -56,6 +61,59 @@ class ComposerCommandEngine : protected CommandReaderBase {
             return Error::BAD_PARAMETER;
         }
 
+        bool parsed;
+        if (!executeDisplaysConcurrently(&parsed)) {
+            parsed = executeCommands();
+        }
+        if (!parsed) {
+            return Error::BAD_PARAMETER;
+        }
+
+        return mWriter->writeQueue(outQueueChanged, outCommandLength, outCommandHandles)
+                       ? Error::NONE
+                       : Error::NO_RESOURCES;
+    }
+
+    const MQDescriptorSync<uint32_t>* getOutputMQDescriptor() { return mWriter->getMQDescriptor(); }
+
+    void reset() {
+        CommandReaderBase::reset();
+        mWriter->reset();
+
+        // after mWriter, which may reference their temporary handles
+        for (auto& engine : mDisplayEngines) {
+            engine->reset();
+        }
+    }
+
+    std::string dumpDebugInfo() const {
+        uint64_t layerStateCommandsExecuted = mLayerStateCommandsExecuted;
+        uint64_t layerStateCommandsDropped = mLayerStateCommandsDropped;
+        uint64_t validates = mValidates;
+        uint64_t validatesSkipped = mValidatesSkipped;
+        for (const auto& engine : mDisplayEngines) {
+            layerStateCommandsExecuted += engine->mLayerStateCommandsExecuted;
+            layerStateCommandsDropped += engine->mLayerStateCommandsDropped;
+            validates += engine->mValidates;
+            validatesSkipped += engine->mValidatesSkipped;
+        }
+
+        std::string info;
+        info += "  input command queue: set " + std::to_string(mInputQueueChanges) + " times\n";
+        info += "  output command queue: " + std::to_string(mWriter->getQueueSize()) +
+                " words, grown " + std::to_string(mWriter->getQueueGrowCount()) +
+                " times, shrunk " + std::to_string(mWriter->getQueueShrinkCount()) + " times\n";
+        info += "  layer state commands: " + std::to_string(layerStateCommandsExecuted) +
+                " executed, " + std::to_string(layerStateCommandsDropped) +
+                " dropped as unchanged\n";
+        info += "  validates: " + std::to_string(validates) + " executed, " +
+                std::to_string(validatesSkipped) + " skipped by presenting as is\n";
+        return info;
+    }
+
+   protected:
+    // Returns true when all commands are executed
+    bool executeCommands() {
         IComposerClient::Command command;
         uint16_t length = 0;
         while (!isEmpty()) {
@@ -63,32 +121,89 @@ class ComposerCommandEngine : protected CommandReaderBase {
                 break;
             }
 
-            bool parsed = executeCommand(command, length);
+            bool parsed = executeTrackedCommand(command, length);
             endCommand();
 
+            // the reader may be empty after the last command failed
             if (!parsed) {
                 ALOGE("failed to parse command 0x%x, length %" PRIu16, command, length);
-                break;
+                return false;
             }
         }
 
-        if (!isEmpty()) {
-            return Error::BAD_PARAMETER;
+        return isEmpty();
+    }
+
+    // Execute a command unless it would not change the layer state last sent
+    // to mHal, and note the changes that require the display to be validated
+    // again.  Only buffer changes let PRESENT_OR_VALIDATE_DISPLAY present as is.
+    bool executeTrackedCommand(IComposerClient::Command command, uint16_t length) {
+        switch (command) {
+            case IComposerClient::Command::SELECT_DISPLAY:
+            case IComposerClient::Command::SELECT_LAYER:
+            case IComposerClient::Command::SET_CLIENT_TARGET:
+            case IComposerClient::Command::SET_OUTPUT_BUFFER:
+            case IComposerClient::Command::VALIDATE_DISPLAY:
+            case IComposerClient::Command::ACCEPT_DISPLAY_CHANGES:
+            case IComposerClient::Command::PRESENT_DISPLAY:
+            case IComposerClient::Command::PRESENT_OR_VALIDATE_DISPLAY:
+            case IComposerClient::Command::SET_LAYER_CURSOR_POSITION:
+            case IComposerClient::Command::SET_LAYER_BUFFER:
+            case IComposerClient::Command::SET_LAYER_SURFACE_DAMAGE:
+                return executeCommand(command, length);
+            case IComposerClient::Command::SET_LAYER_BLEND_MODE:
+            case IComposerClient::Command::SET_LAYER_COLOR:
+            case IComposerClient::Command::SET_LAYER_COMPOSITION_TYPE:
+            case IComposerClient::Command::SET_LAYER_DATASPACE:
+            case IComposerClient::Command::SET_LAYER_DISPLAY_FRAME:
+            case IComposerClient::Command::SET_LAYER_PLANE_ALPHA:
+            case IComposerClient::Command::SET_LAYER_SOURCE_CROP:
+            case IComposerClient::Command::SET_LAYER_TRANSFORM:
+            case IComposerClient::Command::SET_LAYER_VISIBLE_REGION:
+            case IComposerClient::Command::SET_LAYER_Z_ORDER:
+                break;
+            default:
+                // anything else, including commands of later versions
+                mResources->setDisplayMustValidateState(mCurrentDisplay, true);
+                return executeCommand(command, length);
         }
 
-        return mWriter->writeQueue(outQueueChanged, outCommandLength, outCommandHandles)
-                       ? Error::NONE
-                       : Error::NO_RESOURCES;
+        const uint32_t opcode = static_cast<uint32_t>(command);
+        if (!mResources->updateLayerState(mCurrentDisplay, mCurrentLayer, opcode,
+                                          &mData[mDataRead], length)) {
+            mDataRead += length;
+            mLayerStateCommandsDropped++;
+            return true;
+        }
+
+        // a state command writes nothing but errors; a rejected state must
+        // not be dropped when it is sent again
+        uint32_t dataWritten = mWriter->getDataWritten();
+        bool parsed = executeCommand(command, length);
+        if (!parsed || mWriter->getDataWritten() != dataWritten) {
+            mResources->invalidateLayerState(mCurrentDisplay, mCurrentLayer, opcode);
+        }
+        mLayerStateCommandsExecuted++;
+
+        return parsed;
     }
 
-    const MQDescriptorSync<uint32_t>* getOutputMQDescriptor() { return mWriter->getMQDescriptor(); }
+    // The composition types mHal changed differ from the ones last sent
+    void invalidateCompositionTypes(const std::vector<Layer>& changedLayers) {
+        for (auto layer : changedLayers) {
+            mResources->invalidateLayerState(
+                    mCurrentDisplay, layer,
+                    static_cast<uint32_t>(IComposerClient::Command::SET_LAYER_COMPOSITION_TYPE));
+        }
+    }
 
-    void reset() {
-        CommandReaderBase::reset();
-        mWriter->reset();
+    // An engine of the same kind that executes the commands of one display
+    // for this engine.  Subclasses that add commands must override this, or
+    // return nullptr to always execute serially.
+    virtual std::unique_ptr<ComposerCommandEngine> createDisplayEngine() {
+        return std::make_unique<ComposerCommandEngine>(mHal, mResources);
     }
 
-   protected:
     virtual bool executeCommand(IComposerClient::Command command, uint16_t length) {
         switch (command) {
             case IComposerClient::Command::SELECT_DISPLAY:
@@ -156,6 +271,7 @@ class ComposerCommandEngine : protected CommandReaderBase {
         auto err = mHal->validateDisplay(mCurrentDisplay, &changedLayers, &compositionTypes,
                                          &displayRequestMask, &requestedLayers, &requestMasks);
         mResources->setDisplayMustValidateState(mCurrentDisplay, false);
+        invalidateCompositionTypes(changedLayers);
         if (err == Error::NONE) {
             mWriter->setChangedCompositionTypes(changedLayers, compositionTypes);
             mWriter->setDisplayRequests(displayRequestMask, requestedLayers, requestMasks);
@@ -275,6 +391,7 @@ class ComposerCommandEngine : protected CommandReaderBase {
             return false;
         }
         executeValidateDisplayInternal();
+        mValidates++;
         return true;
     }
 
@@ -295,12 +412,17 @@ class ComposerCommandEngine : protected CommandReaderBase {
                 mWriter->setPresentOrValidateResult(1);
                 mWriter->setPresentFence(presentFence);
                 mWriter->setReleaseFences(layers, fences);
+                // a validate executed since the last present was not skipped
+                if (!mResources->setDisplayPresented(mCurrentDisplay)) {
+                    mValidatesSkipped++;
+                }
                 return true;
             }
         }
 
         // Present has failed. We need to fallback to validate
         auto err = executeValidateDisplayInternal();
+        mValidates++;
         if (err == Error::NONE) {
             mWriter->setPresentOrValidateResult(0);
         }
@@ -331,6 +453,7 @@ class ComposerCommandEngine : protected CommandReaderBase {
         std::vector<int> fences;
         auto err = mHal->presentDisplay(mCurrentDisplay, &presentFence, &layers, &fences);
         if (err == Error::NONE) {
+            mResources->setDisplayPresented(mCurrentDisplay);
             mWriter->setPresentFence(presentFence);
             mWriter->setReleaseFences(layers, fences);
         } else {
@@ -576,8 +699,143 @@ class ComposerCommandEngine : protected CommandReaderBase {
         };
     }
 
+    // The commands between two SELECT_DISPLAYs, as offsets into the command
+    // stream, and where their results are in the writer of the display engine
+    struct DisplaySegment {
+        Display display;
+        uint32_t begin;
+        uint32_t end;
+        size_t engineIndex = 0;
+        uint32_t outputBegin = 0;
+        uint32_t outputEnd = 0;
+        bool parsed = false;
+    };
+
+    // Split the command stream at SELECT_DISPLAY.  Returns false when the
+    // stream is malformed; the serial path reports where.
+    bool splitDisplaySegments(std::vector<DisplaySegment>* outSegments) {
+        constexpr uint32_t opcodeMask =
+            static_cast<uint32_t>(IComposerClient::Command::OPCODE_MASK);
+        constexpr uint32_t lengthMask =
+            static_cast<uint32_t>(IComposerClient::Command::LENGTH_MASK);
+
+        const uint32_t size = getDataSize();
+        Display display = mCurrentDisplay;
+        uint32_t segmentBegin = 0;
+        uint32_t offset = 0;
+        while (offset < size) {
+            auto command = static_cast<IComposerClient::Command>(mData[offset] & opcodeMask);
+            uint32_t length = mData[offset] & lengthMask;
+            if (length >= size - offset) {
+                return false;
+            }
+
+            if (command == IComposerClient::Command::SELECT_DISPLAY) {
+                if (length != CommandWriterBase::kSelectDisplayLength) {
+                    return false;
+                }
+                if (offset > segmentBegin) {
+                    outSegments->push_back({display, segmentBegin, offset});
+                }
+                display = (static_cast<uint64_t>(mData[offset + 2]) << 32) | mData[offset + 1];
+                segmentBegin = offset;
+            }
+
+            offset += 1 + length;
+        }
+        if (offset > segmentBegin) {
+            outSegments->push_back({display, segmentBegin, offset});
+        }
+
+        return true;
+    }
+
+    // Execute the commands of each display on its own display engine, in
+    // parallel, and merge their results into mWriter in stream order.
+    // Returns false, without executing anything, when the commands are to be
+    // executed serially instead.
+    //
+    // A command that fails to parse stops the commands of its display only.
+    // Unlike with serial execution, commands of other displays that follow it
+    // in the stream may have been executed by then.  execute fails either way.
+    bool executeDisplaysConcurrently(bool* outParsed) {
+        if (!mHal->supportsConcurrentDisplays()) {
+            return false;
+        }
+
+        std::vector<DisplaySegment> segments;
+        if (!splitDisplaySegments(&segments)) {
+            return false;
+        }
+
+        // segments of the same display stay on one engine, in order
+        std::vector<Display> displays;
+        for (auto& segment : segments) {
+            auto it = std::find(displays.begin(), displays.end(), segment.display);
+            segment.engineIndex = it - displays.begin();
+            if (it == displays.end()) {
+                displays.push_back(segment.display);
+            }
+        }
+        if (displays.size() < 2) {
+            return false;
+        }
+
+        while (mDisplayEngines.size() < displays.size()) {
+            auto engine = createDisplayEngine();
+            if (!engine) {
+                return false;
+            }
+            mDisplayEngines.push_back(std::move(engine));
+        }
+        if (!mWorkers) {
+            mWorkers = std::make_unique<ComposerWorkerPool>(kMaxDisplayWorkers);
+        }
+
+        std::vector<std::function<void()>> tasks;
+        for (size_t i = 0; i < displays.size(); i++) {
+            ComposerCommandEngine* engine = mDisplayEngines[i].get();
+            engine->mCurrentDisplay = mCurrentDisplay;
+            engine->mCurrentLayer = mCurrentLayer;
+
+            tasks.emplace_back([this, engine, i, &segments]() {
+                for (auto& segment : segments) {
+                    if (segment.engineIndex != i) {
+                        continue;
+                    }
+
+                    segment.outputBegin = engine->mWriter->getDataWritten();
+                    segment.parsed = engine->readSegment(*this, segment.begin, segment.end) &&
+                                     engine->executeCommands();
+                    segment.outputEnd = engine->mWriter->getDataWritten();
+                    if (!segment.parsed) {
+                        break;
+                    }
+                }
+            });
+        }
+        mWorkers->run(tasks);
+
+        *outParsed = std::all_of(segments.begin(), segments.end(),
+                                 [](const auto& segment) { return segment.parsed; });
+        if (!*outParsed) {
+            return true;
+        }
+
+        for (const auto& segment : segments) {
+            ComposerCommandEngine* engine = mDisplayEngines[segment.engineIndex].get();
+            mWriter->appendCommands(*engine->mWriter, segment.outputBegin, segment.outputEnd);
+            mCurrentDisplay = engine->mCurrentDisplay;
+            mCurrentLayer = engine->mCurrentLayer;
+        }
+
+        return true;
+    }
+
     // 64KiB minus a small space for metadata such as read/write pointers
     static constexpr size_t kWriterInitialSize = 64 * 1024 / sizeof(uint32_t) - 16;
+    // the calling thread runs the commands of one display too
+    static constexpr size_t kMaxDisplayWorkers = 3;
 
     ComposerHal* mHal;
     ComposerResources* mResources;
@@ -585,6 +843,15 @@ class ComposerCommandEngine : protected CommandReaderBase {
 
     Display mCurrentDisplay = 0;
     Layer mCurrentLayer = 0;
+
+    uint32_t mInputQueueChanges = 0;
+    uint64_t mLayerStateCommandsExecuted = 0;
+    uint64_t mLayerStateCommandsDropped = 0;
+    uint64_t mValidates = 0;
+    uint64_t mValidatesSkipped = 0;
+
+    std::vector<std::unique_ptr<ComposerCommandEngine>> mDisplayEngines;
+    std::unique_ptr<ComposerWorkerPool> mWorkers;
 };
 
 }  // namespace hal
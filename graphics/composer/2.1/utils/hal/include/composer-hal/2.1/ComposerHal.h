@@ -49,6 +49,13 @@ class ComposerHal {
 
     virtual bool hasCapability(hwc2_capability_t capability) = 0;
 
+    // Whether calls for different displays may be made concurrently.  When
+    // true, the command engine executes the commands of each display in a
+    // batch on its own thread.  The calls for one display are still made from
+    // one thread at a time, in the order of its commands.  hwcomposer2 makes
+    // no such promise, so this is off unless an implementation opts in.
+    virtual bool supportsConcurrentDisplays() { return false; }
+
     // dump the debug information
     virtual std::string dumpDebugInfo() = 0;
 
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace hal {
+
+// A fixed set of threads that run batches of tasks for ComposerCommandEngine
+class ComposerWorkerPool {
+   public:
+    explicit ComposerWorkerPool(size_t threadCount) {
+        for (size_t i = 0; i < threadCount; i++) {
+            mThreads.emplace_back([this]() { threadLoop(); });
+        }
+    }
+
+    ~ComposerWorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExiting = true;
+        }
+        mCondition.notify_all();
+
+        for (auto& thread : mThreads) {
+            thread.join();
+        }
+    }
+
+    // Run all tasks and return when they are done.  The calling thread runs
+    // the first task itself.
+    void run(std::vector<std::function<void()>>& tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (size_t i = 1; i < tasks.size(); i++) {
+                mTasks.push_back(&tasks[i]);
+            }
+            mPendingTasks = tasks.size() - 1;
+        }
+        mCondition.notify_all();
+
+        tasks[0]();
+
+        // help out rather than wait when there are more tasks than threads
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mTasks.empty()) {
+            runOneLocked(lock);
+        }
+        mDoneCondition.wait(lock, [this]() { return mPendingTasks == 0; });
+    }
+
+   private:
+    void threadLoop() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            mCondition.wait(lock, [this]() { return mExiting || !mTasks.empty(); });
+            if (mExiting) {
+                return;
+            }
+            runOneLocked(lock);
+        }
+    }
+
+    void runOneLocked(std::unique_lock<std::mutex>& lock) {
+        std::function<void()>* task = mTasks.front();
+        mTasks.pop_front();
+
+        lock.unlock();
+        (*task)();
+        lock.lock();
+
+        if (--mPendingTasks == 0) {
+            mDoneCondition.notify_all();
+        }
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::condition_variable mDoneCondition;
+    std::deque<std::function<void()>*> mTasks;
+    size_t mPendingTasks = 0;
+    bool mExiting = false;
+
+    std::vector<std::thread> mThreads;
+};
+
+}  // namespace hal
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
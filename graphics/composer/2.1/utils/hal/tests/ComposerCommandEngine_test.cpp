@@ -0,0 +1,457 @@
+/*
+ * Copyright 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ComposerCommandEngineTest"
+
+#include <composer-hal/2.1/ComposerCommandEngine.h>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace hal {
+namespace {
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+using ::testing::NiceMock;
+using ::testing::Return;
+using ::testing::Sequence;
+using ::testing::SetArgPointee;
+
+class MockComposerHal : public ComposerHal {
+   public:
+    MOCK_METHOD1(hasCapability, bool(hwc2_capability_t));
+    MOCK_METHOD0(supportsConcurrentDisplays, bool());
+    MOCK_METHOD0(dumpDebugInfo, std::string());
+    MOCK_METHOD1(registerEventCallback, void(EventCallback*));
+    MOCK_METHOD0(unregisterEventCallback, void());
+    MOCK_METHOD0(getMaxVirtualDisplayCount, uint32_t());
+    MOCK_METHOD4(createVirtualDisplay, Error(uint32_t, uint32_t, PixelFormat*, Display*));
+    MOCK_METHOD1(destroyVirtualDisplay, Error(Display));
+    MOCK_METHOD2(createLayer, Error(Display, Layer*));
+    MOCK_METHOD2(destroyLayer, Error(Display, Layer));
+    MOCK_METHOD2(getActiveConfig, Error(Display, Config*));
+    MOCK_METHOD5(getClientTargetSupport,
+                 Error(Display, uint32_t, uint32_t, PixelFormat, Dataspace));
+    MOCK_METHOD2(getColorModes, Error(Display, hidl_vec<ColorMode>*));
+    MOCK_METHOD4(getDisplayAttribute,
+                 Error(Display, Config, IComposerClient::Attribute, int32_t*));
+    MOCK_METHOD2(getDisplayConfigs, Error(Display, hidl_vec<Config>*));
+    MOCK_METHOD2(getDisplayName, Error(Display, hidl_string*));
+    MOCK_METHOD2(getDisplayType, Error(Display, IComposerClient::DisplayType*));
+    MOCK_METHOD2(getDozeSupport, Error(Display, bool*));
+    MOCK_METHOD5(getHdrCapabilities, Error(Display, hidl_vec<Hdr>*, float*, float*, float*));
+    MOCK_METHOD2(setActiveConfig, Error(Display, Config));
+    MOCK_METHOD2(setColorMode, Error(Display, ColorMode));
+    MOCK_METHOD2(setPowerMode, Error(Display, IComposerClient::PowerMode));
+    MOCK_METHOD2(setVsyncEnabled, Error(Display, IComposerClient::Vsync));
+    MOCK_METHOD3(setColorTransform, Error(Display, const float*, int32_t));
+    MOCK_METHOD5(setClientTarget, Error(Display, buffer_handle_t, int32_t, int32_t,
+                                        const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setOutputBuffer, Error(Display, buffer_handle_t, int32_t));
+    MOCK_METHOD6(validateDisplay,
+                 Error(Display, std::vector<Layer>*, std::vector<IComposerClient::Composition>*,
+                       uint32_t*, std::vector<Layer>*, std::vector<uint32_t>*));
+    MOCK_METHOD1(acceptDisplayChanges, Error(Display));
+    MOCK_METHOD4(presentDisplay,
+                 Error(Display, int32_t*, std::vector<Layer>*, std::vector<int32_t>*));
+    MOCK_METHOD4(setLayerCursorPosition, Error(Display, Layer, int32_t, int32_t));
+    MOCK_METHOD4(setLayerBuffer, Error(Display, Layer, buffer_handle_t, int32_t));
+    MOCK_METHOD3(setLayerSurfaceDamage, Error(Display, Layer, const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setLayerBlendMode, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerColor, Error(Display, Layer, IComposerClient::Color));
+    MOCK_METHOD3(setLayerCompositionType, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerDataspace, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerDisplayFrame, Error(Display, Layer, const hwc_rect_t&));
+    MOCK_METHOD3(setLayerPlaneAlpha, Error(Display, Layer, float));
+    MOCK_METHOD3(setLayerSidebandStream, Error(Display, Layer, buffer_handle_t));
+    MOCK_METHOD3(setLayerSourceCrop, Error(Display, Layer, const hwc_frect_t&));
+    MOCK_METHOD3(setLayerTransform, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerVisibleRegion, Error(Display, Layer, const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setLayerZOrder, Error(Display, Layer, uint32_t));
+};
+
+constexpr Display kDisplay = 1;
+constexpr Layer kLayer = 2;
+constexpr Display kDisplay2 = 3;
+constexpr Layer kLayer2 = 4;
+
+constexpr int32_t kPremultiplied = static_cast<int32_t>(IComposerClient::BlendMode::PREMULTIPLIED);
+constexpr int32_t kCoverage = static_cast<int32_t>(IComposerClient::BlendMode::COVERAGE);
+constexpr int32_t kDevice = static_cast<int32_t>(IComposerClient::Composition::DEVICE);
+
+class TestCommandWriter : public CommandWriterBase {
+   public:
+    using CommandWriterBase::CommandWriterBase;
+
+    // a command no version of the engine parses
+    void unknownCommand() {
+        beginCommand(static_cast<IComposerClient::Command>(0x7ff << 16), 0);
+        endCommand();
+    }
+};
+
+// Lists the displays selected and the errors set by the engine
+class TestCommandReader : public CommandReaderBase {
+   public:
+    std::vector<std::string> parse() {
+        std::vector<std::string> results;
+        IComposerClient::Command command;
+        uint16_t length = 0;
+        while (!isEmpty() && beginCommand(&command, &length)) {
+            switch (command) {
+                case IComposerClient::Command::SELECT_DISPLAY:
+                    results.push_back("display " + std::to_string(read64()));
+                    break;
+                case IComposerClient::Command::SET_ERROR: {
+                    uint32_t loc = read();
+                    int32_t err = readSigned();
+                    results.push_back("error " + std::to_string(err) + " at " +
+                                      std::to_string(loc));
+                    break;
+                }
+                default:
+                    for (uint16_t i = 0; i < length; i++) {
+                        read();
+                    }
+                    break;
+            }
+            endCommand();
+        }
+        return results;
+    }
+};
+
+class ComposerCommandEngineTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        // buffers are never imported, so the resources need no mapper
+        ASSERT_EQ(Error::NONE, mResources.addPhysicalDisplay(kDisplay));
+        ASSERT_EQ(Error::NONE, mResources.addLayer(kDisplay, kLayer, 1));
+
+        ON_CALL(mHal, hasCapability(HWC2_CAPABILITY_SKIP_VALIDATE)).WillByDefault(Return(true));
+    }
+
+    // start the commands of a frame for kLayer
+    void selectLayer() {
+        mWriter.selectDisplay(kDisplay);
+        mWriter.selectLayer(kLayer);
+    }
+
+    // the commands SurfaceFlinger sends after a validate that changed nothing
+    void acceptAndPresent() {
+        mWriter.acceptDisplayChanges();
+        mWriter.presentDisplay();
+    }
+
+    void execute(Error expectedError = Error::NONE) {
+        bool queueChanged = false;
+        uint32_t commandLength = 0;
+        hidl_vec<hidl_handle> commandHandles;
+        ASSERT_TRUE(mWriter.writeQueue(&queueChanged, &commandLength, &commandHandles));
+        if (queueChanged) {
+            ASSERT_TRUE(mEngine.setInputMQDescriptor(*mWriter.getMQDescriptor()));
+        }
+
+        bool outQueueChanged = false;
+        uint32_t outCommandLength = 0;
+        hidl_vec<hidl_handle> outCommandHandles;
+        ASSERT_EQ(expectedError, mEngine.execute(commandLength, commandHandles, &outQueueChanged,
+                                                 &outCommandLength, &outCommandHandles));
+        mWriter.reset();
+        if (expectedError != Error::NONE) {
+            mEngine.reset();
+            return;
+        }
+
+        if (outQueueChanged) {
+            ASSERT_TRUE(mReader.setMQDescriptor(*mEngine.getOutputMQDescriptor()));
+        }
+        ASSERT_TRUE(mReader.readQueue(outCommandLength, outCommandHandles));
+        mResults = mReader.parse();
+        mEngine.reset();
+    }
+
+    // a second display with one layer, whose calls may overlap those of kDisplay
+    void addConcurrentDisplay() {
+        ASSERT_EQ(Error::NONE, mResources.addPhysicalDisplay(kDisplay2));
+        ASSERT_EQ(Error::NONE, mResources.addLayer(kDisplay2, kLayer2, 1));
+        ON_CALL(mHal, supportsConcurrentDisplays()).WillByDefault(Return(true));
+    }
+
+    void selectLayer(Display display, Layer layer) {
+        mWriter.selectDisplay(display);
+        mWriter.selectLayer(layer);
+    }
+
+    NiceMock<MockComposerHal> mHal;
+    ComposerResources mResources;
+    ComposerCommandEngine mEngine{&mHal, &mResources};
+    TestCommandWriter mWriter{1024};
+    TestCommandReader mReader;
+    std::vector<std::string> mResults;
+};
+
+TEST_F(ComposerCommandEngineTest, dropsUnchangedLayerState) {
+    EXPECT_CALL(mHal, setLayerBlendMode(kDisplay, kLayer, kPremultiplied)).Times(1);
+    EXPECT_CALL(mHal, setLayerBlendMode(kDisplay, kLayer, kCoverage)).Times(1);
+
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    execute();
+
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::COVERAGE);
+    execute();
+
+    EXPECT_THAT(mEngine.dumpDebugInfo(),
+                HasSubstr("layer state commands: 2 executed, 2 dropped as unchanged"));
+}
+
+TEST_F(ComposerCommandEngineTest, resendsLayerStateRejectedByHal) {
+    EXPECT_CALL(mHal, setLayerBlendMode(kDisplay, kLayer, kPremultiplied))
+            .WillOnce(Return(Error::BAD_PARAMETER))
+            .WillOnce(Return(Error::NONE));
+
+    // the second command is sent again after an error, the third is not
+    for (int i = 0; i < 3; i++) {
+        selectLayer();
+        mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+        execute();
+    }
+}
+
+TEST_F(ComposerCommandEngineTest, resendsCompositionTypeChangedByValidate) {
+    EXPECT_CALL(mHal, setLayerCompositionType(kDisplay, kLayer, kDevice)).Times(2);
+    EXPECT_CALL(mHal, validateDisplay(kDisplay, _, _, _, _, _))
+            .WillOnce(DoAll(SetArgPointee<1>(std::vector<Layer>{kLayer}),
+                            SetArgPointee<2>(std::vector<IComposerClient::Composition>{
+                                    IComposerClient::Composition::CLIENT}),
+                            Return(Error::NONE)));
+    EXPECT_CALL(mHal, acceptDisplayChanges(kDisplay)).Times(1);
+
+    // the HAL now composes the layer as CLIENT, which the next frame undoes
+    selectLayer();
+    mWriter.setLayerCompositionType(IComposerClient::Composition::DEVICE);
+    mWriter.validateDisplay();
+    acceptAndPresent();
+    execute();
+
+    selectLayer();
+    mWriter.setLayerCompositionType(IComposerClient::Composition::DEVICE);
+    execute();
+}
+
+TEST_F(ComposerCommandEngineTest, keepsCompositionTypeUnchangedByValidate) {
+    EXPECT_CALL(mHal, setLayerCompositionType(kDisplay, kLayer, kDevice)).Times(1);
+    EXPECT_CALL(mHal, validateDisplay(kDisplay, _, _, _, _, _)).Times(1);
+
+    selectLayer();
+    mWriter.setLayerCompositionType(IComposerClient::Composition::DEVICE);
+    mWriter.validateDisplay();
+    acceptAndPresent();
+    execute();
+
+    selectLayer();
+    mWriter.setLayerCompositionType(IComposerClient::Composition::DEVICE);
+    execute();
+}
+
+TEST_F(ComposerCommandEngineTest, presentOrValidateValidatesChangedDisplays) {
+    EXPECT_CALL(mHal, validateDisplay(kDisplay, _, _, _, _, _)).Times(3);
+    EXPECT_CALL(mHal, presentDisplay(kDisplay, _, _, _)).Times(4);
+
+    // a new display has never been validated
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    mWriter.presentOrvalidateDisplay();
+    acceptAndPresent();
+    execute();
+
+    // only buffers changed
+    selectLayer();
+    mWriter.setLayerCursorPosition(1, 2);
+    mWriter.presentOrvalidateDisplay();
+    execute();
+
+    // a layer state changed
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::COVERAGE);
+    mWriter.presentOrvalidateDisplay();
+    acceptAndPresent();
+    execute();
+
+    // a command the layer state does not track
+    const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    mWriter.selectDisplay(kDisplay);
+    mWriter.setColorTransform(identity, ColorTransform::IDENTITY);
+    mWriter.presentOrvalidateDisplay();
+    acceptAndPresent();
+    execute();
+
+    EXPECT_THAT(mEngine.dumpDebugInfo(), HasSubstr("validates: 3 executed, 1 skipped"));
+}
+
+TEST_F(ComposerCommandEngineTest, presentOrValidateValidatesWithoutSkipValidate) {
+    ON_CALL(mHal, hasCapability(HWC2_CAPABILITY_SKIP_VALIDATE)).WillByDefault(Return(false));
+    EXPECT_CALL(mHal, validateDisplay(kDisplay, _, _, _, _, _)).Times(2);
+
+    for (int i = 0; i < 2; i++) {
+        selectLayer();
+        mWriter.setLayerCursorPosition(1, 2);
+        mWriter.presentOrvalidateDisplay();
+        acceptAndPresent();
+        execute();
+    }
+
+    EXPECT_THAT(mEngine.dumpDebugInfo(), HasSubstr("validates: 2 executed, 0 skipped"));
+}
+
+TEST_F(ComposerCommandEngineTest, countsOnlyPresentsWithoutChanges) {
+    EXPECT_CALL(mHal, validateDisplay(kDisplay, _, _, _, _, _)).Times(1);
+    EXPECT_CALL(mHal, presentDisplay(kDisplay, _, _, _)).Times(2);
+
+    // presents as is, but after a validate
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    mWriter.validateDisplay();
+    mWriter.presentOrvalidateDisplay();
+    execute();
+
+    selectLayer();
+    mWriter.setLayerBlendMode(IComposerClient::BlendMode::PREMULTIPLIED);
+    mWriter.presentOrvalidateDisplay();
+    execute();
+
+    EXPECT_THAT(mEngine.dumpDebugInfo(), HasSubstr("validates: 1 executed, 1 skipped"));
+}
+
+TEST_F(ComposerCommandEngineTest, concurrentDisplaysKeepCommandOrderOfEachDisplay) {
+    addConcurrentDisplay();
+    Sequence sequence1, sequence2;
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 1))
+            .InSequence(sequence1)
+            .WillOnce(Return(Error::BAD_LAYER));
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 2))
+            .InSequence(sequence1)
+            .WillOnce(Return(Error::BAD_LAYER));
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay2, kLayer2, 1))
+            .InSequence(sequence2)
+            .WillOnce(Return(Error::BAD_LAYER));
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay2, kLayer2, 2))
+            .InSequence(sequence2)
+            .WillOnce(Return(Error::BAD_LAYER));
+
+    // each display selects for 8 words, then sets the z-order
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(1);
+    selectLayer(kDisplay2, kLayer2);
+    mWriter.setLayerZOrder(1);
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(2);
+    selectLayer(kDisplay2, kLayer2);
+    mWriter.setLayerZOrder(2);
+    execute();
+
+    // the results are in stream order, with locations in the whole stream
+    EXPECT_THAT(mResults, ElementsAre("display 1", "error 3 at 6", "display 3", "error 3 at 14",
+                                      "display 1", "error 3 at 22", "display 3",
+                                      "error 3 at 30"));
+}
+
+TEST_F(ComposerCommandEngineTest, concurrentDisplayStopsAtUnknownCommand) {
+    addConcurrentDisplay();
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 1)).Times(1);
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 2)).Times(1);
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay2, kLayer2, _)).Times(0);
+
+    // the other display goes on
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(1);
+    selectLayer(kDisplay2, kLayer2);
+    mWriter.unknownCommand();
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(2);
+    selectLayer(kDisplay2, kLayer2);
+    mWriter.setLayerZOrder(2);
+    execute(Error::BAD_PARAMETER);
+}
+
+TEST_F(ComposerCommandEngineTest, serialDisplaysStopAtUnknownCommand) {
+    ASSERT_EQ(Error::NONE, mResources.addPhysicalDisplay(kDisplay2));
+    ASSERT_EQ(Error::NONE, mResources.addLayer(kDisplay2, kLayer2, 1));
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 1)).Times(1);
+    EXPECT_CALL(mHal, setLayerZOrder(kDisplay, kLayer, 2)).Times(0);
+
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(1);
+    selectLayer(kDisplay2, kLayer2);
+    mWriter.unknownCommand();
+    selectLayer(kDisplay, kLayer);
+    mWriter.setLayerZOrder(2);
+    execute(Error::BAD_PARAMETER);
+}
+
+// The writer keeps its queue when a pending shrink would reallocate it at the
+// same size
+TEST(CommandWriterBaseTest, keepsQueueWhenShrinkWouldNotShrinkIt) {
+    TestCommandWriter writer(1024);
+    auto writeBatch = [&writer](size_t damageRects) {
+        writer.selectDisplay(kDisplay);
+        writer.setLayerSurfaceDamage(std::vector<IComposerClient::Rect>(damageRects));
+        bool queueChanged = false;
+        uint32_t commandLength = 0;
+        hidl_vec<hidl_handle> commandHandles;
+        EXPECT_TRUE(writer.writeQueue(&queueChanged, &commandLength, &commandHandles));
+        writer.reset();
+        return queueChanged;
+    };
+
+    // about 2400 words grow the queue to 4096, then it stays underused
+    EXPECT_TRUE(writeBatch(600));
+    for (int i = 0; i < 256; i++) {
+        EXPECT_FALSE(writeBatch(1));
+    }
+
+    // half the queue is too small for this batch
+    EXPECT_FALSE(writeBatch(600));
+    EXPECT_EQ(4096u, writer.getQueueSize());
+    EXPECT_EQ(0u, writer.getQueueShrinkCount());
+
+    for (int i = 0; i < 256; i++) {
+        EXPECT_FALSE(writeBatch(1));
+    }
+    EXPECT_TRUE(writeBatch(1));
+    EXPECT_EQ(2048u, writer.getQueueSize());
+    EXPECT_EQ(1u, writer.getQueueShrinkCount());
+}
+
+}  // namespace
+}  // namespace hal
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
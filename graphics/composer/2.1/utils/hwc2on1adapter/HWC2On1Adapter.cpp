@@ -25,8 +25,10 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 
 #include <hardware/hwcomposer.h>
@@ -98,15 +100,16 @@ HWC2On1Adapter::HWC2On1Adapter(hwc_composer_device_1_t* hwc1Device)
     mHwc1SupportsBackgroundColor(false),
     mHwc1Callbacks(std::make_unique<Callbacks>(*this)),
     mCapabilities(),
+    mStateMutex(),
+    mDisplayMutex(),
     mLayers(),
     mHwc1VirtualDisplay(),
-    mStateMutex(),
-    mCallbacks(),
-    mHasPendingInvalidate(false),
-    mPendingVsyncs(),
-    mPendingHotplugs(),
     mDisplays(),
-    mHwc1DisplayMap()
+    mHwc1DisplayMap(),
+    mHotplugDelivery(),
+    mRefreshDelivery(),
+    mVsyncDelivery(),
+    mHasPendingInvalidate(false)
 {
     common.close = closeHook;
     getCapabilities = getCapabilitiesHook;
@@ -315,7 +318,14 @@ hwc2_function_pointer_t HWC2On1Adapter::doGetFunction(
 
 Error HWC2On1Adapter::createVirtualDisplay(uint32_t width,
         uint32_t height, hwc2_display_t* outDisplay) {
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+    // Set up the display before publishing it, as mDisplayMutex must not be
+    // held while calling into it
+    auto display = std::make_shared<HWC2On1Adapter::Display>(*this,
+            HWC2::DisplayType::Virtual);
+    display->populateConfigs(width, height);
+    display->setHwc1Id(HWC_DISPLAY_VIRTUAL);
+
+    std::unique_lock<std::shared_timed_mutex> lock(mDisplayMutex);
 
     if (mHwc1VirtualDisplay) {
         // We have already allocated our only HWC1 virtual display
@@ -323,12 +333,9 @@ Error HWC2On1Adapter::createVirtualDisplay(uint32_t width,
         return Error::NoResources;
     }
 
-    mHwc1VirtualDisplay = std::make_shared<HWC2On1Adapter::Display>(*this,
-            HWC2::DisplayType::Virtual);
-    mHwc1VirtualDisplay->populateConfigs(width, height);
+    mHwc1VirtualDisplay = std::move(display);
     const auto displayId = mHwc1VirtualDisplay->getId();
     mHwc1DisplayMap[HWC_DISPLAY_VIRTUAL] = displayId;
-    mHwc1VirtualDisplay->setHwc1Id(HWC_DISPLAY_VIRTUAL);
     mDisplays.emplace(displayId, mHwc1VirtualDisplay);
     *outDisplay = displayId;
 
@@ -336,7 +343,7 @@ Error HWC2On1Adapter::createVirtualDisplay(uint32_t width,
 }
 
 Error HWC2On1Adapter::destroyVirtualDisplay(hwc2_display_t displayId) {
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+    std::unique_lock<std::shared_timed_mutex> lock(mDisplayMutex);
 
     if (!mHwc1VirtualDisplay || (mHwc1VirtualDisplay->getId() != displayId)) {
         return Error::BadDisplay;
@@ -365,7 +372,7 @@ void HWC2On1Adapter::dump(uint32_t* outSize, char* outBuffer) {
 
     // Attempt to acquire the lock for 1 second, but proceed without the lock
     // after that, so we can still get some information if we're deadlocked
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex,
+    std::shared_lock<std::shared_timed_mutex> lock(mDisplayMutex,
             std::defer_lock);
     lock.try_lock_for(1s);
 
@@ -378,17 +385,23 @@ void HWC2On1Adapter::dump(uint32_t* outSize, char* outBuffer) {
         }
     }
 
-    output << "Displays:\n";
+    std::vector<std::shared_ptr<Display>> displays;
     for (const auto& element : mDisplays) {
-        const auto& display = element.second;
+        displays.emplace_back(element.second);
+    }
+
+    // Release the lock before calling into the displays and HWC1, since we no
+    // longer require mutual exclusion to access mDisplays
+    if (lock.owns_lock()) {
+        lock.unlock();
+    }
+
+    output << "Displays:\n";
+    for (const auto& display : displays) {
         output << display->dump();
     }
     output << '\n';
 
-    // Release the lock before calling into HWC1, and since we no longer require
-    // mutual exclusion to access mCapabilities or mDisplays
-    lock.unlock();
-
     if (mHwc1Device->dump) {
         output << "HWC1 dump:\n";
         std::vector<char> hwc1Dump(4096);
@@ -424,81 +437,51 @@ Error HWC2On1Adapter::registerCallback(Callback descriptor,
     ALOGV("registerCallback(%s, %p, %p)", to_string(descriptor).c_str(),
             callbackData, pointer);
 
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
-
-    if (pointer != nullptr) {
-        mCallbacks[descriptor] = {callbackData, pointer};
-    } else {
+    // Held until the queued events are delivered, so that they follow the
+    // primary hotplug and no event of this kind overtakes them
+    CallbackDelivery& delivery = getCallbackDelivery(descriptor);
+    std::lock_guard<std::mutex> lock(delivery.mutex);
+    if (pointer == nullptr) {
         ALOGI("unregisterCallback(%s)", to_string(descriptor).c_str());
-        mCallbacks.erase(descriptor);
+        delivery.data = nullptr;
+        delivery.pointer = nullptr;
         return Error::None;
     }
-
-    bool hasPendingInvalidate = false;
-    std::vector<hwc2_display_t> displayIds;
-    std::vector<std::pair<hwc2_display_t, int64_t>> pendingVsyncs;
-    std::vector<std::pair<hwc2_display_t, int>> pendingHotplugs;
+    delivery.data = callbackData;
+    delivery.pointer = pointer;
 
     if (descriptor == Callback::Refresh) {
-        hasPendingInvalidate = mHasPendingInvalidate;
-        if (hasPendingInvalidate) {
-            for (auto& displayPair : mDisplays) {
-                displayIds.emplace_back(displayPair.first);
-            }
+        if (mHasPendingInvalidate) {
+            mHasPendingInvalidate = false;
+            refreshAllDisplays();
         }
-        mHasPendingInvalidate = false;
     } else if (descriptor == Callback::Vsync) {
-        for (auto pending : mPendingVsyncs) {
-            auto hwc1DisplayId = pending.first;
-            if (mHwc1DisplayMap.count(hwc1DisplayId) == 0) {
-                ALOGE("hwc1Vsync: Couldn't find display for HWC1 id %d",
-                        hwc1DisplayId);
-                continue;
-            }
-            auto displayId = mHwc1DisplayMap[hwc1DisplayId];
-            auto timestamp = pending.second;
-            pendingVsyncs.emplace_back(displayId, timestamp);
+        auto vsync = reinterpret_cast<HWC2_PFN_VSYNC>(pointer);
+        for (const auto& event : delivery.pendingEvents) {
+            vsync(callbackData, event.displayId, event.value);
         }
-        mPendingVsyncs.clear();
+        delivery.pendingEvents.clear();
     } else if (descriptor == Callback::Hotplug) {
         // Hotplug the primary display
-        pendingHotplugs.emplace_back(mHwc1DisplayMap[HWC_DISPLAY_PRIMARY],
-                static_cast<int32_t>(Connection::Connected));
-
-        for (auto pending : mPendingHotplugs) {
-            auto hwc1DisplayId = pending.first;
-            if (mHwc1DisplayMap.count(hwc1DisplayId) == 0) {
-                ALOGE("hwc1Hotplug: Couldn't find display for HWC1 id %d",
-                        hwc1DisplayId);
-                continue;
+        hwc2_display_t primaryDisplayId = 0;
+        {
+            std::shared_lock<std::shared_timed_mutex> displayLock(mDisplayMutex);
+            auto primary = mHwc1DisplayMap.find(HWC_DISPLAY_PRIMARY);
+            if (primary != mHwc1DisplayMap.end()) {
+                primaryDisplayId = primary->second;
             }
-            auto displayId = mHwc1DisplayMap[hwc1DisplayId];
-            auto connected = pending.second;
-            pendingHotplugs.emplace_back(displayId, connected);
-        }
-    }
-
-    // Call pending callbacks without the state lock held
-    lock.unlock();
-
-    if (hasPendingInvalidate) {
-        auto refresh = reinterpret_cast<HWC2_PFN_REFRESH>(pointer);
-        for (auto displayId : displayIds) {
-            refresh(callbackData, displayId);
         }
-    }
-    if (!pendingVsyncs.empty()) {
-        auto vsync = reinterpret_cast<HWC2_PFN_VSYNC>(pointer);
-        for (auto& pendingVsync : pendingVsyncs) {
-            vsync(callbackData, pendingVsync.first, pendingVsync.second);
-        }
-    }
-    if (!pendingHotplugs.empty()) {
         auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer);
-        for (auto& pendingHotplug : pendingHotplugs) {
-            hotplug(callbackData, pendingHotplug.first, pendingHotplug.second);
+        hotplug(callbackData, primaryDisplayId,
+                static_cast<int32_t>(Connection::Connected));
+
+        for (const auto& event : delivery.pendingEvents) {
+            hotplug(callbackData, event.displayId,
+                    static_cast<int32_t>(event.value));
         }
+        delivery.pendingEvents.clear();
     }
+
     return Error::None;
 }
 
@@ -511,6 +494,7 @@ HWC2On1Adapter::Display::Display(HWC2On1Adapter& device, HWC2::DisplayType type)
     mDevice(device),
     mStateMutex(),
     mHwc1RequestedContents(nullptr),
+    mHwc1LayerCapacity(0),
     mRetireFence(),
     mChanges(),
     mHwc1Id(-1),
@@ -526,8 +510,7 @@ HWC2On1Adapter::Display::Display(HWC2On1Adapter& device, HWC2::DisplayType type)
     mHasColorTransform(false),
     mLayers(),
     mHwc1LayerMap(),
-    mNumAvailableRects(0),
-    mNextAvailableRect(nullptr),
+    mHwc1TargetRect(),
     mGeometryChanged(false),
     mHasPrepare(false),
     mHasSet(false)
@@ -543,18 +526,20 @@ Error HWC2On1Adapter::Display::acceptChanges() {
 
     ALOGV("[%" PRIu64 "] acceptChanges", mId);
 
+    std::shared_lock<std::shared_timed_mutex> deviceLock(mDevice.mDisplayMutex);
     for (auto& change : mChanges->getTypeChanges()) {
         auto layerId = change.first;
         auto type = change.second;
-        if (mDevice.mLayers.count(layerId) == 0) {
+        auto mapLayer = mDevice.mLayers.find(layerId);
+        if (mapLayer == mDevice.mLayers.end()) {
             // This should never happen but somehow does.
             ALOGW("Cannot accept change for unknown layer (%" PRIu64 ")",
                   layerId);
             continue;
         }
-        auto layer = mDevice.mLayers[layerId];
-        layer->setCompositionType(type);
+        mapLayer->second->setCompositionType(type);
     }
+    deviceLock.unlock();
 
     mChanges->clearTypeChanges();
 
@@ -565,7 +550,11 @@ Error HWC2On1Adapter::Display::createLayer(hwc2_layer_t* outLayerId) {
     std::unique_lock<std::recursive_mutex> lock(mStateMutex);
 
     auto layer = *mLayers.emplace(std::make_shared<Layer>(*this));
-    mDevice.mLayers.emplace(std::make_pair(layer->getId(), layer));
+    {
+        std::unique_lock<std::shared_timed_mutex> deviceLock(
+                mDevice.mDisplayMutex);
+        mDevice.mLayers.emplace(std::make_pair(layer->getId(), layer));
+    }
     *outLayerId = layer->getId();
     ALOGV("[%" PRIu64 "] created layer %" PRIu64, mId, *outLayerId);
     markGeometryChanged();
@@ -575,6 +564,7 @@ Error HWC2On1Adapter::Display::createLayer(hwc2_layer_t* outLayerId) {
 Error HWC2On1Adapter::Display::destroyLayer(hwc2_layer_t layerId) {
     std::unique_lock<std::recursive_mutex> lock(mStateMutex);
 
+    std::unique_lock<std::shared_timed_mutex> deviceLock(mDevice.mDisplayMutex);
     const auto mapLayer = mDevice.mLayers.find(layerId);
     if (mapLayer == mDevice.mLayers.end()) {
         ALOGV("[%" PRIu64 "] destroyLayer(%" PRIu64 ") failed: no such layer",
@@ -583,6 +573,7 @@ Error HWC2On1Adapter::Display::destroyLayer(hwc2_layer_t layerId) {
     }
     const auto layer = mapLayer->second;
     mDevice.mLayers.erase(mapLayer);
+    deviceLock.unlock();
     const auto zRange = mLayers.equal_range(layer);
     for (auto current = zRange.first; current != zRange.second; ++current) {
         if (**current == *layer) {
@@ -1002,6 +993,7 @@ Error HWC2On1Adapter::Display::validate(uint32_t* outNumTypes,
 Error HWC2On1Adapter::Display::updateLayerZ(hwc2_layer_t layerId, uint32_t z) {
     std::unique_lock<std::recursive_mutex> lock(mStateMutex);
 
+    std::shared_lock<std::shared_timed_mutex> deviceLock(mDevice.mDisplayMutex);
     const auto mapLayer = mDevice.mLayers.find(layerId);
     if (mapLayer == mDevice.mLayers.end()) {
         ALOGE("[%" PRIu64 "] updateLayerZ failed to find layer", mId);
@@ -1009,6 +1001,7 @@ Error HWC2On1Adapter::Display::updateLayerZ(hwc2_layer_t layerId, uint32_t z) {
     }
 
     const auto layer = mapLayer->second;
+    deviceLock.unlock();
     const auto zRange = mLayers.equal_range(layer);
     bool layerOnDisplay = false;
     for (auto current = zRange.first; current != zRange.second; ++current) {
@@ -1237,8 +1230,6 @@ bool HWC2On1Adapter::Display::prepare() {
     mHwc1RequestedContents->numHwLayers = mLayers.size() + 1;
     for (auto& layer : mLayers) {
         auto& hwc1Layer = mHwc1RequestedContents->hwLayers[layer->getHwc1Id()];
-        hwc1Layer.releaseFenceFd = -1;
-        hwc1Layer.acquireFenceFd = -1;
         ALOGV("Applying states for layer %" PRIu64 " ", layer->getId());
         layer->applyState(hwc1Layer);
     }
@@ -1258,7 +1249,7 @@ void HWC2On1Adapter::Display::generateChanges() {
     size_t numLayers = mHwc1RequestedContents->numHwLayers;
     for (size_t hwc1Id = 0; hwc1Id < numLayers; ++hwc1Id) {
         const auto& receivedLayer = mHwc1RequestedContents->hwLayers[hwc1Id];
-        if (mHwc1LayerMap.count(hwc1Id) == 0) {
+        if (hwc1Id >= mHwc1LayerMap.size()) {
             ALOGE_IF(receivedLayer.compositionType != HWC_FRAMEBUFFER_TARGET,
                     "generateChanges: HWC1 layer %zd doesn't have a"
                     " matching HWC2 layer, and isn't the framebuffer target",
@@ -1326,7 +1317,7 @@ void HWC2On1Adapter::Display::addReleaseFences(
     size_t numLayers = hwcContents.numHwLayers;
     for (size_t hwc1Id = 0; hwc1Id < numLayers; ++hwc1Id) {
         const auto& receivedLayer = hwcContents.hwLayers[hwc1Id];
-        if (mHwc1LayerMap.count(hwc1Id) == 0) {
+        if (hwc1Id >= mHwc1LayerMap.size()) {
             if (receivedLayer.compositionType != HWC_FRAMEBUFFER_TARGET) {
                 ALOGE("addReleaseFences: HWC1 layer %zd doesn't have a"
                         " matching HWC2 layer, and isn't the framebuffer"
@@ -1560,31 +1551,14 @@ std::string HWC2On1Adapter::Display::dump() const {
     }
 
     if (mHwc1RequestedContents) {
-        output << "    Last requested HWC1 state\n";
+        output << "    Last requested HWC1 state (room for " <<
+                mHwc1LayerCapacity << " layers)\n";
         output << to_string(*mHwc1RequestedContents, mDevice.mHwc1MinorVersion);
     }
 
     return output.str();
 }
 
-hwc_rect_t* HWC2On1Adapter::Display::GetRects(size_t numRects) {
-    if (numRects == 0) {
-        return nullptr;
-    }
-
-    if (numRects > mNumAvailableRects) {
-        // This should NEVER happen since we calculated how many rects the
-        // display would need.
-        ALOGE("Rect allocation failure! SF is likely to crash soon!");
-        return nullptr;
-
-    }
-    hwc_rect_t* rects = mNextAvailableRect;
-    mNextAvailableRect += numRects;
-    mNumAvailableRects -= numRects;
-    return rects;
-}
-
 hwc_display_contents_1* HWC2On1Adapter::Display::getDisplayContents() {
     return mHwc1RequestedContents.get();
 }
@@ -1790,44 +1764,35 @@ void HWC2On1Adapter::Display::initializeActiveConfig() {
 }
 
 void HWC2On1Adapter::Display::allocateRequestedContents() {
-    // What needs to be allocated:
-    // 1 hwc_display_contents_1_t
-    // 1 hwc_layer_1_t for each layer
-    // 1 hwc_rect_t for each layer's surfaceDamage
-    // 1 hwc_rect_t for each layer's visibleRegion
-    // 1 hwc_layer_1_t for the framebuffer
-    // 1 hwc_rect_t for the framebuffer's visibleRegion
-
-    // Count # of surfaceDamage
-    size_t numSurfaceDamages = 0;
-    for (const auto& layer : mLayers) {
-        numSurfaceDamages += layer->getNumSurfaceDamages();
-    }
-
-    // Count # of visibleRegions (start at 1 for mandatory framebuffer target
-    // region)
-    size_t numVisibleRegion = 1;
-    for (const auto& layer : mLayers) {
-        numVisibleRegion += layer->getNumVisibleRegions();
+    // +1 is for framebuffer target layer.
+    size_t numLayers = mLayers.size() + 1;
+    if (mHwc1RequestedContents && numLayers <= mHwc1LayerCapacity) {
+        return;
     }
 
-    size_t numRects = numVisibleRegion + numSurfaceDamages;
-    auto numLayers = mLayers.size() + 1;
+    size_t capacity = std::max(numLayers, mHwc1LayerCapacity * 2);
     size_t size = sizeof(hwc_display_contents_1_t) +
-            sizeof(hwc_layer_1_t) * numLayers +
-            sizeof(hwc_rect_t) * numRects;
+            sizeof(hwc_layer_1_t) * capacity;
     auto contents = static_cast<hwc_display_contents_1_t*>(std::calloc(size, 1));
     mHwc1RequestedContents.reset(contents);
-    mNextAvailableRect = reinterpret_cast<hwc_rect_t*>(&contents->hwLayers[numLayers]);
-    mNumAvailableRects = numRects;
+    mHwc1LayerCapacity = capacity;
+
+    // Nothing of the old array carries over, so every layer has to be
+    // written again by assignHwc1LayerIds and prepare
+    mHwc1LayerMap.clear();
 }
 
 void HWC2On1Adapter::Display::assignHwc1LayerIds() {
-    mHwc1LayerMap.clear();
+    mHwc1LayerMap.resize(mLayers.size());
     size_t nextHwc1Id = 0;
     for (auto& layer : mLayers) {
-        mHwc1LayerMap[nextHwc1Id] = layer;
-        layer->setHwc1Id(nextHwc1Id++);
+        auto& mappedLayer = mHwc1LayerMap[nextHwc1Id];
+        if (mappedLayer != layer) {
+            mappedLayer = layer;
+            layer->setHwc1Id(nextHwc1Id);
+            layer->invalidateHwc1State();
+        }
+        ++nextHwc1Id;
     }
 }
 
@@ -1879,7 +1844,9 @@ void HWC2On1Adapter::Display::prepareFramebufferTarget() {
     int32_t width = mActiveConfig->getAttribute(Attribute::Width);
     int32_t height = mActiveConfig->getAttribute(Attribute::Height);
 
+    // The entry may hold a layer's state from an earlier frame
     auto& hwc1Target = mHwc1RequestedContents->hwLayers[mLayers.size()];
+    std::memset(&hwc1Target, 0, sizeof(hwc1Target));
     hwc1Target.compositionType = HWC_FRAMEBUFFER_TARGET;
     hwc1Target.releaseFenceFd = -1;
     hwc1Target.hints = 0;
@@ -1896,12 +1863,8 @@ void HWC2On1Adapter::Display::prepareFramebufferTarget() {
     hwc1Target.planeAlpha = 255;
 
     hwc1Target.visibleRegionScreen.numRects = 1;
-    hwc_rect_t* rects = GetRects(1);
-    rects[0].left = 0;
-    rects[0].top = 0;
-    rects[0].right = width;
-    rects[0].bottom = height;
-    hwc1Target.visibleRegionScreen.rects = rects;
+    mHwc1TargetRect = {0, 0, width, height};
+    hwc1Target.visibleRegionScreen.rects = &mHwc1TargetRect;
 
     // We will set this to the correct value in set
     hwc1Target.acquireFenceFd = -1;
@@ -1929,7 +1892,9 @@ HWC2On1Adapter::Layer::Layer(Display& display)
     mZ(0),
     mReleaseFence(),
     mHwc1Id(0),
-    mHasUnsupportedPlaneAlpha(false) {}
+    mHasUnsupportedPlaneAlpha(false),
+    mHwc1StateDirty(true),
+    mHwc1VisibleRegion() {}
 
 bool HWC2On1Adapter::SortLayersByZ::operator()(const std::shared_ptr<Layer>& lhs,
                                                const std::shared_ptr<Layer>& rhs) const {
@@ -1974,55 +1939,55 @@ Error HWC2On1Adapter::Layer::setSurfaceDamage(hwc_region_t damage) {
 
 Error HWC2On1Adapter::Layer::setBlendMode(BlendMode mode) {
     mBlendMode = mode;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setColor(hwc_color_t color) {
     mColor = color;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setCompositionType(Composition type) {
     mCompositionType = type;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setDataspace(android_dataspace_t dataspace) {
     mDataSpace = dataspace;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setDisplayFrame(hwc_rect_t frame) {
     mDisplayFrame = frame;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setPlaneAlpha(float alpha) {
     mPlaneAlpha = alpha;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setSidebandStream(const native_handle_t* stream) {
     mSidebandStream = stream;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setSourceCrop(hwc_frect_t crop) {
     mSourceCrop = crop;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
 Error HWC2On1Adapter::Layer::setTransform(Transform transform) {
     mTransform = transform;
-    mDisplay.markGeometryChanged();
+    markStateChanged();
     return Error::None;
 }
 
@@ -2039,7 +2004,7 @@ Error HWC2On1Adapter::Layer::setVisibleRegion(hwc_region_t visible) {
                     compareRects)) {
         mVisibleRegion.resize(visible.numRects);
         std::copy_n(visible.rects, visible.numRects, mVisibleRegion.begin());
-        mDisplay.markGeometryChanged();
+        markStateChanged();
     }
     return Error::None;
 }
@@ -2059,7 +2024,17 @@ const sp<MiniFence>& HWC2On1Adapter::Layer::getReleaseFence() const {
 }
 
 void HWC2On1Adapter::Layer::applyState(hwc_layer_1_t& hwc1Layer) {
-    applyCommonState(hwc1Layer);
+    if (mHwc1StateDirty) {
+        // Start from a zeroed entry, as a freshly allocated one would be
+        std::memset(&hwc1Layer, 0, sizeof(hwc1Layer));
+        applyCommonState(hwc1Layer);
+        mHwc1StateDirty = false;
+    }
+
+    // HWC1 writes back to the hints, and the fences belong to one frame
+    hwc1Layer.releaseFenceFd = -1;
+    hwc1Layer.acquireFenceFd = -1;
+    hwc1Layer.hints = 0;
     applyCompositionType(hwc1Layer);
     switch (mCompositionType) {
         case Composition::SolidColor : applySolidColorState(hwc1Layer); break;
@@ -2170,13 +2145,11 @@ void HWC2On1Adapter::Layer::applyCommonState(hwc_layer_1_t& hwc1Layer) {
 
     hwc1Layer.transform = static_cast<uint32_t>(mTransform);
 
+    mHwc1VisibleRegion = mVisibleRegion;
     auto& hwc1VisibleRegion = hwc1Layer.visibleRegionScreen;
-    hwc1VisibleRegion.numRects = mVisibleRegion.size();
-    hwc_rect_t* rects = mDisplay.GetRects(hwc1VisibleRegion.numRects);
-    hwc1VisibleRegion.rects = rects;
-    for (size_t i = 0; i < mVisibleRegion.size(); i++) {
-        rects[i] = mVisibleRegion[i];
-    }
+    hwc1VisibleRegion.numRects = mHwc1VisibleRegion.size();
+    hwc1VisibleRegion.rects = mHwc1VisibleRegion.empty() ?
+            nullptr : mHwc1VisibleRegion.data();
 }
 
 void HWC2On1Adapter::Layer::applySolidColorState(hwc_layer_1_t& hwc1Layer) {
@@ -2290,43 +2263,46 @@ void HWC2On1Adapter::populateCapabilities() {
     mCapabilities.insert(Capability::PresentFenceIsNotReliable);
 }
 
-HWC2On1Adapter::Display* HWC2On1Adapter::getDisplay(hwc2_display_t id) {
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+std::shared_ptr<HWC2On1Adapter::Display> HWC2On1Adapter::getDisplay(
+        hwc2_display_t id) {
+    std::shared_lock<std::shared_timed_mutex> lock(mDisplayMutex);
 
     auto display = mDisplays.find(id);
     if (display == mDisplays.end()) {
         return nullptr;
     }
 
-    return display->second.get();
+    return display->second;
 }
 
-std::tuple<HWC2On1Adapter::Layer*, Error> HWC2On1Adapter::getLayer(
-        hwc2_display_t displayId, hwc2_layer_t layerId) {
-    auto display = getDisplay(displayId);
-    if (!display) {
-        return std::make_tuple(static_cast<Layer*>(nullptr), Error::BadDisplay);
+std::tuple<std::shared_ptr<HWC2On1Adapter::Layer>, Error>
+        HWC2On1Adapter::getLayer(hwc2_display_t displayId,
+                hwc2_layer_t layerId) {
+    std::shared_lock<std::shared_timed_mutex> lock(mDisplayMutex);
+
+    if (mDisplays.count(displayId) == 0) {
+        return std::make_tuple(nullptr, Error::BadDisplay);
     }
 
     auto layerEntry = mLayers.find(layerId);
     if (layerEntry == mLayers.end()) {
-        return std::make_tuple(static_cast<Layer*>(nullptr), Error::BadLayer);
+        return std::make_tuple(nullptr, Error::BadLayer);
     }
 
     auto layer = layerEntry->second;
     if (layer->getDisplay().getId() != displayId) {
-        return std::make_tuple(static_cast<Layer*>(nullptr), Error::BadLayer);
+        return std::make_tuple(nullptr, Error::BadLayer);
     }
-    return std::make_tuple(layer.get(), Error::None);
+    return std::make_tuple(std::move(layer), Error::None);
 }
 
 void HWC2On1Adapter::populatePrimary() {
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
-
     auto display = std::make_shared<Display>(*this, HWC2::DisplayType::Physical);
-    mHwc1DisplayMap[HWC_DISPLAY_PRIMARY] = display->getId();
     display->setHwc1Id(HWC_DISPLAY_PRIMARY);
     display->populateConfigs();
+
+    std::unique_lock<std::shared_timed_mutex> lock(mDisplayMutex);
+    mHwc1DisplayMap[HWC_DISPLAY_PRIMARY] = display->getId();
     mDisplays.emplace(display->getId(), std::move(display));
 }
 
@@ -2335,46 +2311,48 @@ bool HWC2On1Adapter::prepareAllDisplays() {
 
     std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
 
-    for (const auto& displayPair : mDisplays) {
-        auto& display = displayPair.second;
+    // Take references so the displays can be prepared without mDisplayMutex
+    // held
+    std::vector<std::shared_ptr<Display>> displays;
+    std::shared_ptr<Display> hwc1Displays[HWC_NUM_DISPLAY_TYPES];
+    {
+        std::shared_lock<std::shared_timed_mutex> displayLock(mDisplayMutex);
+        for (const auto& displayPair : mDisplays) {
+            displays.emplace_back(displayPair.second);
+        }
+        for (const auto& hwc1DisplayPair : mHwc1DisplayMap) {
+            auto display = mDisplays.find(hwc1DisplayPair.second);
+            if (hwc1DisplayPair.first < HWC_NUM_DISPLAY_TYPES &&
+                    display != mDisplays.end()) {
+                hwc1Displays[hwc1DisplayPair.first] = display->second;
+            }
+        }
+    }
+
+    for (const auto& display : displays) {
         if (!display->prepare()) {
             return false;
         }
     }
 
-    if (mHwc1DisplayMap.count(HWC_DISPLAY_PRIMARY) == 0) {
+    if (!hwc1Displays[HWC_DISPLAY_PRIMARY]) {
         ALOGE("prepareAllDisplays: Unable to find primary HWC1 display");
         return false;
     }
 
     // Build an array of hwc_display_contents_1 to call prepare() on HWC1.
+    // Even if an external display isn't present, we still need to send at
+    // least two displays down to HWC1, and the hardware virtual display is
+    // only sent if it is supported.
+    size_t numHwc1Displays = (mHwc1MinorVersion >= 3) ?
+            HWC_NUM_DISPLAY_TYPES : HWC_DISPLAY_VIRTUAL;
     mHwc1Contents.clear();
-
-    // Always push the primary display
-    auto primaryDisplayId = mHwc1DisplayMap[HWC_DISPLAY_PRIMARY];
-    auto& primaryDisplay = mDisplays[primaryDisplayId];
-    mHwc1Contents.push_back(primaryDisplay->getDisplayContents());
-
-    // Push the external display, if present
-    if (mHwc1DisplayMap.count(HWC_DISPLAY_EXTERNAL) != 0) {
-        auto externalDisplayId = mHwc1DisplayMap[HWC_DISPLAY_EXTERNAL];
-        auto& externalDisplay = mDisplays[externalDisplayId];
-        mHwc1Contents.push_back(externalDisplay->getDisplayContents());
-    } else {
-        // Even if an external display isn't present, we still need to send
-        // at least two displays down to HWC1
-        mHwc1Contents.push_back(nullptr);
-    }
-
-    // Push the hardware virtual display, if supported and present
-    if (mHwc1MinorVersion >= 3) {
-        if (mHwc1DisplayMap.count(HWC_DISPLAY_VIRTUAL) != 0) {
-            auto virtualDisplayId = mHwc1DisplayMap[HWC_DISPLAY_VIRTUAL];
-            auto& virtualDisplay = mDisplays[virtualDisplayId];
-            mHwc1Contents.push_back(virtualDisplay->getDisplayContents());
-        } else {
-            mHwc1Contents.push_back(nullptr);
-        }
+    mHwc1ContentsDisplays.clear();
+    for (size_t hwc1Id = 0; hwc1Id < numHwc1Displays; ++hwc1Id) {
+        auto& display = hwc1Displays[hwc1Id];
+        mHwc1Contents.push_back(display ? display->getDisplayContents() :
+                nullptr);
+        mHwc1ContentsDisplays.push_back(display);
     }
 
     for (auto& displayContents : mHwc1Contents) {
@@ -2413,8 +2391,7 @@ bool HWC2On1Adapter::prepareAllDisplays() {
             continue;
         }
 
-        auto displayId = mHwc1DisplayMap[hwc1Id];
-        auto& display = mDisplays[displayId];
+        auto& display = mHwc1ContentsDisplays[hwc1Id];
         display->generateChanges();
         display->markHasPrepare();
         display->resetHasSet();
@@ -2511,8 +2488,7 @@ Error HWC2On1Adapter::setAllDisplays() {
             continue;
         }
 
-        auto displayId = mHwc1DisplayMap[hwc1Id];
-        auto& display = mDisplays[displayId];
+        auto& display = mHwc1ContentsDisplays[hwc1Id];
         Error error = display->set(*mHwc1Contents[hwc1Id]);
         if (error != Error::None) {
             ALOGE("setAllDisplays: Failed to set display %zd: %s", hwc1Id,
@@ -2535,8 +2511,7 @@ Error HWC2On1Adapter::setAllDisplays() {
             continue;
         }
 
-        auto displayId = mHwc1DisplayMap[hwc1Id];
-        auto& display = mDisplays[displayId];
+        auto& display = mHwc1ContentsDisplays[hwc1Id];
         auto retireFenceFd = mHwc1Contents[hwc1Id]->retireFenceFd;
         ALOGV("setAllDisplays: Adding retire fence %d to display %zd",
                 retireFenceFd, hwc1Id);
@@ -2552,59 +2527,49 @@ Error HWC2On1Adapter::setAllDisplays() {
 void HWC2On1Adapter::hwc1Invalidate() {
     ALOGV("Received hwc1Invalidate");
 
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+    std::lock_guard<std::mutex> lock(mRefreshDelivery.mutex);
 
-    // If the HWC2-side callback hasn't been registered yet, buffer this until
-    // it is registered.
-    if (mCallbacks.count(Callback::Refresh) == 0) {
+    // If the HWC2-side callback hasn't been registered yet, this is delivered
+    // once it is registered.
+    if (mRefreshDelivery.pointer == nullptr) {
         mHasPendingInvalidate = true;
         return;
     }
 
-    const auto& callbackInfo = mCallbacks[Callback::Refresh];
-    std::vector<hwc2_display_t> displays;
-    for (const auto& displayPair : mDisplays) {
-        displays.emplace_back(displayPair.first);
-    }
-
-    // Call back without the state lock held.
-    lock.unlock();
-
-    auto refresh = reinterpret_cast<HWC2_PFN_REFRESH>(callbackInfo.pointer);
-    for (auto display : displays) {
-        refresh(callbackInfo.data, display);
-    }
+    refreshAllDisplays();
 }
 
 void HWC2On1Adapter::hwc1Vsync(int hwc1DisplayId, int64_t timestamp) {
     ALOGV("Received hwc1Vsync(%d, %" PRId64 ")", hwc1DisplayId, timestamp);
 
-    std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+    hwc2_display_t displayId = 0;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mDisplayMutex);
+        auto hwc1Display = mHwc1DisplayMap.find(hwc1DisplayId);
+        if (hwc1Display == mHwc1DisplayMap.end()) {
+            ALOGE("hwc1Vsync: Couldn't find display for HWC1 id %d",
+                    hwc1DisplayId);
+            return;
+        }
+        displayId = hwc1Display->second;
+    }
+
+    std::lock_guard<std::mutex> lock(mVsyncDelivery.mutex);
 
     // If the HWC2-side callback hasn't been registered yet, buffer this until
     // it is registered.
-    if (mCallbacks.count(Callback::Vsync) == 0) {
-        mPendingVsyncs.emplace_back(hwc1DisplayId, timestamp);
+    if (mVsyncDelivery.pointer == nullptr) {
+        mVsyncDelivery.pendingEvents.push_back({displayId, timestamp});
         return;
     }
 
-    if (mHwc1DisplayMap.count(hwc1DisplayId) == 0) {
-        ALOGE("hwc1Vsync: Couldn't find display for HWC1 id %d", hwc1DisplayId);
-        return;
-    }
-
-    const auto& callbackInfo = mCallbacks[Callback::Vsync];
-    auto displayId = mHwc1DisplayMap[hwc1DisplayId];
-
-    // Call back without the state lock held.
-    lock.unlock();
-
-    auto vsync = reinterpret_cast<HWC2_PFN_VSYNC>(callbackInfo.pointer);
-    vsync(callbackInfo.data, displayId, timestamp);
+    auto vsync = reinterpret_cast<HWC2_PFN_VSYNC>(mVsyncDelivery.pointer);
+    vsync(mVsyncDelivery.data, displayId, timestamp);
 }
 
 Error HWC2On1Adapter::Display::destroyLayers() {
     std::unique_lock<std::recursive_mutex> lock(mStateMutex);
+    std::unique_lock<std::shared_timed_mutex> deviceLock(mDevice.mDisplayMutex);
 
     for (auto current = mLayers.begin(); current != mLayers.end(); ++current) {
         for(auto current2 = mDevice.mLayers.begin(); current2 != mDevice.mLayers.end(); )
@@ -2617,6 +2582,7 @@ Error HWC2On1Adapter::Display::destroyLayers() {
             ++current2;
         }
     }
+    deviceLock.unlock();
 
     mLayers.clear();
     markGeometryChanged();
@@ -2633,20 +2599,25 @@ void HWC2On1Adapter::hwc1Hotplug(int hwc1DisplayId, int connected) {
     }
 
     std::unique_lock<std::recursive_timed_mutex> lock(mStateMutex);
+    std::unique_lock<std::shared_timed_mutex> displayLock(mDisplayMutex);
 
     hwc2_display_t displayId = UINT64_MAX;
+    std::shared_ptr<Display> disconnectedDisplay;
     if (mHwc1DisplayMap.count(hwc1DisplayId) == 0) {
         if (connected == 0) {
             ALOGW("hwc1Hotplug: Received disconnect for unconnected display");
             return;
         }
 
-        // Create a new display on connect
+        // Create a new display on connect, setting it up before it is
+        // published
+        displayLock.unlock();
         auto display = std::make_shared<HWC2On1Adapter::Display>(*this,
                 HWC2::DisplayType::Physical);
         display->setHwc1Id(HWC_DISPLAY_EXTERNAL);
         display->populateConfigs();
         displayId = display->getId();
+        displayLock.lock();
         mHwc1DisplayMap[HWC_DISPLAY_EXTERNAL] = displayId;
         mDisplays.emplace(displayId, std::move(display));
     } else {
@@ -2657,7 +2628,7 @@ void HWC2On1Adapter::hwc1Hotplug(int hwc1DisplayId, int connected) {
         }
 
         displayId = mHwc1DisplayMap[hwc1DisplayId];
-        auto& display = mDisplays[displayId];
+        disconnectedDisplay = mDisplays[displayId];
         //Remove extern display context if plug out HDMI.
         //Fix crash when plug out HDMI.
         /*
@@ -2668,7 +2639,8 @@ void HWC2On1Adapter::hwc1Hotplug(int hwc1DisplayId, int connected) {
           F DEBUG   :     #02 pc 00000000000116f4  /vendor/lib64/libhwc2on1adapter.so (android::HWC2On1Adapter::setAllDisplays()+740)
           F DEBUG   :     #03 pc 00000000000112b8  /vendor/lib64/libhwc2on1adapter.so (android::HWC2On1Adapter::Display::present(int*)+72)
         */
-        if (mHwc1Contents[HWC_DISPLAY_EXTERNAL] != nullptr)
+        if (mHwc1Contents.size() > HWC_DISPLAY_EXTERNAL &&
+                mHwc1Contents[HWC_DISPLAY_EXTERNAL] != nullptr)
         {
             if(mHwc1Contents[HWC_DISPLAY_EXTERNAL]->retireFenceFd > 0){
                 close(mHwc1Contents[HWC_DISPLAY_EXTERNAL]->retireFenceFd);
@@ -2689,29 +2661,64 @@ void HWC2On1Adapter::hwc1Hotplug(int hwc1DisplayId, int connected) {
                     layer.acquireFenceFd = -1;
                 }
             }
-            mHwc1Contents.erase(mHwc1Contents.begin()+HWC_DISPLAY_EXTERNAL);
+            // Keep the HWC1 display slots in place, a disconnected display is
+            // passed to HWC1 as null
+            mHwc1Contents[HWC_DISPLAY_EXTERNAL] = nullptr;
+            mHwc1ContentsDisplays[HWC_DISPLAY_EXTERNAL].reset();
         }
         // Disconnect an existing display
         mHwc1DisplayMap.erase(HWC_DISPLAY_EXTERNAL);
-        display->destroyLayers();
         mDisplays.erase(displayId);
     }
 
-    // If the HWC2-side callback hasn't been registered yet, buffer this until
-    // it is registered
-    if (mCallbacks.count(Callback::Hotplug) == 0) {
-        mPendingHotplugs.emplace_back(hwc1DisplayId, connected);
+    displayLock.unlock();
+    lock.unlock();
+
+    // Done without the device locks held, as it takes the display lock
+    if (disconnectedDisplay) {
+        disconnectedDisplay->destroyLayers();
+    }
+
+    auto hwc2Connected = (connected == 0) ?
+            HWC2::Connection::Disconnected : HWC2::Connection::Connected;
+
+    std::lock_guard<std::mutex> deliveryLock(mHotplugDelivery.mutex);
+
+    // If the HWC2-side callback hasn't been registered yet, this is delivered
+    // once it is registered
+    if (mHotplugDelivery.pointer == nullptr) {
+        mHotplugDelivery.pendingEvents.push_back(
+                {displayId, static_cast<int64_t>(hwc2Connected)});
         return;
     }
 
-    const auto& callbackInfo = mCallbacks[Callback::Hotplug];
+    auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(mHotplugDelivery.pointer);
+    hotplug(mHotplugDelivery.data, displayId,
+            static_cast<int32_t>(hwc2Connected));
+}
 
-    // Call back without the state lock held
-    lock.unlock();
+HWC2On1Adapter::CallbackDelivery& HWC2On1Adapter::getCallbackDelivery(
+        Callback descriptor) {
+    switch (descriptor) {
+        case Callback::Hotplug: return mHotplugDelivery;
+        case Callback::Refresh: return mRefreshDelivery;
+        default: return mVsyncDelivery;
+    }
+}
 
-    auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(callbackInfo.pointer);
-    auto hwc2Connected = (connected == 0) ?
-            HWC2::Connection::Disconnected : HWC2::Connection::Connected;
-    hotplug(callbackInfo.data, displayId, static_cast<int32_t>(hwc2Connected));
+void HWC2On1Adapter::refreshAllDisplays() {
+    std::vector<hwc2_display_t> displays;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mDisplayMutex);
+        for (const auto& displayPair : mDisplays) {
+            displays.emplace_back(displayPair.first);
+        }
+    }
+
+    auto refresh = reinterpret_cast<HWC2_PFN_REFRESH>(mRefreshDelivery.pointer);
+    for (auto display : displays) {
+        refresh(mRefreshDelivery.data, display);
+    }
 }
+
 } // namespace android
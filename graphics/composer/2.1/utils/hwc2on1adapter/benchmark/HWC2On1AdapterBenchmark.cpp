@@ -0,0 +1,316 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The adapter header must come first, as it asks hwcomposer2.h for the C++
+// definitions
+#include "hwc2on1adapter/HWC2On1Adapter.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <hardware/hwcomposer.h>
+
+namespace android {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const int32_t kDisplayWidth = 1920;
+const int32_t kDisplayHeight = 1080;
+const int32_t kVsyncPeriod = 16666667;
+const int kNumLayers = 4;
+const auto kCallInterval = std::chrono::microseconds(200);
+
+// Stands in for a HWC1 device whose prepare and set each take the given
+// time, as they would while the hardware composes.
+struct FakeHwc1Device : public hwc_composer_device_1 {
+    explicit FakeHwc1Device(std::chrono::microseconds workTime) : mWorkTime(workTime) {
+        memset(static_cast<hwc_composer_device_1*>(this), 0, sizeof(hwc_composer_device_1));
+        common.tag = HARDWARE_DEVICE_TAG;
+        common.version = HWC_DEVICE_API_VERSION_1_3;
+        common.close = closeHook;
+        prepare = prepareHook;
+        set = setHook;
+        eventControl = eventControlHook;
+        blank = blankHook;
+        query = queryHook;
+        registerProcs = registerProcsHook;
+        getDisplayConfigs = getDisplayConfigsHook;
+        getDisplayAttributes = getDisplayAttributesHook;
+    }
+
+    static FakeHwc1Device* getFake(hwc_composer_device_1* device) {
+        return static_cast<FakeHwc1Device*>(device);
+    }
+
+    static int closeHook(hw_device_t* /*device*/) { return 0; }
+
+    static int prepareHook(hwc_composer_device_1* device, size_t /*numDisplays*/,
+                           hwc_display_contents_1_t** /*displays*/) {
+        // Every layer stays HWC_FRAMEBUFFER
+        std::this_thread::sleep_for(getFake(device)->mWorkTime);
+        return 0;
+    }
+
+    static int setHook(hwc_composer_device_1* device, size_t numDisplays,
+                       hwc_display_contents_1_t** displays) {
+        std::this_thread::sleep_for(getFake(device)->mWorkTime);
+        for (size_t d = 0; d < numDisplays; d++) {
+            if (displays[d] == nullptr) {
+                continue;
+            }
+            displays[d]->retireFenceFd = -1;
+            for (size_t l = 0; l < displays[d]->numHwLayers; l++) {
+                auto& layer = displays[d]->hwLayers[l];
+                if (layer.acquireFenceFd >= 0) {
+                    close(layer.acquireFenceFd);
+                }
+                layer.releaseFenceFd = -1;
+            }
+        }
+        return 0;
+    }
+
+    static int eventControlHook(hwc_composer_device_1* /*device*/, int /*display*/,
+                                int /*event*/, int /*enabled*/) {
+        return 0;
+    }
+
+    static int blankHook(hwc_composer_device_1* /*device*/, int /*display*/, int /*blank*/) {
+        return 0;
+    }
+
+    static int queryHook(hwc_composer_device_1* /*device*/, int what, int* value) {
+        if (what == HWC_DISPLAY_TYPES_SUPPORTED) {
+            *value = HWC_DISPLAY_PRIMARY_BIT | HWC_DISPLAY_VIRTUAL_BIT;
+            return 0;
+        }
+        return -EINVAL;
+    }
+
+    static void registerProcsHook(hwc_composer_device_1* device, hwc_procs_t const* procs) {
+        getFake(device)->mProcs = procs;
+    }
+
+    static int getDisplayConfigsHook(hwc_composer_device_1* /*device*/, int display,
+                                     uint32_t* configs, size_t* numConfigs) {
+        if (display != HWC_DISPLAY_PRIMARY || *numConfigs < 1) {
+            *numConfigs = 0;
+            return -EINVAL;
+        }
+        configs[0] = 0;
+        *numConfigs = 1;
+        return 0;
+    }
+
+    static int getDisplayAttributesHook(hwc_composer_device_1* /*device*/, int /*display*/,
+                                        uint32_t /*config*/, const uint32_t* attributes,
+                                        int32_t* values) {
+        for (size_t i = 0; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE; i++) {
+            switch (attributes[i]) {
+                case HWC_DISPLAY_VSYNC_PERIOD: values[i] = kVsyncPeriod; break;
+                case HWC_DISPLAY_WIDTH: values[i] = kDisplayWidth; break;
+                case HWC_DISPLAY_HEIGHT: values[i] = kDisplayHeight; break;
+                case HWC_DISPLAY_DPI_X: values[i] = 160000; break;
+                case HWC_DISPLAY_DPI_Y: values[i] = 160000; break;
+                default: values[i] = 0; break;
+            }
+        }
+        return 0;
+    }
+
+    const std::chrono::microseconds mWorkTime;
+    const hwc_procs_t* mProcs = nullptr;
+};
+
+template <typename PFN>
+PFN getFunction(hwc2_device_t* device, hwc2_function_descriptor_t descriptor) {
+    return reinterpret_cast<PFN>(device->getFunction(device, descriptor));
+}
+
+// Runs the validate/present loop SurfaceFlinger would run on the primary
+// display on a thread of its own, so the benchmarks can measure how long
+// other calls into the adapter wait behind it.
+class PresentLoop {
+   public:
+    explicit PresentLoop(std::chrono::microseconds hwc1WorkTime)
+        : mHwc1(hwc1WorkTime), mAdapter(&mHwc1) {
+        auto registerCallback =
+                getFunction<HWC2_PFN_REGISTER_CALLBACK>(&mAdapter, HWC2_FUNCTION_REGISTER_CALLBACK);
+        registerCallback(&mAdapter, HWC2_CALLBACK_HOTPLUG, this,
+                         reinterpret_cast<hwc2_function_pointer_t>(hotplugHook));
+        registerCallback(&mAdapter, HWC2_CALLBACK_VSYNC, this,
+                         reinterpret_cast<hwc2_function_pointer_t>(vsyncHook));
+
+        auto createLayer = getFunction<HWC2_PFN_CREATE_LAYER>(&mAdapter, HWC2_FUNCTION_CREATE_LAYER);
+        auto setCompositionType = getFunction<HWC2_PFN_SET_LAYER_COMPOSITION_TYPE>(
+                &mAdapter, HWC2_FUNCTION_SET_LAYER_COMPOSITION_TYPE);
+        auto setZOrder =
+                getFunction<HWC2_PFN_SET_LAYER_Z_ORDER>(&mAdapter, HWC2_FUNCTION_SET_LAYER_Z_ORDER);
+        for (int i = 0; i < kNumLayers; i++) {
+            hwc2_layer_t layer = 0;
+            createLayer(&mAdapter, mPrimaryDisplay, &layer);
+            setCompositionType(&mAdapter, mPrimaryDisplay, layer, HWC2_COMPOSITION_CLIENT);
+            setZOrder(&mAdapter, mPrimaryDisplay, layer, i);
+        }
+
+        auto createVirtualDisplay = getFunction<HWC2_PFN_CREATE_VIRTUAL_DISPLAY>(
+                &mAdapter, HWC2_FUNCTION_CREATE_VIRTUAL_DISPLAY);
+        int32_t format = HAL_PIXEL_FORMAT_RGBA_8888;
+        createVirtualDisplay(&mAdapter, kDisplayWidth, kDisplayHeight, &format, &mVirtualDisplay);
+
+        mThread = std::thread([this]() { threadLoop(); });
+    }
+
+    ~PresentLoop() {
+        mStop = true;
+        mThread.join();
+    }
+
+    // Delivers a vsync the way the HWC1 vsync thread would, returning once the
+    // HWC2 callback ran
+    void fireVsync() {
+        mHwc1.mProcs->vsync(mHwc1.mProcs, HWC_DISPLAY_PRIMARY,
+                            Clock::now().time_since_epoch().count());
+    }
+
+    hwc2_device_t* getDevice() { return &mAdapter; }
+    hwc2_display_t getVirtualDisplay() const { return mVirtualDisplay; }
+    uint64_t getVsyncCount() const { return mVsyncCount; }
+    uint64_t getFrameCount() const { return mFrameCount; }
+
+   private:
+    static void hotplugHook(hwc2_callback_data_t data, hwc2_display_t display,
+                            int32_t connected) {
+        auto loop = static_cast<PresentLoop*>(data);
+        if (connected == HWC2_CONNECTION_CONNECTED && loop->mPrimaryDisplay == 0) {
+            loop->mPrimaryDisplay = display;
+        }
+    }
+
+    static void vsyncHook(hwc2_callback_data_t data, hwc2_display_t /*display*/,
+                          int64_t /*timestamp*/) {
+        static_cast<PresentLoop*>(data)->mVsyncCount++;
+    }
+
+    void threadLoop() {
+        auto validate =
+                getFunction<HWC2_PFN_VALIDATE_DISPLAY>(&mAdapter, HWC2_FUNCTION_VALIDATE_DISPLAY);
+        auto acceptChanges = getFunction<HWC2_PFN_ACCEPT_DISPLAY_CHANGES>(
+                &mAdapter, HWC2_FUNCTION_ACCEPT_DISPLAY_CHANGES);
+        auto present =
+                getFunction<HWC2_PFN_PRESENT_DISPLAY>(&mAdapter, HWC2_FUNCTION_PRESENT_DISPLAY);
+
+        while (!mStop) {
+            uint32_t numTypes = 0;
+            uint32_t numRequests = 0;
+            int32_t error = validate(&mAdapter, mPrimaryDisplay, &numTypes, &numRequests);
+            if (error == HWC2_ERROR_HAS_CHANGES) {
+                acceptChanges(&mAdapter, mPrimaryDisplay);
+            }
+            int32_t retireFence = -1;
+            present(&mAdapter, mPrimaryDisplay, &retireFence);
+            if (retireFence >= 0) {
+                close(retireFence);
+            }
+            mFrameCount++;
+        }
+    }
+
+    FakeHwc1Device mHwc1;
+    HWC2On1Adapter mAdapter;
+    hwc2_display_t mPrimaryDisplay = 0;
+    hwc2_display_t mVirtualDisplay = 0;
+
+    std::atomic<uint64_t> mVsyncCount{0};
+    std::atomic<uint64_t> mFrameCount{0};
+    std::atomic<bool> mStop{false};
+    std::thread mThread;
+};
+
+void reportLatencies(benchmark::State& state, std::vector<double>& latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    if (latencies.empty()) {
+        return;
+    }
+    state.counters["p50_us"] = latencies[latencies.size() / 2] * 1e6;
+    state.counters["p99_us"] = latencies[latencies.size() * 99 / 100] * 1e6;
+    state.counters["max_us"] = latencies.back() * 1e6;
+}
+
+// Time for a HWC1 vsync to reach the HWC2 callback while the primary display
+// presents. The argument is how long HWC1 prepare and set take, in
+// microseconds.
+void BM_VsyncDuringPresent(benchmark::State& state) {
+    PresentLoop loop(std::chrono::microseconds(state.range(0)));
+
+    std::vector<double> latencies;
+    for (auto _ : state) {
+        auto start = Clock::now();
+        loop.fireVsync();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        state.SetIterationTime(elapsed.count());
+        latencies.push_back(elapsed.count());
+
+        std::this_thread::sleep_for(kCallInterval);
+    }
+
+    if (loop.getVsyncCount() != latencies.size()) {
+        state.SkipWithError("vsyncs were lost");
+    }
+    state.counters["frames"] = loop.getFrameCount();
+    reportLatencies(state, latencies);
+}
+
+// Time for a call on the virtual display while the primary display presents.
+void BM_OtherDisplayCallDuringPresent(benchmark::State& state) {
+    PresentLoop loop(std::chrono::microseconds(state.range(0)));
+    auto getDisplayType = getFunction<HWC2_PFN_GET_DISPLAY_TYPE>(loop.getDevice(),
+                                                                 HWC2_FUNCTION_GET_DISPLAY_TYPE);
+
+    std::vector<double> latencies;
+    for (auto _ : state) {
+        int32_t type = 0;
+        auto start = Clock::now();
+        getDisplayType(loop.getDevice(), loop.getVirtualDisplay(), &type);
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        state.SetIterationTime(elapsed.count());
+        latencies.push_back(elapsed.count());
+
+        std::this_thread::sleep_for(kCallInterval);
+    }
+
+    state.counters["frames"] = loop.getFrameCount();
+    reportLatencies(state, latencies);
+}
+
+BENCHMARK(BM_VsyncDuringPresent)->Arg(0)->Arg(1000)->Arg(4000)->UseManualTime()
+        ->Iterations(2000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_OtherDisplayCallDuringPresent)->Arg(0)->Arg(1000)->Arg(4000)->UseManualTime()
+        ->Iterations(2000)->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+}  // namespace android
+
+BENCHMARK_MAIN();
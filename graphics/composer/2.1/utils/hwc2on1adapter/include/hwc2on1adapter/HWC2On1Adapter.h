@@ -26,10 +26,12 @@
 #include "MiniFence.h"
 
 #include <atomic>
+#include <cstdlib>
 #include <map>
 #include <mutex>
 #include <queue>
 #include <set>
+#include <shared_mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -273,7 +275,6 @@ private:
             std::string dump() const;
 
             // Return a rect from the pool allocated during validate()
-            hwc_rect_t* GetRects(size_t numRects);
 
             hwc_display_contents_1* getDisplayContents();
 
@@ -379,6 +380,8 @@ private:
             // Creates a bi-directional mapping between index in HWC1
             // prepare/set array and Layer object. Stores mapping in
             // mHwc1LayerMap and also updates Layer's attribute mHwc1Id.
+            // Layers that moved to another index have their HWC1 state
+            // invalidated.
             void assignHwc1LayerIds();
 
             // Called after a response to prepare() has been received:
@@ -413,14 +416,25 @@ private:
             // which require locking.
             mutable std::recursive_mutex mStateMutex;
 
-            // Allocate RAM able to store all layers and rects used for
-            // communication with HWC1. Place allocated RAM in variable
-            // mHwc1RequestedContents.
+            // Make sure mHwc1RequestedContents can hold all layers used for
+            // communication with HWC1. The allocation is kept across frames
+            // and only replaced, at least doubling in size, when it is too
+            // small.
             void allocateRequestedContents();
 
+            struct ContentsDeleter {
+                void operator()(hwc_display_contents_1* contents) const {
+                    std::free(contents);
+                }
+            };
+
             // Array of structs exchanged between client and hwc1 device.
             // Sent to device upon calling prepare().
-            std::unique_ptr<hwc_display_contents_1> mHwc1RequestedContents;
+            std::unique_ptr<hwc_display_contents_1, ContentsDeleter>
+                    mHwc1RequestedContents;
+            // Number of hwc_layer_1 entries mHwc1RequestedContents has room
+            // for, including the framebuffer target.
+            size_t mHwc1LayerCapacity;
     private:
             DeferredFence mRetireFence;
 
@@ -452,12 +466,10 @@ private:
 
             // Mapping between layer index in array of hwc_display_contents_1*
             // passed to HWC1 during validate/set and Layer object.
-            std::unordered_map<size_t, std::shared_ptr<Layer>> mHwc1LayerMap;
+            std::vector<std::shared_ptr<Layer>> mHwc1LayerMap;
 
-            // All communication with HWC1 via prepare/set is done with one
-            // alloc. This pointer is pointing to a pool of hwc_rect_t.
-            size_t mNumAvailableRects;
-            hwc_rect_t* mNextAvailableRect;
+            // Visible region of the HWC_FRAMEBUFFER_TARGET layer.
+            hwc_rect_t mHwc1TargetRect;
 
             // True if any of the Layers contained in this Display have been
             // updated with anything other than a buffer since last call to
@@ -567,15 +579,19 @@ private:
             void setHwc1Id(size_t id) { mHwc1Id = id; }
             size_t getHwc1Id() const { return mHwc1Id; }
 
-            // Write state to HWC1 communication struct.
+            // Write state to HWC1 communication struct. Only the buffer and
+            // composition type are written every frame, the rest of the
+            // entry is kept from the last frame unless the state changed.
             void applyState(struct hwc_layer_1& hwc1Layer);
 
+            // Forces the next applyState to rewrite the whole entry, e.g.
+            // because it previously held another layer.
+            void invalidateHwc1State() { mHwc1StateDirty = true; }
+
             std::string dump() const;
 
             std::size_t getNumVisibleRegions() { return mVisibleRegion.size(); }
 
-            std::size_t getNumSurfaceDamages() { return mSurfaceDamage.size(); }
-
             // True if a layer cannot be properly rendered by the device due
             // to usage of SolidColor (a.k.a BackgroundColor in HWC1).
             bool hasUnsupportedBackgroundColor() {
@@ -583,6 +599,11 @@ private:
                         !mDisplay.getDevice().supportsBackgroundColor());
             }
         private:
+            void markStateChanged() {
+                mHwc1StateDirty = true;
+                mDisplay.markGeometryChanged();
+            }
+
             void applyCommonState(struct hwc_layer_1& hwc1Layer);
             void applySolidColorState(struct hwc_layer_1& hwc1Layer);
             void applySidebandState(struct hwc_layer_1& hwc1Layer);
@@ -613,6 +634,12 @@ private:
 
             size_t mHwc1Id;
             bool mHasUnsupportedPlaneAlpha;
+
+            // True when the entry last written by applyState is stale.
+            bool mHwc1StateDirty;
+            // Copy of mVisibleRegion referenced by that entry, so it stays
+            // valid until the next applyState.
+            std::vector<hwc_rect_t> mHwc1VisibleRegion;
     };
 
     // Utility tempate calling a Layer object method based on ID parameters:
@@ -626,7 +653,7 @@ private:
         auto result = getAdapter(device)->getLayer(displayId, layerId);
         auto error = std::get<HWC2::Error>(result);
         if (error == HWC2::Error::None) {
-            auto layer = std::get<Layer*>(result);
+            auto layer = std::get<std::shared_ptr<Layer>>(result);
             error = ((*layer).*member)(std::forward<Args>(args)...);
         }
         return static_cast<int32_t>(error);
@@ -678,13 +705,17 @@ private:
     // Adapter internals
 
     void populateCapabilities();
-    Display* getDisplay(hwc2_display_t id);
-    std::tuple<Layer*, HWC2::Error> getLayer(hwc2_display_t displayId,
-            hwc2_layer_t layerId);
+    std::shared_ptr<Display> getDisplay(hwc2_display_t id);
+    std::tuple<std::shared_ptr<Layer>, HWC2::Error> getLayer(
+            hwc2_display_t displayId, hwc2_layer_t layerId);
     void populatePrimary();
 
     bool prepareAllDisplays();
     std::vector<struct hwc_display_contents_1*> mHwc1Contents;
+    // The displays whose contents are in mHwc1Contents, at the same index.
+    // Holding them keeps the contents valid until set even if a display is
+    // disconnected in between.
+    std::vector<std::shared_ptr<Display>> mHwc1ContentsDisplays;
     HWC2::Error setAllDisplays();
 
     // Callbacks
@@ -692,6 +723,28 @@ private:
     void hwc1Vsync(int hwc1DisplayId, int64_t timestamp);
     void hwc1Hotplug(int hwc1DisplayId, int connected);
 
+    struct PendingEvent {
+        hwc2_display_t displayId;
+        // Timestamp for vsync, HWC2::Connection for hotplug
+        int64_t value;
+    };
+
+    // The registration and the events of one kind of HWC2 callback. The
+    // mutex is held while the callback is called, so it gets its events one
+    // at a time and in order. Each kind has a mutex of its own, so a slow
+    // hotplug or refresh callback does not hold up vsyncs.
+    struct CallbackDelivery {
+        std::mutex mutex;
+        hwc2_callback_data_t data = nullptr;
+        hwc2_function_pointer_t pointer = nullptr;
+        // Events that arrived before the callback was registered
+        std::vector<PendingEvent> pendingEvents;
+    };
+
+    CallbackDelivery& getCallbackDelivery(HWC2::Callback descriptor);
+    // Expects mRefreshDelivery.mutex to be held
+    void refreshAllDisplays();
+
     // These are set in the constructor and before any asynchronous events are
     // possible
 
@@ -705,40 +758,44 @@ private:
 
     std::unordered_set<HWC2::Capability> mCapabilities;
 
-    // These are only accessed from the main SurfaceFlinger thread (not from
-    // callbacks or dump
+    // Serializes HWC1 prepare/set and protects mHwc1Contents. This needs to
+    // be recursive, since the HWC1 implementation can call back into the
+    // hotplug callback on the same thread that is calling prepare or set.
+    //
+    // Lock order: a Display's mStateMutex, then this mutex, then
+    // mDisplayMutex. prepareAllDisplays and setAllDisplays go on to lock the
+    // other displays with this mutex held. mDisplayMutex is never held while
+    // calling into a Display.
+    std::recursive_timed_mutex mStateMutex;
+
+    // Protects the display and layer lookup tables below. They are read on
+    // every HWC2 call, and only written when displays or layers come and go.
+    mutable std::shared_timed_mutex mDisplayMutex;
 
     std::map<hwc2_layer_t, std::shared_ptr<Layer>> mLayers;
 
     // A HWC1 supports only one virtual display.
     std::shared_ptr<Display> mHwc1VirtualDisplay;
 
-    // These are potentially accessed from multiple threads, and are protected
-    // by this mutex. This needs to be recursive, since the HWC1 implementation
-    // can call back into the invalidate callback on the same thread that is
-    // calling prepare.
-    std::recursive_timed_mutex mStateMutex;
-
-    struct CallbackInfo {
-        hwc2_callback_data_t data;
-        hwc2_function_pointer_t pointer;
-    };
-    std::unordered_map<HWC2::Callback, CallbackInfo> mCallbacks;
-    bool mHasPendingInvalidate;
-
-    // There is a small gap between the time the HWC1 module is started and
-    // when the callbacks for vsync and hotplugs are registered by the
-    // HWC2on1Adapter. To prevent losing events they are stored in these arrays
-    // and fed to the callback as soon as possible.
-    std::vector<std::pair<int, int64_t>> mPendingVsyncs;
-    std::vector<std::pair<int, int>> mPendingHotplugs;
-
     // Mapping between HWC1 display id and Display objects.
     std::map<hwc2_display_t, std::shared_ptr<Display>> mDisplays;
 
     // Map HWC1 display type (HWC_DISPLAY_PRIMARY, HWC_DISPLAY_EXTERNAL,
     // HWC_DISPLAY_VIRTUAL) to Display IDs generated by HWC2on1Adapter objects.
     std::unordered_map<int, hwc2_display_t> mHwc1DisplayMap;
+
+    // Lock order: a CallbackDelivery's mutex, then mDisplayMutex. None is
+    // held while calling into the HWC1 device.
+    //
+    // There is a small gap between the time the HWC1 module is started and
+    // when the callbacks for vsync and hotplugs are registered by the
+    // HWC2on1Adapter. To prevent losing events, HWC1 events arriving before
+    // then are queued and fed to the callback as soon as it is registered.
+    CallbackDelivery mHotplugDelivery;
+    CallbackDelivery mRefreshDelivery;
+    CallbackDelivery mVsyncDelivery;
+    // Protected by mRefreshDelivery.mutex
+    bool mHasPendingInvalidate;
 };
 
 } // namespace android
@@ -21,11 +21,18 @@
 #include "hwc2onfbadapter/HWC2OnFbAdapter.h"
 
 #include <algorithm>
+#include <cmath>
 #include <type_traits>
 
+#include <errno.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
+#include <sys/timerfd.h>
 #include <unistd.h> // for close
 
 #include <hardware/fb.h>
@@ -692,6 +699,7 @@ const HWC2OnFbAdapter::Info& HWC2OnFbAdapter::getInfo() const {
 }
 
 void HWC2OnFbAdapter::updateDebugString() {
+    mDebugString.clear();
     if (mFbDevice->common.version >= 1 && mFbDevice->dump) {
         char buffer[4096];
         mFbDevice->dump(mFbDevice, buffer, sizeof(buffer));
@@ -699,6 +707,7 @@ void HWC2OnFbAdapter::updateDebugString() {
 
         mDebugString = buffer;
     }
+    mVsyncThread.dump(mDebugString);
 }
 
 const std::string& HWC2OnFbAdapter::getDebugString() const {
@@ -785,6 +794,9 @@ bool HWC2OnFbAdapter::postBuffer() {
     int error = 0;
     if (mBuffer) {
         error = mFbDevice->post(mFbDevice, mBuffer);
+        if (error == 0) {
+            mVsyncThread.addPresentSample(VsyncThread::now());
+        }
     }
 
     return error == 0;
@@ -815,6 +827,115 @@ void HWC2OnFbAdapter::getCapabilities(uint32_t* outCount,
     }
 }
 
+void HWC2OnFbAdapter::VsyncModel::reset(int64_t phase, int64_t period) {
+    mNominalPhase = phase;
+    mNominalPeriod = period;
+    mFirstSample = 0;
+    mNumSamples = 0;
+    mLocked = false;
+    mPeriod = period;
+    mPhase = phase;
+    mErrorRms = 0;
+    mErrorMax = 0;
+}
+
+void HWC2OnFbAdapter::VsyncModel::addSample(int64_t timestamp) {
+    if (mNumSamples < kMaxSamples) {
+        mSamples[(mFirstSample + mNumSamples) % kMaxSamples] = timestamp;
+        mNumSamples++;
+    } else {
+        mSamples[mFirstSample] = timestamp;
+        mFirstSample = (mFirstSample + 1) % kMaxSamples;
+    }
+
+    updateModel();
+}
+
+void HWC2OnFbAdapter::VsyncModel::updateModel() {
+    if (mNumSamples < kMinSamples) {
+        return;
+    }
+
+    // The time between two posts is a whole number of vsyncs.  Intervals that
+    // are far from one are posts that did not wait for vsync.
+    int64_t estimate = mLocked ? mPeriod : mNominalPeriod;
+    int64_t totalTime = 0;
+    int64_t totalVsyncs = 0;
+    for (size_t i = 1; i < mNumSamples; i++) {
+        int64_t interval = mSamples[(mFirstSample + i) % kMaxSamples] -
+                mSamples[(mFirstSample + i - 1) % kMaxSamples];
+        int64_t vsyncs = (interval + estimate / 2) / estimate;
+        if (vsyncs < 1 || std::abs(interval - vsyncs * estimate) > estimate / 4) {
+            continue;
+        }
+        totalTime += interval;
+        totalVsyncs += vsyncs;
+    }
+
+    // Do not trust a period far off the one the device reports
+    int64_t period = (totalVsyncs > 0) ? totalTime / totalVsyncs : 0;
+    if (period <= 0 || std::abs(period - mNominalPeriod) > mNominalPeriod / 10) {
+        mLocked = false;
+        return;
+    }
+
+    // Average the sample phases on the unit circle, so that samples on
+    // either side of a vsync do not average out to the middle of the period
+    double sumSin = 0.0;
+    double sumCos = 0.0;
+    for (size_t i = 0; i < mNumSamples; i++) {
+        double angle = 2.0 * M_PI * (mSamples[i] % period) / period;
+        sumSin += std::sin(angle);
+        sumCos += std::cos(angle);
+    }
+    int64_t phase = int64_t(std::atan2(sumSin, sumCos) / (2.0 * M_PI) * period);
+    if (phase < 0) {
+        phase += period;
+    }
+
+    double sumSquaredError = 0.0;
+    int64_t maxError = 0;
+    for (size_t i = 0; i < mNumSamples; i++) {
+        int64_t error = (mSamples[i] - phase) % period;
+        if (error < 0) {
+            error += period;
+        }
+        if (error > period / 2) {
+            error -= period;
+        }
+        sumSquaredError += double(error) * error;
+        maxError = std::max(maxError, std::abs(error));
+    }
+
+    mPeriod = period;
+    mPhase = phase;
+    mErrorRms = int64_t(std::sqrt(sumSquaredError / mNumSamples));
+    mErrorMax = maxError;
+    mLocked = mErrorRms < period / 10;
+}
+
+int64_t HWC2OnFbAdapter::VsyncModel::predictNextVsync(int64_t t) const {
+    int64_t phase = mLocked ? mPhase : mNominalPhase;
+    int64_t period = getPeriod();
+
+    int64_t n = (t - phase) / period;
+    int64_t vsync = phase + n * period;
+    if (vsync < t) {
+        vsync += period;
+    }
+    return vsync;
+}
+
+void HWC2OnFbAdapter::VsyncModel::dump(std::string& result) const {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Vsync model: %s, period %" PRId64 " ns (nominal %" PRId64 " ns), "
+             "phase %" PRId64 " ns, %zu samples, error rms %" PRId64 " ns max %" PRId64 " ns\n",
+             mLocked ? "locked" : "unlocked", getPeriod(), mNominalPeriod,
+             mLocked ? mPhase : mNominalPhase, mNumSamples, mErrorRms, mErrorMax);
+    result += buffer;
+}
+
 int64_t HWC2OnFbAdapter::VsyncThread::now() {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -827,6 +948,30 @@ bool HWC2OnFbAdapter::VsyncThread::sleepUntil(int64_t t) {
     ts.tv_sec = t / 1'000'000'000;
     ts.tv_nsec = t % 1'000'000'000;
 
+    if (mTimerFd >= 0) {
+        struct itimerspec spec = {};
+        spec.it_value = ts;
+        if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0) {
+            // mStopFd stays readable once signaled, so a stop() that ran
+            // before the timer was armed is not missed
+            struct pollfd fds[2] = {{mTimerFd, POLLIN, 0}, {mStopFd, POLLIN, 0}};
+            while (true) {
+                int ret = poll(fds, 2, -1);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0 || (fds[1].revents & POLLIN)) {
+                    return false;
+                }
+
+                uint64_t expirations;
+                return read(mTimerFd, &expirations, sizeof(expirations)) ==
+                        sizeof(expirations);
+            }
+        }
+        ALOGE("failed to arm the vsync timer: %s", strerror(errno));
+    }
+
     while (true) {
         int error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
         if (error) {
@@ -841,8 +986,19 @@ bool HWC2OnFbAdapter::VsyncThread::sleepUntil(int64_t t) {
 }
 
 void HWC2OnFbAdapter::VsyncThread::start(int64_t firstVsync, int64_t period) {
-    mNextVsync = firstVsync;
-    mPeriod = period;
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (mTimerFd < 0) {
+        ALOGE("failed to create the vsync timer: %s", strerror(errno));
+    } else {
+        mStopFd = eventfd(0, EFD_CLOEXEC);
+        if (mStopFd < 0) {
+            // the timer could not be interrupted, sleep instead
+            ALOGE("failed to create the vsync stop event: %s", strerror(errno));
+            ::close(mTimerFd);
+            mTimerFd = -1;
+        }
+    }
+    mModel.reset(firstVsync, period);
     mStarted = true;
     mThread = std::thread(&VsyncThread::vsyncLoop, this);
 }
@@ -853,7 +1009,24 @@ void HWC2OnFbAdapter::VsyncThread::stop() {
         mStarted = false;
     }
     mCondition.notify_all();
+
+    // Wake the thread now rather than waiting for the next vsync
+    if (mStopFd >= 0) {
+        uint64_t value = 1;
+        if (write(mStopFd, &value, sizeof(value)) != sizeof(value)) {
+            ALOGE("failed to signal the vsync stop event: %s", strerror(errno));
+        }
+    }
     mThread.join();
+
+    if (mTimerFd >= 0) {
+        ::close(mTimerFd);
+        mTimerFd = -1;
+    }
+    if (mStopFd >= 0) {
+        ::close(mStopFd);
+        mStopFd = -1;
+    }
 }
 
 void HWC2OnFbAdapter::VsyncThread::setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data) {
@@ -870,6 +1043,24 @@ void HWC2OnFbAdapter::VsyncThread::enableCallback(bool enable) {
     mCondition.notify_all();
 }
 
+void HWC2OnFbAdapter::VsyncThread::addPresentSample(int64_t timestamp) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mModel.addSample(timestamp);
+}
+
+void HWC2OnFbAdapter::VsyncThread::dump(std::string& result) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mModel.dump(result);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Vsync callbacks: %" PRIu64 " fired, wakeup late avg %" PRId64 " ns max %" PRId64
+             " ns\n",
+             mVsyncCount, mVsyncCount ? mWakeupLateTotal / int64_t(mVsyncCount) : 0,
+             mWakeupLateMax);
+    result += buffer;
+}
+
 void HWC2OnFbAdapter::VsyncThread::vsyncLoop() {
     prctl(PR_SET_NAME, "VsyncThread", 0, 0, 0);
 
@@ -881,29 +1072,33 @@ void HWC2OnFbAdapter::VsyncThread::vsyncLoop() {
     while (true) {
         if (!mCallbackEnabled) {
             mCondition.wait(lock, [this] { return mCallbackEnabled || !mStarted; });
-            if (!mStarted) {
-                break;
-            }
+        }
+        if (!mStarted) {
+            break;
         }
 
+        // Never report the same vsync twice, even if the model moved it
+        int64_t t = std::max(now(), mLastVsync + mModel.getPeriod() / 2);
+        int64_t nextVsync = mModel.predictNextVsync(t);
+
         lock.unlock();
 
-        // adjust mNextVsync if necessary
-        int64_t t = now();
-        if (mNextVsync < t) {
-            int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
-            mNextVsync += mPeriod * n;
-        }
-        bool fire = sleepUntil(mNextVsync);
+        bool fire = sleepUntil(nextVsync);
+        int64_t wakeup = now();
 
         lock.lock();
 
-        if (fire) {
-            ALOGV("VsyncThread(%" PRId64 ")", mNextVsync);
+        if (fire && mStarted) {
+            int64_t late = wakeup - nextVsync;
+            mWakeupLateTotal += late;
+            mWakeupLateMax = std::max(mWakeupLateMax, late);
+            mVsyncCount++;
+
+            ALOGV("VsyncThread(%" PRId64 ")", nextVsync);
             if (mCallback) {
-                mCallback(mCallbackData, getDisplayId(), mNextVsync);
+                mCallback(mCallbackData, getDisplayId(), nextVsync);
             }
-            mNextVsync += mPeriod;
+            mLastVsync = nextVsync;
         }
     }
 }
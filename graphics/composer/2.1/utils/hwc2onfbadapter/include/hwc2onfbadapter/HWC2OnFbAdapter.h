@@ -97,25 +97,69 @@ private:
 
     std::unordered_set<HWC2::Capability> mCapabilities;
 
+    // Learns the vsync period and phase from the times post() returned,
+    // since fbdev implementations usually return from post() right after
+    // the flip. Until the samples fit a model well enough, vsync is assumed
+    // to follow the nominal period.
+    class VsyncModel {
+    public:
+        void reset(int64_t phase, int64_t period);
+        void addSample(int64_t timestamp);
+
+        // The first vsync at or after t
+        int64_t predictNextVsync(int64_t t) const;
+        int64_t getPeriod() const { return mLocked ? mPeriod : mNominalPeriod; }
+        void dump(std::string& result) const;
+
+    private:
+        void updateModel();
+
+        static constexpr size_t kMaxSamples = 32;
+        static constexpr size_t kMinSamples = 6;
+
+        int64_t mNominalPhase{0};
+        int64_t mNominalPeriod{0};
+
+        int64_t mSamples[kMaxSamples]{};
+        size_t mFirstSample{0};
+        size_t mNumSamples{0};
+
+        bool mLocked{false};
+        int64_t mPeriod{0};
+        int64_t mPhase{0};
+        int64_t mErrorRms{0};
+        int64_t mErrorMax{0};
+    };
+
     class VsyncThread {
     public:
         static int64_t now();
-        static bool sleepUntil(int64_t t);
 
         void start(int64_t first, int64_t period);
         void stop();
         void setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data);
         void enableCallback(bool enable);
+        void addPresentSample(int64_t timestamp);
+        void dump(std::string& result);
 
     private:
         void vsyncLoop();
-        bool waitUntilNextVsync();
+        bool sleepUntil(int64_t t);
 
         std::thread mThread;
-        int64_t mNextVsync{0};
-        int64_t mPeriod{0};
+        // Absolute CLOCK_MONOTONIC timer the thread sleeps on, -1 when
+        // unavailable
+        int mTimerFd{-1};
+        // Signaled by stop() so the thread does not sleep on a timer it
+        // re-armed after stop() ran
+        int mStopFd{-1};
+        int64_t mLastVsync{0};
 
         std::mutex mMutex;
+        VsyncModel mModel;
+        uint64_t mVsyncCount{0};
+        int64_t mWakeupLateTotal{0};
+        int64_t mWakeupLateMax{0};
         std::condition_variable mCondition;
         bool mStarted{false};
         HWC2_PFN_VSYNC mCallback{nullptr};
@@ -18,6 +18,17 @@
 
 #include "composer-resources/2.1/ComposerResources.h"
 
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <algorithm>
+#include <functional>
+
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC 0x444d4142
+#endif
+
 namespace android {
 namespace hardware {
 namespace graphics {
@@ -44,6 +55,41 @@ bool ComposerHandleImporter::init() {
     return mMapper2 != nullptr;
 }
 
+size_t ComposerHandleImporter::BufferKeyHash::operator()(const BufferKey& key) const {
+    size_t hash = key.size();
+    for (auto val : key) {
+        hash ^= std::hash<uint64_t>()(val) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
+
+bool ComposerHandleImporter::getBufferKey(const native_handle_t* rawHandle, BufferKey* outKey) {
+    // fds differ from one transaction to the next; what they refer to does not
+    BufferKey key;
+    key.reserve(2 + rawHandle->numFds * 2 + rawHandle->numInts);
+    key.push_back(rawHandle->numFds);
+    key.push_back(rawHandle->numInts);
+    for (int i = 0; i < rawHandle->numFds; i++) {
+        // only the dmabuf filesystem gives every dma-buf an inode of its own;
+        // older kernels share one anonymous inode between all of them
+        struct statfs fs;
+        struct stat st;
+        if (fstatfs(rawHandle->data[i], &fs) != 0 || fs.f_type != DMA_BUF_MAGIC ||
+            fstat(rawHandle->data[i], &st) != 0) {
+            return false;
+        }
+        key.push_back(st.st_dev);
+        key.push_back(st.st_ino);
+    }
+    // the ints tell apart buffers that share fds, e.g. at different offsets
+    for (int i = 0; i < rawHandle->numInts; i++) {
+        key.push_back(static_cast<uint32_t>(rawHandle->data[rawHandle->numFds + i]));
+    }
+
+    *outKey = std::move(key);
+    return true;
+}
+
 Error ComposerHandleImporter::importBuffer(const native_handle_t* rawHandle,
                                            const native_handle_t** outBufferHandle) {
     if (!rawHandle || (!rawHandle->numFds && !rawHandle->numInts)) {
@@ -51,6 +97,84 @@ Error ComposerHandleImporter::importBuffer(const native_handle_t* rawHandle,
         return Error::NONE;
     }
 
+    BufferKey key;
+    if (getBufferKey(rawHandle, &key)) {
+        std::lock_guard<std::mutex> lock(mBuffersMutex);
+        auto keyIter = mBufferKeys.find(key);
+        if (keyIter != mBufferKeys.end()) {
+            mBuffers[keyIter->second].refCount++;
+            mReuseCount++;
+            *outBufferHandle = keyIter->second;
+            return Error::NONE;
+        }
+    }
+
+    // import without holding the lock; IMapper may be slow
+    const native_handle_t* bufferHandle;
+    Error error = importBufferFromMapper(rawHandle, &bufferHandle);
+    if (error != Error::NONE) {
+        return error;
+    }
+
+    const native_handle_t* duplicateHandle = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mBuffersMutex);
+        mImportCount++;
+        if (!key.empty()) {
+            auto result = mBufferKeys.emplace(key, bufferHandle);
+            if (!result.second) {
+                // imported by another thread in the meantime
+                duplicateHandle = bufferHandle;
+                bufferHandle = result.first->second;
+                mReuseCount++;
+            }
+        }
+
+        ImportedBuffer& buffer = mBuffers[bufferHandle];
+        if (buffer.refCount++ == 0) {
+            buffer.key = std::move(key);
+        }
+    }
+    freeBufferToMapper(duplicateHandle);
+
+    *outBufferHandle = bufferHandle;
+    return Error::NONE;
+}
+
+void ComposerHandleImporter::freeBuffer(const native_handle_t* bufferHandle) {
+    if (!bufferHandle) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mBuffersMutex);
+        auto bufferIter = mBuffers.find(bufferHandle);
+        if (bufferIter != mBuffers.end()) {
+            if (--bufferIter->second.refCount > 0) {
+                return;
+            }
+            if (!bufferIter->second.key.empty()) {
+                mBufferKeys.erase(bufferIter->second.key);
+            }
+            mBuffers.erase(bufferIter);
+            mFreeCount++;
+        } else {
+            ALOGW("freeing buffer %p that was not imported", bufferHandle);
+        }
+    }
+
+    freeBufferToMapper(bufferHandle);
+}
+
+std::string ComposerHandleImporter::dumpDebugInfo() {
+    std::lock_guard<std::mutex> lock(mBuffersMutex);
+    return "  imported buffers: " + std::to_string(mBuffers.size()) + " live, " +
+           std::to_string(mImportCount) + " imported, " + std::to_string(mReuseCount) +
+           " reused, " + std::to_string(mFreeCount) + " freed\n";
+}
+
+Error ComposerHandleImporter::importBufferFromMapper(const native_handle_t* rawHandle,
+                                                     const native_handle_t** outBufferHandle) {
     const native_handle_t* bufferHandle;
     if (mMapper2) {
         mapper::V2_0::Error error;
@@ -87,7 +211,7 @@ Error ComposerHandleImporter::importBuffer(const native_handle_t* rawHandle,
     return Error::NONE;
 }
 
-void ComposerHandleImporter::freeBuffer(const native_handle_t* bufferHandle) {
+void ComposerHandleImporter::freeBufferToMapper(const native_handle_t* bufferHandle) {
     if (bufferHandle) {
         if (mMapper2) {
             mMapper2->freeBuffer(static_cast<void*>(const_cast<native_handle_t*>(bufferHandle)));
@@ -209,12 +333,28 @@ Error ComposerLayerResource::getSidebandStream(uint32_t slot, bool fromCache,
     return mSidebandStreamCache.getHandle(slot, fromCache, inHandle, outHandle, outReplacedHandle);
 }
 
+bool ComposerLayerResource::updateState(uint32_t opcode, const uint32_t* args, uint16_t length) {
+    auto stateIter = mStates.find(opcode);
+    if (stateIter != mStates.end() && stateIter->second.size() == length &&
+        std::equal(args, args + length, stateIter->second.begin())) {
+        return false;
+    }
+
+    mStates[opcode].assign(args, args + length);
+    return true;
+}
+
+void ComposerLayerResource::invalidateState(uint32_t opcode) {
+    mStates.erase(opcode);
+}
+
 ComposerDisplayResource::ComposerDisplayResource(DisplayType type, ComposerHandleImporter& importer,
                                                  uint32_t outputBufferCacheSize)
     : mType(type),
       mClientTargetCache(importer),
       mOutputBufferCache(importer, ComposerHandleCache::HandleType::BUFFER, outputBufferCacheSize),
-      mMustValidate(true) {}
+      mMustValidate(true),
+      mChangedSincePresent(true) {}
 
 bool ComposerDisplayResource::initClientTargetCache(uint32_t cacheSize) {
     return mClientTargetCache.initCache(ComposerHandleCache::HandleType::BUFFER, cacheSize);
@@ -268,12 +408,19 @@ std::vector<Layer> ComposerDisplayResource::getLayers() const {
 
 void ComposerDisplayResource::setMustValidateState(bool mustValidate) {
     mMustValidate = mustValidate;
+    mChangedSincePresent |= mustValidate;
 }
 
 bool ComposerDisplayResource::mustValidate() const {
     return mMustValidate;
 }
 
+bool ComposerDisplayResource::setPresented() {
+    bool changed = mChangedSincePresent;
+    mChangedSincePresent = false;
+    return changed;
+}
+
 std::unique_ptr<ComposerResources> ComposerResources::create() {
     auto resources = std::make_unique<ComposerResources>();
     return resources->init() ? std::move(resources) : nullptr;
@@ -336,8 +483,11 @@ Error ComposerResources::addLayer(Display display, Layer layer, uint32_t bufferC
         return Error::BAD_DISPLAY;
     }
 
-    return displayResource->addLayer(layer, std::move(layerResource)) ? Error::NONE
-                                                                      : Error::BAD_LAYER;
+    if (!displayResource->addLayer(layer, std::move(layerResource))) {
+        return Error::BAD_LAYER;
+    }
+    displayResource->setMustValidateState(true);
+    return Error::NONE;
 }
 
 Error ComposerResources::removeLayer(Display display, Layer layer) {
@@ -347,7 +497,11 @@ Error ComposerResources::removeLayer(Display display, Layer layer) {
         return Error::BAD_DISPLAY;
     }
 
-    return displayResource->removeLayer(layer) ? Error::NONE : Error::BAD_LAYER;
+    if (!displayResource->removeLayer(layer)) {
+        return Error::BAD_LAYER;
+    }
+    displayResource->setMustValidateState(true);
+    return Error::NONE;
 }
 
 Error ComposerResources::getDisplayClientTarget(Display display, uint32_t slot, bool fromCache,
@@ -399,6 +553,48 @@ bool ComposerResources::mustValidateDisplay(Display display) {
     return false;
 }
 
+bool ComposerResources::setDisplayPresented(Display display) {
+    std::lock_guard<std::mutex> lock(mDisplayResourcesMutex);
+    auto* displayResource = findDisplayResourceLocked(display);
+    if (displayResource) {
+        return displayResource->setPresented();
+    }
+    return true;
+}
+
+bool ComposerResources::updateLayerState(Display display, Layer layer, uint32_t opcode,
+                                         const uint32_t* args, uint16_t length) {
+    std::lock_guard<std::mutex> lock(mDisplayResourcesMutex);
+    auto* displayResource = findDisplayResourceLocked(display);
+    if (!displayResource) {
+        return true;
+    }
+    auto* layerResource = displayResource->findLayerResource(layer);
+    if (!layerResource) {
+        // let ComposerHal report the bad layer
+        return true;
+    }
+
+    if (!layerResource->updateState(opcode, args, length)) {
+        return false;
+    }
+    displayResource->setMustValidateState(true);
+    return true;
+}
+
+void ComposerResources::invalidateLayerState(Display display, Layer layer, uint32_t opcode) {
+    std::lock_guard<std::mutex> lock(mDisplayResourcesMutex);
+    auto* displayResource = findDisplayResourceLocked(display);
+    auto* layerResource = displayResource ? displayResource->findLayerResource(layer) : nullptr;
+    if (layerResource) {
+        layerResource->invalidateState(opcode);
+    }
+}
+
+std::string ComposerResources::dumpDebugInfo() {
+    return mImporter.dumpDebugInfo();
+}
+
 std::unique_ptr<ComposerDisplayResource> ComposerResources::createDisplayResource(
         ComposerDisplayResource::DisplayType type, uint32_t outputBufferCacheSize) {
     return std::make_unique<ComposerDisplayResource>(type, mImporter, outputBufferCacheSize);
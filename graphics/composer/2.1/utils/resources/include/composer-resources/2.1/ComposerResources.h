@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -40,8 +41,18 @@ namespace V2_1 {
 namespace hal {
 
 // wrapper for IMapper to import buffers and sideband streams
+//
+// A buffer is imported once however many caches hold it.  A raw handle whose
+// fds are all dma-bufs is identified by their inodes and by its ints before
+// it is imported, so a buffer sent again for another slot or layer gets the
+// handle imported the first time without calling IMapper.  This needs a
+// kernel that gives every dma-buf its own inode; on older kernels, or for
+// other fds, each raw handle is imported separately.
+// Every importBuffer must be balanced by a freeBuffer.
 class ComposerHandleImporter {
   public:
+    virtual ~ComposerHandleImporter() = default;
+
     bool init();
 
     Error importBuffer(const native_handle_t* rawHandle, const native_handle_t** outBufferHandle);
@@ -49,10 +60,38 @@ class ComposerHandleImporter {
     Error importStream(const native_handle_t* rawHandle, const native_handle_t** outStreamHandle);
     void freeStream(const native_handle_t* streamHandle);
 
+    std::string dumpDebugInfo();
+
+  protected:
+    using BufferKey = std::vector<uint64_t>;
+
+    virtual Error importBufferFromMapper(const native_handle_t* rawHandle,
+                                         const native_handle_t** outBufferHandle);
+    virtual void freeBufferToMapper(const native_handle_t* bufferHandle);
+    // Returns false when the raw handle does not identify its buffer
+    virtual bool getBufferKey(const native_handle_t* rawHandle, BufferKey* outKey);
+
   private:
+    struct BufferKeyHash {
+        size_t operator()(const BufferKey& key) const;
+    };
+
+    struct ImportedBuffer {
+        uint32_t refCount = 0;
+        // empty when the buffer is not shared
+        BufferKey key;
+    };
+
     sp<mapper::V2_0::IMapper> mMapper2;
     sp<mapper::V3_0::IMapper> mMapper3;
     sp<mapper::V4_0::IMapper> mMapper4;
+
+    std::mutex mBuffersMutex;
+    std::unordered_map<const native_handle_t*, ImportedBuffer> mBuffers;
+    std::unordered_map<BufferKey, const native_handle_t*, BufferKeyHash> mBufferKeys;
+    uint64_t mImportCount = 0;
+    uint64_t mReuseCount = 0;
+    uint64_t mFreeCount = 0;
 };
 
 class ComposerHandleCache {
@@ -101,9 +140,17 @@ class ComposerLayerResource {
                             const native_handle_t** outHandle,
                             const native_handle** outReplacedHandle);
 
+    // Record the arguments of a layer state command, keyed by its opcode.
+    // Returns false when they are the ones last recorded for it.
+    bool updateState(uint32_t opcode, const uint32_t* args, uint16_t length);
+    void invalidateState(uint32_t opcode);
+
   protected:
     ComposerHandleCache mBufferCache;
     ComposerHandleCache mSidebandStreamCache;
+
+    // the layer state last sent to ComposerHal
+    std::unordered_map<uint32_t, std::vector<uint32_t>> mStates;
 };
 
 // display resource
@@ -140,11 +187,16 @@ class ComposerDisplayResource {
 
     bool mustValidate() const;
 
+    // Returns whether the display was marked as needing validation since it
+    // was last presented, and starts over for the next present.
+    bool setPresented();
+
   protected:
     const DisplayType mType;
     ComposerHandleCache mClientTargetCache;
     ComposerHandleCache mOutputBufferCache;
     bool mMustValidate;
+    bool mChangedSincePresent;
 
     std::unordered_map<Layer, std::unique_ptr<ComposerLayerResource>> mLayerResources;
 };
@@ -176,6 +228,19 @@ class ComposerResources {
 
     bool mustValidateDisplay(Display display);
 
+    // Returns false when nothing that requires validation changed since the
+    // display was last presented.
+    bool setDisplayPresented(Display display);
+
+    std::string dumpDebugInfo();
+
+    // Returns false when a layer state command would not change the state
+    // last sent to ComposerHal.  Otherwise the display must be validated.
+    bool updateLayerState(Display display, Layer layer, uint32_t opcode, const uint32_t* args,
+                          uint16_t length);
+    // the next command of that opcode is sent even if unchanged
+    void invalidateLayerState(Display display, Layer layer, uint32_t opcode);
+
     // When a buffer in the cache is replaced by a new one, we must keep it
     // alive until it has been replaced in ComposerHal.
     class ReplacedHandle {
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ComposerResourcesTest"
+
+#include <composer-resources/2.1/ComposerResources.h>
+
+#include <fcntl.h>
+
+#include <map>
+#include <set>
+
+#include <gtest/gtest.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace hal {
+namespace {
+
+// Imports buffers by cloning their raw handles, and identifies raw handles by
+// the keys given to them
+class FakeHandleImporter : public ComposerHandleImporter {
+   public:
+    void setBufferKey(const native_handle_t* rawHandle, uint64_t key) {
+        mRawBufferKeys[rawHandle] = key;
+    }
+
+    size_t getMapperImportCount() const { return mMapperImportCount; }
+    size_t getLiveImportCount() const { return mLiveImports.size(); }
+
+   protected:
+    Error importBufferFromMapper(const native_handle_t* rawHandle,
+                                 const native_handle_t** outBufferHandle) override {
+        native_handle_t* bufferHandle = native_handle_clone(rawHandle);
+        if (!bufferHandle) {
+            return Error::NO_RESOURCES;
+        }
+
+        mMapperImportCount++;
+        mLiveImports.insert(bufferHandle);
+        *outBufferHandle = bufferHandle;
+        return Error::NONE;
+    }
+
+    void freeBufferToMapper(const native_handle_t* bufferHandle) override {
+        if (bufferHandle) {
+            ASSERT_EQ(1u, mLiveImports.erase(bufferHandle));
+            native_handle_close(bufferHandle);
+            native_handle_delete(const_cast<native_handle_t*>(bufferHandle));
+        }
+    }
+
+    // raw handles without a key are identified by the real implementation
+    bool getBufferKey(const native_handle_t* rawHandle, BufferKey* outKey) override {
+        auto keyIter = mRawBufferKeys.find(rawHandle);
+        if (keyIter == mRawBufferKeys.end()) {
+            return ComposerHandleImporter::getBufferKey(rawHandle, outKey);
+        }
+        *outKey = {keyIter->second};
+        return true;
+    }
+
+   private:
+    std::map<const native_handle_t*, uint64_t> mRawBufferKeys;
+    size_t mMapperImportCount = 0;
+    std::set<const native_handle_t*> mLiveImports;
+};
+
+class ComposerHandleImporterTest : public ::testing::Test {
+   protected:
+    void TearDown() override {
+        for (auto rawHandle : mRawHandles) {
+            native_handle_close(rawHandle);
+            native_handle_delete(rawHandle);
+        }
+    }
+
+    // A raw handle with the same fd inode and ints as every other, like
+    // dma-buf handles on kernels that give all dma-bufs one anonymous inode.
+    // /dev/null is not on the dmabuf filesystem, so it never identifies a
+    // buffer.
+    const native_handle_t* createRawHandle() {
+        native_handle_t* rawHandle = native_handle_create(1, 2);
+        rawHandle->data[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        rawHandle->data[1] = 1920;
+        rawHandle->data[2] = 1080;
+        mRawHandles.push_back(rawHandle);
+        return rawHandle;
+    }
+
+    FakeHandleImporter mImporter;
+    std::vector<native_handle_t*> mRawHandles;
+};
+
+TEST_F(ComposerHandleImporterTest, sharesBufferWithSameKey) {
+    const native_handle_t* rawHandle1 = createRawHandle();
+    const native_handle_t* rawHandle2 = createRawHandle();
+    mImporter.setBufferKey(rawHandle1, 1);
+    mImporter.setBufferKey(rawHandle2, 1);
+
+    const native_handle_t* bufferHandle1;
+    const native_handle_t* bufferHandle2;
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle1, &bufferHandle1));
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle2, &bufferHandle2));
+    EXPECT_EQ(bufferHandle1, bufferHandle2);
+    // the second raw handle never reaches the mapper
+    EXPECT_EQ(1u, mImporter.getMapperImportCount());
+    EXPECT_EQ(1u, mImporter.getLiveImportCount());
+    EXPECT_EQ("  imported buffers: 1 live, 1 imported, 1 reused, 0 freed\n",
+              mImporter.dumpDebugInfo());
+
+    // freed by the last reference
+    mImporter.freeBuffer(bufferHandle1);
+    EXPECT_EQ(1u, mImporter.getLiveImportCount());
+    mImporter.freeBuffer(bufferHandle2);
+    EXPECT_EQ(0u, mImporter.getLiveImportCount());
+
+    // the key can be imported again
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle2, &bufferHandle2));
+    EXPECT_EQ(2u, mImporter.getMapperImportCount());
+    EXPECT_EQ(1u, mImporter.getLiveImportCount());
+    mImporter.freeBuffer(bufferHandle2);
+}
+
+TEST_F(ComposerHandleImporterTest, keepsBuffersWithDifferentKeysApart) {
+    const native_handle_t* rawHandle1 = createRawHandle();
+    const native_handle_t* rawHandle2 = createRawHandle();
+    mImporter.setBufferKey(rawHandle1, 1);
+    mImporter.setBufferKey(rawHandle2, 2);
+
+    const native_handle_t* bufferHandle1;
+    const native_handle_t* bufferHandle2;
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle1, &bufferHandle1));
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle2, &bufferHandle2));
+    EXPECT_NE(bufferHandle1, bufferHandle2);
+    EXPECT_EQ(2u, mImporter.getLiveImportCount());
+
+    mImporter.freeBuffer(bufferHandle1);
+    mImporter.freeBuffer(bufferHandle2);
+    EXPECT_EQ(0u, mImporter.getLiveImportCount());
+}
+
+TEST_F(ComposerHandleImporterTest, importsNonDmaBufHandlesEveryTime) {
+    const native_handle_t* rawHandle1 = createRawHandle();
+    const native_handle_t* rawHandle2 = createRawHandle();
+
+    const native_handle_t* bufferHandle1;
+    const native_handle_t* bufferHandle2;
+    const native_handle_t* bufferHandle3;
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle1, &bufferHandle1));
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle1, &bufferHandle2));
+    ASSERT_EQ(Error::NONE, mImporter.importBuffer(rawHandle2, &bufferHandle3));
+    EXPECT_NE(bufferHandle1, bufferHandle2);
+    EXPECT_NE(bufferHandle1, bufferHandle3);
+    EXPECT_NE(bufferHandle2, bufferHandle3);
+    EXPECT_EQ(3u, mImporter.getLiveImportCount());
+
+    mImporter.freeBuffer(bufferHandle1);
+    mImporter.freeBuffer(bufferHandle2);
+    mImporter.freeBuffer(bufferHandle3);
+    EXPECT_EQ(0u, mImporter.getLiveImportCount());
+}
+
+}  // namespace
+}  // namespace hal
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -54,6 +54,11 @@ class ComposerCommandEngine : public V2_1::hal::ComposerCommandEngine {
         return std::make_unique<CommandWriterBase>(writerInitialSize);
     }
 
+    std::unique_ptr<V2_1::hal::ComposerCommandEngine> createDisplayEngine() override {
+        return std::make_unique<ComposerCommandEngine>(
+                mHal, static_cast<V2_2::hal::ComposerResources*>(mResources));
+    }
+
     bool executeSetLayerPerFrameMetadata(uint16_t length) {
         // (key, value) pairs
         if (length % 2 != 0) {
@@ -86,6 +91,11 @@ class ComposerCommandEngine : public V2_1::hal::ComposerCommandEngine {
             mWriter->setError(getCommandLoc(), err);
         }
 
+        // the layer color is no longer the one SET_LAYER_COLOR last sent
+        mResources->invalidateLayerState(
+                mCurrentDisplay, mCurrentLayer,
+                static_cast<uint32_t>(IComposerClient::Command::SET_LAYER_COLOR));
+
         return true;
     }
 
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ComposerCommandEngineTest"
+
+#include <composer-hal/2.2/ComposerCommandEngine.h>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_2 {
+namespace hal {
+namespace {
+
+using ::testing::_;
+using ::testing::InSequence;
+using ::testing::NiceMock;
+
+class MockComposerHal : public ComposerHal {
+   public:
+    // V2_1::hal::ComposerHal
+    MOCK_METHOD1(hasCapability, bool(hwc2_capability_t));
+    MOCK_METHOD0(supportsConcurrentDisplays, bool());
+    MOCK_METHOD0(dumpDebugInfo, std::string());
+    MOCK_METHOD1(registerEventCallback, void(EventCallback*));
+    MOCK_METHOD0(unregisterEventCallback, void());
+    MOCK_METHOD0(getMaxVirtualDisplayCount, uint32_t());
+    MOCK_METHOD1(destroyVirtualDisplay, Error(Display));
+    MOCK_METHOD2(createLayer, Error(Display, Layer*));
+    MOCK_METHOD2(destroyLayer, Error(Display, Layer));
+    MOCK_METHOD2(getActiveConfig, Error(Display, Config*));
+    MOCK_METHOD4(getDisplayAttribute,
+                 Error(Display, Config, IComposerClient::Attribute, int32_t*));
+    MOCK_METHOD2(getDisplayConfigs, Error(Display, hidl_vec<Config>*));
+    MOCK_METHOD2(getDisplayName, Error(Display, hidl_string*));
+    MOCK_METHOD2(getDisplayType, Error(Display, IComposerClient::DisplayType*));
+    MOCK_METHOD2(getDozeSupport, Error(Display, bool*));
+    MOCK_METHOD5(getHdrCapabilities, Error(Display, hidl_vec<common::V1_0::Hdr>*, float*,
+                                           float*, float*));
+    MOCK_METHOD2(setActiveConfig, Error(Display, Config));
+    MOCK_METHOD2(setVsyncEnabled, Error(Display, IComposerClient::Vsync));
+    MOCK_METHOD3(setColorTransform, Error(Display, const float*, int32_t));
+    MOCK_METHOD5(setClientTarget, Error(Display, buffer_handle_t, int32_t, int32_t,
+                                        const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setOutputBuffer, Error(Display, buffer_handle_t, int32_t));
+    MOCK_METHOD6(validateDisplay,
+                 Error(Display, std::vector<Layer>*, std::vector<IComposerClient::Composition>*,
+                       uint32_t*, std::vector<Layer>*, std::vector<uint32_t>*));
+    MOCK_METHOD1(acceptDisplayChanges, Error(Display));
+    MOCK_METHOD4(presentDisplay,
+                 Error(Display, int32_t*, std::vector<Layer>*, std::vector<int32_t>*));
+    MOCK_METHOD4(setLayerCursorPosition, Error(Display, Layer, int32_t, int32_t));
+    MOCK_METHOD4(setLayerBuffer, Error(Display, Layer, buffer_handle_t, int32_t));
+    MOCK_METHOD3(setLayerSurfaceDamage, Error(Display, Layer, const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setLayerBlendMode, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerColor, Error(Display, Layer, IComposerClient::Color));
+    MOCK_METHOD3(setLayerCompositionType, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerDataspace, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerDisplayFrame, Error(Display, Layer, const hwc_rect_t&));
+    MOCK_METHOD3(setLayerPlaneAlpha, Error(Display, Layer, float));
+    MOCK_METHOD3(setLayerSidebandStream, Error(Display, Layer, buffer_handle_t));
+    MOCK_METHOD3(setLayerSourceCrop, Error(Display, Layer, const hwc_frect_t&));
+    MOCK_METHOD3(setLayerTransform, Error(Display, Layer, int32_t));
+    MOCK_METHOD3(setLayerVisibleRegion, Error(Display, Layer, const std::vector<hwc_rect_t>&));
+    MOCK_METHOD3(setLayerZOrder, Error(Display, Layer, uint32_t));
+
+    // V2_2::hal::ComposerHal
+    MOCK_METHOD2(getPerFrameMetadataKeys,
+                 Error(Display, std::vector<IComposerClient::PerFrameMetadataKey>*));
+    MOCK_METHOD3(setLayerPerFrameMetadata,
+                 Error(Display, Layer, const std::vector<IComposerClient::PerFrameMetadata>&));
+    MOCK_METHOD3(getReadbackBufferAttributes, Error(Display, PixelFormat*, Dataspace*));
+    // unique_fd is move-only, so gmock cannot take it by value
+    Error setReadbackBuffer(Display, const native_handle_t*, base::unique_fd) override {
+        return Error::UNSUPPORTED;
+    }
+    MOCK_METHOD2(getReadbackBufferFence, Error(Display, base::unique_fd*));
+    MOCK_METHOD4(createVirtualDisplay_2_2, Error(uint32_t, uint32_t, PixelFormat*, Display*));
+    MOCK_METHOD5(getClientTargetSupport_2_2,
+                 Error(Display, uint32_t, uint32_t, PixelFormat, Dataspace));
+    MOCK_METHOD2(setPowerMode_2_2, Error(Display, IComposerClient::PowerMode));
+    MOCK_METHOD3(setLayerFloatColor, Error(Display, Layer, IComposerClient::FloatColor));
+    MOCK_METHOD2(getColorModes_2_2, Error(Display, hidl_vec<ColorMode>*));
+    MOCK_METHOD3(getRenderIntents, Error(Display, ColorMode, std::vector<RenderIntent>*));
+    MOCK_METHOD3(setColorMode_2_2, Error(Display, ColorMode, RenderIntent));
+    MOCK_METHOD1(getDataspaceSaturationMatrix, std::array<float, 16>(Dataspace));
+};
+
+constexpr Display kDisplay = 1;
+constexpr Layer kLayer = 2;
+
+constexpr IComposerClient::Color kRed = {0xff, 0, 0, 0xff};
+constexpr IComposerClient::FloatColor kFloatBlue = {0.0f, 0.0f, 1.0f, 1.0f};
+
+class ComposerCommandEngineTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        // buffers are never imported, so the resources need no mapper
+        ASSERT_EQ(Error::NONE, mResources.addPhysicalDisplay(kDisplay));
+        ASSERT_EQ(Error::NONE, mResources.addLayer(kDisplay, kLayer, 1));
+    }
+
+    // start the commands of a frame for kLayer
+    void selectLayer() {
+        mWriter.selectDisplay(kDisplay);
+        mWriter.selectLayer(kLayer);
+    }
+
+    void execute() {
+        bool queueChanged = false;
+        uint32_t commandLength = 0;
+        hidl_vec<hidl_handle> commandHandles;
+        ASSERT_TRUE(mWriter.writeQueue(&queueChanged, &commandLength, &commandHandles));
+        if (queueChanged) {
+            ASSERT_TRUE(mEngine.setInputMQDescriptor(*mWriter.getMQDescriptor()));
+        }
+
+        bool outQueueChanged = false;
+        uint32_t outCommandLength = 0;
+        hidl_vec<hidl_handle> outCommandHandles;
+        ASSERT_EQ(Error::NONE, mEngine.execute(commandLength, commandHandles, &outQueueChanged,
+                                               &outCommandLength, &outCommandHandles));
+        mWriter.reset();
+        mEngine.reset();
+    }
+
+    NiceMock<MockComposerHal> mHal;
+    ComposerResources mResources;
+    ComposerCommandEngine mEngine{&mHal, &mResources};
+    CommandWriterBase mWriter{1024};
+};
+
+TEST_F(ComposerCommandEngineTest, resendsColorAfterFloatColor) {
+    {
+        InSequence seq;
+        EXPECT_CALL(mHal, setLayerColor(kDisplay, kLayer, _)).Times(1);
+        EXPECT_CALL(mHal, setLayerFloatColor(kDisplay, kLayer, _)).Times(1);
+        EXPECT_CALL(mHal, setLayerColor(kDisplay, kLayer, _)).Times(1);
+    }
+
+    // the float color replaced the color, so the same color is not unchanged
+    selectLayer();
+    mWriter.setLayerColor(kRed);
+    execute();
+
+    selectLayer();
+    mWriter.setLayerFloatColor(kFloatBlue);
+    execute();
+
+    selectLayer();
+    mWriter.setLayerColor(kRed);
+    execute();
+}
+
+}  // namespace
+}  // namespace hal
+}  // namespace V2_2
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -120,12 +120,7 @@ class CommandWriterBase : public V2_2::CommandWriterBase {
     }
 
    protected:
-    void writeBlob(uint32_t length, const unsigned char* blob) {
-        memcpy(&mData[mDataWritten], blob, length);
-        uint32_t numElements = length / 4;
-        mDataWritten += numElements;
-        mDataWritten += (length - (numElements * 4) > 0) ? 1 : 0;
-    }
+    void writeBlob(uint32_t length, const unsigned char* blob) { writeBytes(blob, length); }
 };
 
 // This class helps parse a command queue.  Note that all sizes/lengths are in
@@ -55,6 +55,11 @@ class ComposerCommandEngine : public V2_2::hal::ComposerCommandEngine {
         return std::make_unique<CommandWriterBase>(writerInitialSize);
     }
 
+    std::unique_ptr<V2_1::hal::ComposerCommandEngine> createDisplayEngine() override {
+        return std::make_unique<ComposerCommandEngine>(
+                mHal, static_cast<V2_2::hal::ComposerResources*>(mResources));
+    }
+
     bool executeSetLayerColorTransform(uint16_t length) {
         if (length != CommandWriterBase::kSetLayerColorTransformLength) {
             return false;
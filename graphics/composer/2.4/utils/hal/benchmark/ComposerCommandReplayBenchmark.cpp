@@ -0,0 +1,616 @@
+/*
+ * Copyright 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ComposerCommandReplayBenchmark"
+
+// Replays recorded composer command streams through the command engines of
+// composer 2.1 to 2.4 against a HAL that does nothing, to measure what
+// parsing and dispatching the commands costs.
+//
+// Set COMPOSER_COMMAND_STREAM to a file saved by CommandStreamRecorder to
+// replay it; otherwise a synthetic stream is generated.  Handles cannot be
+// recorded, so buffers and fences are replayed as null handles and buffer
+// import is not part of the measurement.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <new>
+#include <set>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <composer-command-buffer/2.1/ComposerCommandStream.h>
+#include <composer-hal/2.1/ComposerCommandEngine.h>
+#include <composer-hal/2.2/ComposerCommandEngine.h>
+#include <composer-hal/2.3/ComposerCommandEngine.h>
+#include <composer-hal/2.4/ComposerCommandEngine.h>
+#include <log/log.h>
+
+namespace {
+
+std::atomic<uint64_t> gAllocationCount{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+    gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_4 {
+namespace hal {
+namespace {
+
+using V2_1::CommandStreamBatch;
+using V2_1::CommandStreamRecorder;
+using V2_1::CommandQueueType;
+
+// Accepts every command and reports no changes
+class NullComposerHal : public ComposerHal {
+  public:
+    bool hasCapability(hwc2_capability_t) override { return false; }
+    std::string dumpDebugInfo() override { return std::string(); }
+    void registerEventCallback(EventCallback*) override {}
+    void unregisterEventCallback() override {}
+
+    uint32_t getMaxVirtualDisplayCount() override { return 0; }
+    V2_1::Error destroyVirtualDisplay(Display) override { return V2_1::Error::UNSUPPORTED; }
+    V2_1::Error createLayer(Display, Layer*) override { return V2_1::Error::UNSUPPORTED; }
+    V2_1::Error destroyLayer(Display, Layer) override { return V2_1::Error::UNSUPPORTED; }
+
+    V2_1::Error getActiveConfig(Display, Config*) override { return V2_1::Error::UNSUPPORTED; }
+    V2_1::Error getDisplayAttribute(Display, Config, V2_1::IComposerClient::Attribute,
+                                    int32_t*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDisplayConfigs(Display, hidl_vec<Config>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDisplayName(Display, hidl_string*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDisplayType(Display, V2_1::IComposerClient::DisplayType*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDozeSupport(Display, bool*) override { return V2_1::Error::UNSUPPORTED; }
+    V2_1::Error setActiveConfig(Display, Config) override { return V2_1::Error::UNSUPPORTED; }
+    V2_1::Error setVsyncEnabled(Display, V2_1::IComposerClient::Vsync) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+
+    V2_1::Error setColorTransform(Display, const float*, int32_t) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setClientTarget(Display, buffer_handle_t, int32_t acquireFence, int32_t,
+                                const std::vector<hwc_rect_t>&) override {
+        closeFence(acquireFence);
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setOutputBuffer(Display, buffer_handle_t, int32_t releaseFence) override {
+        closeFence(releaseFence);
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error validateDisplay(Display, std::vector<Layer>*,
+                                std::vector<V2_1::IComposerClient::Composition>*,
+                                uint32_t* outDisplayRequestMask, std::vector<Layer>*,
+                                std::vector<uint32_t>*) override {
+        *outDisplayRequestMask = 0;
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error acceptDisplayChanges(Display) override { return V2_1::Error::NONE; }
+    V2_1::Error presentDisplay(Display, int32_t* outPresentFence, std::vector<Layer>*,
+                               std::vector<int32_t>*) override {
+        *outPresentFence = -1;
+        return V2_1::Error::NONE;
+    }
+
+    V2_1::Error setLayerCursorPosition(Display, Layer, int32_t, int32_t) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerBuffer(Display, Layer, buffer_handle_t, int32_t acquireFence) override {
+        closeFence(acquireFence);
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerSurfaceDamage(Display, Layer, const std::vector<hwc_rect_t>&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerBlendMode(Display, Layer, int32_t) override { return V2_1::Error::NONE; }
+    V2_1::Error setLayerColor(Display, Layer, V2_1::IComposerClient::Color) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerCompositionType(Display, Layer, int32_t) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerDataspace(Display, Layer, int32_t) override { return V2_1::Error::NONE; }
+    V2_1::Error setLayerDisplayFrame(Display, Layer, const hwc_rect_t&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerPlaneAlpha(Display, Layer, float) override { return V2_1::Error::NONE; }
+    V2_1::Error setLayerSidebandStream(Display, Layer, buffer_handle_t) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerSourceCrop(Display, Layer, const hwc_frect_t&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerTransform(Display, Layer, int32_t) override { return V2_1::Error::NONE; }
+    V2_1::Error setLayerVisibleRegion(Display, Layer, const std::vector<hwc_rect_t>&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error setLayerZOrder(Display, Layer, uint32_t) override { return V2_1::Error::NONE; }
+
+    // 2.2
+    V2_1::Error setReadbackBuffer(Display, const native_handle_t*, base::unique_fd) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getReadbackBufferFence(Display, base::unique_fd*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error createVirtualDisplay_2_2(uint32_t, uint32_t, common::V1_1::PixelFormat*,
+                                         Display*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setPowerMode_2_2(Display, V2_2::IComposerClient::PowerMode) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setLayerFloatColor(Display, Layer, V2_2::IComposerClient::FloatColor) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error getRenderIntents(Display, common::V1_1::ColorMode,
+                                 std::vector<common::V1_1::RenderIntent>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    std::array<float, 16> getDataspaceSaturationMatrix(common::V1_1::Dataspace) override {
+        return {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+                0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+    }
+
+    // 2.3
+    V2_1::Error getPerFrameMetadataKeys_2_3(
+            Display, std::vector<V2_3::IComposerClient::PerFrameMetadataKey>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setColorMode_2_3(Display, common::V1_2::ColorMode, RenderIntent) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getRenderIntents_2_3(Display, common::V1_2::ColorMode,
+                                     std::vector<RenderIntent>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getColorModes_2_3(Display, hidl_vec<common::V1_2::ColorMode>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getClientTargetSupport_2_3(Display, uint32_t, uint32_t, common::V1_2::PixelFormat,
+                                           common::V1_2::Dataspace) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getReadbackBufferAttributes_2_3(Display, common::V1_2::PixelFormat*,
+                                                common::V1_2::Dataspace*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getHdrCapabilities_2_3(Display, hidl_vec<common::V1_2::Hdr>*, float*, float*,
+                                       float*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setLayerPerFrameMetadata_2_3(
+            Display, Layer, const std::vector<V2_3::IComposerClient::PerFrameMetadata>&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error getDisplayIdentificationData(Display, uint8_t*, std::vector<uint8_t>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setLayerColorTransform(Display, Layer, const float*) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error getDisplayedContentSamplingAttributes(
+            uint64_t, common::V1_2::PixelFormat&, common::V1_2::Dataspace&,
+            hidl_bitfield<V2_3::IComposerClient::FormatColorComponent>&) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setDisplayedContentSamplingEnabled(
+            uint64_t, V2_3::IComposerClient::DisplayedContentSampling,
+            hidl_bitfield<V2_3::IComposerClient::FormatColorComponent>, uint64_t) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDisplayedContentSample(uint64_t, uint64_t, uint64_t, uint64_t&,
+                                          hidl_vec<uint64_t>&, hidl_vec<uint64_t>&,
+                                          hidl_vec<uint64_t>&, hidl_vec<uint64_t>&) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error getDisplayCapabilities(
+            Display, std::vector<V2_3::IComposerClient::DisplayCapability>*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setLayerPerFrameMetadataBlobs(
+            Display, Layer, std::vector<V2_3::IComposerClient::PerFrameMetadataBlob>&) override {
+        return V2_1::Error::NONE;
+    }
+    V2_1::Error getDisplayBrightnessSupport(Display, bool*) override {
+        return V2_1::Error::UNSUPPORTED;
+    }
+    V2_1::Error setDisplayBrightness(Display, float) override { return V2_1::Error::UNSUPPORTED; }
+
+    // 2.4
+    void registerEventCallback_2_4(EventCallback_2_4*) override {}
+    void unregisterEventCallback_2_4() override {}
+    Error getDisplayCapabilities_2_4(Display,
+                                     std::vector<IComposerClient::DisplayCapability>*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error getDisplayConnectionType(Display, IComposerClient::DisplayConnectionType*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error getDisplayAttribute_2_4(Display, Config, IComposerClient::Attribute,
+                                  int32_t*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error getDisplayVsyncPeriod(Display, VsyncPeriodNanos*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error setActiveConfigWithConstraints(Display, Config,
+                                         const IComposerClient::VsyncPeriodChangeConstraints&,
+                                         VsyncPeriodChangeTimeline*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error setAutoLowLatencyMode(Display, bool) override { return Error::UNSUPPORTED; }
+    Error getSupportedContentTypes(Display,
+                                   std::vector<IComposerClient::ContentType>*) override {
+        return Error::UNSUPPORTED;
+    }
+    Error setContentType(Display, IComposerClient::ContentType) override {
+        return Error::UNSUPPORTED;
+    }
+    Error validateDisplay_2_4(Display, std::vector<Layer>*,
+                              std::vector<IComposerClient::Composition>*,
+                              uint32_t* outDisplayRequestMask, std::vector<Layer>*,
+                              std::vector<uint32_t>*,
+                              IComposerClient::ClientTargetProperty*) override {
+        *outDisplayRequestMask = 0;
+        return Error::NONE;
+    }
+    Error setLayerGenericMetadata(Display, Layer, const std::string&, bool,
+                                  const std::vector<uint8_t>&) override {
+        return Error::NONE;
+    }
+    Error getLayerGenericMetadataKeys(
+            std::vector<IComposerClient::LayerGenericMetadataKey>*) override {
+        return Error::UNSUPPORTED;
+    }
+
+  private:
+    static void closeFence(int32_t fence) {
+        if (fence >= 0) {
+            close(fence);
+        }
+    }
+};
+
+// The time spent in each command type, when enabled
+struct CommandProfile {
+    struct Entry {
+        uint64_t count = 0;
+        std::chrono::nanoseconds time{0};
+    };
+
+    bool enabled = false;
+    std::map<uint32_t, Entry> entries;
+};
+
+// An engine that times executeCommand by opcode
+template <typename Engine>
+class ProfilingEngine : public Engine {
+  public:
+    template <typename Hal, typename Resources>
+    ProfilingEngine(Hal* hal, Resources* resources, CommandProfile* profile)
+        : Engine(hal, resources), mProfile(profile) {}
+
+  protected:
+    bool executeCommand(V2_1::IComposerClient::Command command, uint16_t length) override {
+        if (!mProfile->enabled) {
+            return Engine::executeCommand(command, length);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool parsed = Engine::executeCommand(command, length);
+        auto& entry = mProfile->entries[static_cast<uint32_t>(command)];
+        entry.count++;
+        entry.time += std::chrono::steady_clock::now() - start;
+        return parsed;
+    }
+
+  private:
+    CommandProfile* mProfile;
+};
+
+struct Composer2_1 {
+    using Engine = V2_1::hal::ComposerCommandEngine;
+    using Resources = V2_1::hal::ComposerResources;
+};
+
+struct Composer2_2 {
+    using Engine = V2_2::hal::ComposerCommandEngine;
+    using Resources = V2_2::hal::ComposerResources;
+};
+
+struct Composer2_3 {
+    using Engine = V2_3::hal::ComposerCommandEngine;
+    using Resources = V2_2::hal::ComposerResources;
+};
+
+struct Composer2_4 {
+    using Engine = V2_4::hal::ComposerCommandEngine;
+    using Resources = V2_2::hal::ComposerResources;
+};
+
+constexpr uint32_t kCacheSize = 64;
+constexpr Display kSyntheticDisplays[] = {0, 1};
+constexpr uint32_t kSyntheticLayers = 16;
+constexpr uint32_t kSyntheticFrames = 240;
+
+// A few displays of layers whose buffers change every frame and that move
+// every so often, as a UI does while scrolling
+std::vector<CommandStreamBatch> generateSyntheticStream() {
+    CommandStreamRecorder recorder;
+    CommandWriterBase writer(4096);
+    writer.setRecorder(&recorder);
+
+    native_handle_t* buffer = native_handle_create(0, 1);
+    buffer->data[0] = 1;
+
+    for (uint32_t frame = 0; frame < kSyntheticFrames; frame++) {
+        for (Display display : kSyntheticDisplays) {
+            writer.selectDisplay(display);
+            for (uint32_t i = 0; i < kSyntheticLayers; i++) {
+                int32_t offset = (i % 4 == frame % 4) ? int32_t(frame) : 0;
+                V2_1::IComposerClient::Rect frameRect{0, offset, 1080, offset + 120};
+
+                writer.selectLayer(i + 1);
+                writer.setLayerBuffer(frame % 3, (frame < 3) ? buffer : nullptr, -1);
+                writer.setLayerSurfaceDamage({frameRect});
+                writer.setLayerCompositionType(V2_1::IComposerClient::Composition::DEVICE);
+                writer.setLayerBlendMode(V2_1::IComposerClient::BlendMode::PREMULTIPLIED);
+                writer.setLayerDataspace(common::V1_2::Dataspace::UNKNOWN);
+                writer.setLayerDisplayFrame(frameRect);
+                writer.setLayerSourceCrop({0.0f, 0.0f, 1080.0f, 120.0f});
+                writer.setLayerTransform(static_cast<common::V1_0::Transform>(0));
+                writer.setLayerPlaneAlpha(1.0f);
+                writer.setLayerVisibleRegion({frameRect});
+                writer.setLayerZOrder(i);
+            }
+            writer.presentOrvalidateDisplay();
+        }
+
+        bool queueChanged;
+        uint32_t commandLength;
+        hidl_vec<hidl_handle> commandHandles;
+        writer.writeQueue(&queueChanged, &commandLength, &commandHandles);
+        writer.reset();
+    }
+
+    writer.setRecorder(nullptr);
+    native_handle_delete(buffer);
+
+    return recorder.getBatches();
+}
+
+const std::vector<CommandStreamBatch>& getStream() {
+    static const std::vector<CommandStreamBatch> stream = []() {
+        const char* path = getenv("COMPOSER_COMMAND_STREAM");
+        if (!path) {
+            return generateSyntheticStream();
+        }
+
+        std::vector<CommandStreamBatch> batches;
+        CommandStreamRecorder::load(path, &batches);
+        return batches;
+    }();
+    return stream;
+}
+
+// Replays a stream into one engine through real message queues
+template <typename Composer>
+class Replayer {
+  public:
+    Replayer(const std::vector<CommandStreamBatch>& batches)
+        : mBatches(batches), mEngine(&mHal, &mResources, &mProfile) {
+        size_t maxLength = 1;
+        for (const auto& batch : mBatches) {
+            maxLength = std::max(maxLength, batch.commands.size());
+            mBatchHandles.emplace_back(batch.handles.size());
+            mCommandCount += scanBatch(batch);
+        }
+
+        mInputQueue = std::make_unique<CommandQueueType>(maxLength);
+        mEngine.setInputMQDescriptor(*mInputQueue->getDesc());
+    }
+
+    bool isValid() const { return mInputQueue->isValid(); }
+    size_t getCommandCount() const { return mCommandCount; }
+    CommandProfile& getProfile() { return mProfile; }
+
+    // Returns false when the engine failed to parse or execute the batch
+    bool replayBatch(size_t index) {
+        const auto& batch = mBatches[index];
+        if (!mInputQueue->write(batch.commands.data(), batch.commands.size())) {
+            return false;
+        }
+
+        bool outQueueChanged = false;
+        uint32_t outLength = 0;
+        hidl_vec<hidl_handle> outHandles;
+        auto err = mEngine.execute(batch.commands.size(), mBatchHandles[index], &outQueueChanged,
+                                   &outLength, &outHandles);
+        bool drained = drainOutput(outQueueChanged, outLength);
+        mEngine.reset();
+
+        return err == V2_1::Error::NONE && drained;
+    }
+
+  private:
+    void registerDisplaysAndLayers(Display display, Layer layer) {
+        if (mDisplays.insert(display).second) {
+            mResources.addPhysicalDisplay(display);
+            mResources.setDisplayClientTargetCacheSize(display, kCacheSize);
+        }
+        if (mLayers.insert({display, layer}).second) {
+            mResources.addLayer(display, layer, kCacheSize);
+        }
+    }
+
+    // Count the commands of a batch.  The resources of every display and
+    // layer it selects must exist, as they would have been created through
+    // IComposerClient.
+    size_t scanBatch(const CommandStreamBatch& batch) {
+        constexpr uint32_t opcodeMask =
+                static_cast<uint32_t>(V2_1::IComposerClient::Command::OPCODE_MASK);
+        constexpr uint32_t lengthMask =
+                static_cast<uint32_t>(V2_1::IComposerClient::Command::LENGTH_MASK);
+
+        const auto& words = batch.commands;
+        size_t count = 0;
+        Display display = 0;
+        for (size_t pos = 0; pos < words.size();) {
+            auto command = static_cast<V2_1::IComposerClient::Command>(words[pos] & opcodeMask);
+            uint16_t length = words[pos] & lengthMask;
+            if (length == 2 && pos + 2 < words.size()) {
+                uint64_t id = (static_cast<uint64_t>(words[pos + 2]) << 32) | words[pos + 1];
+                if (command == V2_1::IComposerClient::Command::SELECT_DISPLAY) {
+                    display = id;
+                    registerDisplaysAndLayers(display, 0);
+                } else if (command == V2_1::IComposerClient::Command::SELECT_LAYER) {
+                    registerDisplaysAndLayers(display, id);
+                }
+            }
+            pos += 1 + length;
+            count++;
+        }
+        return count;
+    }
+
+    bool drainOutput(bool queueChanged, uint32_t length) {
+        if (queueChanged || !mOutputQueue) {
+            auto descriptor = mEngine.getOutputMQDescriptor();
+            if (!descriptor) {
+                return length == 0;
+            }
+            mOutputQueue = std::make_unique<CommandQueueType>(*descriptor, false);
+        }
+        if (length == 0) {
+            return true;
+        }
+
+        if (mOutput.size() < length) {
+            mOutput.resize(length);
+        }
+        return mOutputQueue->read(mOutput.data(), length);
+    }
+
+    const std::vector<CommandStreamBatch>& mBatches;
+    std::vector<hidl_vec<hidl_handle>> mBatchHandles;
+    size_t mCommandCount = 0;
+
+    NullComposerHal mHal;
+    typename Composer::Resources mResources;
+    std::set<Display> mDisplays;
+    std::set<std::pair<Display, Layer>> mLayers;
+    CommandProfile mProfile;
+    ProfilingEngine<typename Composer::Engine> mEngine;
+
+    std::unique_ptr<CommandQueueType> mInputQueue;
+    std::unique_ptr<CommandQueueType> mOutputQueue;
+    std::vector<uint32_t> mOutput;
+};
+
+// One iteration replays one batch, cycling through the stream.  With a
+// non-zero argument, the time of each command type is reported as well,
+// which slows the replay down.
+template <typename Composer>
+void BM_ReplayCommandStream(benchmark::State& state) {
+    const auto& batches = getStream();
+    if (batches.empty()) {
+        state.SkipWithError("no command stream to replay");
+        return;
+    }
+
+    Replayer<Composer> replayer(batches);
+    if (!replayer.isValid()) {
+        state.SkipWithError("failed to create the input queue");
+        return;
+    }
+
+    // the first pass fills the caches and the output queue
+    for (size_t i = 0; i < batches.size(); i++) {
+        replayer.replayBatch(i);
+    }
+    replayer.getProfile().enabled = state.range(0) != 0;
+
+    size_t index = 0;
+    uint64_t batchCount = 0;
+    uint64_t failedBatches = 0;
+    uint64_t allocationsBefore = gAllocationCount.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        if (!replayer.replayBatch(index)) {
+            failedBatches++;
+        }
+        batchCount++;
+        index = (index + 1) % batches.size();
+    }
+    uint64_t allocations = gAllocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+
+    double commandsPerBatch = double(replayer.getCommandCount()) / batches.size();
+    state.SetItemsProcessed(int64_t(batchCount * commandsPerBatch));
+    state.counters["commands_per_batch"] = commandsPerBatch;
+    state.counters["allocs_per_batch"] = batchCount ? double(allocations) / batchCount : 0.0;
+    state.counters["failed_batches"] = failedBatches;
+
+    for (const auto& entry : replayer.getProfile().entries) {
+        auto name = toString(static_cast<IComposerClient::Command>(entry.first));
+        state.counters[name + "_ns"] =
+                double(entry.second.time.count()) / std::max<uint64_t>(entry.second.count, 1);
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_ReplayCommandStream, Composer2_1)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ReplayCommandStream, Composer2_2)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ReplayCommandStream, Composer2_3)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ReplayCommandStream, Composer2_4)->Arg(0)->Arg(1);
+
+}  // namespace
+}  // namespace hal
+}  // namespace V2_4
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
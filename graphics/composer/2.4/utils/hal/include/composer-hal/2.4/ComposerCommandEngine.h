@@ -39,11 +39,25 @@ class ComposerCommandEngine : public V2_3::hal::ComposerCommandEngine {
         : BaseType2_3(hal, resources), mHal(hal) {}
 
   protected:
+    bool executeCommand(V2_1::IComposerClient::Command command, uint16_t length) override {
+        switch (static_cast<IComposerClient::Command>(command)) {
+            case IComposerClient::Command::SET_LAYER_GENERIC_METADATA:
+                return executeSetLayerGenericMetadata(length);
+            default:
+                return BaseType2_3::executeCommand(command, length);
+        }
+    }
+
     std::unique_ptr<V2_1::CommandWriterBase> createCommandWriter(
             size_t writerInitialSize) override {
         return std::make_unique<CommandWriterBase>(writerInitialSize);
     }
 
+    std::unique_ptr<V2_1::hal::ComposerCommandEngine> createDisplayEngine() override {
+        return std::make_unique<ComposerCommandEngine>(
+                mHal, static_cast<V2_2::hal::ComposerResources*>(mResources));
+    }
+
   private:
     using BaseType2_1 = V2_1::hal::ComposerCommandEngine;
     using BaseType2_3 = V2_3::hal::ComposerCommandEngine;
@@ -62,6 +76,7 @@ class ComposerCommandEngine : public V2_3::hal::ComposerCommandEngine {
                                              &displayRequestMask, &requestedLayers, &requestMasks,
                                              &clientTargetProperty);
         mResources->setDisplayMustValidateState(mCurrentDisplay, false);
+        invalidateCompositionTypes(changedLayers);
         if (err == Error::NONE) {
             mWriter->setChangedCompositionTypes(changedLayers, compositionTypes);
             mWriter->setDisplayRequests(displayRequestMask, requestedLayers, requestMasks);
@@ -74,15 +89,6 @@ class ComposerCommandEngine : public V2_3::hal::ComposerCommandEngine {
 
     CommandWriterBase* getWriter() { return static_cast<CommandWriterBase*>(mWriter.get()); }
 
-    bool executeCommand(V2_1::IComposerClient::Command command, uint16_t length) override {
-        switch (static_cast<IComposerClient::Command>(command)) {
-            case IComposerClient::Command::SET_LAYER_GENERIC_METADATA:
-                return executeSetLayerGenericMetadata(length);
-            default:
-                return BaseType2_3::executeCommand(command, length);
-        }
-    }
-
     bool executeSetLayerGenericMetadata(uint16_t length) {
         // We expect at least two buffer lengths and a mandatory flag
         if (length < 3) {